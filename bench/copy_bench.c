@@ -0,0 +1,204 @@
+// Throughput of the copy engine methods on the file system of a directory.
+// Run it once per file system to compare, e.g. ext4, xfs, btrfs and tmpfs:
+//   rtad_copy_bench /mnt/btrfs 1024
+#include "rtad_def.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+static double now_seconds(void) {
+  LARGE_INTEGER freq, counter;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&counter);
+  return (double)counter.QuadPart / (double)freq.QuadPart;
+}
+
+static int fd_sync(int fd) { return _commit(fd); }
+
+static long long allocated_kib(const char *path) {
+  (void)path;
+  return -1;
+}
+
+#else
+#include <time.h>
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int fd_sync(int fd) { return fsync(fd); }
+
+static long long allocated_kib(const char *path) {
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    return -1;
+  }
+  return (long long)st.st_blocks / 2;
+}
+
+#endif
+
+struct method {
+  const char *name;
+  unsigned flags;
+  int stdio; // run stdio_copy_path instead of fd_copy
+};
+
+// The copy loop used before the copy engine: stdio and a 4KiB buffer.
+static int stdio_copy_path(const char *src_path, const char *dest_path) {
+  FILE *src_fp = fopen(src_path, "rb");
+  FILE *dest_fp = fopen(dest_path, "wb");
+  if (!src_fp || !dest_fp) {
+    if (src_fp) {
+      fclose(src_fp);
+    }
+    if (dest_fp) {
+      fclose(dest_fp);
+    }
+    return -1;
+  }
+  char copy_buf[4096];
+  size_t bytes;
+  int result = 0;
+  while ((bytes = fread(copy_buf, 1, sizeof(copy_buf), src_fp)) > 0) {
+    if (fwrite(copy_buf, 1, bytes, dest_fp) != bytes) {
+      result = -1;
+      break;
+    }
+  }
+  fflush(dest_fp);
+  fd_sync(fileno(dest_fp));
+  fclose(src_fp);
+  fclose(dest_fp);
+  return result;
+}
+
+// Source file: pseudo-random data with a hole in the middle quarter.
+static int create_source(const char *path, off_t size) {
+  int fd = file_create(path);
+  if (fd < 0) {
+    return -1;
+  }
+  char *buf = (char *)malloc(COPY_BUFFER_SIZE);
+  if (!buf) {
+    file_close(fd);
+    return -1;
+  }
+  uint64_t x = 0x9E3779B97F4A7C15ULL;
+  for (size_t i = 0; i < COPY_BUFFER_SIZE; i++) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    buf[i] = (char)x;
+  }
+  int result = 0;
+  for (off_t offset = 0; offset < size && result == 0;
+       offset += COPY_BUFFER_SIZE) {
+    if (offset >= size / 2 && offset < size / 2 + size / 4) {
+      continue;
+    }
+    size_t chunk = size - offset > COPY_BUFFER_SIZE ? COPY_BUFFER_SIZE
+                                                    : (size_t)(size - offset);
+    result = file_pwrite(fd, buf, chunk, offset);
+  }
+  if (result == 0) {
+    result = fd_truncate(fd, size);
+  }
+  fd_sync(fd);
+  free(buf);
+  file_close(fd);
+  return result;
+}
+
+static int run_round(const struct method *m, const char *src_path,
+                    const char *dest_path, off_t size, double *seconds) {
+  remove(dest_path);
+  double start = now_seconds();
+  if (m->stdio) {
+    if (stdio_copy_path(src_path, dest_path) != 0) {
+      return -1;
+    }
+  } else {
+    int src_fd = file_open(src_path);
+    int dest_fd = file_create(dest_path);
+    int result = -1;
+    if (src_fd >= 0 && dest_fd >= 0) {
+      result = fd_copy(src_fd, dest_fd, size, m->flags);
+      if (result == 0) {
+        result = fd_sync(dest_fd);
+      }
+    }
+    if (src_fd >= 0) {
+      file_close(src_fd);
+    }
+    if (dest_fd >= 0) {
+      file_close(dest_fd);
+    }
+    if (result != 0) {
+      return -1;
+    }
+  }
+  *seconds = now_seconds() - start;
+  return 0;
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[]) {
+  const char *dir = argc > 1 ? argv[1] : ".";
+  long long size_mib = argc > 2 ? atoll(argv[2]) : 256;
+  int rounds = argc > 3 ? atoi(argv[3]) : 5;
+  if (size_mib <= 0 || rounds <= 0 || rounds > 100) {
+    fprintf(stderr, "usage: %s [dir] [size_mib] [rounds]\n", argv[0]);
+    return 1;
+  }
+  char src_path[PATH_MAX];
+  char dest_path[PATH_MAX];
+  snprintf(src_path, sizeof(src_path), "%s/rtad_copy_bench_src", dir);
+  snprintf(dest_path, sizeof(dest_path), "%s/rtad_copy_bench_dest", dir);
+  off_t size = (off_t)size_mib * 1024 * 1024;
+  if (create_source(src_path, size) != 0) {
+    fprintf(stderr, "failed to create %s\n", src_path);
+    return 1;
+  }
+
+  const struct method methods[] = {
+      {"stdio 4KiB (old)", 0, 1},
+      {"read/write 1MiB", 0, 0},
+      {"read/write 1MiB sparse", COPY_SPARSE, 0},
+      {"sendfile", COPY_SENDFILE, 0},
+      {"copy_file_range", COPY_RANGE, 0},
+      {"copy_file_range sparse", COPY_RANGE | COPY_SPARSE, 0},
+      {"reflink", COPY_REFLINK, 0},
+      {"default (all)", COPY_ALL, 0},
+  };
+  printf("%lld MiB source in %s, median of %d rounds, fsync included\n",
+         size_mib, dir, rounds);
+  printf("%-24s %10s %10s %14s\n", "method", "ms", "MiB/s", "allocated KiB");
+  for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+    double seconds[100];
+    int ok = 1;
+    for (int r = 0; r < rounds && ok; r++) {
+      ok = run_round(&methods[i], src_path, dest_path, size, &seconds[r]) == 0;
+    }
+    if (!ok) {
+      printf("%-24s %10s\n", methods[i].name, "failed");
+      continue;
+    }
+    qsort(seconds, (size_t)rounds, sizeof(double), compare_double);
+    double median = seconds[rounds / 2];
+    printf("%-24s %10.2f %10.1f %14lld\n", methods[i].name, median * 1e3,
+           (double)size_mib / median, allocated_kib(dest_path));
+  }
+  remove(dest_path);
+  remove(src_path);
+  return 0;
+}
@@ -0,0 +1,471 @@
+// Throughput, latency and system calls of the public API across payload
+// sizes, with the page cache warm:
+//   rtad_bench [-d dir] [-m max_mib] [-t seconds] [-o results.json]
+// Payloads go from 1KiB up to max_mib (256 by default), 16 times bigger each
+// step. Every operation runs for about -t seconds per size, at least
+// MIN_ITERATIONS times, and reports the median throughput and the latency
+// percentiles. On Linux, system calls are counted with /proc/self/io, which
+// counts the read and write ones (read, pread, sendfile, copy_file_range...),
+// and page faults with getrusage. The results are written as JSON with -o so
+// runs can be compared. The biggest payload is held in memory twice.
+#include "rtad.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#include <time.h>
+#endif
+
+#define MIN_ITERATIONS 5
+#define MAX_ITERATIONS 10000
+#define STREAM_BUF_SIZE (1024 * 1024)
+#define TOUCH_STRIDE 4096
+#define BASE_SIZE (64 * 1024)
+
+#if defined(_WIN32)
+static double now_seconds(void) {
+  LARGE_INTEGER freq, counter;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&counter);
+  return (double)counter.QuadPart / (double)freq.QuadPart;
+}
+#else
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+#endif
+
+// process-wide counters, -1 where the system doesn't tell
+struct counters {
+  long long read_calls;
+  long long write_calls;
+  long long minor_faults;
+  long long major_faults;
+};
+
+static void counters_read(struct counters *c) {
+  c->read_calls = c->write_calls = c->minor_faults = c->major_faults = -1;
+#if defined(__linux__)
+  FILE *fp = fopen("/proc/self/io", "r");
+  if (fp) {
+    char line[128];
+    while (fgets(line, sizeof(line), fp)) {
+      sscanf(line, "syscr: %lld", &c->read_calls);
+      sscanf(line, "syscw: %lld", &c->write_calls);
+    }
+    fclose(fp);
+  }
+#endif
+#if !defined(_WIN32)
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    c->minor_faults = usage.ru_minflt;
+    c->major_faults = usage.ru_majflt;
+  }
+#endif
+}
+
+// calls made by counters_read itself, taken out of every measure
+static struct counters counters_cost;
+
+static long long counter_delta(long long before, long long after,
+                               long long cost) {
+  if (before < 0 || after < 0) {
+    return -1;
+  }
+  long long delta = after - before - cost;
+  return delta > 0 ? delta : 0;
+}
+
+static void counters_diff(const struct counters *before,
+                          const struct counters *after, struct counters *out) {
+  out->read_calls = counter_delta(before->read_calls, after->read_calls,
+                                  counters_cost.read_calls);
+  out->write_calls = counter_delta(before->write_calls, after->write_calls,
+                                   counters_cost.write_calls);
+  out->minor_faults = counter_delta(before->minor_faults, after->minor_faults,
+                                    counters_cost.minor_faults);
+  out->major_faults = counter_delta(before->major_faults, after->major_faults,
+                                    counters_cost.major_faults);
+}
+
+struct bench {
+  const char *path;      // a small file with the payload
+  const char *copy_path; // rtad_copy_self_with_data output
+  char *data;            // the payload
+  char *out;             // extraction buffer, as big as the payload
+  char *stream_buf;
+  size_t size;
+  rtad_file *file; // opened by the operations working on a handle
+};
+
+struct op {
+  const char *name;
+  int (*prepare)(struct bench *b); // before each iteration, not timed
+  int (*run)(struct bench *b);
+  int open_file; // run works on b->file, opened once per size
+};
+
+static int run_append(struct bench *b) {
+  rtad_file *file = rtad_open_rw(b->path);
+  if (!file) {
+    return -1;
+  }
+  int result = rtad_file_append(file, b->data, b->size);
+  return rtad_close(file) == 0 ? result : -1;
+}
+
+static int run_copy_self(struct bench *b) {
+  return rtad_copy_self_with_data(b->copy_path, b->data, b->size);
+}
+
+static int run_extract(struct bench *b) {
+  char *data = NULL;
+  size_t size = 0;
+  if (rtad_extract_data(b->path, &data, &size) != 0) {
+    return -1;
+  }
+  int result = size == b->size ? 0 : -1;
+  rtad_free_extracted_data(data);
+  return result;
+}
+
+static int run_extract_into(struct bench *b) {
+  size_t size = 0;
+  return rtad_extract_into(b->file, NULL, b->out, b->size, &size) == 0 &&
+                 size == b->size
+             ? 0
+             : -1;
+}
+
+// every page is touched, so the mapping is paid for
+static int run_map(struct bench *b) {
+  const char *data = NULL;
+  size_t size = 0;
+  if (rtad_map_data(b->path, &data, &size) != 0) {
+    return -1;
+  }
+  volatile char sum = 0;
+  for (size_t i = 0; i < size; i += TOUCH_STRIDE) {
+    sum += data[i];
+  }
+  (void)sum;
+  return rtad_unmap_data(data, size) == 0 && size == b->size ? 0 : -1;
+}
+
+static int run_stream(struct bench *b) {
+  rtad_file *file = rtad_open(b->path);
+  rtad_reader *reader = file ? rtad_reader_open(file, NULL) : NULL;
+  size_t total = 0;
+  int result = reader ? 0 : -1;
+  while (result == 0) {
+    size_t read_size = 0;
+    result = rtad_reader_read(reader, b->stream_buf, STREAM_BUF_SIZE,
+                              &read_size);
+    if (read_size == 0) {
+      break;
+    }
+    total += read_size;
+  }
+  if (reader) {
+    rtad_reader_close(reader);
+  }
+  if (file) {
+    rtad_close(file);
+  }
+  return result == 0 && total == b->size ? 0 : -1;
+}
+
+static int run_truncate(struct bench *b) { return rtad_truncate_data(b->path); }
+
+// the reading operations come after append, truncate last
+static const struct op ops[] = {
+    {"append", NULL, run_append, 0},
+    {"copy_self", NULL, run_copy_self, 0},
+    {"extract", NULL, run_extract, 0},
+    {"extract_into", NULL, run_extract_into, 1},
+    {"map", NULL, run_map, 0},
+    {"stream", NULL, run_stream, 0},
+    {"truncate", run_append, run_truncate, 0},
+};
+
+struct result {
+  const char *op;
+  size_t size;
+  int iterations;
+  double mib_per_s; // at the median latency
+  double p50_us, p90_us, p99_us, min_us, max_us;
+  struct counters per_iteration; // -1 if not counted
+};
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// nearest rank of a sorted sample
+static double percentile(const double *sorted, int count, double p) {
+  int rank = (int)(p * count + 0.999999);
+  return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static long long per_iteration(long long total, int iterations) {
+  return total < 0 ? -1 : (total + iterations / 2) / iterations;
+}
+
+static int measure(const struct op *op, struct bench *b, double budget,
+                   double *latencies, struct result *out) {
+  if (op->open_file && !(b->file = rtad_open(b->path))) {
+    return -1;
+  }
+  int count = 0;
+  int result = 0;
+  struct counters total = {0, 0, 0, 0};
+  double start = now_seconds();
+  while (result == 0 && count < MAX_ITERATIONS &&
+         (count < MIN_ITERATIONS || now_seconds() - start < budget)) {
+    if (op->prepare && op->prepare(b) != 0) {
+      result = -1;
+      break;
+    }
+    struct counters before, after, delta;
+    counters_read(&before);
+    double t0 = now_seconds();
+    result = op->run(b);
+    latencies[count++] = now_seconds() - t0;
+    counters_read(&after);
+    counters_diff(&before, &after, &delta);
+    total.read_calls = delta.read_calls < 0 || total.read_calls < 0
+                           ? -1
+                           : total.read_calls + delta.read_calls;
+    total.write_calls = delta.write_calls < 0 || total.write_calls < 0
+                            ? -1
+                            : total.write_calls + delta.write_calls;
+    total.minor_faults = delta.minor_faults < 0 || total.minor_faults < 0
+                             ? -1
+                             : total.minor_faults + delta.minor_faults;
+    total.major_faults = delta.major_faults < 0 || total.major_faults < 0
+                             ? -1
+                             : total.major_faults + delta.major_faults;
+  }
+  if (b->file) {
+    rtad_close(b->file);
+    b->file = NULL;
+  }
+  if (result != 0) {
+    return -1;
+  }
+  qsort(latencies, (size_t)count, sizeof(double), compare_double);
+  double median = percentile(latencies, count, 0.5);
+  out->op = op->name;
+  out->size = b->size;
+  out->iterations = count;
+  out->mib_per_s =
+      median > 0 ? (double)b->size / (1024.0 * 1024.0) / median : 0.0;
+  out->p50_us = median * 1e6;
+  out->p90_us = percentile(latencies, count, 0.9) * 1e6;
+  out->p99_us = percentile(latencies, count, 0.99) * 1e6;
+  out->min_us = latencies[0] * 1e6;
+  out->max_us = latencies[count - 1] * 1e6;
+  out->per_iteration.read_calls = per_iteration(total.read_calls, count);
+  out->per_iteration.write_calls = per_iteration(total.write_calls, count);
+  out->per_iteration.minor_faults = per_iteration(total.minor_faults, count);
+  out->per_iteration.major_faults = per_iteration(total.major_faults, count);
+  return 0;
+}
+
+static void fill(char *data, size_t size) {
+  uint64_t x = 0x9E3779B97F4A7C15ULL;
+  for (size_t i = 0; i < size; i++) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    data[i] = (char)x;
+  }
+}
+
+static int create_base(const char *path) {
+  static char base[BASE_SIZE];
+  fill(base, sizeof(base));
+  FILE *fp = fopen(path, "wb");
+  if (!fp) {
+    return -1;
+  }
+  int result = fwrite(base, 1, sizeof(base), fp) == sizeof(base) ? 0 : -1;
+  return fclose(fp) == 0 ? result : -1;
+}
+
+static void print_size(char *buf, size_t buf_size, size_t size) {
+  if (size >= 1024 * 1024 * 1024 && size % (1024 * 1024 * 1024) == 0) {
+    snprintf(buf, buf_size, "%zuGiB", size / (1024 * 1024 * 1024));
+  } else if (size >= 1024 * 1024 && size % (1024 * 1024) == 0) {
+    snprintf(buf, buf_size, "%zuMiB", size / (1024 * 1024));
+  } else {
+    snprintf(buf, buf_size, "%zuKiB", size / 1024);
+  }
+}
+
+static void json_counter(FILE *fp, const char *name, long long value,
+                         const char *sep) {
+  if (value < 0) {
+    fprintf(fp, "\"%s\": null%s", name, sep);
+  } else {
+    fprintf(fp, "\"%s\": %lld%s", name, value, sep);
+  }
+}
+
+static int write_json(const char *path, const char *dir, double budget,
+                      const struct result *results, size_t count) {
+  FILE *fp = fopen(path, "w");
+  if (!fp) {
+    return -1;
+  }
+  fprintf(fp, "{\n  \"tool\": \"rtad_bench\",\n  \"format\": 1,\n");
+  fprintf(fp, "  \"dir\": \"");
+  for (const char *p = dir; *p; p++) {
+    if (*p == '"' || *p == '\\') {
+      fputc('\\', fp);
+    }
+    fputc(*p, fp);
+  }
+  fprintf(fp, "\",\n  \"seconds_per_op\": %g,\n", budget);
+  fprintf(fp, "  \"zlib\": %s,\n",
+          rtad_codec_supported(RTAD_CODEC_ZLIB) == 0 ? "true" : "false");
+  fprintf(fp, "  \"results\": [\n");
+  for (size_t i = 0; i < count; i++) {
+    const struct result *r = &results[i];
+    fprintf(fp,
+            "    {\"op\": \"%s\", \"size\": %zu, \"iterations\": %d, "
+            "\"mib_per_s\": %.3f, \"p50_us\": %.3f, \"p90_us\": %.3f, "
+            "\"p99_us\": %.3f, \"min_us\": %.3f, \"max_us\": %.3f, ",
+            r->op, r->size, r->iterations, r->mib_per_s, r->p50_us, r->p90_us,
+            r->p99_us, r->min_us, r->max_us);
+    json_counter(fp, "read_calls", r->per_iteration.read_calls, ", ");
+    json_counter(fp, "write_calls", r->per_iteration.write_calls, ", ");
+    json_counter(fp, "minor_faults", r->per_iteration.minor_faults, ", ");
+    json_counter(fp, "major_faults", r->per_iteration.major_faults, "}");
+    fprintf(fp, "%s\n", i + 1 < count ? "," : "");
+  }
+  fprintf(fp, "  ]\n}\n");
+  return fclose(fp) == 0 ? 0 : -1;
+}
+
+static int usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [-d dir] [-m max_mib] [-t seconds] [-o results.json]\n",
+          name);
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  const char *dir = ".";
+  const char *json_path = NULL;
+  double max_mib = 256;
+  double budget = 0.5;
+  for (int i = 1; i < argc; i++) {
+    const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+    if (!value) {
+      return usage(argv[0]);
+    }
+    if (strcmp(argv[i], "-d") == 0) {
+      dir = value;
+    } else if (strcmp(argv[i], "-m") == 0) {
+      max_mib = atof(value);
+    } else if (strcmp(argv[i], "-t") == 0) {
+      budget = atof(value);
+    } else if (strcmp(argv[i], "-o") == 0) {
+      json_path = value;
+    } else {
+      return usage(argv[0]);
+    }
+    i++;
+  }
+  if (max_mib * 1024 * 1024 < 1024 ||
+      max_mib * 1024 * 1024 > (double)SIZE_MAX / 2 || budget < 0) {
+    return usage(argv[0]);
+  }
+  size_t max_size = (size_t)(max_mib * 1024 * 1024);
+  size_t sizes[32];
+  size_t size_count = 0;
+  for (size_t size = 1024; size <= max_size && size_count < 31; size *= 16) {
+    sizes[size_count++] = size;
+    if (size > max_size / 16) {
+      break;
+    }
+  }
+  if (sizes[size_count - 1] < max_size) {
+    sizes[size_count++] = max_size;
+  }
+
+  char path[1024], copy_path[1024];
+  snprintf(path, sizeof(path), "%s/rtad_bench_base", dir);
+  snprintf(copy_path, sizeof(copy_path), "%s/rtad_bench_copy", dir);
+  struct bench b = {.path = path, .copy_path = copy_path};
+  b.data = (char *)malloc(max_size);
+  b.out = (char *)malloc(max_size);
+  b.stream_buf = (char *)malloc(STREAM_BUF_SIZE);
+  double *latencies = (double *)malloc(MAX_ITERATIONS * sizeof(double));
+  size_t op_count = sizeof(ops) / sizeof(ops[0]);
+  struct result *results =
+      (struct result *)calloc(size_count * op_count, sizeof(struct result));
+  if (!b.data || !b.out || !b.stream_buf || !latencies || !results ||
+      create_base(path) != 0) {
+    fprintf(stderr, "rtad_bench: cannot set up in %s\n", dir);
+    return 1;
+  }
+  fill(b.data, max_size);
+  struct counters before, after;
+  counters_read(&before);
+  counters_read(&after);
+  counters_diff(&before, &after, &counters_cost);
+
+  printf("%-13s %8s %6s %10s %10s %10s %10s %7s %7s %7s\n", "op", "size",
+         "iters", "MiB/s", "p50_us", "p90_us", "p99_us", "reads", "writes",
+         "faults");
+  size_t result_count = 0;
+  int status = 0;
+  for (size_t s = 0; s < size_count; s++) {
+    b.size = sizes[s];
+    char size_name[32];
+    print_size(size_name, sizeof(size_name), b.size);
+    for (size_t o = 0; o < op_count; o++) {
+      struct result *r = &results[result_count];
+      if (measure(&ops[o], &b, budget, latencies, r) != 0) {
+        fprintf(stderr, "rtad_bench: %s failed at %s\n", ops[o].name,
+                size_name);
+        status = 1;
+        continue;
+      }
+      result_count++;
+      printf("%-13s %8s %6d %10.1f %10.1f %10.1f %10.1f %7lld %7lld %7lld\n",
+             r->op, size_name, r->iterations, r->mib_per_s, r->p50_us,
+             r->p90_us, r->p99_us, r->per_iteration.read_calls,
+             r->per_iteration.write_calls,
+             r->per_iteration.minor_faults < 0
+                 ? -1
+                 : r->per_iteration.minor_faults +
+                       r->per_iteration.major_faults);
+      fflush(stdout);
+    }
+  }
+  if (json_path &&
+      write_json(json_path, dir, budget, results, result_count) != 0) {
+    fprintf(stderr, "rtad_bench: cannot write %s\n", json_path);
+    status = 1;
+  }
+  remove(path);
+  remove(copy_path);
+  free(results);
+  free(latencies);
+  free(b.stream_buf);
+  free(b.out);
+  free(b.data);
+  return status;
+}
@@ -0,0 +1,191 @@
+// Batched reads at several queue depths, through io_uring when the kernel
+// has it, against one positional read after the other:
+//   rtad_uring_bench [dir] [files] [file_kib] [rounds]
+// "entries" reads 4KiB blocks at random offsets of one file, like looking up
+// many entries at startup; "ingest" reads many whole files, like packing a
+// tree. The page cache is dropped before every round with posix_fadvise, so
+// the reads go to the device.
+#include "rtad_def.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define READ_SIZE 4096
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void drop_cache(int fd) {
+#if defined(POSIX_FADV_DONTNEED)
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#else
+  (void)fd;
+#endif
+}
+
+static int create_file(const char *path, size_t size, uint64_t seed) {
+  int fd = file_create(path);
+  if (fd < 0) {
+    return -1;
+  }
+  char *buf = (char *)malloc(COPY_BUFFER_SIZE);
+  int result = buf ? 0 : -1;
+  uint64_t x = seed | 1;
+  for (size_t offset = 0; offset < size && result == 0;
+       offset += COPY_BUFFER_SIZE) {
+    size_t chunk =
+        size - offset > COPY_BUFFER_SIZE ? COPY_BUFFER_SIZE : size - offset;
+    for (size_t i = 0; i < chunk; i++) {
+      x ^= x << 13;
+      x ^= x >> 7;
+      x ^= x << 17;
+      buf[i] = (char)x;
+    }
+    result = file_pwrite(fd, buf, chunk, (off_t)offset);
+  }
+  if (result == 0) {
+    result = fsync(fd) == 0 ? 0 : -1;
+  }
+  free(buf);
+  file_close(fd);
+  return result;
+}
+
+// run the batch at a depth, 0 without ring, and return the seconds taken
+static double run_batch(struct rtad_io *ios, size_t count, const int *fds,
+                        size_t fd_count, unsigned depth, char *arena,
+                        size_t arena_size) {
+  for (size_t i = 0; i < fd_count; i++) {
+    drop_cache(fds[i]);
+  }
+  struct rtad_ring *ring = NULL;
+  if (depth > 0) {
+    ring = ring_open(depth, arena, arena_size);
+    if (!ring) {
+      return -1;
+    }
+  }
+  double start = now_seconds();
+  int result = io_batch(ring, ios, count);
+  double seconds = now_seconds() - start;
+  ring_close(ring);
+  return result == 0 ? seconds : -1;
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static void report(const char *name, struct rtad_io *ios, size_t count,
+                   const int *fds, size_t fd_count, char *arena,
+                   size_t arena_size, int rounds) {
+  static const unsigned depths[] = {0, 1, 4, 16, 64, 256};
+  uint64_t bytes = 0;
+  for (size_t i = 0; i < count; i++) {
+    bytes += ios[i].size;
+  }
+  printf("\n%s: %zu reads, %.1f MiB\n", name, count,
+         (double)bytes / (1024 * 1024));
+  printf("%-12s %10s %10s %10s\n", "depth", "ms", "MiB/s", "reads/s");
+  for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+    double seconds[100];
+    int ok = 1;
+    for (int r = 0; r < rounds && ok; r++) {
+      seconds[r] =
+          run_batch(ios, count, fds, fd_count, depths[d], arena, arena_size);
+      ok = seconds[r] >= 0;
+    }
+    char label[32];
+    snprintf(label, sizeof(label), depths[d] ? "io_uring %u" : "pread",
+             depths[d]);
+    if (!ok) {
+      printf("%-12s %10s\n", label, "failed");
+      continue;
+    }
+    qsort(seconds, (size_t)rounds, sizeof(double), compare_double);
+    double median = seconds[rounds / 2];
+    printf("%-12s %10.2f %10.1f %10.0f\n", label, median * 1e3,
+           (double)bytes / (1024 * 1024) / median, (double)count / median);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  const char *dir = argc > 1 ? argv[1] : ".";
+  long files = argc > 2 ? atol(argv[2]) : 1000;
+  long file_kib = argc > 3 ? atol(argv[3]) : 64;
+  int rounds = argc > 4 ? atoi(argv[4]) : 3;
+  if (files <= 0 || files > 100000 || file_kib <= 0 || rounds <= 0 ||
+      rounds > 100) {
+    fprintf(stderr, "usage: %s [dir] [files] [file_kib] [rounds]\n", argv[0]);
+    return 1;
+  }
+  size_t file_size = (size_t)file_kib * 1024;
+  size_t total = (size_t)files * file_size;
+  char path[PATH_MAX];
+  int *fds = (int *)malloc((size_t)files * sizeof(int));
+  struct rtad_io *ios =
+      (struct rtad_io *)malloc((size_t)files * sizeof(struct rtad_io));
+  // every read has its own place, the whole arena is registered
+  char *arena = (char *)malloc(total);
+  if (!fds || !ios || !arena) {
+    return 1;
+  }
+  struct rtad_ring *probe = ring_open(1, NULL, 0);
+  printf("%ld files of %ld KiB in %s, median of %d rounds, io_uring %s\n",
+         files, file_kib, dir, rounds, probe ? "available" : "not available");
+  ring_close(probe);
+
+  // one big file read in blocks at random offsets
+  snprintf(path, sizeof(path), "%s/rtad_uring_bench_big", dir);
+  if (create_file(path, total, 1) != 0 || (fds[0] = file_open(path)) < 0) {
+    fprintf(stderr, "failed to create %s\n", path);
+    return 1;
+  }
+  size_t block_count = total / READ_SIZE;
+  size_t count = (size_t)files < block_count ? (size_t)files : block_count;
+  uint64_t x = 0x9E3779B97F4A7C15ULL;
+  for (size_t i = 0; i < count; i++) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    off_t offset = (off_t)((x % block_count) * READ_SIZE);
+    ios[i] = (struct rtad_io){.fd = fds[0],
+                              .buf = arena + i * READ_SIZE,
+                              .size = READ_SIZE,
+                              .offset = offset};
+  }
+  report("entries", ios, count, fds, 1, arena, total, rounds);
+  file_close(fds[0]);
+  remove(path);
+
+  // many files read whole
+  for (long i = 0; i < files; i++) {
+    snprintf(path, sizeof(path), "%s/rtad_uring_bench_%ld", dir, i);
+    if (create_file(path, file_size, (uint64_t)i) != 0 ||
+        (fds[i] = file_open(path)) < 0) {
+      fprintf(stderr, "failed to create %s\n", path);
+      return 1;
+    }
+    ios[i] = (struct rtad_io){.fd = fds[i],
+                              .buf = arena + (size_t)i * file_size,
+                              .size = file_size,
+                              .offset = 0};
+  }
+  report("ingest", ios, (size_t)files, fds, (size_t)files, arena, total,
+         rounds);
+  for (long i = 0; i < files; i++) {
+    file_close(fds[i]);
+    snprintf(path, sizeof(path), "%s/rtad_uring_bench_%ld", dir, i);
+    remove(path);
+  }
+  free(arena);
+  free(ios);
+  free(fds);
+  return 0;
+}
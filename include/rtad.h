@@ -1,6 +1,153 @@
 #ifndef __RTAD_H__
 #define __RTAD_H__
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * @brief An opened executable with appended entries.
+ */
+typedef struct rtad_file rtad_file;
+
+/**
+ * @brief Codecs of compressed entries, RTAD_CODEC_ZLIB is only available if
+ * the library is built with RTAD_WITH_ZLIB.
+ */
+#define RTAD_CODEC_NONE 0
+#define RTAD_CODEC_LZ 1 // built-in, fast
+#define RTAD_CODEC_ZLIB 2
+
+// default raw size of a compressed chunk
+#define RTAD_CHUNK_SIZE (64 * 1024)
+
+// rtad_writer_set_align alignments, a page and a huge page on most systems
+#define RTAD_ALIGN_PAGE (4 * 1024)
+#define RTAD_ALIGN_HUGE (2 * 1024 * 1024)
+#define RTAD_ALIGN_MAX (1u << 30)
+
+// size of the BLAKE3 tree hash kept with the appended data
+#define RTAD_HASH_SIZE 32
+
+// rtad_writer_set_dedup flags
+#define RTAD_DEDUP_ENTRIES 0x1 // identical entries and chunks stored once
+#define RTAD_DEDUP_CDC 0x2     // content-defined chunks, shared when shifted
+
+// rtad_writer_set_load flags
+#define RTAD_LOAD_SEGMENT 0x1 // a PT_LOAD in a PT_NULL program header
+#define RTAD_LOAD_NOTE 0x2    // or in a PT_NOTE one, never the build id's
+
+/**
+ * @brief The entry is compressed in chunks that are decoded on their own.
+ */
+#define RTAD_ENTRY_CHUNKED 0x1
+
+/**
+ * @brief Location of an entry in the appended data.
+ */
+struct rtad_entry {
+  uint64_t offset; // relative to the start of appended data
+  uint64_t size;   // stored size
+  uint32_t flags;  // RTAD_ENTRY_*
+  uint32_t align;  // file offset alignment of the stored bytes, 0 if none
+  uint64_t raw_size; // size once decoded
+};
+
+/**
+ * @brief A streaming writer of appended data.
+ */
+typedef struct rtad_writer rtad_writer;
+
+/**
+ * @brief A seekable reader of the appended data or of one entry.
+ */
+typedef struct rtad_reader rtad_reader;
+
+/**
+ * @brief A buffer of a gather write.
+ */
+struct rtad_iovec {
+  const void *data;
+  size_t size;
+};
+
+/**
+ * @brief A named buffer to be appended as an entry.
+ */
+struct rtad_input {
+  const char *name;
+  const char *data;
+  size_t size;
+  uint32_t codec; // RTAD_CODEC_*, 0 to store as is
+};
+
+/**
+ * @brief Data of an entry read by rtad_get_many, free data with
+ * rtad_free_extracted_data. Also a buffer of a scatter read by
+ * rtad_extract_iov.
+ */
+struct rtad_data {
+  char *data;
+  size_t size;
+};
+
+/**
+ * @brief Memory of the read path: handles, readers, their buffers and the
+ * data returned to be freed with rtad_free_extracted_data. alloc returns
+ * memory aligned like malloc does, or NULL; free may be a no-op for an arena.
+ */
+struct rtad_allocator {
+  void *(*alloc)(void *ctx, size_t size);
+  void (*free)(void *ctx, void *ptr);
+  void *ctx;
+};
+
+/**
+ * @brief Phases timed by the statistics and reported to the trace hook. A
+ * phase entered again while it runs, like a reader read by an extraction, is
+ * counted once; a copy made by a repack is counted in both phases.
+ */
+#define RTAD_PHASE_HEADER 0  // reading the trailer and the TOC of a file
+#define RTAD_PHASE_COPY 1    // copying an executable or stored entries
+#define RTAD_PHASE_APPEND 2  // writing appended data
+#define RTAD_PHASE_EXTRACT 3 // reading entries and appended data
+#define RTAD_PHASE_VERIFY 4  // checking the whole tree hash
+#define RTAD_PHASE_COMPACT 5 // dropping dead bytes in place
+#define RTAD_PHASE_COUNT 6
+
+/**
+ * @brief Counters of rtad_stats_get, only collected if the library is built
+ * with RTAD_WITH_STATS.
+ */
+struct rtad_stats {
+  uint64_t bytes_read;    // into memory, with pread or io_uring
+  uint64_t bytes_written; // from memory
+  uint64_t bytes_copied;  // file to file in the kernel
+  uint64_t syscalls;      // reads, writes, copies, opens, maps, seeks
+  uint64_t opens;
+  uint64_t maps;
+  // reads of a compressed entry served by the chunk a reader last decoded,
+  // and the ones that had to decode it; chunks_decoded counts all of them
+  uint64_t cache_hits;
+  uint64_t cache_misses;
+  uint64_t chunks_decoded;
+  uint64_t phase_calls[RTAD_PHASE_COUNT];
+  uint64_t phase_ns[RTAD_PHASE_COUNT];
+};
+
+/**
+ * @brief Called when a phase begins and ends, on the thread running it,
+ * time_ns is read from a monotonic clock.
+ */
+typedef void (*rtad_trace_fn)(void *ctx, int phase, int end, uint64_t time_ns);
+
+/**
+ * @brief A named file to be appended as an entry.
+ */
+struct rtad_file_input {
+  const char *name;
+  const char *path;
+  uint32_t codec; // RTAD_CODEC_*, 0 to store as is
+};
 
 /**
  * @brief Truncate appended data from a file.
@@ -43,6 +190,18 @@ int rtad_extract_data(const char *exe_path, char **out_data,
  * @return int 0 on success, -1 on failure.
  */
 int rtad_free_extracted_data(char *data);
+/**
+ * @brief Allocate the memory of the read path with allocator instead of
+ * malloc and free. Set it once before any other call: memory is freed with
+ * the allocator it came from, and the handle of rtad_self is never freed.
+ * Writers keep using malloc. With stats, the first counted call of a thread
+ * also takes its counters from the allocator; they are never freed, the next
+ * new thread reuses them once the thread exits.
+ *
+ * @param allocator copied, NULL for malloc and free
+ * @return int 0 on success, -1 if alloc or free is missing.
+ */
+int rtad_set_allocator(const struct rtad_allocator *allocator);
 /**
  * @brief Extract appended data from executable itself.
  *
@@ -64,4 +223,657 @@ int rtad_validate_hdr(const char *exe_path);
  * @return int 0 on valid, -1 on invalid.
  */
 int rtad_validate_self_hdr();
+/**
+ * @brief Map appended data from exe_path as read-only memory.
+ * Pages are loaded on demand and shared with other processes mapping the
+ * same file, nothing is copied. The file must not be modified while mapped.
+ *
+ * @param exe_path
+ * @param out_data
+ * @param out_data_size
+ * @return int 0 on success, -1 on failure.
+ */
+int rtad_map_data(const char *exe_path, const char **out_data,
+                  size_t *out_data_size);
+/**
+ * @brief Map appended data from executable itself as read-only memory.
+ *
+ * @param out_data
+ * @param out_data_size
+ * @return int 0 on success, -1 on failure.
+ */
+int rtad_map_self_data(const char **out_data, size_t *out_data_size);
+/**
+ * @brief Unmap data returned by rtad_map_data or rtad_map_self_data.
+ *
+ * @param data
+ * @param data_size
+ * @return int 0 on success, -1 on failure.
+ */
+int rtad_unmap_data(const char *data, size_t data_size);
+/**
+ * @brief Copy self executable to dest_path and append named entries to it.
+ * Entry names must be unique, the entry data may be empty.
+ *
+ * @param dest_path
+ * @param inputs
+ * @param count
+ * @return int 0 on success, -1 on failure.
+ */
+int rtad_copy_self_with_entries(const char *dest_path,
+                                const struct rtad_input *inputs, size_t count);
+/**
+ * @brief Compact the payload of a file, see rtad_file_compact.
+ *
+ * @param exe_path
+ * @return int 0 on success, -1 on failure.
+ */
+int rtad_compact(const char *exe_path);
+/**
+ * @brief Pack a new file from the executable part of src, the entries of src
+ * to keep and new entries. Only the bytes before the payload of src and the
+ * kept entries are copied, see rtad_writer_copy_entries.
+ *
+ * @param src rtad_self() to re-pack the running executable
+ * @param dest_path created or replaced
+ * @param keep names of the entries of src to keep
+ * @param keep_count
+ * @param inputs new entries
+ * @param count
+ * @return int 0 on success, -1 on failure.
+ */
+int rtad_file_repack(rtad_file *src, const char *dest_path,
+                     const char *const *keep, size_t keep_count,
+                     const struct rtad_input *inputs, size_t count);
+/**
+ * @brief Re-pack the file at src_path, see rtad_file_repack.
+ *
+ * @param src_path
+ * @param dest_path
+ * @param keep
+ * @param keep_count
+ * @param inputs
+ * @param count
+ * @return int 0 on success, -1 on failure.
+ */
+int rtad_repack(const char *src_path, const char *dest_path,
+                const char *const *keep, size_t keep_count,
+                const struct rtad_input *inputs, size_t count);
+/**
+ * @brief Open a writer appending data to dest_path, existing appended data of
+ * dest_path is removed first. To pack the executable itself, prepare
+ * dest_path with rtad_truncate_self_data.
+ * Data is written through a fixed-size buffer, only the TOC is kept in memory.
+ *
+ * @param dest_path
+ * @return rtad_writer* NULL on failure.
+ */
+rtad_writer *rtad_writer_open(const char *dest_path);
+/**
+ * @brief Open a writer that updates the entries of a packed file in place.
+ * The payload is kept and only what is written, a new TOC and the tree hash
+ * are appended: an entry replaces the one with the same name, which is left
+ * as dead bytes until rtad_compact. A file without payload gets a new one.
+ *
+ * @param dest_path
+ * @return rtad_writer* NULL on error or if the payload has no entries.
+ */
+rtad_writer *rtad_writer_open_update(const char *dest_path);
+/**
+ * @brief Leave an entry out of the TOC written at close, its bytes stay in
+ * the file.
+ *
+ * @param writer
+ * @param name
+ * @return int 0 on success, -1 if there is no such entry.
+ */
+int rtad_writer_remove(rtad_writer *writer, const char *name);
+/**
+ * @brief Copy entries of src as they are stored, compressed chunks included,
+ * after the entry being written. The bytes are copied in the kernel when the
+ * file systems allow it, entries sharing bytes in src share them here too.
+ *
+ * @param writer
+ * @param src
+ * @param names of the entries to copy, they keep their names
+ * @param count
+ * @return int 0 on success, -1 on failure or if an entry is missing.
+ */
+int rtad_writer_copy_entries(rtad_writer *writer, rtad_file *src,
+                             const char *const *names, size_t count);
+/**
+ * @brief Start a new named entry, following writes go to this entry.
+ * If data is written before the first entry, the writer produces a single
+ * anonymous payload and entries can't be started anymore.
+ *
+ * @param writer
+ * @param name
+ * @return int 0 on success, -1 on failure.
+ */
+int rtad_writer_begin_entry(rtad_writer *writer, const char *name);
+/**
+ * @brief Compress the following entries with codec in chunks of chunk_size
+ * bytes, or the payload if nothing is written yet. The entry being written
+ * keeps its codec. A reader decodes only the chunks covering what is read.
+ *
+ * @param writer
+ * @param codec RTAD_CODEC_*
+ * @param chunk_size 0 for RTAD_CHUNK_SIZE
+ * @return int 0 on success, -1 if the codec is not supported.
+ */
+int rtad_writer_set_codec(rtad_writer *writer, uint32_t codec,
+                          uint32_t chunk_size);
+/**
+ * @brief Compress the chunks of the following entries, or of the payload, on
+ * threads worker threads while one thread writes them in order. The output
+ * is the same whatever the number of threads.
+ *
+ * @param writer
+ * @param threads 0 for one per processor, 1 to compress on the calling thread
+ * @return int 0 on success, -1 on failure.
+ */
+int rtad_writer_set_threads(rtad_writer *writer, unsigned threads);
+/**
+ * @brief Store the following entries once when their content was written
+ * before, the TOC points them at the same bytes, and share their identical
+ * chunks. With RTAD_DEDUP_CDC, chunks are cut where the content says so,
+ * from a quarter to four times the chunk size, so runs shared at different
+ * offsets share their chunks too. Entries become chunked even without codec.
+ *
+ * @param writer
+ * @param flags RTAD_DEDUP_*, 0 to stop
+ * @return int 0 on success, -1 on unknown flags.
+ */
+int rtad_writer_set_dedup(rtad_writer *writer, uint32_t flags);
+/**
+ * @brief Start the following entries stored as is, without codec nor dedup,
+ * at a file offset multiple of align, so rtad_entry_map returns them
+ * page-aligned. The gap before an entry is filled with zeros.
+ *
+ * @param writer
+ * @param align a power of 2 up to RTAD_ALIGN_MAX, RTAD_ALIGN_PAGE or
+ * RTAD_ALIGN_HUGE usually, 0 to stop
+ * @return int 0 on success, -1 on an invalid alignment.
+ */
+int rtad_writer_set_align(rtad_writer *writer, uint32_t align);
+/**
+ * @brief Load the payload with the executable. At close, a Linux ELF
+ * executable linked with this library statically gets a PT_LOAD segment over
+ * the payload, so rtad_self and its views are in memory the loader mapped,
+ * without opening the file. Other files keep the payload at the tail only.
+ * Once added, the segment follows the payload through later changes.
+ *
+ * The segment needs a spare program header. RTAD_LOAD_SEGMENT only takes an
+ * unused PT_NULL one, which linkers seldom leave. RTAD_LOAD_NOTE also lets it
+ * take a PT_NOTE header: the notes stay in the file, but tools reading them
+ * through the program headers, like core dumps and debuggers, don't see them
+ * anymore. A PT_NOTE with the GNU build id is never taken.
+ *
+ * @param writer
+ * @param flags RTAD_LOAD_* flags, RTAD_LOAD_NOTE implies RTAD_LOAD_SEGMENT, 0
+ * to keep the payload at the tail only
+ * @return int 0 on success, -1 on unknown flags.
+ */
+int rtad_writer_set_load(rtad_writer *writer, uint32_t flags);
+/**
+ * @brief Check if a codec is built in this library.
+ *
+ * @param codec
+ * @return int 0 if supported, -1 otherwise.
+ */
+int rtad_codec_supported(uint32_t codec);
+/**
+ * @brief Append data to the payload or to the current entry.
+ *
+ * @param writer
+ * @param data
+ * @param size
+ * @return int 0 on success, -1 on failure.
+ */
+int rtad_writer_write(rtad_writer *writer, const void *data, size_t size);
+/**
+ * @brief Append several buffers in order, without concatenating them first.
+ *
+ * @param writer
+ * @param iov
+ * @param iov_count
+ * @return int 0 on success, -1 on failure.
+ */
+int rtad_writer_writev(rtad_writer *writer, const struct rtad_iovec *iov,
+                       size_t iov_count);
+/**
+ * @brief Append files as entries, in order. The files are read in slices
+ * with many reads in flight, through io_uring on Linux when the kernel
+ * allows it, while the entries are written.
+ *
+ * @param writer
+ * @param inputs
+ * @param count
+ * @return int 0 on success, -1 on failure, the writer can only be aborted.
+ */
+int rtad_writer_add_files(rtad_writer *writer,
+                          const struct rtad_file_input *inputs, size_t count);
+/**
+ * @brief Write the TOC and the trailer, then free the writer.
+ * If any write failed, the file is restored to its size without payload.
+ *
+ * @param writer
+ * @return int 0 on success, -1 on failure.
+ */
+int rtad_writer_close(rtad_writer *writer);
+/**
+ * @brief Drop everything written, restore the file to its size without
+ * payload and free the writer.
+ *
+ * @param writer
+ * @return int 0 on success, -1 on failure.
+ */
+int rtad_writer_abort(rtad_writer *writer);
+/**
+ * @brief Open exe_path to read appended data or look up appended entries.
+ * The trailer and the TOC are read at once from the end of the file and kept
+ * in the handle. A file without appended data can be opened too, see
+ * rtad_file_validate.
+ *
+ * @param exe_path
+ * @return rtad_file* NULL on failure.
+ */
+rtad_file *rtad_open(const char *exe_path);
+/**
+ * @brief Same as rtad_open, the file is opened for writing too, to truncate
+ * or append on the handle.
+ *
+ * @param exe_path
+ * @return rtad_file* NULL on failure.
+ */
+rtad_file *rtad_open_rw(const char *exe_path);
+/**
+ * @brief Open the executable itself to read appended data or look up
+ * appended entries.
+ *
+ * @return rtad_file* NULL on failure.
+ */
+rtad_file *rtad_open_self(void);
+/**
+ * @brief Get the handle of the executable itself, opened on the first call and
+ * kept until the process exits. It's safe to use from any thread, it must not
+ * be closed.
+ *
+ * @return rtad_file* NULL on failure.
+ */
+rtad_file *rtad_self(void);
+/**
+ * @brief Get a view of the appended data of the executable itself. The view is
+ * mapped once and shared by all callers, don't unmap it.
+ *
+ * @param out_data
+ * @param out_data_size
+ * @return int 0 on success, -1 on failure.
+ */
+int rtad_self_data(const char **out_data, size_t *out_data_size);
+/**
+ * @brief Get a view of an entry of the executable itself, inside the view of
+ * rtad_self_data.
+ *
+ * @param name
+ * @param out_data
+ * @param out_data_size
+ * @return int 0 on success, -1 if not found or on failure.
+ */
+int rtad_self_entry(const char *name, const char **out_data,
+                    size_t *out_data_size);
+/**
+ * @brief Close a file returned by rtad_open, rtad_open_rw or rtad_open_self.
+ *
+ * @param file
+ * @return int 0 on success, -1 on failure.
+ */
+int rtad_close(rtad_file *file);
+/**
+ * @brief Validate if the file has appended data with a valid header.
+ *
+ * @param file
+ * @return int 0 on valid, -1 on invalid.
+ */
+int rtad_file_validate(rtad_file *file);
+/**
+ * @brief Get the BLAKE3 hash of the appended data, as written by the writer.
+ * The same as b3sum of the payload bytes before the tree hash.
+ *
+ * @param file
+ * @param out_hash
+ * @return int 0 on success, -1 if the file has no tree hash.
+ */
+int rtad_file_hash(rtad_file *file, uint8_t out_hash[RTAD_HASH_SIZE]);
+/**
+ * @brief Check the whole appended data against its tree hash, hashing blocks
+ * on threads threads.
+ *
+ * @param file
+ * @param threads 0 for one per processor
+ * @return int 0 if it matches, -1 on mismatch, without tree hash or on error.
+ */
+int rtad_verify_full(rtad_file *file, unsigned threads);
+/**
+ * @brief Extract the appended data, free it with rtad_free_extracted_data.
+ *
+ * @param file
+ * @param out_data
+ * @param out_data_size
+ * @return int 0 on success, -1 on failure.
+ */
+int rtad_file_extract(rtad_file *file, char **out_data, size_t *out_data_size);
+/**
+ * @brief Extract an entry, or the whole appended data if entry is NULL, into
+ * a buffer of the caller. Nothing is allocated for data stored as is;
+ * chunked data needs its chunk table and, for compressed chunks, a buffer of
+ * one stored chunk, both from the allocator.
+ *
+ * @param file
+ * @param entry
+ * @param buf
+ * @param capacity
+ * @param out_data_size size of the data, set also if it doesn't fit
+ * @return int 0 on success, -1 if the data doesn't fit or on failure.
+ */
+int rtad_extract_into(rtad_file *file, const struct rtad_entry *entry,
+                      char *buf, size_t capacity, size_t *out_data_size);
+/**
+ * @brief Same as rtad_extract_into, filling the buffers in order.
+ *
+ * @param file
+ * @param entry
+ * @param bufs
+ * @param buf_count
+ * @param out_data_size size of the data, set also if it doesn't fit
+ * @return int 0 on success, -1 if the data doesn't fit or on failure.
+ */
+int rtad_extract_iov(rtad_file *file, const struct rtad_entry *entry,
+                     const struct rtad_data *bufs, size_t buf_count,
+                     size_t *out_data_size);
+/**
+ * @brief Map the appended data as read-only memory, unmap it with
+ * rtad_unmap_data. The mapping stays valid after the file is closed.
+ *
+ * @param file
+ * @param out_data
+ * @param out_data_size
+ * @return int 0 on success, -1 on failure.
+ */
+int rtad_file_map(rtad_file *file, const char **out_data,
+                  size_t *out_data_size);
+/**
+ * @brief Truncate the appended data, the file must be opened with
+ * rtad_open_rw. A file without appended data is left as is.
+ *
+ * @param file
+ * @return int 0 on success, -1 on failure.
+ */
+int rtad_file_truncate(rtad_file *file);
+/**
+ * @brief Append data, the existing appended data is replaced. The file must be
+ * opened with rtad_open_rw.
+ *
+ * @param file
+ * @param data
+ * @param size
+ * @return int 0 on success, -1 on failure.
+ */
+int rtad_file_append(rtad_file *file, const char *data, size_t size);
+/**
+ * @brief Append named entries, the existing appended data is replaced. The
+ * file must be opened with rtad_open_rw. Entry names must be unique, the entry
+ * data may be empty.
+ *
+ * @param file
+ * @param inputs
+ * @param count
+ * @return int 0 on success, -1 on failure.
+ */
+int rtad_file_append_entries(rtad_file *file, const struct rtad_input *inputs,
+                             size_t count);
+/**
+ * @brief Get the size of the payload bytes no entry points at, left by
+ * updates and reclaimed by rtad_file_compact.
+ *
+ * @param file
+ * @param out_size
+ * @return int 0 on success, -1 on failure.
+ */
+int rtad_file_dead_size(rtad_file *file, uint64_t *out_size);
+/**
+ * @brief Rewrite the payload in place with only the bytes the entries point
+ * at, shared ones stay shared. If it fails midway, the payload is dropped.
+ *
+ * @param file writable
+ * @return int 0 on success, -1 on failure.
+ */
+int rtad_file_compact(rtad_file *file);
+/**
+ * @brief Find an entry by name. The TOC is kept in memory by rtad_open, the
+ * lookup doesn't read the file.
+ *
+ * @param file
+ * @param name
+ * @param out_entry
+ * @return int 0 on success, -1 if not found or on failure.
+ */
+int rtad_find(rtad_file *file, const char *name, struct rtad_entry *out_entry);
+/**
+ * @brief Get the number of entries, 0 without a table of contents.
+ *
+ * @param file
+ * @return size_t
+ */
+size_t rtad_entry_count(rtad_file *file);
+/**
+ * @brief Get an entry by index, in the order of the table of contents. The
+ * name isn't NUL-terminated and stays valid until the file is closed.
+ *
+ * @param file
+ * @param index below rtad_entry_count
+ * @param out_name
+ * @param out_name_size
+ * @param out_entry
+ * @return int 0 on success, -1 on failure.
+ */
+int rtad_entry_at(rtad_file *file, size_t index, const char **out_name,
+                  size_t *out_name_size, struct rtad_entry *out_entry);
+/**
+ * @brief Read the data of an entry, free it with rtad_free_extracted_data.
+ *
+ * @param file
+ * @param entry
+ * @param out_data
+ * @param out_data_size
+ * @return int 0 on success, -1 on failure.
+ */
+int rtad_entry_read(rtad_file *file, const struct rtad_entry *entry,
+                    char **out_data, size_t *out_data_size);
+/**
+ * @brief Map an entry stored as is as read-only memory, unmap it with
+ * rtad_unmap_data. Pages are read on first access. The view is page-aligned
+ * when the entry was written with rtad_writer_set_align, and backed by huge
+ * pages when the system allows it with RTAD_ALIGN_HUGE. The mapping stays
+ * valid after the file is closed.
+ *
+ * @param file
+ * @param entry
+ * @param out_data
+ * @param out_data_size
+ * @return int 0 on success, -1 if the entry is chunked, empty or on failure.
+ */
+int rtad_entry_map(rtad_file *file, const struct rtad_entry *entry,
+                   const char **out_data, size_t *out_data_size);
+/**
+ * @brief Get an entry as an anonymous, sealed file in memory, for code that
+ * only takes a descriptor or a path like dlopen("/proc/self/fd/N"). Entries
+ * stored as is are copied in the kernel, compressed ones are decoded chunk by
+ * chunk. The file can't be written, grown or shrunk, its position is 0. Linux
+ * only, close it with close.
+ *
+ * @param file
+ * @param entry NULL for the whole appended data
+ * @return int the descriptor, -1 on failure or if not supported.
+ */
+int rtad_entry_fd(rtad_file *file, const struct rtad_entry *entry);
+/**
+ * @brief Send size bytes of an entry from offset to a socket, a pipe or a
+ * file, at its position. An entry stored as is goes from the file to out_fd
+ * with sendfile, never copied in user space; store pre-compressed assets
+ * like .gz files as is to serve them with a Content-Encoding. A compressed
+ * entry is decoded chunk by chunk and written. On a non-blocking socket that
+ * is full, it fails with errno EAGAIN and *out_sent tells where to resume.
+ *
+ * @param file
+ * @param entry NULL for the whole appended data
+ * @param out_fd
+ * @param offset in the decoded entry
+ * @param size clipped to the end of the entry
+ * @param out_sent the bytes sent, also on failure
+ * @return int 0 on success, -1 on failure.
+ */
+int rtad_entry_sendfile(rtad_file *file, const struct rtad_entry *entry,
+                        int out_fd, uint64_t offset, uint64_t size,
+                        uint64_t *out_sent);
+/**
+ * @brief Open an entry as a read-only stdio stream, for code that takes a
+ * FILE *. It reads through a reader, so compressed entries are decoded one
+ * chunk at a time and nothing is loaded whole; fseek and ftell work. Built on
+ * fopencookie on Linux and funopen on macOS and BSD. The file must stay open
+ * until the stream is closed with fclose.
+ *
+ * @param file
+ * @param entry NULL for the whole appended data
+ * @param mode "r" or "rb"
+ * @return FILE* NULL on failure, for another mode or if not supported.
+ */
+FILE *rtad_fopen(rtad_file *file, const struct rtad_entry *entry,
+                 const char *mode);
+/**
+ * @brief Read several entries at once. Their stored bytes are sorted by
+ * offset and read with as few positional reads as possible, close ranges
+ * merged, then copied or decoded into a buffer per entry.
+ *
+ * @param file
+ * @param names
+ * @param count
+ * @param out count results, in the order of names
+ * @return int 0 on success, -1 if an entry is missing or on failure, out is
+ * then cleared.
+ */
+int rtad_get_many(rtad_file *file, const char *const *names, size_t count,
+                  struct rtad_data *out);
+/**
+ * @brief Open a reader over an entry, or over the whole appended data if
+ * entry is NULL. Readers share the descriptor of the file and read with
+ * positional reads, the file must outlive its readers.
+ *
+ * @param file
+ * @param entry
+ * @return rtad_reader* NULL on failure.
+ */
+rtad_reader *rtad_reader_open(rtad_file *file, const struct rtad_entry *entry);
+/**
+ * @brief Close a reader.
+ *
+ * @param reader
+ * @return int 0 on success, -1 on failure.
+ */
+int rtad_reader_close(rtad_reader *reader);
+/**
+ * @brief Read up to size bytes at the current position and advance it.
+ * *out_read is 0 at the end.
+ *
+ * @param reader
+ * @param buf
+ * @param size
+ * @param out_read
+ * @return int 0 on success, -1 on failure.
+ */
+int rtad_reader_read(rtad_reader *reader, void *buf, size_t size,
+                     size_t *out_read);
+/**
+ * @brief Read up to size bytes at offset, the position is not changed.
+ *
+ * @param reader
+ * @param buf
+ * @param size
+ * @param offset
+ * @param out_read
+ * @return int 0 on success, -1 on failure.
+ */
+int rtad_reader_pread(rtad_reader *reader, void *buf, size_t size,
+                      uint64_t offset, size_t *out_read);
+/**
+ * @brief Move the position, whence is SEEK_SET, SEEK_CUR or SEEK_END.
+ *
+ * @param reader
+ * @param offset
+ * @param whence
+ * @return int 0 on success, -1 on failure.
+ */
+int rtad_reader_seek(rtad_reader *reader, int64_t offset, int whence);
+/**
+ * @brief Get the current position.
+ *
+ * @param reader
+ * @return uint64_t
+ */
+uint64_t rtad_reader_tell(const rtad_reader *reader);
+/**
+ * @brief Get the size of the data the reader is over.
+ *
+ * @param reader
+ * @return uint64_t
+ */
+uint64_t rtad_reader_size(const rtad_reader *reader);
+/**
+ * @brief Check the stored bytes read from now on against the tree hash. Each
+ * block is hashed the first time it's touched, a read touching a block that
+ * doesn't match fails.
+ *
+ * @param reader
+ * @return int 0 on success, -1 if the file has no tree hash or it's corrupted.
+ */
+int rtad_reader_enable_verify(rtad_reader *reader);
+/**
+ * @brief Get the counters of all threads since the start or the last
+ * rtad_stats_reset. Each thread counts on its own, they are summed here.
+ *
+ * @param out_stats
+ * @return int 0 on success, -1 if the library is built without
+ * RTAD_WITH_STATS.
+ */
+int rtad_stats_get(struct rtad_stats *out_stats);
+/**
+ * @brief Get the counters of the calling thread since it first used the
+ * library or the last rtad_stats_reset.
+ *
+ * @param out_stats
+ * @return int 0 on success, -1 if the library is built without
+ * RTAD_WITH_STATS.
+ */
+int rtad_stats_thread(struct rtad_stats *out_stats);
+/**
+ * @brief Start counting again from 0, for all threads.
+ */
+void rtad_stats_reset(void);
+/**
+ * @brief Call trace at the beginning and the end of every phase. Set it before
+ * other threads use the library.
+ *
+ * @param trace NULL to stop tracing
+ * @param ctx passed to trace
+ * @return int 0 on success, -1 if the library is built without
+ * RTAD_WITH_STATS.
+ */
+int rtad_set_trace(rtad_trace_fn trace, void *ctx);
+/**
+ * @brief Get the name of a phase, like "header".
+ *
+ * @param phase RTAD_PHASE_*
+ * @return const char* NULL if the phase is unknown
+ */
+const char *rtad_phase_name(int phase);
 #endif
\ No newline at end of file
@@ -14,329 +14,5732 @@ RTAD_PRIVATE int exe_path(char *buffer, size_t buf_size) {
   return 0;
 }
 
+RTAD_PRIVATE int exe_open(void) {
+  char pathBuf[PATH_MAX];
+  if (exe_path(pathBuf, sizeof(pathBuf)) != 0) {
+    return -1;
+  }
+  return file_open(pathBuf);
+}
+
+#elif defined(__APPLE__)
+RTAD_PRIVATE int exe_path(char *buffer, size_t buf_size) {
+  if (!buffer || buf_size == 0)
+    return -1;
+  uint32_t size = (uint32_t)buf_size;
+  if (_NSGetExecutablePath(buffer, &size) != 0) {
+    // Buffer too small
+    if (buf_size > 0)
+      buffer[buf_size - 1] = '\0';
+    return -1;
+  }
+  return 0;
+}
+
+RTAD_PRIVATE int exe_open(void) {
+  char pathBuf[PATH_MAX];
+  if (exe_path(pathBuf, sizeof(pathBuf)) != 0) {
+    return -1;
+  }
+  return file_open(pathBuf);
+}
+
+#elif defined(__linux__)
+RTAD_PRIVATE int exe_open(void) {
+  // the link always refers to the running binary, even after the path is
+  // replaced or removed
+  return file_open("/proc/self/exe");
+}
+
+#else
+#error "Define failed: Unsupported platform"
+
+#endif
+
+#if defined(_WIN32)
+RTAD_PRIVATE size_t map_granularity(void) {
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return (size_t)info.dwAllocationGranularity;
+}
+
+RTAD_PRIVATE const char *fd_map(int fd, off_t offset, size_t size) {
+  HANDLE hFile = (HANDLE)_get_osfhandle(fd);
+  if (hFile == INVALID_HANDLE_VALUE || offset < 0 || size == 0) {
+    return NULL;
+  }
+  size_t granularity = map_granularity();
+  size_t delta = (size_t)(offset % (off_t)granularity);
+  unsigned long long base_offset = (unsigned long long)(offset - delta);
+  HANDLE hMap = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+  STAT_ADD(STAT_SYSCALLS, 1);
+  STAT_ADD(STAT_MAPS, 1);
+  if (!hMap) {
+    return NULL;
+  }
+  // the view keeps the mapping object alive, the handle is not needed
+  void *base = MapViewOfFile(hMap, FILE_MAP_READ, (DWORD)(base_offset >> 32),
+                             (DWORD)(base_offset & 0xFFFFFFFF), size + delta);
+  CloseHandle(hMap);
+  if (!base) {
+    return NULL;
+  }
+  return (const char *)base + delta;
+}
+
+RTAD_PRIVATE int file_unmap(const char *addr, size_t size) {
+  (void)size;
+  if (!addr) {
+    return -1;
+  }
+  uintptr_t base = (uintptr_t)addr - (uintptr_t)addr % map_granularity();
+  STAT_ADD(STAT_SYSCALLS, 1);
+  return UnmapViewOfFile((LPCVOID)base) ? 0 : -1;
+}
+
+RTAD_PRIVATE int file_open(const char *path) {
+  if (!path) {
+    return -1;
+  }
+  STAT_ADD(STAT_SYSCALLS, 1);
+  STAT_ADD(STAT_OPENS, 1);
+  return _open(path, _O_RDONLY | _O_BINARY);
+}
+
+RTAD_PRIVATE int file_close(int fd) {
+  STAT_ADD(STAT_SYSCALLS, 1);
+  return _close(fd);
+}
+
+RTAD_PRIVATE int file_pread(int fd, void *buf, size_t size, off_t offset) {
+  HANDLE hFile = (HANDLE)_get_osfhandle(fd);
+  if (hFile == INVALID_HANDLE_VALUE || offset < 0) {
+    return -1;
+  }
+  char *p = (char *)buf;
+  while (size > 0) {
+    DWORD chunk = size > 0x40000000 ? 0x40000000 : (DWORD)size;
+    OVERLAPPED ov = {0};
+    ov.Offset = (DWORD)((unsigned long long)offset & 0xFFFFFFFF);
+    ov.OffsetHigh = (DWORD)((unsigned long long)offset >> 32);
+    DWORD bytes = 0;
+    STAT_ADD(STAT_SYSCALLS, 1);
+    if (!ReadFile(hFile, p, chunk, &bytes, &ov) || bytes == 0) {
+      return -1;
+    }
+    STAT_ADD(STAT_BYTES_READ, bytes);
+    p += bytes;
+    size -= bytes;
+    offset += bytes;
+  }
+  return 0;
+}
+
+RTAD_PRIVATE int file_open_rw(const char *path) {
+  if (!path) {
+    return -1;
+  }
+  STAT_ADD(STAT_SYSCALLS, 1);
+  STAT_ADD(STAT_OPENS, 1);
+  return _open(path, _O_RDWR | _O_BINARY);
+}
+
+RTAD_PRIVATE int fd_seek(int fd, off_t offset) {
+  STAT_ADD(STAT_SYSCALLS, 1);
+  return _lseeki64(fd, (__int64)offset, SEEK_SET) == (__int64)offset ? 0 : -1;
+}
+
+RTAD_PRIVATE int file_write(int fd, const void *buf, size_t size) {
+  const char *p = (const char *)buf;
+  while (size > 0) {
+    unsigned int chunk = size > 0x40000000 ? 0x40000000 : (unsigned int)size;
+    int bytes = _write(fd, p, chunk);
+    STAT_ADD(STAT_SYSCALLS, 1);
+    if (bytes <= 0) {
+      return -1;
+    }
+    STAT_ADD(STAT_BYTES_WRITTEN, bytes);
+    p += bytes;
+    size -= (size_t)bytes;
+  }
+  return 0;
+}
+
+RTAD_PRIVATE int fd_send_buf(int fd, const void *buf, size_t size,
+                             uint64_t *out_sent) {
+  const char *p = (const char *)buf;
+  while (size > 0) {
+    unsigned int chunk = size > 0x40000000 ? 0x40000000 : (unsigned int)size;
+    int bytes = _write(fd, p, chunk);
+    STAT_ADD(STAT_SYSCALLS, 1);
+    if (bytes <= 0) {
+      return -1;
+    }
+    STAT_ADD(STAT_BYTES_WRITTEN, bytes);
+    *out_sent += (uint64_t)bytes;
+    p += bytes;
+    size -= (size_t)bytes;
+  }
+  return 0;
+}
+
+RTAD_PRIVATE int file_writev(int fd, const struct rtad_iovec *iov,
+                             size_t iov_count) {
+  // no gather write on Windows, the CRT buffers nothing so write them in turn
+  for (size_t i = 0; i < iov_count; i++) {
+    if (file_write(fd, iov[i].data, iov[i].size) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+RTAD_PRIVATE int file_create(const char *path) {
+  if (!path) {
+    return -1;
+  }
+  STAT_ADD(STAT_SYSCALLS, 1);
+  STAT_ADD(STAT_OPENS, 1);
+  return _open(path, _O_RDWR | _O_CREAT | _O_TRUNC | _O_BINARY,
+               _S_IREAD | _S_IWRITE);
+}
+
+RTAD_PRIVATE int file_pwrite(int fd, const void *buf, size_t size,
+                             off_t offset) {
+  HANDLE hFile = (HANDLE)_get_osfhandle(fd);
+  if (hFile == INVALID_HANDLE_VALUE || offset < 0) {
+    return -1;
+  }
+  const char *p = (const char *)buf;
+  while (size > 0) {
+    DWORD chunk = size > 0x40000000 ? 0x40000000 : (DWORD)size;
+    OVERLAPPED ov = {0};
+    ov.Offset = (DWORD)((unsigned long long)offset & 0xFFFFFFFF);
+    ov.OffsetHigh = (DWORD)((unsigned long long)offset >> 32);
+    DWORD bytes = 0;
+    STAT_ADD(STAT_SYSCALLS, 1);
+    if (!WriteFile(hFile, p, chunk, &bytes, &ov) || bytes == 0) {
+      return -1;
+    }
+    STAT_ADD(STAT_BYTES_WRITTEN, bytes);
+    p += bytes;
+    size -= bytes;
+    offset += bytes;
+  }
+  return 0;
+}
+
+RTAD_PRIVATE int fd_truncate(int fd, off_t size) {
+  STAT_ADD(STAT_SYSCALLS, 1);
+  return _chsize_s(fd, (__int64)size) == 0 ? 0 : -1;
+}
+
+RTAD_PRIVATE int memfd_open(const char *name) {
+  (void)name;
+  return -1;
+}
+
+RTAD_PRIVATE int memfd_seal(int fd) {
+  (void)fd;
+  return -1;
+}
+
+RTAD_PRIVATE off_t fd_length(int fd) {
+  LARGE_INTEGER li;
+  HANDLE hFile = (HANDLE)_get_osfhandle(fd);
+  STAT_ADD(STAT_SYSCALLS, 1);
+  if (hFile == INVALID_HANDLE_VALUE || GetFileSizeEx(hFile, &li) == 0) {
+    return -1;
+  }
+  return (off_t)li.QuadPart;
+}
+
+static BOOL CALLBACK once_callback(PINIT_ONCE once, PVOID param,
+                                   PVOID *context) {
+  (void)once;
+  (void)context;
+  ((void (*)(void))param)();
+  return TRUE;
+}
+
+RTAD_PRIVATE void run_once(rtad_once_t *once, void (*init)(void)) {
+  InitOnceExecuteOnce(once, once_callback, (PVOID)init, NULL);
+}
+
+struct thread_start {
+  void (*fn)(void *);
+  void *arg;
+};
+
+static DWORD WINAPI thread_main(LPVOID param) {
+  struct thread_start start = *(struct thread_start *)param;
+  free(param);
+  start.fn(start.arg);
+  return 0;
+}
+
+RTAD_PRIVATE int thread_create(rtad_thread_t *thread, void (*fn)(void *),
+                               void *arg) {
+  struct thread_start *start =
+      (struct thread_start *)malloc(sizeof(struct thread_start));
+  if (!start) {
+    return -1;
+  }
+  start->fn = fn;
+  start->arg = arg;
+  *thread = CreateThread(NULL, 0, thread_main, start, 0, NULL);
+  if (!*thread) {
+    free(start);
+    return -1;
+  }
+  return 0;
+}
+
+RTAD_PRIVATE void thread_join(rtad_thread_t thread) {
+  WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+}
+
+RTAD_PRIVATE int mutex_init(rtad_mutex_t *mutex) {
+  InitializeSRWLock(mutex);
+  return 0;
+}
+
+RTAD_PRIVATE void mutex_destroy(rtad_mutex_t *mutex) { (void)mutex; }
+
+RTAD_PRIVATE void mutex_lock(rtad_mutex_t *mutex) {
+  AcquireSRWLockExclusive(mutex);
+}
+
+RTAD_PRIVATE void mutex_unlock(rtad_mutex_t *mutex) {
+  ReleaseSRWLockExclusive(mutex);
+}
+
+RTAD_PRIVATE int cond_init(rtad_cond_t *cond) {
+  InitializeConditionVariable(cond);
+  return 0;
+}
+
+RTAD_PRIVATE void cond_destroy(rtad_cond_t *cond) { (void)cond; }
+
+RTAD_PRIVATE void cond_wait(rtad_cond_t *cond, rtad_mutex_t *mutex) {
+  SleepConditionVariableSRW(cond, mutex, INFINITE, 0);
+}
+
+RTAD_PRIVATE void cond_broadcast(rtad_cond_t *cond) {
+  WakeAllConditionVariable(cond);
+}
+
+RTAD_PRIVATE unsigned cpu_count(void) {
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors > 0 ? (unsigned)info.dwNumberOfProcessors
+                                       : 1;
+}
+
+#if defined(RTAD_HAVE_STATS)
+// only the statistics keep a slot per thread and read the clock
+static void (*key_destructor)(void *);
+
+static VOID WINAPI key_callback(PVOID value) {
+  if (value && key_destructor) {
+    key_destructor(value);
+  }
+}
+
+RTAD_PRIVATE int key_create(rtad_key_t *key, void (*destructor)(void *)) {
+  // fiber-local storage, its callback also runs when a thread exits
+  key_destructor = destructor;
+  *key = FlsAlloc(key_callback);
+  return *key == FLS_OUT_OF_INDEXES ? -1 : 0;
+}
+
+RTAD_PRIVATE int key_set(rtad_key_t key, void *value) {
+  return FlsSetValue(key, value) ? 0 : -1;
+}
+
+RTAD_PRIVATE uint64_t clock_ns(void) {
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER counter;
+  if (freq.QuadPart == 0) {
+    QueryPerformanceFrequency(&freq);
+  }
+  QueryPerformanceCounter(&counter);
+  return (uint64_t)((double)counter.QuadPart * 1e9 / (double)freq.QuadPart);
+}
+#endif
+
+#else
+RTAD_PRIVATE size_t map_granularity(void) {
+  return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+RTAD_PRIVATE const char *fd_map(int fd, off_t offset, size_t size) {
+  if (fd < 0 || offset < 0 || size == 0) {
+    return NULL;
+  }
+  size_t delta = (size_t)(offset % (off_t)map_granularity());
+  // the mapping holds its own reference to the file
+  void *base =
+      mmap(NULL, size + delta, PROT_READ, MAP_SHARED, fd, offset - delta);
+  STAT_ADD(STAT_SYSCALLS, 1);
+  STAT_ADD(STAT_MAPS, 1);
+  if (base == MAP_FAILED) {
+    return NULL;
+  }
+  return (const char *)base + delta;
+}
+
+RTAD_PRIVATE int file_unmap(const char *addr, size_t size) {
+  if (!addr || size == 0) {
+    return -1;
+  }
+  size_t delta = (uintptr_t)addr % map_granularity();
+  STAT_ADD(STAT_SYSCALLS, 1);
+  return munmap((void *)(addr - delta), size + delta);
+}
+
+RTAD_PRIVATE int file_open(const char *path) {
+  if (!path) {
+    return -1;
+  }
+  STAT_ADD(STAT_SYSCALLS, 1);
+  STAT_ADD(STAT_OPENS, 1);
+  return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+RTAD_PRIVATE int file_close(int fd) {
+  STAT_ADD(STAT_SYSCALLS, 1);
+  return close(fd);
+}
+
+RTAD_PRIVATE int file_pread(int fd, void *buf, size_t size, off_t offset) {
+  char *p = (char *)buf;
+  while (size > 0) {
+    ssize_t bytes = pread(fd, p, size, offset);
+    STAT_ADD(STAT_SYSCALLS, 1);
+    if (bytes < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytes <= 0) {
+      // error or unexpected end of file
+      return -1;
+    }
+    STAT_ADD(STAT_BYTES_READ, bytes);
+    p += bytes;
+    size -= (size_t)bytes;
+    offset += bytes;
+  }
+  return 0;
+}
+
+RTAD_PRIVATE int file_open_rw(const char *path) {
+  if (!path) {
+    return -1;
+  }
+  STAT_ADD(STAT_SYSCALLS, 1);
+  STAT_ADD(STAT_OPENS, 1);
+  return open(path, O_RDWR | O_CLOEXEC);
+}
+
+RTAD_PRIVATE int fd_seek(int fd, off_t offset) {
+  STAT_ADD(STAT_SYSCALLS, 1);
+  return lseek(fd, offset, SEEK_SET) == offset ? 0 : -1;
+}
+
+RTAD_PRIVATE int file_write(int fd, const void *buf, size_t size) {
+  const char *p = (const char *)buf;
+  while (size > 0) {
+    ssize_t bytes = write(fd, p, size);
+    STAT_ADD(STAT_SYSCALLS, 1);
+    if (bytes < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytes <= 0) {
+      return -1;
+    }
+    STAT_ADD(STAT_BYTES_WRITTEN, bytes);
+    p += bytes;
+    size -= (size_t)bytes;
+  }
+  return 0;
+}
+
+RTAD_PRIVATE int fd_send_buf(int fd, const void *buf, size_t size,
+                             uint64_t *out_sent) {
+  const char *p = (const char *)buf;
+  while (size > 0) {
+    ssize_t bytes = write(fd, p, size);
+    STAT_ADD(STAT_SYSCALLS, 1);
+    if (bytes < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytes <= 0) {
+      return -1;
+    }
+    STAT_ADD(STAT_BYTES_WRITTEN, bytes);
+    *out_sent += (uint64_t)bytes;
+    p += bytes;
+    size -= (size_t)bytes;
+  }
+  return 0;
+}
+
+RTAD_PRIVATE int file_writev(int fd, const struct rtad_iovec *iov,
+                             size_t iov_count) {
+  // convert in batches, struct iovec may differ from struct rtad_iovec
+  struct iovec vec[64];
+  while (iov_count > 0) {
+    int count = 0;
+    while (count < 64 && (size_t)count < iov_count) {
+      vec[count].iov_base = (void *)iov[count].data;
+      vec[count].iov_len = iov[count].size;
+      count++;
+    }
+    ssize_t bytes = writev(fd, vec, count);
+    STAT_ADD(STAT_SYSCALLS, 1);
+    if (bytes < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytes < 0) {
+      return -1;
+    }
+    STAT_ADD(STAT_BYTES_WRITTEN, bytes);
+    // finish a partial write of the batch piece by piece
+    size_t done = (size_t)bytes;
+    for (int i = 0; i < count; i++) {
+      if (done >= vec[i].iov_len) {
+        done -= vec[i].iov_len;
+        continue;
+      }
+      if (file_write(fd, (const char *)vec[i].iov_base + done,
+                     vec[i].iov_len - done) != 0) {
+        return -1;
+      }
+      done = 0;
+    }
+    iov += count;
+    iov_count -= (size_t)count;
+  }
+  return 0;
+}
+
+RTAD_PRIVATE int file_create(const char *path) {
+  if (!path) {
+    return -1;
+  }
+  STAT_ADD(STAT_SYSCALLS, 1);
+  STAT_ADD(STAT_OPENS, 1);
+  return open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+}
+
+RTAD_PRIVATE int file_pwrite(int fd, const void *buf, size_t size,
+                             off_t offset) {
+  const char *p = (const char *)buf;
+  while (size > 0) {
+    ssize_t bytes = pwrite(fd, p, size, offset);
+    STAT_ADD(STAT_SYSCALLS, 1);
+    if (bytes < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytes <= 0) {
+      return -1;
+    }
+    STAT_ADD(STAT_BYTES_WRITTEN, bytes);
+    p += bytes;
+    size -= (size_t)bytes;
+    offset += bytes;
+  }
+  return 0;
+}
+
+RTAD_PRIVATE int fd_truncate(int fd, off_t size) {
+  STAT_ADD(STAT_SYSCALLS, 1);
+  return ftruncate(fd, size) == 0 ? 0 : -1;
+}
+
+RTAD_PRIVATE int memfd_open(const char *name) {
+#if defined(__linux__) && defined(SYS_memfd_create)
+  // through the system call, glibc only wraps it since 2.27
+  STAT_ADD(STAT_SYSCALLS, 1);
+  STAT_ADD(STAT_OPENS, 1);
+  return (int)syscall(SYS_memfd_create, name,
+                      MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+  (void)name;
+  return -1;
+#endif
+}
+
+RTAD_PRIVATE int memfd_seal(int fd) {
+#if defined(__linux__)
+  STAT_ADD(STAT_SYSCALLS, 1);
+  return fcntl(fd, F_ADD_SEALS,
+               F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == 0
+             ? 0
+             : -1;
+#else
+  (void)fd;
+  return -1;
+#endif
+}
+
+RTAD_PRIVATE off_t fd_length(int fd) {
+  struct stat st;
+  STAT_ADD(STAT_SYSCALLS, 1);
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    return -1;
+  }
+  return st.st_size;
+}
+
+RTAD_PRIVATE void run_once(rtad_once_t *once, void (*init)(void)) {
+  pthread_once(once, init);
+}
+
+struct thread_start {
+  void (*fn)(void *);
+  void *arg;
+};
+
+static void *thread_main(void *param) {
+  struct thread_start start = *(struct thread_start *)param;
+  free(param);
+  start.fn(start.arg);
+  return NULL;
+}
+
+RTAD_PRIVATE int thread_create(rtad_thread_t *thread, void (*fn)(void *),
+                               void *arg) {
+  struct thread_start *start =
+      (struct thread_start *)malloc(sizeof(struct thread_start));
+  if (!start) {
+    return -1;
+  }
+  start->fn = fn;
+  start->arg = arg;
+  if (pthread_create(thread, NULL, thread_main, start) != 0) {
+    free(start);
+    return -1;
+  }
+  return 0;
+}
+
+RTAD_PRIVATE void thread_join(rtad_thread_t thread) {
+  pthread_join(thread, NULL);
+}
+
+RTAD_PRIVATE int mutex_init(rtad_mutex_t *mutex) {
+  return pthread_mutex_init(mutex, NULL) == 0 ? 0 : -1;
+}
+
+RTAD_PRIVATE void mutex_destroy(rtad_mutex_t *mutex) {
+  pthread_mutex_destroy(mutex);
+}
+
+RTAD_PRIVATE void mutex_lock(rtad_mutex_t *mutex) {
+  pthread_mutex_lock(mutex);
+}
+
+RTAD_PRIVATE void mutex_unlock(rtad_mutex_t *mutex) {
+  pthread_mutex_unlock(mutex);
+}
+
+RTAD_PRIVATE int cond_init(rtad_cond_t *cond) {
+  return pthread_cond_init(cond, NULL) == 0 ? 0 : -1;
+}
+
+RTAD_PRIVATE void cond_destroy(rtad_cond_t *cond) {
+  pthread_cond_destroy(cond);
+}
+
+RTAD_PRIVATE void cond_wait(rtad_cond_t *cond, rtad_mutex_t *mutex) {
+  pthread_cond_wait(cond, mutex);
+}
+
+RTAD_PRIVATE void cond_broadcast(rtad_cond_t *cond) {
+  pthread_cond_broadcast(cond);
+}
+
+RTAD_PRIVATE unsigned cpu_count(void) {
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? (unsigned)count : 1;
+}
+
+#if defined(RTAD_HAVE_STATS)
+// only the statistics keep a slot per thread and read the clock
+RTAD_PRIVATE int key_create(rtad_key_t *key, void (*destructor)(void *)) {
+  return pthread_key_create(key, destructor) == 0 ? 0 : -1;
+}
+
+RTAD_PRIVATE int key_set(rtad_key_t key, void *value) {
+  return pthread_setspecific(key, value) == 0 ? 0 : -1;
+}
+
+RTAD_PRIVATE uint64_t clock_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+#endif
+
+#endif
+
+// set once before anything is allocated, so it's read without lock
+static struct rtad_allocator mem_allocator;
+
+int rtad_set_allocator(const struct rtad_allocator *allocator) {
+  if (!allocator) {
+    memset(&mem_allocator, 0, sizeof(mem_allocator));
+    return 0;
+  }
+  if (!allocator->alloc || !allocator->free) {
+    return -1;
+  }
+  mem_allocator = *allocator;
+  return 0;
+}
+
+RTAD_PRIVATE void *mem_alloc(size_t size) {
+  if (mem_allocator.alloc) {
+    return mem_allocator.alloc(mem_allocator.ctx, size > 0 ? size : 1);
+  }
+  return malloc(size > 0 ? size : 1);
+}
+
+RTAD_PRIVATE void *mem_calloc(size_t count, size_t size) {
+  if (size > 0 && count > SIZE_MAX / size) {
+    return NULL;
+  }
+  void *ptr = mem_alloc(count * size);
+  if (ptr) {
+    memset(ptr, 0, count * size);
+  }
+  return ptr;
+}
+
+RTAD_PRIVATE void *mem_grow(void *ptr, size_t old_size, size_t new_size) {
+  void *grown = mem_alloc(new_size);
+  if (grown && ptr) {
+    memcpy(grown, ptr, old_size);
+    mem_free(ptr);
+  }
+  return grown;
+}
+
+RTAD_PRIVATE void mem_free(void *ptr) {
+  if (!ptr) {
+    return;
+  }
+  if (mem_allocator.free) {
+    mem_allocator.free(mem_allocator.ctx, ptr);
+  } else {
+    free(ptr);
+  }
+}
+
+#if defined(RTAD_HAVE_STATS)
+// Counters are only written by their thread, other threads read them while
+// they change: a relaxed load and store is enough and is not a locked add.
 #if defined(_MSC_VER)
-RTAD_PRIVATE int file_truncate(const char *path, size_t size) {
-  if (!path || size == 0) {
+#define STAT_LOAD(x) (*(volatile uint64_t *)&(x))
+#define STAT_STORE(x, v) (*(volatile uint64_t *)&(x) = (v))
+#else
+#define STAT_LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STAT_STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#endif
+
+// The counters of a thread, from mem_calloc. A slot is never freed: the one of
+// a thread that exited is taken by the next new thread, so its counts stay in
+// the totals.
+struct stats_slot {
+  uint64_t counts[STAT_COUNT];
+  uint64_t thread_base[STAT_COUNT]; // counts when taken or reset
+  unsigned active;                  // bits of the running phases
+  int used;                         // taken by a thread, under stats_mutex
+  struct stats_slot *next;
+};
+
+static rtad_once_t stats_once = RTAD_ONCE_INIT;
+static rtad_mutex_t stats_mutex;
+static int stats_ready;
+static rtad_key_t stats_key;
+static int stats_key_ready;
+static struct stats_slot *stats_slots;
+static uint64_t stats_base[STAT_COUNT]; // totals at the last reset
+static RTAD_THREAD_LOCAL struct stats_slot *stats_local;
+// set before other threads use the library, like the allocator
+static rtad_trace_fn trace_fn;
+static void *trace_ctx;
+
+// a thread exits, its slot is free to take
+static void stats_release(void *value) {
+  struct stats_slot *slot = (struct stats_slot *)value;
+  mutex_lock(&stats_mutex);
+  slot->used = 0;
+  mutex_unlock(&stats_mutex);
+  stats_local = NULL;
+}
+
+static void stats_init(void) {
+  stats_ready = mutex_init(&stats_mutex) == 0;
+  stats_key_ready = key_create(&stats_key, stats_release) == 0;
+}
+
+// the slot of the calling thread, taken on first use
+static struct stats_slot *stats_attach(void) {
+  if (stats_local) {
+    return stats_local;
+  }
+  // counting must not change errno, it's read after the calls counted
+  int saved_errno = errno;
+  run_once(&stats_once, stats_init);
+  struct stats_slot *slot = NULL;
+  if (stats_ready) {
+    mutex_lock(&stats_mutex);
+    for (slot = stats_slots; slot && slot->used; slot = slot->next) {
+    }
+    if (!slot && (slot = (struct stats_slot *)mem_calloc(1, sizeof(*slot)))) {
+      slot->next = stats_slots;
+      stats_slots = slot;
+    }
+    if (slot) {
+      slot->used = 1;
+      slot->active = 0;
+      for (int i = 0; i < STAT_COUNT; i++) {
+        STAT_STORE(slot->thread_base[i], STAT_LOAD(slot->counts[i]));
+      }
+    }
+    mutex_unlock(&stats_mutex);
+  }
+  if (slot && stats_key_ready) {
+    key_set(stats_key, slot);
+  }
+  stats_local = slot;
+  errno = saved_errno;
+  return slot;
+}
+
+RTAD_PRIVATE void stat_add(enum rtad_stat stat, uint64_t n) {
+  struct stats_slot *slot = stats_attach();
+  if (slot) {
+    STAT_STORE(slot->counts[stat], STAT_LOAD(slot->counts[stat]) + n);
+  }
+}
+
+RTAD_PRIVATE uint64_t phase_begin(int phase) {
+  struct stats_slot *slot = stats_attach();
+  if (!slot || (slot->active & (1u << phase))) {
+    return 0;
+  }
+  slot->active |= 1u << phase;
+  uint64_t now = clock_ns();
+  if (trace_fn) {
+    trace_fn(trace_ctx, phase, 0, now);
+  }
+  return now > 0 ? now : 1;
+}
+
+RTAD_PRIVATE void phase_end(int phase, uint64_t start) {
+  struct stats_slot *slot = stats_local;
+  if (start == 0 || !slot) {
+    return;
+  }
+  uint64_t now = clock_ns();
+  slot->active &= ~(1u << phase);
+  stat_add((enum rtad_stat)(STAT_PHASE_CALLS + phase), 1);
+  stat_add((enum rtad_stat)(STAT_PHASE_NS + phase),
+           now > start ? now - start : 0);
+  if (trace_fn) {
+    trace_fn(trace_ctx, phase, 1, now);
+  }
+}
+
+static void stats_fill(struct rtad_stats *stats, const uint64_t *counts) {
+  stats->bytes_read = counts[STAT_BYTES_READ];
+  stats->bytes_written = counts[STAT_BYTES_WRITTEN];
+  stats->bytes_copied = counts[STAT_BYTES_COPIED];
+  stats->syscalls = counts[STAT_SYSCALLS];
+  stats->opens = counts[STAT_OPENS];
+  stats->maps = counts[STAT_MAPS];
+  stats->cache_hits = counts[STAT_CACHE_HITS];
+  stats->cache_misses = counts[STAT_CACHE_MISSES];
+  stats->chunks_decoded = counts[STAT_CHUNKS_DECODED];
+  for (int i = 0; i < RTAD_PHASE_COUNT; i++) {
+    stats->phase_calls[i] = counts[STAT_PHASE_CALLS + i];
+    stats->phase_ns[i] = counts[STAT_PHASE_NS + i];
+  }
+}
+
+int rtad_stats_get(struct rtad_stats *out_stats) {
+  if (!out_stats) {
+    return -1;
+  }
+  run_once(&stats_once, stats_init);
+  if (!stats_ready) {
+    return -1;
+  }
+  uint64_t counts[STAT_COUNT] = {0};
+  mutex_lock(&stats_mutex);
+  for (struct stats_slot *slot = stats_slots; slot; slot = slot->next) {
+    for (int i = 0; i < STAT_COUNT; i++) {
+      counts[i] += STAT_LOAD(slot->counts[i]);
+    }
+  }
+  for (int i = 0; i < STAT_COUNT; i++) {
+    counts[i] -= stats_base[i];
+  }
+  mutex_unlock(&stats_mutex);
+  stats_fill(out_stats, counts);
+  return 0;
+}
+
+int rtad_stats_thread(struct rtad_stats *out_stats) {
+  struct stats_slot *slot = stats_attach();
+  if (!out_stats || !slot) {
+    return -1;
+  }
+  uint64_t counts[STAT_COUNT];
+  for (int i = 0; i < STAT_COUNT; i++) {
+    counts[i] = STAT_LOAD(slot->counts[i]) - STAT_LOAD(slot->thread_base[i]);
+  }
+  stats_fill(out_stats, counts);
+  return 0;
+}
+
+void rtad_stats_reset(void) {
+  run_once(&stats_once, stats_init);
+  if (!stats_ready) {
+    return;
+  }
+  mutex_lock(&stats_mutex);
+  memset(stats_base, 0, sizeof(stats_base));
+  for (struct stats_slot *slot = stats_slots; slot; slot = slot->next) {
+    for (int i = 0; i < STAT_COUNT; i++) {
+      uint64_t count = STAT_LOAD(slot->counts[i]);
+      stats_base[i] += count;
+      STAT_STORE(slot->thread_base[i], count);
+    }
+  }
+  mutex_unlock(&stats_mutex);
+}
+
+int rtad_set_trace(rtad_trace_fn trace, void *ctx) {
+  trace_fn = trace;
+  trace_ctx = ctx;
+  return 0;
+}
+
+#else
+int rtad_stats_get(struct rtad_stats *out_stats) {
+  (void)out_stats;
+  return -1;
+}
+
+int rtad_stats_thread(struct rtad_stats *out_stats) {
+  (void)out_stats;
+  return -1;
+}
+
+void rtad_stats_reset(void) {}
+
+int rtad_set_trace(rtad_trace_fn trace, void *ctx) {
+  (void)trace;
+  (void)ctx;
+  return -1;
+}
+
+#endif
+
+const char *rtad_phase_name(int phase) {
+  static const char *const names[RTAD_PHASE_COUNT] = {
+      "header", "copy", "append", "extract", "verify", "compact"};
+  return phase >= 0 && phase < RTAD_PHASE_COUNT ? names[phase] : NULL;
+}
+
+RTAD_PRIVATE int fd_copy_range(int src_fd, off_t src_offset, int dest_fd,
+                               off_t dest_offset, off_t size,
+                               unsigned methods) {
+  if (src_offset < 0 || dest_offset < 0 || size < 0) {
+    return -1;
+  }
+#if defined(__linux__)
+  // in-kernel copies, a method that fails is dropped for the rest of the
+  // range, the file systems or the kernel may not support it
+  while (size > 0 && (methods & (COPY_RANGE | COPY_SENDFILE))) {
+    size_t chunk = size > COPY_CHUNK_SIZE ? COPY_CHUNK_SIZE : (size_t)size;
+    ssize_t bytes = -1;
+    if (methods & COPY_RANGE) {
+      errno = ENOSYS;
+#if defined(SYS_copy_file_range)
+      loff_t in = src_offset;
+      loff_t out = dest_offset;
+      bytes = syscall(SYS_copy_file_range, src_fd, &in, dest_fd, &out, chunk,
+                      0);
+      STAT_ADD(STAT_SYSCALLS, 1);
+#endif
+      if (bytes <= 0 && !(bytes < 0 && errno == EINTR)) {
+        methods &= ~COPY_RANGE;
+        continue;
+      }
+    } else {
+      off_t in = src_offset;
+      if (lseek(dest_fd, dest_offset, SEEK_SET) == dest_offset) {
+        bytes = sendfile(dest_fd, src_fd, &in, chunk);
+      }
+      STAT_ADD(STAT_SYSCALLS, 2);
+      if (bytes <= 0 && !(bytes < 0 && errno == EINTR)) {
+        methods &= ~COPY_SENDFILE;
+        continue;
+      }
+    }
+    if (bytes > 0) {
+      STAT_ADD(STAT_BYTES_COPIED, bytes);
+      src_offset += bytes;
+      dest_offset += bytes;
+      size -= bytes;
+    }
+  }
+#endif
+  if (size == 0) {
+    return 0;
+  }
+  size_t buf_size =
+      size > COPY_BUFFER_SIZE ? COPY_BUFFER_SIZE : (size_t)size;
+  char *copy_buf = (char *)malloc(buf_size);
+  if (!copy_buf) {
+    return -1;
+  }
+  while (size > 0) {
+    size_t chunk = size > (off_t)buf_size ? buf_size : (size_t)size;
+    if (file_pread(src_fd, copy_buf, chunk, src_offset) != 0 ||
+        file_pwrite(dest_fd, copy_buf, chunk, dest_offset) != 0) {
+      free(copy_buf);
+      return -1;
+    }
+    src_offset += (off_t)chunk;
+    dest_offset += (off_t)chunk;
+    size -= (off_t)chunk;
+  }
+  free(copy_buf);
+  return 0;
+}
+
+RTAD_PRIVATE int fd_copy(int src_fd, int dest_fd, off_t size,
+                         unsigned methods) {
+  if (src_fd < 0 || dest_fd < 0 || size < 0) {
+    return -1;
+  }
+#if defined(__linux__) && defined(FICLONE)
+  // a reflink shares all extents, it's done in constant time, even if only
+  // a prefix is kept
+  if ((methods & COPY_REFLINK) && size <= fd_length(src_fd)) {
+    STAT_ADD(STAT_SYSCALLS, 1);
+    if (ioctl(dest_fd, FICLONE, src_fd) == 0) {
+      return size == fd_length(src_fd) ? 0 : fd_truncate(dest_fd, size);
+    }
+  }
+#endif
+  off_t offset = 0;
+  while (offset < size) {
+    off_t data = offset;
+    off_t hole = size;
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    if (methods & COPY_SPARSE) {
+      data = lseek(src_fd, offset, SEEK_DATA);
+      STAT_ADD(STAT_SYSCALLS, 1);
+      if (data >= 0) {
+        STAT_ADD(STAT_SYSCALLS, 1);
+        hole = lseek(src_fd, data, SEEK_HOLE);
+        if (hole < 0 || hole > size) {
+          hole = size;
+        }
+      } else if (errno == ENXIO) {
+        // only a hole is left
+        data = size;
+      } else {
+        // holes are not reported, copy everything
+        methods &= ~COPY_SPARSE;
+        data = offset;
+      }
+      if (data > size) {
+        data = size;
+      }
+    }
+#endif
+    if (hole > data &&
+        fd_copy_range(src_fd, data, dest_fd, data, hole - data, methods) !=
+            0) {
+      return -1;
+    }
+    offset = hole;
+  }
+  // a trailing hole is not written, set the size explicitly
+  return fd_truncate(dest_fd, size);
+}
+
+RTAD_PRIVATE int fd_send(int in_fd, off_t offset, int out_fd, uint64_t size,
+                         uint64_t *out_sent) {
+  if (in_fd < 0 || out_fd < 0 || offset < 0) {
+    return -1;
+  }
+#if defined(__linux__)
+  // to a socket, a pipe or a file, without going through user space
+  while (size > 0) {
+    off_t in = offset;
+    size_t chunk = size > COPY_CHUNK_SIZE ? COPY_CHUNK_SIZE : (size_t)size;
+    ssize_t bytes = sendfile(out_fd, in_fd, &in, chunk);
+    STAT_ADD(STAT_SYSCALLS, 1);
+    if (bytes < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytes < 0 && (errno == EINVAL || errno == ENOSYS)) {
+      // not between these two, read and write
+      break;
+    }
+    if (bytes <= 0) {
+      // a full non-blocking socket too, the caller goes on later
+      return -1;
+    }
+    STAT_ADD(STAT_BYTES_COPIED, bytes);
+    *out_sent += (uint64_t)bytes;
+    offset += bytes;
+    size -= (uint64_t)bytes;
+  }
+#elif defined(__APPLE__)
+  // only to a stream socket, the length is set to what was sent even when
+  // it fails
+  while (size > 0) {
+    off_t len = size > COPY_CHUNK_SIZE ? COPY_CHUNK_SIZE : (off_t)size;
+    int result = sendfile(in_fd, out_fd, offset, &len, NULL, 0);
+    STAT_ADD(STAT_SYSCALLS, 1);
+    STAT_ADD(STAT_BYTES_COPIED, len);
+    *out_sent += (uint64_t)len;
+    offset += len;
+    size -= (uint64_t)len;
+    if ((result == 0 && len > 0) || (result != 0 && errno == EINTR)) {
+      continue;
+    }
+    if (result != 0 && len == 0 && (errno == ENOTSOCK || errno == EOPNOTSUPP)) {
+      // not a socket, read and write
+      break;
+    }
+    // an error, a full non-blocking socket or an unexpected end of file
+    return -1;
+  }
+#endif
+  if (size == 0) {
+    return 0;
+  }
+  size_t buf_size = size > COPY_BUFFER_SIZE ? COPY_BUFFER_SIZE : (size_t)size;
+  char *buf = (char *)malloc(buf_size);
+  if (!buf) {
+    return -1;
+  }
+  int result = 0;
+  while (size > 0 && result == 0) {
+    size_t chunk = size > buf_size ? buf_size : (size_t)size;
+    result = file_pread(in_fd, buf, chunk, offset) == 0 &&
+                     fd_send_buf(out_fd, buf, chunk, out_sent) == 0
+                 ? 0
+                 : -1;
+    offset += (off_t)chunk;
+    size -= chunk;
+  }
+  free(buf);
+  return result;
+}
+
+// the request done with positional I/O on the calling thread
+static void io_now(struct rtad_io *io) {
+  int result = io->write ? file_pwrite(io->fd, io->buf, io->size, io->offset)
+                         : file_pread(io->fd, io->buf, io->size, io->offset);
+  io->transferred = result == 0 ? io->size : 0;
+  io->state = result == 0 ? IO_DONE : IO_FAILED;
+}
+
+#if defined(RTAD_HAVE_IO_URING)
+struct rtad_ring {
+  int fd;
+  unsigned depth;
+  unsigned in_flight;
+  unsigned to_submit;
+  // submission queue, shared with the kernel
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  // completion queue, shared with the kernel
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+  // the registered buffer, requests inside it use the fixed operations
+  char *fixed;
+  size_t fixed_size;
+  // the vectors of the other requests, one per submission slot
+  struct iovec *vecs;
+};
+
+RTAD_PRIVATE struct rtad_ring *ring_open(unsigned depth, char *buf,
+                                         size_t buf_size) {
+  struct rtad_ring *ring = (struct rtad_ring *)mem_calloc(1, sizeof(*ring));
+  if (!ring) {
+    return NULL;
+  }
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring->fd = (int)syscall(__NR_io_uring_setup, depth, &params);
+  STAT_ADD(STAT_SYSCALLS, 1);
+  if (ring->fd < 0) {
+    // not built in the kernel, or forbidden by a sandbox
+    mem_free(ring);
+    return NULL;
+  }
+  ring->depth = depth < params.sq_entries ? depth : params.sq_entries;
+  ring->sq_ring_size =
+      params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size > ring->sq_ring_size) {
+      ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  ring->cq_ring = MAP_FAILED;
+  ring->sqes = (struct io_uring_sqe *)MAP_FAILED;
+  if (ring->sq_ring != MAP_FAILED) {
+    ring->cq_ring = (params.features & IORING_FEAT_SINGLE_MMAP)
+                        ? ring->sq_ring
+                        : mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_POPULATE, ring->fd,
+                               IORING_OFF_CQ_RING);
+    ring->sqes = (struct io_uring_sqe *)mmap(
+        NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  }
+  ring->vecs =
+      (struct iovec *)mem_calloc(params.sq_entries, sizeof(struct iovec));
+  if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+      ring->sqes == (struct io_uring_sqe *)MAP_FAILED || !ring->vecs) {
+    ring_close(ring);
+    return NULL;
+  }
+  char *sq = (char *)ring->sq_ring;
+  char *cq = (char *)ring->cq_ring;
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  if (buf && buf_size > 0) {
+    // pinned once for all requests, it may exceed RLIMIT_MEMLOCK on older
+    // kernels, requests are then done without it
+    struct iovec vec = {.iov_base = buf, .iov_len = buf_size};
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS,
+                &vec, 1) == 0) {
+      ring->fixed = buf;
+      ring->fixed_size = buf_size;
+    }
+  }
+  return ring;
+}
+
+RTAD_PRIVATE void ring_close(struct rtad_ring *ring) {
+  if (!ring) {
+    return;
+  }
+  if (ring->sqes && ring->sqes != (struct io_uring_sqe *)MAP_FAILED) {
+    munmap(ring->sqes, ring->sqes_size);
+  }
+  if (ring->cq_ring && ring->cq_ring != MAP_FAILED &&
+      ring->cq_ring != ring->sq_ring) {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  }
+  if (ring->sq_ring && ring->sq_ring != MAP_FAILED) {
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  }
+  close(ring->fd);
+  mem_free(ring->vecs);
+  mem_free(ring);
+}
+
+static void ring_queue(struct rtad_ring *ring, struct rtad_io *io) {
+  unsigned tail = *ring->sq_tail;
+  unsigned index = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  char *buf = io->buf + io->transferred;
+  size_t size = io->size - io->transferred;
+  // a longer request completes short, the rest is queued again
+  if (size > COPY_CHUNK_SIZE) {
+    size = COPY_CHUNK_SIZE;
+  }
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->fd = io->fd;
+  sqe->off = (uint64_t)io->offset + io->transferred;
+  sqe->user_data = (uint64_t)(uintptr_t)io;
+  if (ring->fixed && buf >= ring->fixed &&
+      buf < ring->fixed + ring->fixed_size &&
+      size <= (size_t)(ring->fixed + ring->fixed_size - buf)) {
+    sqe->opcode = io->write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)size;
+    sqe->buf_index = 0;
+  } else {
+    ring->vecs[index].iov_base = buf;
+    ring->vecs[index].iov_len = size;
+    sqe->opcode = io->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->addr = (uint64_t)(uintptr_t)&ring->vecs[index];
+    sqe->len = 1;
+  }
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->to_submit++;
+}
+
+RTAD_PRIVATE int io_submit(struct rtad_ring *ring, struct rtad_io *io) {
+  io->transferred = 0;
+  if (!ring) {
+    io_now(io);
+    return 0;
+  }
+  if (ring->in_flight == ring->depth) {
+    return -1;
+  }
+  io->state = IO_QUEUED;
+  if (io->size == 0) {
+    io->state = IO_DONE;
+    return 0;
+  }
+  ring->in_flight++;
+  ring_queue(ring, io);
+  return 0;
+}
+
+RTAD_PRIVATE unsigned ring_in_flight(const struct rtad_ring *ring) {
+  return ring ? ring->in_flight : 0;
+}
+
+RTAD_PRIVATE int ring_reap(struct rtad_ring *ring) {
+  unsigned head = *ring->cq_head;
+  int ready = head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  if (!ready || ring->to_submit > 0) {
+    // wait only if nothing has completed yet
+    long submitted = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit,
+                             ready ? 0 : 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    STAT_ADD(STAT_SYSCALLS, 1);
+    if (submitted < 0) {
+      return errno == EINTR || errno == EAGAIN || errno == EBUSY ? 0 : -1;
+    }
+    ring->to_submit -= (unsigned)submitted;
+  }
+  unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    struct rtad_io *io = (struct rtad_io *)(uintptr_t)cqe->user_data;
+    int res = cqe->res;
+    if (res == -EINTR || res == -EAGAIN) {
+      ring_queue(ring, io);
+      continue;
+    }
+    if (res <= 0) {
+      // error or unexpected end of file
+      io->state = IO_FAILED;
+      ring->in_flight--;
+      continue;
+    }
+    io->transferred += (size_t)res;
+    STAT_ADD(io->write ? STAT_BYTES_WRITTEN : STAT_BYTES_READ, res);
+    if (io->transferred < io->size) {
+      ring_queue(ring, io);
+      continue;
+    }
+    io->state = IO_DONE;
+    ring->in_flight--;
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  return 0;
+}
+
+#else
+RTAD_PRIVATE struct rtad_ring *ring_open(unsigned depth, char *buf,
+                                         size_t buf_size) {
+  (void)depth;
+  (void)buf;
+  (void)buf_size;
+  return NULL;
+}
+
+RTAD_PRIVATE void ring_close(struct rtad_ring *ring) { (void)ring; }
+
+RTAD_PRIVATE int io_submit(struct rtad_ring *ring, struct rtad_io *io) {
+  (void)ring;
+  io_now(io);
+  return 0;
+}
+
+RTAD_PRIVATE unsigned ring_in_flight(const struct rtad_ring *ring) {
+  (void)ring;
+  return 0;
+}
+
+RTAD_PRIVATE int ring_reap(struct rtad_ring *ring) {
+  (void)ring;
+  return -1;
+}
+
+#endif
+
+RTAD_PRIVATE int io_batch(struct rtad_ring *ring, struct rtad_io *ios,
+                          size_t count) {
+  size_t next = 0;
+  for (;;) {
+    while (next < count && io_submit(ring, &ios[next]) == 0) {
+      next++;
+    }
+    if (next == count) {
+      break;
+    }
+    if (ring_reap(ring) != 0) {
+      return -1;
+    }
+  }
+  // wait for the last requests
+  while (ring_in_flight(ring) > 0) {
+    if (ring_reap(ring) != 0) {
+      return -1;
+    }
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (ios[i].state != IO_DONE) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+RTAD_PRIVATE uint64_t name_hash(const char *name, size_t name_size) {
+  // 64-bit FNV-1a
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < name_size; i++) {
+    hash ^= (unsigned char)name[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+RTAD_PRIVATE int trailer_parse(const char *tail, size_t tail_size,
+                               off_t file_size, struct rtad_trailer *trailer) {
+  if (!tail || !trailer || tail_size < RTAD_HDR_SIZE ||
+      (off_t)tail_size > file_size) {
+    return -1;
+  }
+  // the magic is always at the end, for both layouts
+  const char *magic = tail + tail_size - RTAD_MAGIC_SIZE;
+  struct rtad_trailer temp_trailer;
+  if (memcmp(magic, RTAD_MAGIC, RTAD_MAGIC_SIZE) == 0) {
+    // legacy header, present it as a trailer without TOC
+    struct rtad_hdr header;
+    memcpy(&header, tail + tail_size - RTAD_HDR_SIZE, sizeof(header));
+    memset(&temp_trailer, 0, sizeof(temp_trailer));
+    temp_trailer.data_size = header.data_size;
+    temp_trailer.version = 1;
+    temp_trailer.trailer_size = RTAD_HDR_SIZE;
+    memcpy(temp_trailer.magic, header.magic, sizeof(temp_trailer.magic));
+  } else if (memcmp(magic, RTAD_MAGIC_V2, RTAD_MAGIC_SIZE) == 0 &&
+             tail_size >= RTAD_TRAILER_SIZE) {
+    memcpy(&temp_trailer, tail + tail_size - RTAD_TRAILER_SIZE,
+           sizeof(temp_trailer));
+    if (temp_trailer.version != RTAD_VERSION ||
+        temp_trailer.trailer_size != RTAD_TRAILER_SIZE) {
+      return -1;
+    }
+  } else {
+    return -1;
+  }
+  // the payload and the TOC must be inside the file
+  if (temp_trailer.data_size >
+      (uint64_t)file_size - temp_trailer.trailer_size) {
+    return -1;
+  }
+  if ((temp_trailer.flags & RTAD_TRAILER_TOC) &&
+      (temp_trailer.toc_offset > temp_trailer.data_size ||
+       temp_trailer.toc_size >
+           temp_trailer.data_size - temp_trailer.toc_offset)) {
+    return -1;
+  }
+  *trailer = temp_trailer;
+  return 0;
+}
+
+RTAD_PRIVATE void trailer_init(struct rtad_trailer *trailer,
+                               uint64_t data_size) {
+  memset(trailer, 0, sizeof(*trailer));
+  trailer->data_size = data_size;
+  trailer->version = RTAD_VERSION;
+  trailer->trailer_size = RTAD_TRAILER_SIZE;
+  memcpy(trailer->magic, RTAD_MAGIC_V2, sizeof(trailer->magic));
+}
+
+static int file_load_tail(struct rtad_file *file) {
+  mem_free(file->toc_data);
+  file->toc_data = NULL;
+  memset(&file->trailer, 0, sizeof(file->trailer));
+  memset(&file->toc, 0, sizeof(file->toc));
+  memset(&file->hash, 0, sizeof(file->hash));
+  off_t file_size = file->image
+                        ? file->image_offset + (off_t)file->image_size
+                        : fd_length(file->fd);
+  if (file_size < 0) {
+    return -1;
+  }
+  file->file_size = file_size;
+  file->data_offset = file_size;
+  if (file_size < (off_t)RTAD_HDR_SIZE) {
+    return 0;
+  }
+  size_t tail_size =
+      file_size < TAIL_READ_SIZE ? (size_t)file_size : TAIL_READ_SIZE;
+  if (file->image && tail_size > file->image_size) {
+    // only the payload is in memory
+    tail_size = file->image_size;
+  }
+  off_t tail_offset = file_size - (off_t)tail_size;
+  char *tail = (char *)mem_alloc(tail_size);
+  if (!tail) {
+    return -1;
+  }
+  if (file_read(file, tail, tail_size, tail_offset) != 0) {
+    goto FAIL;
+  }
+  struct rtad_trailer trailer;
+  if (trailer_parse(tail, tail_size, file_size, &trailer) != 0) {
+    // no valid trailer, the file has no payload
+    mem_free(tail);
+    return 0;
+  }
+  off_t data_offset =
+      file_size - (off_t)trailer.trailer_size - (off_t)trailer.data_size;
+  if (trailer.flags & RTAD_TRAILER_HASH) {
+    struct rtad_hash_hdr *hash = &file->hash;
+    if (trailer.data_size < sizeof(*hash)) {
+      goto FAIL;
+    }
+    off_t hash_offset = data_offset + (off_t)trailer.data_size -
+                        (off_t)sizeof(*hash);
+    if (hash_offset >= tail_offset) {
+      memcpy(hash, tail + (hash_offset - tail_offset), sizeof(*hash));
+    } else if (file_read(file, hash, sizeof(*hash), hash_offset) != 0) {
+      goto FAIL;
+    }
+    uint64_t hashed_size = trailer.data_size - sizeof(*hash);
+    uint64_t block_count =
+        hash->block_size > 0
+            ? hash->covered_size / hash->block_size +
+                  (hash->covered_size % hash->block_size != 0)
+            : 0;
+    if (hash->algorithm != RTAD_HASH_BLAKE3 ||
+        hash->block_size < BLAKE3_CHUNK_LEN ||
+        (hash->block_size & (hash->block_size - 1)) != 0 ||
+        hash->covered_size > hashed_size ||
+        hash->block_count != (block_count > 0 ? block_count : 1) ||
+        (uint64_t)hash->block_count * RTAD_HASH_SIZE !=
+            hashed_size - hash->covered_size) {
+      goto FAIL;
+    }
+    // the rest of the payload ends before the leaves
+    trailer.data_size = hash->covered_size;
+    if ((trailer.flags & RTAD_TRAILER_TOC) &&
+        (trailer.toc_offset > trailer.data_size ||
+         trailer.toc_size > trailer.data_size - trailer.toc_offset)) {
+      goto FAIL;
+    }
+  }
+  if (trailer.flags & RTAD_TRAILER_TOC) {
+    struct rtad_toc_hdr *toc = &file->toc;
+    if (trailer.toc_size < sizeof(*toc) || trailer.toc_size > SIZE_MAX) {
+      goto FAIL;
+    }
+    size_t toc_size = (size_t)trailer.toc_size;
+    off_t toc_offset = data_offset + (off_t)trailer.toc_offset;
+    file->toc_data = (char *)mem_alloc(toc_size);
+    if (!file->toc_data) {
+      goto FAIL;
+    }
+    if (toc_offset >= tail_offset) {
+      memcpy(file->toc_data, tail + (toc_offset - tail_offset), toc_size);
+    } else if (file_read(file, file->toc_data, toc_size, toc_offset) != 0) {
+      // the TOC doesn't fit in the tail, read it on its own
+      goto FAIL;
+    }
+    memcpy(toc, file->toc_data, sizeof(*toc));
+    if (toc->bucket_count == 0 ||
+        (toc->bucket_count & (toc->bucket_count - 1)) != 0 ||
+        toc->entry_size < RTAD_TOC_ENTRY_MIN_SIZE ||
+        sizeof(*toc) + ((uint64_t)toc->bucket_count + 1) * sizeof(uint32_t) +
+                (uint64_t)toc->entry_count * toc->entry_size +
+                toc->names_size !=
+            trailer.toc_size) {
+      goto FAIL;
+    }
+  }
+  mem_free(tail);
+  file->trailer = trailer;
+  file->data_offset = data_offset;
+  return 0;
+FAIL:
+  mem_free(tail);
+  mem_free(file->toc_data);
+  file->toc_data = NULL;
+  memset(&file->toc, 0, sizeof(file->toc));
+  memset(&file->hash, 0, sizeof(file->hash));
+  return -1;
+}
+
+RTAD_PRIVATE int file_load(struct rtad_file *file) {
+  uint64_t start = PHASE_BEGIN(RTAD_PHASE_HEADER);
+  int result = file_load_tail(file);
+  PHASE_END(RTAD_PHASE_HEADER, start);
+  return result;
+}
+
+RTAD_PRIVATE struct rtad_file *file_attach(int fd, int writable) {
+  if (fd < 0) {
+    return NULL;
+  }
+  struct rtad_file *file = (struct rtad_file *)mem_calloc(1, sizeof(*file));
+  if (!file) {
+    file_close(fd);
+    return NULL;
+  }
+  file->fd = fd;
+  file->writable = writable;
+  if (file_load(file) != 0) {
+    rtad_close(file);
+    return NULL;
+  }
+  return file;
+}
+
+struct rtad_file *rtad_open(const char *exe_path) {
+  if (!exe_path) {
+    return NULL;
+  }
+  return file_attach(file_open(exe_path), 0);
+}
+
+struct rtad_file *rtad_open_rw(const char *exe_path) {
+  if (!exe_path) {
+    return NULL;
+  }
+  return file_attach(file_open_rw(exe_path), 1);
+}
+
+struct rtad_file *rtad_open_self(void) { return file_attach(exe_open(), 0); }
+
+#if defined(__linux__)
+// patched in the file by elf_update; volatile, so it's read at run time and
+// not folded into the code
+static const volatile struct rtad_locator locator = {RTAD_LOCATOR_MAGIC, 0, 0,
+                                                     0};
+
+// an executable of the byte order and word size of this library
+static int elf_check(const Elf64_Ehdr *ehdr) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  const int data = ELFDATA2LSB;
+#else
+  const int data = ELFDATA2MSB;
+#endif
+  if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+      ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+      ehdr->e_ident[EI_DATA] != data ||
+      (ehdr->e_type != ET_EXEC && ehdr->e_type != ET_DYN) ||
+      ehdr->e_phentsize != sizeof(Elf64_Phdr) || ehdr->e_phnum == 0 ||
+      ehdr->e_phnum >= PN_XNUM) {
+    return -1;
+  }
+  return 0;
+}
+
+// find the locator in the loaded segments of the executable, [0, end) of fd
+static off_t elf_find_locator(int fd, off_t end, const Elf64_Phdr *phdrs,
+                              size_t count, size_t own,
+                              uint64_t *out_vaddr) {
+  char magic[RTAD_LOCATOR_MAGIC_SIZE];
+  for (size_t i = 0; i < sizeof(magic); i++) {
+    // from the locator of this library, the literal would be found too
+    magic[i] = locator.magic[i];
+  }
+  const char *image = fd_map(fd, 0, (size_t)end);
+  if (!image) {
+    return -1;
+  }
+  off_t found = -1;
+  for (size_t i = 0; i < count && found < 0; i++) {
+    const Elf64_Phdr *phdr = &phdrs[i];
+    if (i == own || phdr->p_type != PT_LOAD ||
+        phdr->p_offset >= (uint64_t)end) {
+      continue;
+    }
+    uint64_t size = (uint64_t)end - phdr->p_offset < phdr->p_filesz
+                        ? (uint64_t)end - phdr->p_offset
+                        : phdr->p_filesz;
+    const char *at = (const char *)memmem(image + phdr->p_offset,
+                                          (size_t)size, magic, sizeof(magic));
+    if (at) {
+      found = (off_t)(at - image);
+      *out_vaddr = phdr->p_vaddr + ((uint64_t)found - phdr->p_offset);
+    }
+  }
+  file_unmap(image, (size_t)end);
+  return found;
+}
+
+RTAD_PRIVATE int elf_note_build_id(int fd, off_t end, const Elf64_Phdr *phdr) {
+  if (phdr->p_offset > (uint64_t)end ||
+      phdr->p_filesz > (uint64_t)end - phdr->p_offset) {
+    // not in the executable, can't be checked
+    return 1;
+  }
+  size_t size = (size_t)phdr->p_filesz;
+  char *notes = (char *)mem_alloc(size ? size : 1);
+  if (!notes || file_pread(fd, notes, size, (off_t)phdr->p_offset) != 0) {
+    mem_free(notes);
+    return 1;
+  }
+  // names and descriptions are padded to 8 bytes in notes aligned so, else 4
+  size_t align = phdr->p_align == 8 ? 8 : 4;
+  int found = 0;
+  size_t at = 0;
+  while (!found && size - at >= sizeof(Elf64_Nhdr)) {
+    Elf64_Nhdr nhdr;
+    memcpy(&nhdr, notes + at, sizeof(nhdr));
+    at += sizeof(nhdr);
+    size_t name_size = ((size_t)nhdr.n_namesz + align - 1) & ~(align - 1);
+    size_t desc_size = ((size_t)nhdr.n_descsz + align - 1) & ~(align - 1);
+    if (name_size > size - at || desc_size > size - at - name_size) {
+      break;
+    }
+    found = nhdr.n_type == NT_GNU_BUILD_ID &&
+            nhdr.n_namesz == sizeof(ELF_NOTE_GNU) &&
+            memcmp(notes + at, ELF_NOTE_GNU, sizeof(ELF_NOTE_GNU)) == 0;
+    at += name_size + desc_size;
+  }
+  mem_free(notes);
+  return found;
+}
+
+RTAD_PRIVATE int elf_update(struct rtad_file *file, uint32_t load) {
+  Elf64_Ehdr ehdr;
+  off_t file_size = fd_length(file->fd);
+  // the executable ends where the payload starts
+  off_t end = file->data_offset;
+  if (file_size < 0) {
+    return -1;
+  }
+  if (end < (off_t)sizeof(ehdr) ||
+      file_pread(file->fd, &ehdr, sizeof(ehdr), 0) != 0 ||
+      elf_check(&ehdr) != 0) {
+    // not an ELF executable, the payload is only at the tail
+    return 0;
+  }
+  size_t count = ehdr.e_phnum;
+  size_t phdrs_size = count * sizeof(Elf64_Phdr);
+  if (ehdr.e_phoff > (uint64_t)end ||
+      phdrs_size > (uint64_t)end - ehdr.e_phoff) {
+    return 0;
+  }
+  Elf64_Phdr *phdrs = (Elf64_Phdr *)mem_alloc(phdrs_size);
+  if (!phdrs ||
+      file_pread(file->fd, phdrs, phdrs_size, (off_t)ehdr.e_phoff) != 0) {
+    mem_free(phdrs);
+    return -1;
+  }
+  // the segment added before runs past the end of the executable; a spare
+  // header for a new one is a PT_NULL, or with RTAD_LOAD_NOTE the last PT_NOTE
+  // without the build id
+  size_t own = count;
+  size_t spare = count;
+  int interp = 0;
+  uint64_t align = 4096;
+  uint64_t vaddr_end = 0;
+  for (size_t i = 0; i < count; i++) {
+    const Elf64_Phdr *phdr = &phdrs[i];
+    if (phdr->p_type == PT_LOAD &&
+        phdr->p_offset + phdr->p_filesz > (uint64_t)end) {
+      own = i;
+    } else if (phdr->p_type == PT_LOAD) {
+      align = phdr->p_align > align ? phdr->p_align : align;
+      if (phdr->p_vaddr + phdr->p_memsz > vaddr_end) {
+        vaddr_end = phdr->p_vaddr + phdr->p_memsz;
+      }
+    } else if (phdr->p_type == PT_INTERP) {
+      interp = 1;
+    } else if (phdr->p_type == PT_NULL &&
+               (spare == count || phdrs[spare].p_type != PT_NULL)) {
+      spare = i;
+    } else if (phdr->p_type == PT_NOTE && (load & RTAD_LOAD_NOTE) &&
+               (spare == count || phdrs[spare].p_type == PT_NOTE) &&
+               !elf_note_build_id(file->fd, end, phdr)) {
+      spare = i;
+    }
+  }
+  int result = 0;
+  uint64_t locator_vaddr = 0;
+  off_t locator_offset = -1;
+  // a new segment needs a spare header, and an executable: a shared library,
+  // or a static PIE, is not the file rtad_self reads
+  int add = own == count && load && file_size > end && spare < count &&
+            (align & (align - 1)) == 0 && (ehdr.e_type == ET_EXEC || interp);
+  if (own < count || add) {
+    locator_offset =
+        elf_find_locator(file->fd, end, phdrs, count, own, &locator_vaddr);
+  }
+  if (locator_offset < 0) {
+    // not linked with this library, or nothing to do
+    goto DONE;
+  }
+  // the magic is kept, the fields after it are written
+  struct rtad_locator value;
+  memset(&value, 0, sizeof(value));
+  if (file_size > end) {
+    Elf64_Phdr segment;
+    memset(&segment, 0, sizeof(segment));
+    segment.p_type = PT_LOAD;
+    segment.p_flags = PF_R;
+    segment.p_align = align;
+    // mapped from the page of the payload start, after every other segment
+    segment.p_offset = (uint64_t)end & ~(align - 1);
+    segment.p_vaddr = (vaddr_end + align - 1) & ~(align - 1);
+    segment.p_paddr = segment.p_vaddr;
+    segment.p_filesz = (uint64_t)file_size - segment.p_offset;
+    segment.p_memsz = segment.p_filesz;
+    if (own == count) {
+      // PT_LOAD headers are sorted by address, the new one goes after the
+      // last one
+      memmove(&phdrs[spare], &phdrs[spare + 1],
+              (count - spare - 1) * sizeof(Elf64_Phdr));
+      own = 0;
+      for (size_t i = 0; i < count - 1; i++) {
+        if (phdrs[i].p_type == PT_LOAD) {
+          own = i + 1;
+        }
+      }
+      memmove(&phdrs[own + 1], &phdrs[own],
+              (count - 1 - own) * sizeof(Elf64_Phdr));
+    }
+    phdrs[own] = segment;
+    value.delta = (int64_t)(segment.p_vaddr +
+                            ((uint64_t)end - segment.p_offset) -
+                            locator_vaddr);
+    value.offset = (uint64_t)end;
+    value.size = (uint64_t)(file_size - end);
+  } else {
+    // without payload, the header is left unused
+    memset(&phdrs[own], 0, sizeof(Elf64_Phdr));
+  }
+  if (file_pwrite(file->fd, phdrs, phdrs_size, (off_t)ehdr.e_phoff) != 0 ||
+      file_pwrite(file->fd, (const char *)&value + sizeof(value.magic),
+                  sizeof(value) - sizeof(value.magic),
+                  locator_offset + (off_t)sizeof(value.magic)) != 0) {
+    result = -1;
+  }
+DONE:
+  mem_free(phdrs);
+  return result;
+}
+
+// rtad_self of a payload loaded with the executable, read in memory
+static struct rtad_file *image_attach(void) {
+  uint64_t size = locator.size;
+  if (size == 0 || size > SIZE_MAX) {
+    return NULL;
+  }
+  struct rtad_file *file = (struct rtad_file *)mem_calloc(1, sizeof(*file));
+  if (!file) {
+    return NULL;
+  }
+  file->fd = -1;
+  file->image = (const char *)((uintptr_t)&locator + (uintptr_t)locator.delta);
+  file->image_offset = (off_t)locator.offset;
+  file->image_size = (size_t)size;
+  if (file_load(file) != 0 || file->data_offset != file->image_offset) {
+    rtad_close(file);
+    return NULL;
+  }
+  return file;
+}
+#else
+RTAD_PRIVATE int elf_update(struct rtad_file *file, uint32_t load) {
+  (void)file;
+  (void)load;
+  return 0;
+}
+
+static struct rtad_file *image_attach(void) { return NULL; }
+#endif
+
+// The executable itself, opened on first use and kept for the lifetime of the
+// process. Nothing changes after self_init, so readers don't lock.
+static rtad_once_t self_once = RTAD_ONCE_INIT;
+static rtad_once_t self_fd_once = RTAD_ONCE_INIT;
+static struct rtad_file *self_file;
+static const char *self_data; // mapping of the whole payload, may be NULL
+
+static void self_init(void) {
+  // loaded with the executable, there is nothing to open nor read
+  struct rtad_file *file = image_attach();
+  if (!file) {
+    file = file_attach(exe_open(), 0);
+  }
+  if (!file) {
+    return;
+  }
+  file->shared = 1;
+  if (file->trailer.data_size > 0 && file->trailer.data_size <= SIZE_MAX &&
+      !(file->trailer.flags & RTAD_TRAILER_CHUNKED)) {
+    // without the mapping, views are not available but the handle is
+    self_data = file->image
+                    ? file->image + (file->data_offset - file->image_offset)
+                    : fd_map(file->fd, file->data_offset,
+                             (size_t)file->trailer.data_size);
+  }
+  self_file = file;
+}
+
+static void self_fd_init(void) { self_file->fd = exe_open(); }
+
+struct rtad_file *rtad_self(void) {
+  run_once(&self_once, self_init);
+  return self_file;
+}
+
+RTAD_PRIVATE int file_fd(struct rtad_file *file) {
+  if (file->image) {
+    // only rtad_self is loaded with the executable
+    run_once(&self_fd_once, self_fd_init);
+  }
+  return file->fd;
+}
+
+RTAD_PRIVATE int file_read(struct rtad_file *file, void *buf, size_t size,
+                           off_t offset) {
+  if (file->image && offset >= file->image_offset &&
+      (uint64_t)(offset - file->image_offset) <= file->image_size &&
+      size <= file->image_size - (size_t)(offset - file->image_offset)) {
+    memcpy(buf, file->image + (offset - file->image_offset), size);
+    return 0;
+  }
+  return file_pread(file_fd(file), buf, size, offset);
+}
+
+int rtad_self_data(const char **out_data, size_t *out_data_size) {
+  if (!out_data || !out_data_size || !rtad_self() || !self_data) {
+    return -1;
+  }
+  *out_data = self_data;
+  *out_data_size = (size_t)self_file->trailer.data_size;
+  return 0;
+}
+
+int rtad_self_entry(const char *name, const char **out_data,
+                    size_t *out_data_size) {
+  struct rtad_entry entry;
+  // compressed entries are only read with a reader
+  if (!name || !out_data || !out_data_size || !rtad_self() || !self_data ||
+      rtad_find(self_file, name, &entry) != 0 ||
+      (entry.flags & RTAD_ENTRY_CHUNKED)) {
+    return -1;
+  }
+  *out_data = self_data + entry.offset;
+  *out_data_size = (size_t)entry.size;
+  return 0;
+}
+
+int rtad_close(struct rtad_file *file) {
+  if (!file || file->shared) {
+    return -1;
+  }
+  int result = file->fd >= 0 ? file_close(file->fd) : -1;
+  mem_free(file->toc_data);
+  mem_free(file);
+  return result == 0 ? 0 : -1;
+}
+
+int rtad_file_validate(struct rtad_file *file) {
+  if (!file || file->trailer.trailer_size == 0) {
+    return -1;
+  }
+  return 0;
+}
+
+int rtad_file_hash(struct rtad_file *file, uint8_t out_hash[RTAD_HASH_SIZE]) {
+  if (!file || !out_hash || file->hash.block_count == 0) {
+    return -1;
+  }
+  memcpy(out_hash, file->hash.root, RTAD_HASH_SIZE);
+  return 0;
+}
+
+int rtad_file_extract(struct rtad_file *file, char **out_data,
+                      size_t *out_data_size) {
+  if (rtad_file_validate(file) != 0 || !out_data || !out_data_size) {
+    return -1;
+  }
+  // a chunked payload is decoded
+  return reader_read_all(file, NULL, out_data, out_data_size);
+}
+
+int rtad_file_map(struct rtad_file *file, const char **out_data,
+                  size_t *out_data_size) {
+  // a chunked payload can't be mapped as is
+  if (rtad_file_validate(file) != 0 || !out_data || !out_data_size ||
+      (file->trailer.flags & RTAD_TRAILER_CHUNKED) ||
+      file->trailer.data_size == 0 || file->trailer.data_size > SIZE_MAX) {
+    return -1;
+  }
+  size_t data_size = (size_t)file->trailer.data_size;
+  const char *data = fd_map(file_fd(file), file->data_offset, data_size);
+  if (!data) {
+    return -1;
+  }
+  *out_data = data;
+  *out_data_size = data_size;
+  return 0;
+}
+
+// drop the payload, a segment loading it is left to the caller
+static int file_drop_payload(struct rtad_file *file) {
+  if (!file || !file->writable) {
+    return -1;
+  }
+  if (file->trailer.trailer_size == 0) {
+    // no payload, nothing to truncate
+    return 0;
+  }
+  if (fd_truncate(file->fd, file->data_offset) != 0) {
+    return -1;
+  }
+  mem_free(file->toc_data);
+  file->toc_data = NULL;
+  memset(&file->trailer, 0, sizeof(file->trailer));
+  memset(&file->toc, 0, sizeof(file->toc));
+  memset(&file->hash, 0, sizeof(file->hash));
+  file->file_size = file->data_offset;
+  return 0;
+}
+
+int rtad_file_truncate(struct rtad_file *file) {
+  // a segment over the payload would run past the end of the file
+  return file_drop_payload(file) == 0 && elf_update(file, 0) == 0 ? 0 : -1;
+}
+
+int rtad_file_append(struct rtad_file *file, const char *data, size_t size) {
+  if (!file || !data || size == 0) {
+    return -1;
+  }
+  // through the writer, for the tree hash
+  struct rtad_writer *writer = writer_open(file, 0);
+  if (!writer) {
+    return -1;
+  }
+  if (rtad_writer_write(writer, data, size) != 0) {
+    rtad_writer_abort(writer);
+    return -1;
+  }
+  return rtad_writer_close(writer);
+}
+
+RTAD_PRIVATE struct rtad_file *file_copy_exe(struct rtad_file *src,
+                                             const char *dest_path) {
+  if (!src || !dest_path) {
+    return NULL;
+  }
+  struct rtad_file *dest = (struct rtad_file *)mem_calloc(1, sizeof(*dest));
+  if (!dest) {
+    return NULL;
+  }
+  dest->fd = file_create(dest_path);
+  dest->writable = 1;
+  if (dest->fd < 0) {
+    goto FAIL;
+  }
+  // src is only read with positional I/O, it may be shared like rtad_self;
+  // the copy stops where the payload starts
+  uint64_t start = PHASE_BEGIN(RTAD_PHASE_COPY);
+  int copied = fd_copy(file_fd(src), dest->fd, src->data_offset, COPY_ALL);
+  PHASE_END(RTAD_PHASE_COPY, start);
+  if (copied != 0) {
+    goto FAIL;
+  }
+  // the copy is known, there is nothing to read back
+  dest->file_size = src->data_offset;
+  dest->data_offset = src->data_offset;
+  return dest;
+FAIL:
+  rtad_close(dest);
+  return NULL;
+}
+
+int rtad_extract_hdr(const char *exe_path, struct rtad_trailer *trailer) {
+  if (!trailer || !exe_path) {
+    return -1;
+  }
+  struct rtad_file *file = rtad_open(exe_path);
+  int result = rtad_file_validate(file);
+  if (result == 0) {
+    *trailer = file->trailer;
+  }
+  rtad_close(file);
+  return result;
+}
+
+int rtad_validate_hdr(const char *exe_path) {
+  if (!exe_path) {
+    return -1;
+  }
+  struct rtad_file *file = rtad_open(exe_path);
+  int result = rtad_file_validate(file);
+  rtad_close(file);
+  return result;
+}
+
+int rtad_truncate_data(const char *exe_path) {
+  if (!exe_path) {
+    return -1;
+  }
+  struct rtad_file *file = rtad_open_rw(exe_path);
+  if (!file) {
+    // could not open the file
+    // or file does not exist
+    return -1;
+  }
+  int result = rtad_file_truncate(file);
+  if (rtad_close(file) != 0) {
+    result = -1;
+  }
+  return result;
+}
+
+int rtad_append_packed_data(const char *dest_path, const char *append_data,
+                            size_t append_data_size) {
+  if (!dest_path || !append_data || append_data_size == 0) {
+    return -1;
+  }
+  struct rtad_file *file = rtad_open_rw(dest_path);
+  if (!file) {
+    return -1;
+  }
+  int result = rtad_file_append(file, append_data, append_data_size);
+  if (rtad_close(file) != 0) {
+    result = -1;
+  }
+  return result;
+}
+
+int rtad_copy_self_with_data(const char *dest_path, const char *append_data,
+                             size_t append_data_size) {
+  if (!dest_path || !append_data || append_data_size == 0) {
+    return -1;
+  }
+  struct rtad_file *dest = file_copy_exe(rtad_self(), dest_path);
+  if (!dest) {
+    return -1;
+  }
+  int result = rtad_file_append(dest, append_data, append_data_size);
+  if (rtad_close(dest) != 0) {
+    result = -1;
+  }
+  return result;
+}
+
+int rtad_extract_data(const char *exe_path, char **out_data,
+                      size_t *out_data_size) {
+  if (!exe_path || !out_data || !out_data_size) {
+    return -1;
+  }
+  struct rtad_file *file = rtad_open(exe_path);
+  int result = rtad_file_extract(file, out_data, out_data_size);
+  rtad_close(file);
+  return result;
+}
+
+int rtad_free_extracted_data(char *data) {
+  if (!data) {
+    return -1;
+  }
+  mem_free(data);
+  return 0;
+}
+
+int rtad_extract_self_data(char **out_data, size_t *out_data_size) {
+  if (!out_data || !out_data_size) {
+    return -1;
+  }
+  return rtad_file_extract(rtad_self(), out_data, out_data_size);
+}
+
+int rtad_validate_self_hdr() { return rtad_file_validate(rtad_self()); }
+
+int rtad_truncate_self_data(const char *new_path) {
+  if (!new_path) {
+    return -1;
+  }
+  struct rtad_file *dest = file_copy_exe(rtad_self(), new_path);
+  if (!dest) {
+    return -1;
+  }
+  int result = elf_update(dest, 0);
+  if (rtad_close(dest) != 0) {
+    result = -1;
+  }
+  return result;
+}
+
+int rtad_map_data(const char *exe_path, const char **out_data,
+                  size_t *out_data_size) {
+  if (!exe_path || !out_data || !out_data_size) {
+    return -1;
+  }
+  struct rtad_file *file = rtad_open(exe_path);
+  // the mapping outlives the descriptor
+  int result = rtad_file_map(file, out_data, out_data_size);
+  rtad_close(file);
+  return result;
+}
+
+int rtad_map_self_data(const char **out_data, size_t *out_data_size) {
+  if (!out_data || !out_data_size) {
+    return -1;
+  }
+  return rtad_file_map(rtad_self(), out_data, out_data_size);
+}
+
+int rtad_unmap_data(const char *data, size_t data_size) {
+  if (!data || data_size == 0) {
+    return -1;
+  }
+  return file_unmap(data, data_size);
+}
+
+RTAD_PRIVATE char *toc_build(struct rtad_toc_item *items, size_t count,
+                            size_t *out_toc_size) {
+  // an update may remove every entry, the TOC is then empty
+  if ((!items && count > 0) || count >= UINT32_MAX || !out_toc_size) {
+    return NULL;
+  }
+  uint32_t bucket_count = 1;
+  while (bucket_count < count) {
+    bucket_count <<= 1;
+  }
+  uint32_t *buckets = (uint32_t *)calloc(bucket_count + 1, sizeof(uint32_t));
+  // index of the item at every TOC position
+  uint32_t *order = (uint32_t *)malloc(count > 0 ? count * sizeof(uint32_t) : 1);
+  char *toc = NULL;
+  if (!buckets || !order) {
+    goto FAIL;
+  }
+  uint64_t names_size = 0;
+  for (size_t i = 0; i < count; i++) {
+    size_t name_size = strlen(items[i].name);
+    items[i].record.name_hash = name_hash(items[i].name, name_size);
+    items[i].record.name_size = (uint32_t)name_size;
+    names_size += name_size;
+    buckets[(items[i].record.name_hash & (bucket_count - 1)) + 1]++;
+  }
+  if (names_size > UINT32_MAX) {
+    goto FAIL;
+  }
+  for (uint32_t b = 0; b < bucket_count; b++) {
+    buckets[b + 1] += buckets[b];
+  }
+  // counting sort by bucket, stable in input order
+  uint32_t *fill = (uint32_t *)malloc(bucket_count * sizeof(uint32_t));
+  if (!fill) {
+    goto FAIL;
+  }
+  memcpy(fill, buckets, bucket_count * sizeof(uint32_t));
+  for (size_t i = 0; i < count; i++) {
+    order[fill[items[i].record.name_hash & (bucket_count - 1)]++] =
+        (uint32_t)i;
+  }
+  free(fill);
+  // reject duplicated names, they can only collide inside one bucket
+  for (uint32_t b = 0; b < bucket_count; b++) {
+    for (uint32_t i = buckets[b]; i < buckets[b + 1]; i++) {
+      for (uint32_t j = i + 1; j < buckets[b + 1]; j++) {
+        const struct rtad_toc_item *x = &items[order[i]];
+        const struct rtad_toc_item *y = &items[order[j]];
+        if (x->record.name_hash == y->record.name_hash &&
+            x->record.name_size == y->record.name_size &&
+            memcmp(x->name, y->name, x->record.name_size) == 0) {
+          goto FAIL;
+        }
+      }
+    }
+  }
+
+  struct rtad_toc_hdr hdr = {
+      .entry_count = (uint32_t)count,
+      .bucket_count = bucket_count,
+      .entry_size = sizeof(struct rtad_toc_entry),
+      .names_size = (uint32_t)names_size,
+  };
+  size_t buckets_size = (bucket_count + 1) * sizeof(uint32_t);
+  size_t entries_size = count * sizeof(struct rtad_toc_entry);
+  size_t toc_size = sizeof(hdr) + buckets_size + entries_size + names_size;
+  toc = (char *)malloc(toc_size);
+  if (!toc) {
+    goto FAIL;
+  }
+  char *p = toc;
+  memcpy(p, &hdr, sizeof(hdr));
+  p += sizeof(hdr);
+  memcpy(p, buckets, buckets_size);
+  p += buckets_size;
+  char *names = p + entries_size;
+  uint32_t name_offset = 0;
+  for (size_t i = 0; i < count; i++) {
+    struct rtad_toc_item *item = &items[order[i]];
+    item->record.name_offset = name_offset;
+    memcpy(p, &item->record, sizeof(item->record));
+    p += sizeof(item->record);
+    memcpy(names + name_offset, item->name, item->record.name_size);
+    name_offset += item->record.name_size;
+  }
+  free(buckets);
+  free(order);
+  *out_toc_size = toc_size;
+  return toc;
+FAIL:
+  free(buckets);
+  free(order);
+  free(toc);
+  return NULL;
+}
+
+static uint32_t lz_read32(const unsigned char *p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static unsigned char *lz_put_length(unsigned char *out, size_t length) {
+  while (length >= 255) {
+    *out++ = 255;
+    length -= 255;
+  }
+  *out++ = (unsigned char)length;
+  return out;
+}
+
+// a token with both lengths, the literals, the offset and the extra match
+// length; the last sequence has no match
+static unsigned char *lz_put_sequence(unsigned char *out,
+                                      const unsigned char *out_end,
+                                      const unsigned char *literals,
+                                      size_t literal_size, size_t offset,
+                                      size_t match_size) {
+  size_t extra = match_size ? match_size - LZ_MIN_MATCH : 0;
+  size_t worst =
+      1 + literal_size / 255 + 1 + literal_size + 2 + extra / 255 + 1;
+  if ((size_t)(out_end - out) < worst) {
+    return NULL;
+  }
+  unsigned char *token = out++;
+  *token = (unsigned char)((literal_size < 15 ? literal_size : 15) << 4);
+  if (literal_size >= 15) {
+    out = lz_put_length(out, literal_size - 15);
+  }
+  memcpy(out, literals, literal_size);
+  out += literal_size;
+  if (match_size) {
+    *out++ = (unsigned char)(offset & 0xFF);
+    *out++ = (unsigned char)(offset >> 8);
+    *token |= (unsigned char)(extra < 15 ? extra : 15);
+    if (extra >= 15) {
+      out = lz_put_length(out, extra - 15);
+    }
+  }
+  return out;
+}
+
+RTAD_PRIVATE size_t lz_compress(const char *src, size_t src_size, char *dst,
+                                size_t dst_capacity) {
+  if ((!src && src_size > 0) || !dst || src_size > UINT32_MAX) {
+    return 0;
+  }
+  const unsigned char *in = (const unsigned char *)src;
+  unsigned char *out = (unsigned char *)dst;
+  const unsigned char *out_end = out + dst_capacity;
+  // last position of every hashed 4-byte sequence
+  uint32_t table[1 << LZ_HASH_BITS];
+  memset(table, 0, sizeof(table));
+  size_t anchor = 0;
+  size_t pos = 0;
+  while (pos + LZ_MIN_MATCH <= src_size) {
+    uint32_t sequence = lz_read32(in + pos);
+    uint32_t hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+    size_t ref = table[hash];
+    table[hash] = (uint32_t)pos;
+    if (ref >= pos || pos - ref > LZ_MAX_OFFSET ||
+        lz_read32(in + ref) != sequence) {
+      // step faster over data that doesn't compress
+      pos += 1 + ((pos - anchor) >> 6);
+      continue;
+    }
+    size_t match_size = LZ_MIN_MATCH;
+    while (pos + match_size < src_size &&
+           in[ref + match_size] == in[pos + match_size]) {
+      match_size++;
+    }
+    out = lz_put_sequence(out, out_end, in + anchor, pos - anchor, pos - ref,
+                          match_size);
+    if (!out) {
+      return 0;
+    }
+    pos += match_size;
+    anchor = pos;
+  }
+  out = lz_put_sequence(out, out_end, in + anchor, src_size - anchor, 0, 0);
+  if (!out) {
+    return 0;
+  }
+  return (size_t)(out - (unsigned char *)dst);
+}
+
+static int lz_get_length(const unsigned char **in, const unsigned char *in_end,
+                         size_t *length) {
+  unsigned char byte;
+  do {
+    if (*in == in_end) {
+      return -1;
+    }
+    byte = *(*in)++;
+    *length += byte;
+  } while (byte == 255);
+  return 0;
+}
+
+RTAD_PRIVATE int lz_decompress(const char *src, size_t src_size, char *dst,
+                               size_t dst_size) {
+  if (!src || (!dst && dst_size > 0)) {
+    return -1;
+  }
+  const unsigned char *in = (const unsigned char *)src;
+  const unsigned char *in_end = in + src_size;
+  unsigned char *out = (unsigned char *)dst;
+  size_t out_pos = 0;
+  while (in < in_end) {
+    unsigned token = *in++;
+    size_t literal_size = token >> 4;
+    if (literal_size == 15 && lz_get_length(&in, in_end, &literal_size) != 0) {
+      return -1;
+    }
+    if (literal_size > (size_t)(in_end - in) ||
+        literal_size > dst_size - out_pos) {
+      return -1;
+    }
+    memcpy(out + out_pos, in, literal_size);
+    in += literal_size;
+    out_pos += literal_size;
+    if (in == in_end) {
+      // the last sequence has no match
+      break;
+    }
+    if (in_end - in < 2) {
+      return -1;
+    }
+    size_t offset = (size_t)in[0] | ((size_t)in[1] << 8);
+    in += 2;
+    size_t match_size = token & 15;
+    if (match_size == 15 && lz_get_length(&in, in_end, &match_size) != 0) {
+      return -1;
+    }
+    match_size += LZ_MIN_MATCH;
+    if (offset == 0 || offset > out_pos || match_size > dst_size - out_pos) {
+      return -1;
+    }
+    unsigned char *ref = out + out_pos - offset;
+    if (offset >= match_size) {
+      memcpy(out + out_pos, ref, match_size);
+    } else {
+      // the match overlaps its own output, e.g. a run of one byte
+      for (size_t i = 0; i < match_size; i++) {
+        out[out_pos + i] = ref[i];
+      }
+    }
+    out_pos += match_size;
+  }
+  return out_pos == dst_size ? 0 : -1;
+}
+
+int rtad_codec_supported(uint32_t codec) {
+  switch (codec) {
+  case RTAD_CODEC_NONE:
+  case RTAD_CODEC_LZ:
+#if defined(RTAD_HAVE_ZLIB)
+  case RTAD_CODEC_ZLIB:
+#endif
+    return 0;
+  default:
+    return -1;
+  }
+}
+
+RTAD_PRIVATE size_t codec_bound(uint32_t codec, size_t size) {
+  switch (codec) {
+  case RTAD_CODEC_LZ:
+    // literals only: a length byte per 255 of them, and the token
+    return size + size / 255 + 16;
+#if defined(RTAD_HAVE_ZLIB)
+  case RTAD_CODEC_ZLIB:
+    return (size_t)compressBound((uLong)size);
+#endif
+  default:
+    return 0;
+  }
+}
+
+RTAD_PRIVATE size_t codec_compress(uint32_t codec, const char *src,
+                                   size_t src_size, char *dst,
+                                   size_t dst_capacity) {
+  switch (codec) {
+  case RTAD_CODEC_LZ:
+    return lz_compress(src, src_size, dst, dst_capacity);
+#if defined(RTAD_HAVE_ZLIB)
+  case RTAD_CODEC_ZLIB: {
+    uLongf dst_size = (uLongf)dst_capacity;
+    if (compress2((Bytef *)dst, &dst_size, (const Bytef *)src, (uLong)src_size,
+                  Z_DEFAULT_COMPRESSION) != Z_OK) {
+      return 0;
+    }
+    return (size_t)dst_size;
+  }
+#endif
+  default:
+    return 0;
+  }
+}
+
+RTAD_PRIVATE int codec_decompress(uint32_t codec, const char *src,
+                                  size_t src_size, char *dst, size_t dst_size) {
+  switch (codec) {
+  case RTAD_CODEC_LZ:
+    return lz_decompress(src, src_size, dst, dst_size);
+#if defined(RTAD_HAVE_ZLIB)
+  case RTAD_CODEC_ZLIB: {
+    uLongf out_size = (uLongf)dst_size;
+    if (uncompress((Bytef *)dst, &out_size, (const Bytef *)src,
+                   (uLong)src_size) != Z_OK ||
+        out_size != dst_size) {
+      return -1;
+    }
+    return 0;
+  }
+#endif
+  default:
+    return -1;
+  }
+}
+
+// BLAKE3, portable and limited to the 32-byte hash of the default mode
+static const uint32_t blake3_iv[8] = {0x6A09E667, 0xBB67AE85, 0x3C6EF372,
+                                      0xA54FF53A, 0x510E527F, 0x9B05688C,
+                                      0x1F83D9AB, 0x5BE0CD19};
+
+// the message words of every round, the permutation applied round after round
+static const uint8_t blake3_schedule[7][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+    {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+    {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+    {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+    {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+    {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+};
+
+static uint32_t rotr32(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+#define BLAKE3_G(a, b, c, d, x, y)                                             \
+  do {                                                                         \
+    s[a] = s[a] + s[b] + (x);                                                  \
+    s[d] = rotr32(s[d] ^ s[a], 16);                                            \
+    s[c] = s[c] + s[d];                                                        \
+    s[b] = rotr32(s[b] ^ s[c], 12);                                            \
+    s[a] = s[a] + s[b] + (y);                                                  \
+    s[d] = rotr32(s[d] ^ s[a], 8);                                             \
+    s[c] = s[c] + s[d];                                                        \
+    s[b] = rotr32(s[b] ^ s[c], 7);                                             \
+  } while (0)
+
+// the first half of the output, a chaining value, or the hash with
+// BLAKE3_ROOT
+static void blake3_compress(const uint32_t cv[8], const uint32_t m[16],
+                            uint32_t block_len, uint64_t counter,
+                            uint32_t flags, uint32_t out[8]) {
+  uint32_t s[16];
+  memcpy(s, cv, 8 * sizeof(uint32_t));
+  memcpy(s + 8, blake3_iv, 4 * sizeof(uint32_t));
+  s[12] = (uint32_t)counter;
+  s[13] = (uint32_t)(counter >> 32);
+  s[14] = block_len;
+  s[15] = flags;
+  for (int round = 0; round < 7; round++) {
+    const uint8_t *w = blake3_schedule[round];
+    BLAKE3_G(0, 4, 8, 12, m[w[0]], m[w[1]]);
+    BLAKE3_G(1, 5, 9, 13, m[w[2]], m[w[3]]);
+    BLAKE3_G(2, 6, 10, 14, m[w[4]], m[w[5]]);
+    BLAKE3_G(3, 7, 11, 15, m[w[6]], m[w[7]]);
+    BLAKE3_G(0, 5, 10, 15, m[w[8]], m[w[9]]);
+    BLAKE3_G(1, 6, 11, 12, m[w[10]], m[w[11]]);
+    BLAKE3_G(2, 7, 8, 13, m[w[12]], m[w[13]]);
+    BLAKE3_G(3, 4, 9, 14, m[w[14]], m[w[15]]);
+  }
+  for (int i = 0; i < 8; i++) {
+    out[i] = s[i] ^ s[i + 8];
+  }
+}
+
+#undef BLAKE3_G
+
+// little-endian words, zero-padded past size
+static void blake3_load(const uint8_t *bytes, size_t size, uint32_t *words,
+                        size_t word_count) {
+  if (size >= word_count * 4) {
+    for (size_t i = 0; i < word_count; i++) {
+      const uint8_t *b = bytes + i * 4;
+      words[i] = (uint32_t)b[0] | (uint32_t)b[1] << 8 | (uint32_t)b[2] << 16 |
+                 (uint32_t)b[3] << 24;
+    }
+    return;
+  }
+  for (size_t i = 0; i < word_count; i++) {
+    uint32_t w = 0;
+    for (size_t j = 0; j < 4; j++) {
+      size_t k = i * 4 + j;
+      w |= (uint32_t)(k < size ? bytes[k] : 0) << (8 * j);
+    }
+    words[i] = w;
+  }
+}
+
+static void blake3_store(const uint32_t words[8], uint8_t out[32]) {
+  for (size_t i = 0; i < 32; i++) {
+    out[i] = (uint8_t)(words[i / 4] >> (8 * (i % 4)));
+  }
+}
+
+static void blake3_chunk(const uint8_t *data, size_t size, uint64_t counter,
+                         uint32_t root, uint32_t out[8]) {
+  uint32_t cv[8];
+  memcpy(cv, blake3_iv, sizeof(cv));
+  // an empty chunk is a single empty block
+  size_t block_count =
+      size > 0 ? (size + BLAKE3_BLOCK_LEN - 1) / BLAKE3_BLOCK_LEN : 1;
+  for (size_t i = 0; i < block_count; i++) {
+    size_t block_len = size - i * BLAKE3_BLOCK_LEN;
+    if (block_len > BLAKE3_BLOCK_LEN) {
+      block_len = BLAKE3_BLOCK_LEN;
+    }
+    uint32_t block[16];
+    blake3_load(data + i * BLAKE3_BLOCK_LEN, block_len, block, 16);
+    uint32_t flags = i == 0 ? BLAKE3_CHUNK_START : 0;
+    if (i + 1 == block_count) {
+      flags |= BLAKE3_CHUNK_END | root;
+    }
+    blake3_compress(cv, block, (uint32_t)block_len, counter, flags, cv);
+  }
+  memcpy(out, cv, sizeof(cv));
+}
+
+static void blake3_parent(const uint32_t left[8], const uint32_t right[8],
+                          uint32_t root, uint32_t out[8]) {
+  uint32_t block[16];
+  memcpy(block, left, 8 * sizeof(uint32_t));
+  memcpy(block + 8, right, 8 * sizeof(uint32_t));
+  blake3_compress(blake3_iv, block, BLAKE3_BLOCK_LEN, 0, BLAKE3_PARENT | root,
+                  out);
+}
+
+// the left subtree has the largest power of 2 number of chunks that leaves
+// something on the right
+static void blake3_subtree(const uint8_t *data, size_t size,
+                           uint64_t chunk_counter, uint32_t root,
+                           uint32_t out[8]) {
+  if (size <= BLAKE3_CHUNK_LEN) {
+    blake3_chunk(data, size, chunk_counter, root, out);
+    return;
+  }
+  size_t left_size = BLAKE3_CHUNK_LEN;
+  while (left_size * 2 < size) {
+    left_size *= 2;
+  }
+  uint32_t left[8], right[8];
+  blake3_subtree(data, left_size, chunk_counter, 0, left);
+  blake3_subtree(data + left_size, size - left_size,
+                 chunk_counter + left_size / BLAKE3_CHUNK_LEN, 0, right);
+  blake3_parent(left, right, root, out);
+}
+
+// blocks hold the same power of 2 number of chunks, so the tree splits
+// between leaves the way it splits between chunks
+static void blake3_leaves(const uint8_t *leaves, size_t count, uint32_t root,
+                          uint32_t out[8]) {
+  if (count == 1) {
+    blake3_load(leaves, RTAD_HASH_SIZE, out, 8);
+    return;
+  }
+  size_t left_count = 1;
+  while (left_count * 2 < count) {
+    left_count *= 2;
+  }
+  uint32_t left[8], right[8];
+  blake3_leaves(leaves, left_count, 0, left);
+  blake3_leaves(leaves + left_count * RTAD_HASH_SIZE, count - left_count, 0,
+                right);
+  blake3_parent(left, right, root, out);
+}
+
+RTAD_PRIVATE void hash_tree(const char *data, size_t size,
+                            uint64_t chunk_counter, int root,
+                            uint8_t out[RTAD_HASH_SIZE]) {
+  uint32_t words[8];
+  blake3_subtree((const uint8_t *)data, size, chunk_counter,
+                 root ? BLAKE3_ROOT : 0, words);
+  blake3_store(words, out);
+}
+
+RTAD_PRIVATE void hash_leaves(const uint8_t *leaves, size_t count,
+                              uint8_t out[RTAD_HASH_SIZE]) {
+  uint32_t words[8];
+  blake3_leaves(leaves, count, BLAKE3_ROOT, words);
+  blake3_store(words, out);
+}
+
+RTAD_PRIVATE int writer_flush(struct rtad_writer *writer) {
+  if (writer->buffer_used > 0 &&
+      file_write(writer->file->fd, writer->buffer, writer->buffer_used) != 0) {
+    return -1;
+  }
+  writer->buffer_used = 0;
+  return 0;
+}
+
+// write stored bytes of the payload, through the buffer if they fit
+// hash the block of the payload starting at data_size - size
+RTAD_PRIVATE int writer_add_leaf(struct rtad_writer *writer, const char *data,
+                                 size_t size) {
+  if (writer->leaf_count == UINT32_MAX) {
+    return -1;
+  }
+  if (writer->leaf_count == writer->leaf_capacity) {
+    size_t capacity = writer->leaf_capacity ? writer->leaf_capacity * 2 : 64;
+    uint8_t *leaves =
+        (uint8_t *)realloc(writer->leaves, capacity * RTAD_HASH_SIZE);
+    if (!leaves) {
+      return -1;
+    }
+    writer->leaves = leaves;
+    writer->leaf_capacity = capacity;
+  }
+  hash_tree(data, size,
+            (uint64_t)writer->leaf_count *
+                (RTAD_HASH_BLOCK_SIZE / BLAKE3_CHUNK_LEN),
+            0, writer->leaves + writer->leaf_count * RTAD_HASH_SIZE);
+  writer->leaf_count++;
+  return 0;
+}
+
+// the last block stays in hash_block until more bytes follow, it's hashed as
+// the root if it's the only one
+RTAD_PRIVATE int writer_hash(struct rtad_writer *writer,
+                             const struct rtad_iovec *iov, size_t iov_count) {
+  for (size_t i = 0; i < iov_count; i++) {
+    const char *p = (const char *)iov[i].data;
+    size_t size = iov[i].size;
+    while (size > 0) {
+      if (writer->hash_used == RTAD_HASH_BLOCK_SIZE) {
+        if (writer_add_leaf(writer, writer->hash_block,
+                            RTAD_HASH_BLOCK_SIZE) != 0) {
+          return -1;
+        }
+        writer->hash_used = 0;
+      }
+      if (writer->hash_used == 0 && size > RTAD_HASH_BLOCK_SIZE) {
+        // a whole block with more bytes after it is hashed in place
+        if (writer_add_leaf(writer, p, RTAD_HASH_BLOCK_SIZE) != 0) {
+          return -1;
+        }
+        p += RTAD_HASH_BLOCK_SIZE;
+        size -= RTAD_HASH_BLOCK_SIZE;
+        continue;
+      }
+      size_t n = RTAD_HASH_BLOCK_SIZE - writer->hash_used;
+      if (n > size) {
+        n = size;
+      }
+      memcpy(writer->hash_block + writer->hash_used, p, n);
+      writer->hash_used += n;
+      p += n;
+      size -= n;
+    }
+  }
+  return 0;
+}
+
+RTAD_PRIVATE int writer_emit(struct rtad_writer *writer,
+                             const struct rtad_iovec *iov, size_t iov_count) {
+  if (writer->hashing && writer_hash(writer, iov, iov_count) != 0) {
+    return -1;
+  }
+  uint64_t total = 0;
+  for (size_t i = 0; i < iov_count; i++) {
+    total += iov[i].size;
+  }
+  if (total > WRITE_BUFFER_SIZE - writer->buffer_used &&
+      writer_flush(writer) != 0) {
+    return -1;
+  }
+  if (total <= WRITE_BUFFER_SIZE - writer->buffer_used) {
+    // small writes are gathered in the buffer
+    for (size_t i = 0; i < iov_count; i++) {
+      // an empty one may have no data
+      if (iov[i].size > 0) {
+        memcpy(writer->buffer + writer->buffer_used, iov[i].data,
+               iov[i].size);
+      }
+      writer->buffer_used += iov[i].size;
+    }
+  } else if (file_writev(writer->file->fd, iov, iov_count) != 0) {
+    // large writes go straight to the file
+    return -1;
+  }
+  writer->data_size += total;
+  return 0;
+}
+
+// bytes to skip after offset of a payload starting at base so the next ones
+// start at a file offset multiple of align
+static uint64_t align_gap(off_t base, uint64_t offset, uint32_t align) {
+  if (align <= 1) {
+    return 0;
+  }
+  uint64_t rest = ((uint64_t)base + offset) & (align - 1);
+  return rest ? align - rest : 0;
+}
+
+// fill a gap with zeros, hashed like any other payload bytes
+static int writer_pad(struct rtad_writer *writer, uint64_t size) {
+  static const char zeros[WRITE_BUFFER_SIZE];
+  while (size > 0) {
+    struct rtad_iovec iov = {.data = zeros,
+                             .size = size < sizeof(zeros) ? (size_t)size
+                                                          : sizeof(zeros)};
+    if (writer_emit(writer, &iov, 1) != 0) {
+      return -1;
+    }
+    size -= iov.size;
+  }
+  return 0;
+}
+
+// close the tree hash and write it, the leaves are not covered
+RTAD_PRIVATE int writer_put_hash(struct rtad_writer *writer) {
+  struct rtad_hash_hdr hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.covered_size = writer->data_size;
+  hdr.block_size = RTAD_HASH_BLOCK_SIZE;
+  hdr.algorithm = RTAD_HASH_BLAKE3;
+  if (writer->leaf_count == 0) {
+    hash_tree(writer->hash_block, writer->hash_used, 0, 1, hdr.root);
+  }
+  if (writer_add_leaf(writer, writer->hash_block, writer->hash_used) != 0) {
+    return -1;
+  }
+  if (writer->leaf_count > 1) {
+    hash_leaves(writer->leaves, writer->leaf_count, hdr.root);
+  }
+  hdr.block_count = (uint32_t)writer->leaf_count;
+  writer->hashing = 0;
+  struct rtad_iovec iov[2] = {
+      {.data = writer->leaves, .size = writer->leaf_count * RTAD_HASH_SIZE},
+      {.data = &hdr, .size = sizeof(hdr)},
+  };
+  return writer_emit(writer, iov, 2);
+}
+
+// compress a chunk, or keep it as is if it doesn't get smaller
+RTAD_PRIVATE struct rtad_iovec chunk_encode(uint32_t codec, const char *raw,
+                                            size_t raw_size, char *out,
+                                            size_t out_capacity,
+                                            uint32_t *flags) {
+  struct rtad_iovec stored = {.data = out, .size = 0};
+  stored.size = codec_compress(codec, raw, raw_size, out, out_capacity);
+  *flags = 0;
+  if (stored.size == 0 || stored.size >= raw_size) {
+    stored.data = raw;
+    stored.size = raw_size;
+    *flags = RTAD_CHUNK_STORED;
+  }
+  return stored;
+}
+
+static struct rtad_dedup_item *dedup_slot(struct rtad_dedup_item *items,
+                                          size_t capacity,
+                                          const uint8_t *digest,
+                                          uint32_t tag) {
+  uint64_t key;
+  memcpy(&key, digest, sizeof(key));
+  size_t i = (size_t)key & (capacity - 1);
+  while (items[i].used && (items[i].tag != tag ||
+                           memcmp(items[i].digest, digest, RTAD_HASH_SIZE))) {
+    i = (i + 1) & (capacity - 1);
+  }
+  return &items[i];
+}
+
+// stored bytes with this hash written before, NULL if none
+RTAD_PRIVATE const struct rtad_dedup_item *
+dedup_find(const struct rtad_writer *writer, const uint8_t *digest,
+           uint32_t tag) {
+  if (writer->dedup_count == 0) {
+    return NULL;
+  }
+  const struct rtad_dedup_item *item = dedup_slot(
+      writer->dedup_items, writer->dedup_capacity, digest, tag);
+  return item->used ? item : NULL;
+}
+
+RTAD_PRIVATE int dedup_add(struct rtad_writer *writer, const uint8_t *digest,
+                           uint32_t tag, uint64_t offset, uint64_t size) {
+  // kept at most half full
+  if ((writer->dedup_count + 1) * 2 > writer->dedup_capacity) {
+    size_t capacity = writer->dedup_capacity ? writer->dedup_capacity * 2 : 256;
+    struct rtad_dedup_item *items = (struct rtad_dedup_item *)calloc(
+        capacity, sizeof(struct rtad_dedup_item));
+    if (!items) {
+      return -1;
+    }
+    for (size_t i = 0; i < writer->dedup_capacity; i++) {
+      if (writer->dedup_items[i].used) {
+        *dedup_slot(items, capacity, writer->dedup_items[i].digest,
+                    writer->dedup_items[i].tag) = writer->dedup_items[i];
+      }
+    }
+    free(writer->dedup_items);
+    writer->dedup_items = items;
+    writer->dedup_capacity = capacity;
+  }
+  struct rtad_dedup_item *item =
+      dedup_slot(writer->dedup_items, writer->dedup_capacity, digest, tag);
+  memcpy(item->digest, digest, RTAD_HASH_SIZE);
+  item->offset = offset;
+  item->size = size;
+  item->tag = tag;
+  item->used = 1;
+  writer->dedup_count++;
+  return 0;
+}
+
+// add the chunk to the table and write it, unless the same stored bytes were
+// written before, with dedup the digest is their hash
+RTAD_PRIVATE int writer_put_stored(struct rtad_writer *writer,
+                                   const struct rtad_iovec *stored,
+                                   uint32_t flags, size_t raw_size,
+                                   const uint8_t *digest) {
+  struct rtad_chunk_hdr *hdr = &writer->chunk_hdr;
+  if (hdr->chunk_count == UINT32_MAX) {
+    return -1;
+  }
+  if (hdr->chunk_count == writer->chunk_capacity) {
+    size_t capacity = writer->chunk_capacity ? writer->chunk_capacity * 2 : 64;
+    struct rtad_chunk *chunks = (struct rtad_chunk *)realloc(
+        writer->chunks, capacity * sizeof(struct rtad_chunk));
+    if (!chunks) {
+      return -1;
+    }
+    writer->chunks = chunks;
+    uint32_t *raw_sizes =
+        (uint32_t *)realloc(writer->raw_sizes, capacity * sizeof(uint32_t));
+    if (!raw_sizes) {
+      return -1;
+    }
+    writer->raw_sizes = raw_sizes;
+    writer->chunk_capacity = capacity;
+  }
+  struct rtad_chunk *chunk = &writer->chunks[hdr->chunk_count];
+  // stored chunks are the raw bytes whatever the codec
+  uint32_t tag =
+      (flags & RTAD_CHUNK_STORED) ? RTAD_CHUNK_STORED : hdr->codec << 8 | flags;
+  const struct rtad_dedup_item *item =
+      digest ? dedup_find(writer, digest, tag) : NULL;
+  if (item) {
+    chunk->offset = item->offset;
+  } else {
+    chunk->offset = writer->data_size;
+    if (writer_emit(writer, stored, 1) != 0 ||
+        (digest &&
+         dedup_add(writer, digest, tag, chunk->offset, stored->size) != 0)) {
+      return -1;
+    }
+  }
+  chunk->size = (uint32_t)stored->size;
+  chunk->flags = flags;
+  writer->raw_sizes[hdr->chunk_count] = (uint32_t)raw_size;
+  hdr->chunk_count++;
+  return 0;
+}
+
+static void pool_work(void *arg) {
+  struct rtad_pool *pool = (struct rtad_pool *)arg;
+  mutex_lock(&pool->lock);
+  while (!pool->stop) {
+    // slots are filled in ring order, so the next one is the oldest
+    struct rtad_slot *slot = &pool->slots[pool->next_work];
+    if (slot->state != RTAD_SLOT_FILLED) {
+      cond_wait(&pool->changed, &pool->lock);
+      continue;
+    }
+    slot->state = RTAD_SLOT_BUSY;
+    pool->next_work = (pool->next_work + 1) % pool->slot_count;
+    mutex_unlock(&pool->lock);
+    slot->stored = chunk_encode(pool->codec, slot->raw, slot->raw_size,
+                                slot->out, pool->bound, &slot->flags);
+    if (pool->dedup) {
+      hash_tree((const char *)slot->stored.data, slot->stored.size, 0, 1,
+                slot->digest);
+    }
+    mutex_lock(&pool->lock);
+    slot->state = RTAD_SLOT_DONE;
+    cond_broadcast(&pool->changed);
+  }
+  mutex_unlock(&pool->lock);
+}
+
+static void pool_write(void *arg) {
+  struct rtad_pool *pool = (struct rtad_pool *)arg;
+  mutex_lock(&pool->lock);
+  while (!pool->stop) {
+    // wait for the oldest chunk even if later ones are done, so they are
+    // written in order
+    struct rtad_slot *slot = &pool->slots[pool->next_write];
+    if (slot->state != RTAD_SLOT_DONE) {
+      cond_wait(&pool->changed, &pool->lock);
+      continue;
+    }
+    int failed = pool->failed;
+    mutex_unlock(&pool->lock);
+    if (!failed &&
+        writer_put_stored(pool->writer, &slot->stored, slot->flags,
+                          slot->raw_size,
+                          pool->dedup ? slot->digest : NULL) != 0) {
+      failed = 1;
+    }
+    mutex_lock(&pool->lock);
+    pool->failed = failed;
+    slot->state = RTAD_SLOT_FREE;
+    pool->next_write = (pool->next_write + 1) % pool->slot_count;
+    pool->pending--;
+    cond_broadcast(&pool->changed);
+  }
+  mutex_unlock(&pool->lock);
+}
+
+// stop the threads, chunks not written yet are dropped
+RTAD_PRIVATE void pool_destroy(struct rtad_pool *pool) {
+  if (!pool) {
+    return;
+  }
+  if (pool->sync_ready) {
+    mutex_lock(&pool->lock);
+    pool->stop = 1;
+    cond_broadcast(&pool->changed);
+    mutex_unlock(&pool->lock);
+    for (size_t i = 0; i < pool->started; i++) {
+      thread_join(pool->threads[i]);
+    }
+    cond_destroy(&pool->changed);
+    mutex_destroy(&pool->lock);
+  }
+  for (size_t i = 0; pool->slots && i < pool->slot_count; i++) {
+    free(pool->slots[i].raw);
+    free(pool->slots[i].out);
+  }
+  free(pool->slots);
+  free(pool->threads);
+  free(pool);
+}
+
+// a pool for the codec, chunk size, dedup and number of threads of the
+// writer
+RTAD_PRIVATE struct rtad_pool *pool_create(struct rtad_writer *writer) {
+  struct rtad_pool *pool =
+      (struct rtad_pool *)calloc(1, sizeof(struct rtad_pool));
+  if (!pool) {
+    return NULL;
+  }
+  pool->writer = writer;
+  pool->codec = writer->codec;
+  pool->chunk_limit = writer->chunk_limit;
+  // without codec every chunk is stored, there is nothing to compress into
+  pool->bound = codec_bound(writer->codec, writer->chunk_limit);
+  pool->thread_count = writer->threads;
+  pool->dedup = (writer->dedup & RTAD_DEDUP_ENTRIES) != 0;
+  // two slots per worker, one compressed while the other is filled
+  pool->slot_count = (size_t)writer->threads * 2;
+  pool->slots =
+      (struct rtad_slot *)calloc(pool->slot_count, sizeof(struct rtad_slot));
+  pool->threads = (rtad_thread_t *)malloc((writer->threads + 1) *
+                                          sizeof(rtad_thread_t));
+  if (!pool->slots || !pool->threads) {
+    goto FAIL;
+  }
+  for (size_t i = 0; i < pool->slot_count; i++) {
+    pool->slots[i].raw = (char *)malloc(pool->chunk_limit);
+    pool->slots[i].out = (char *)malloc(pool->bound > 0 ? pool->bound : 1);
+    if (!pool->slots[i].raw || !pool->slots[i].out) {
+      goto FAIL;
+    }
+  }
+  if (mutex_init(&pool->lock) != 0) {
+    goto FAIL;
+  }
+  if (cond_init(&pool->changed) != 0) {
+    mutex_destroy(&pool->lock);
+    goto FAIL;
+  }
+  pool->sync_ready = 1;
+  if (thread_create(&pool->threads[0], pool_write, pool) != 0) {
+    goto FAIL;
+  }
+  pool->started = 1;
+  for (unsigned i = 0; i < writer->threads; i++) {
+    if (thread_create(&pool->threads[pool->started], pool_work, pool) != 0) {
+      goto FAIL;
+    }
+    pool->started++;
+  }
+  return pool;
+FAIL:
+  pool_destroy(pool);
+  return NULL;
+}
+
+// hand the full chunk buffer to the workers, waiting for a free slot
+RTAD_PRIVATE int pool_submit(struct rtad_writer *writer) {
+  struct rtad_pool *pool = writer->pool;
+  mutex_lock(&pool->lock);
+  struct rtad_slot *slot = &pool->slots[pool->next_fill];
+  while (slot->state != RTAD_SLOT_FREE) {
+    cond_wait(&pool->changed, &pool->lock);
+  }
+  int failed = pool->failed;
+  if (!failed) {
+    char *raw = slot->raw;
+    slot->raw = writer->chunk_buf;
+    slot->raw_size = writer->chunk_used;
+    slot->state = RTAD_SLOT_FILLED;
+    writer->chunk_buf = raw;
+    writer->chunk_buf_capacity = pool->chunk_limit;
+    pool->next_fill = (pool->next_fill + 1) % pool->slot_count;
+    pool->pending++;
+    cond_broadcast(&pool->changed);
+  }
+  mutex_unlock(&pool->lock);
+  writer->chunk_used = 0;
+  return failed ? -1 : 0;
+}
+
+// wait until every submitted chunk is written
+RTAD_PRIVATE int pool_drain(struct rtad_pool *pool) {
+  mutex_lock(&pool->lock);
+  while (pool->pending > 0) {
+    cond_wait(&pool->changed, &pool->lock);
+  }
+  int failed = pool->failed;
+  mutex_unlock(&pool->lock);
+  return failed ? -1 : 0;
+}
+
+// start the entry, or the payload, with the codec and dedup set at this time
+RTAD_PRIVATE int writer_start(struct rtad_writer *writer) {
+  writer->entry_offset = writer->data_size;
+  writer->entry_raw_size = 0;
+  memset(&writer->chunk_hdr, 0, sizeof(writer->chunk_hdr));
+  writer->chunk_used = 0;
+  writer->cdc_hash = 0;
+  // stored chunks can be shared too, so dedup chunks without codec
+  writer->chunked = writer->codec != RTAD_CODEC_NONE || writer->dedup != 0;
+  if (!writer->chunked) {
+    return 0;
+  }
+  uint64_t chunk_limit = writer->chunk_size;
+  if (writer->dedup & RTAD_DEDUP_CDC) {
+    chunk_limit *= RTAD_CDC_MAX_FACTOR;
+    writer->chunk_hdr.flags = RTAD_CHUNKS_VARIABLE;
+  }
+  if (chunk_limit > UINT32_MAX) {
+    return -1;
+  }
+  writer->chunk_limit = (size_t)chunk_limit;
+  if (writer->chunk_buf_capacity < writer->chunk_limit) {
+    char *chunk_buf = (char *)realloc(writer->chunk_buf, writer->chunk_limit);
+    if (!chunk_buf) {
+      return -1;
+    }
+    writer->chunk_buf = chunk_buf;
+    writer->chunk_buf_capacity = writer->chunk_limit;
+  }
+  size_t bound = codec_bound(writer->codec, writer->chunk_limit);
+  if (writer->compress_capacity < bound) {
+    char *compress_buf = (char *)realloc(writer->compress_buf, bound);
+    if (!compress_buf) {
+      return -1;
+    }
+    writer->compress_buf = compress_buf;
+    writer->compress_capacity = bound;
+  }
+  // the pool is idle between entries, replace it if the settings changed
+  struct rtad_pool *pool = writer->pool;
+  if (pool && (pool->codec != writer->codec ||
+               pool->chunk_limit != writer->chunk_limit ||
+               pool->thread_count != writer->threads ||
+               pool->dedup != ((writer->dedup & RTAD_DEDUP_ENTRIES) != 0))) {
+    pool_destroy(pool);
+    writer->pool = NULL;
+  }
+  if (!writer->pool && writer->threads > 1) {
+    // without a pool, chunks are compressed here to the same output
+    writer->pool = pool_create(writer);
+  }
+  writer->chunk_hdr.codec = writer->codec;
+  writer->chunk_hdr.chunk_size = writer->chunk_size;
+  return 0;
+}
+
+// compress and write the chunk being filled
+RTAD_PRIVATE int writer_put_chunk(struct rtad_writer *writer) {
+  if (writer->pool) {
+    return pool_submit(writer);
+  }
+  uint32_t flags = 0;
+  struct rtad_iovec stored =
+      chunk_encode(writer->chunk_hdr.codec, writer->chunk_buf,
+                   writer->chunk_used, writer->compress_buf,
+                   writer->compress_capacity, &flags);
+  uint8_t digest[RTAD_HASH_SIZE];
+  int dedup = (writer->dedup & RTAD_DEDUP_ENTRIES) != 0;
+  if (dedup) {
+    hash_tree((const char *)stored.data, stored.size, 0, 1, digest);
+  }
+  if (writer_put_stored(writer, &stored, flags, writer->chunk_used,
+                        dedup ? digest : NULL) != 0) {
+    return -1;
+  }
+  writer->chunk_used = 0;
+  return 0;
+}
+
+static rtad_once_t gear_once = RTAD_ONCE_INIT;
+static uint64_t gear[256];
+
+static void gear_init(void) {
+  // fixed, so the same content is cut at the same places by every writer
+  uint64_t x = 0;
+  for (size_t i = 0; i < 256; i++) {
+    // splitmix64
+    x += 0x9E3779B97F4A7C15ULL;
+    uint64_t z = x;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    gear[i] = z ^ (z >> 31);
+  }
+}
+
+// the length of p up to and with a content-defined cut, size if none; no cut
+// before chunk_size / RTAD_CDC_MIN_DIVISOR bytes in the chunk
+RTAD_PRIVATE size_t writer_cdc_scan(struct rtad_writer *writer,
+                                    const uint8_t *p, size_t size, int *cut) {
+  size_t min_size = writer->chunk_size / RTAD_CDC_MIN_DIVISOR;
+  size_t i = 0;
+  *cut = 0;
+  if (writer->chunk_used < min_size) {
+    i = min_size - writer->chunk_used;
+    if (i >= size) {
+      return size;
+    }
+  }
+  // a cut every chunk_size bytes on average after the minimum, decided by
+  // the top bits that depend on the last 64 bytes
+  int bits = 0;
+  while (bits < 63 && ((uint64_t)2 << bits) <= writer->chunk_size) {
+    bits++;
+  }
+  uint64_t mask = bits > 0 ? ~(uint64_t)0 << (64 - bits) : 0;
+  uint64_t hash = writer->cdc_hash;
+  for (; i < size; i++) {
+    hash = (hash << 1) + gear[p[i]];
+    if ((hash & mask) == 0) {
+      writer->cdc_hash = 0;
+      *cut = 1;
+      return i + 1;
+    }
+  }
+  writer->cdc_hash = hash;
+  return size;
+}
+
+// finish the entry, or the payload, and fill its TOC record
+RTAD_PRIVATE int writer_end(struct rtad_writer *writer) {
+  if (writer->mode == RTAD_WRITER_ENTRIES && !writer->entry_open) {
+    // already ended, or copied entries only
+    return 0;
+  }
+  struct rtad_chunk_hdr *hdr = &writer->chunk_hdr;
+  struct rtad_toc_entry *record =
+      writer->entry_open ? &writer->items[writer->item_count - 1].record
+                         : NULL;
+  writer->entry_open = 0;
+  if (writer->chunked) {
+    // an empty entry has no chunk, only the index
+    if (writer->chunk_used > 0 && writer_put_chunk(writer) != 0) {
+      return -1;
+    }
+    if (writer->pool && pool_drain(writer->pool) != 0) {
+      return -1;
+    }
+    hdr->raw_size = writer->entry_raw_size;
+    struct rtad_iovec iov[3] = {
+        {.data = writer->chunks,
+         .size = hdr->chunk_count * sizeof(struct rtad_chunk)},
+        {.data = writer->raw_sizes,
+         .size = (hdr->flags & RTAD_CHUNKS_VARIABLE)
+                     ? hdr->chunk_count * sizeof(uint32_t)
+                     : 0},
+        {.data = hdr, .size = sizeof(*hdr)},
+    };
+    if (record && (writer->dedup & RTAD_DEDUP_ENTRIES)) {
+      // all the chunks of an entry seen before were shared, so its index is
+      // the same too and the entry shares the whole stored range
+      uint8_t digest[RTAD_HASH_SIZE];
+      size_t index_size = iov[0].size + iov[1].size + iov[2].size;
+      char *index = (char *)malloc(index_size);
+      if (!index) {
+        return -1;
+      }
+      memcpy(index, iov[0].data, iov[0].size);
+      memcpy(index + iov[0].size, iov[1].data, iov[1].size);
+      memcpy(index + iov[0].size + iov[1].size, iov[2].data, iov[2].size);
+      hash_tree(index, index_size, 0, 1, digest);
+      free(index);
+      const struct rtad_dedup_item *item =
+          dedup_find(writer, digest, RTAD_DEDUP_TAG_ENTRY);
+      if (item) {
+        record->offset = item->offset;
+        record->size = item->size;
+        record->raw_size = writer->entry_raw_size;
+        record->flags |= RTAD_ENTRY_CHUNKED;
+        return 0;
+      }
+      if (writer_emit(writer, iov, 3) != 0 ||
+          dedup_add(writer, digest, RTAD_DEDUP_TAG_ENTRY, record->offset,
+                    writer->data_size - record->offset) != 0) {
+        return -1;
+      }
+    } else if (writer_emit(writer, iov, 3) != 0) {
+      return -1;
+    }
+  }
+  if (record) {
+    record->size = writer->data_size - record->offset;
+    record->raw_size = writer->entry_raw_size;
+    if (writer->chunked) {
+      record->flags |= RTAD_ENTRY_CHUNKED;
+    }
+  }
+  return 0;
+}
+
+RTAD_PRIVATE void writer_free(struct rtad_writer *writer) {
+  for (size_t i = 0; i < writer->item_count; i++) {
+    free((char *)writer->items[i].name);
+  }
+  pool_destroy(writer->pool);
+  free(writer->hash_block);
+  free(writer->leaves);
+  free(writer->items);
+  free(writer->chunks);
+  free(writer->raw_sizes);
+  free(writer->dedup_items);
+  free(writer->chunk_buf);
+  free(writer->compress_buf);
+  if (writer->owns_file) {
+    rtad_close(writer->file);
+  }
+  free(writer);
+}
+
+// a writer with the default settings, the caller positions it
+static struct rtad_writer *writer_alloc(struct rtad_file *file,
+                                        int owns_file) {
+  if (!file) {
+    return NULL;
+  }
+  struct rtad_writer *writer =
+      (struct rtad_writer *)calloc(1, sizeof(struct rtad_writer));
+  if (!writer) {
+    if (owns_file) {
+      rtad_close(file);
+    }
+    return NULL;
+  }
+  writer->file = file;
+  writer->owns_file = owns_file;
+  writer->chunk_size = RTAD_CHUNK_SIZE;
+  writer->threads = 1;
+  writer->hashing = 1;
+  writer->hash_block = (char *)malloc(RTAD_HASH_BLOCK_SIZE);
+  if (!writer->hash_block) {
+    writer_free(writer);
+    return NULL;
+  }
+  return writer;
+}
+
+RTAD_PRIVATE struct rtad_writer *writer_open(struct rtad_file *file,
+                                             int owns_file) {
+  struct rtad_writer *writer = writer_alloc(file, owns_file);
+  // drop the existing payload, the new one replaces it; a segment loading it
+  // is moved at close
+  if (!writer || file_drop_payload(file) != 0 ||
+      fd_seek(file->fd, file->data_offset) != 0) {
+    if (writer) {
+      writer_free(writer);
+    }
+    return NULL;
+  }
+  writer->base_size = file->data_offset;
+  return writer;
+}
+
+// hash the payload kept by an update: the leaves of its whole blocks are
+// reused once checked against the root, only the rest is read back
+static int writer_resume_hash(struct rtad_writer *writer) {
+  struct rtad_file *file = writer->file;
+  uint64_t start = 0;
+  if (file->hash.block_size == RTAD_HASH_BLOCK_SIZE &&
+      file->hash.block_count > 1) {
+    // the writer grows the leaves with realloc, they are moved to malloc
+    uint8_t *leaves = hash_leaves_load(file);
+    size_t leaves_size = (size_t)file->hash.block_count * RTAD_HASH_SIZE;
+    writer->leaves = leaves ? (uint8_t *)malloc(leaves_size) : NULL;
+    if (writer->leaves) {
+      memcpy(writer->leaves, leaves, leaves_size);
+    }
+    mem_free(leaves);
+    if (!writer->leaves) {
+      return -1;
+    }
+    writer->leaf_capacity = file->hash.block_count;
+    writer->leaf_count =
+        (size_t)(file->hash.covered_size / RTAD_HASH_BLOCK_SIZE);
+    start = (uint64_t)writer->leaf_count * RTAD_HASH_BLOCK_SIZE;
+  }
+  // the last block, the old leaves and trailer, or a payload without hash
+  char *buf = (char *)malloc(COPY_BUFFER_SIZE);
+  if (!buf) {
+    return -1;
+  }
+  int result = 0;
+  while (start < writer->data_size && result == 0) {
+    struct rtad_iovec iov = {.data = buf,
+                             .size = writer->data_size - start <
+                                             COPY_BUFFER_SIZE
+                                         ? (size_t)(writer->data_size - start)
+                                         : COPY_BUFFER_SIZE};
+    result = file_pread(file->fd, buf, iov.size,
+                        file->data_offset + (off_t)start) == 0 &&
+                     writer_hash(writer, &iov, 1) == 0
+                 ? 0
+                 : -1;
+    start += iov.size;
+  }
+  free(buf);
+  return result;
+}
+
+RTAD_PRIVATE struct rtad_writer *writer_open_update(struct rtad_file *file,
+                                                    int owns_file) {
+  if (file && file->data_offset == file->file_size) {
+    return writer_open(file, owns_file);
+  }
+  struct rtad_writer *writer = writer_alloc(file, owns_file);
+  if (!writer) {
+    return NULL;
+  }
+  struct rtad_live live;
+  memset(&live, 0, sizeof(live));
+  // the old TOC, its bytes and those of the old trailer stay in the payload
+  writer->update = 1;
+  writer->mode = RTAD_WRITER_ENTRIES;
+  writer->base_size = file->file_size;
+  writer->data_size = (uint64_t)(file->file_size - file->data_offset);
+  if (!(file->trailer.flags & RTAD_TRAILER_TOC) ||
+      live_load(file, &live, 0) != 0 ||
+      fd_seek(file->fd, file->file_size) != 0 ||
+      writer_resume_hash(writer) != 0) {
+    live_free(&live);
+    writer_free(writer);
+    return NULL;
+  }
+  writer->items = live.items;
+  writer->item_count = live.item_count;
+  writer->item_capacity = live.item_count;
+  live.items = NULL;
+  live_free(&live);
+  return writer;
+}
+
+struct rtad_writer *rtad_writer_open(const char *dest_path) {
+  return writer_open(rtad_open_rw(dest_path), 1);
+}
+
+struct rtad_writer *rtad_writer_open_update(const char *dest_path) {
+  return writer_open_update(rtad_open_rw(dest_path), 1);
+}
+
+int rtad_writer_begin_entry(struct rtad_writer *writer, const char *name) {
+  if (!writer || !name || name[0] == '\0' || writer->failed ||
+      writer->mode == RTAD_WRITER_DATA) {
+    return -1;
+  }
+  if (writer->item_count == writer->item_capacity) {
+    size_t capacity = writer->item_capacity ? writer->item_capacity * 2 : 16;
+    struct rtad_toc_item *items = (struct rtad_toc_item *)realloc(
+        writer->items, capacity * sizeof(struct rtad_toc_item));
+    if (!items) {
+      return -1;
+    }
+    writer->items = items;
+    writer->item_capacity = capacity;
+  }
+  size_t name_size = strlen(name) + 1;
+  char *name_copy = (char *)malloc(name_size);
+  if (!name_copy) {
+    return -1;
+  }
+  memcpy(name_copy, name, name_size);
+  // only entries stored as is are mapped, chunked ones are not aligned
+  uint32_t align = writer->codec == RTAD_CODEC_NONE && writer->dedup == 0
+                       ? writer->align
+                       : 0;
+  if (writer_end(writer) != 0 ||
+      writer_pad(writer, align_gap(writer->file->data_offset,
+                                   writer->data_size, align)) != 0 ||
+      writer_start(writer) != 0) {
+    free(name_copy);
+    writer->failed = 1;
+    return -1;
+  }
+  if (writer->update) {
+    // the older entry is left out of the TOC, its bytes become dead
+    rtad_writer_remove(writer, name);
+  }
+  struct rtad_toc_item *item = &writer->items[writer->item_count++];
+  memset(item, 0, sizeof(*item));
+  item->name = name_copy;
+  item->record.offset = writer->data_size;
+  item->record.align = align;
+  writer->mode = RTAD_WRITER_ENTRIES;
+  writer->entry_open = 1;
+  return 0;
+}
+
+// copy the merged spans of live from src after the payload written so far,
+// in the kernel when possible; they are read back for the tree hash. The
+// zeros before an aligned span are written first.
+static int writer_copy_spans(struct rtad_writer *writer, struct rtad_file *src,
+                             const struct rtad_live *live) {
+  struct rtad_file *dest = writer->file;
+  char *buf = (char *)malloc(COPY_BUFFER_SIZE);
+  if (!buf || writer_flush(writer) != 0) {
+    free(buf);
+    return -1;
+  }
+  int result = 0;
+  for (size_t i = 0; i < live->extent_count && result == 0; i++) {
+    const struct rtad_extent *span = &live->extents[i];
+    off_t src_offset = src->data_offset + (off_t)span->offset;
+    if (span->new_offset > writer->data_size &&
+        (fd_seek(dest->fd, dest->data_offset + (off_t)writer->data_size) !=
+             0 ||
+         writer_pad(writer, span->new_offset - writer->data_size) != 0 ||
+         writer_flush(writer) != 0)) {
+      result = -1;
+      break;
+    }
+    uint64_t start = PHASE_BEGIN(RTAD_PHASE_COPY);
+    result = fd_copy_range(file_fd(src), src_offset, dest->fd,
+                           dest->data_offset + (off_t)writer->data_size,
+                           (off_t)span->size, COPY_RANGE | COPY_SENDFILE);
+    PHASE_END(RTAD_PHASE_COPY, start);
+    for (uint64_t done = 0; done < span->size && result == 0;) {
+      struct rtad_iovec iov = {.data = buf,
+                               .size = span->size - done < COPY_BUFFER_SIZE
+                                           ? (size_t)(span->size - done)
+                                           : COPY_BUFFER_SIZE};
+      result = file_read(src, buf, iov.size, src_offset + (off_t)done) == 0 &&
+                       writer_hash(writer, &iov, 1) == 0
+                   ? 0
+                   : -1;
+      done += iov.size;
+    }
+    writer->data_size += span->size;
+  }
+  free(buf);
+  // the copy may have moved the position, the writer goes on after it
+  if (result == 0 &&
+      fd_seek(dest->fd, dest->data_offset + (off_t)writer->data_size) != 0) {
+    result = -1;
+  }
+  return result;
+}
+
+static int writer_copy_entries(struct rtad_writer *writer,
+                               struct rtad_file *src,
+                               const char *const *names, size_t count) {
+  if (!writer || !src || (!names && count > 0) || writer->failed ||
+      writer->mode == RTAD_WRITER_DATA || rtad_file_validate(src) != 0) {
+    return -1;
+  }
+  if (count == 0) {
+    return 0;
+  }
+  struct rtad_live live;
+  if (live_select(src, &live, names, count) != 0) {
+    live_free(&live);
+    return -1;
+  }
+  // the entry being written ends before the copied ones
+  if (writer_end(writer) != 0) {
+    goto FAIL;
+  }
+  writer->mode = RTAD_WRITER_ENTRIES;
+  live_spans(&live, writer->data_size, writer->file->data_offset);
+  if (writer_copy_spans(writer, src, &live) != 0 ||
+      live_put_records(writer, &live) != 0) {
+    goto FAIL;
+  }
+  for (size_t i = 0; i < live.item_count; i++) {
+    if (writer->item_count == writer->item_capacity) {
+      size_t capacity = writer->item_capacity ? writer->item_capacity * 2 : 16;
+      struct rtad_toc_item *items = (struct rtad_toc_item *)realloc(
+          writer->items, capacity * sizeof(struct rtad_toc_item));
+      if (!items) {
+        goto FAIL;
+      }
+      writer->items = items;
+      writer->item_capacity = capacity;
+    }
+    if (writer->update) {
+      rtad_writer_remove(writer, live.items[i].name);
+    }
+    writer->items[writer->item_count++] = live.items[i];
+    live.items[i].name = NULL;
+  }
+  live_free(&live);
+  return 0;
+FAIL:
+  live_free(&live);
+  writer->failed = 1;
+  return -1;
+}
+
+int rtad_writer_copy_entries(struct rtad_writer *writer,
+                             struct rtad_file *src, const char *const *names,
+                             size_t count) {
+  uint64_t start = PHASE_BEGIN(RTAD_PHASE_APPEND);
+  int result = writer_copy_entries(writer, src, names, count);
+  PHASE_END(RTAD_PHASE_APPEND, start);
+  return result;
+}
+
+int rtad_writer_remove(struct rtad_writer *writer, const char *name) {
+  if (!writer || !name || writer->failed) {
+    return -1;
+  }
+  for (size_t i = 0; i < writer->item_count; i++) {
+    if (!writer->items[i].removed && strcmp(writer->items[i].name, name) == 0) {
+      writer->items[i].removed = 1;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+int rtad_writer_set_codec(struct rtad_writer *writer, uint32_t codec,
+                          uint32_t chunk_size) {
+  if (!writer || rtad_codec_supported(codec) != 0) {
+    return -1;
+  }
+  writer->codec = codec;
+  writer->chunk_size = chunk_size ? chunk_size : RTAD_CHUNK_SIZE;
+  return 0;
+}
+
+int rtad_writer_set_dedup(struct rtad_writer *writer, uint32_t flags) {
+  if (!writer || (flags & ~(RTAD_DEDUP_ENTRIES | RTAD_DEDUP_CDC)) != 0) {
+    return -1;
+  }
+  if (flags & RTAD_DEDUP_CDC) {
+    // content-defined chunks are only worth it to share them
+    flags |= RTAD_DEDUP_ENTRIES;
+    run_once(&gear_once, gear_init);
+  }
+  writer->dedup = flags;
+  return 0;
+}
+
+int rtad_writer_set_align(struct rtad_writer *writer, uint32_t align) {
+  if (!writer || align > RTAD_ALIGN_MAX || (align & (align - 1)) != 0) {
+    return -1;
+  }
+  writer->align = align;
+  return 0;
+}
+
+int rtad_writer_set_load(struct rtad_writer *writer, uint32_t flags) {
+  if (!writer || (flags & ~(RTAD_LOAD_SEGMENT | RTAD_LOAD_NOTE)) != 0) {
+    return -1;
+  }
+  if (flags & RTAD_LOAD_NOTE) {
+    flags |= RTAD_LOAD_SEGMENT;
+  }
+  writer->load = flags;
+  return 0;
+}
+
+int rtad_writer_set_threads(struct rtad_writer *writer, unsigned threads) {
+  if (!writer) {
+    return -1;
+  }
+  writer->threads = threads ? threads : cpu_count();
+  return 0;
+}
+
+int rtad_writer_write(struct rtad_writer *writer, const void *data,
+                      size_t size) {
+  struct rtad_iovec iov = {.data = data, .size = size};
+  return rtad_writer_writev(writer, &iov, 1);
+}
+
+static int writer_writev(struct rtad_writer *writer,
+                         const struct rtad_iovec *iov, size_t iov_count) {
+  if (!writer || (!iov && iov_count > 0) || writer->failed) {
+    return -1;
+  }
+  uint64_t total = 0;
+  for (size_t i = 0; i < iov_count; i++) {
+    if (!iov[i].data && iov[i].size > 0) {
+      return -1;
+    }
+    total += iov[i].size;
+  }
+  if (total == 0) {
+    return 0;
+  }
+  if (writer->mode == RTAD_WRITER_EMPTY) {
+    if (writer_start(writer) != 0) {
+      writer->failed = 1;
+      return -1;
+    }
+    writer->mode = RTAD_WRITER_DATA;
+  } else if (writer->mode == RTAD_WRITER_ENTRIES && !writer->entry_open) {
+    // an update writes entries only
+    return -1;
+  }
+  writer->entry_raw_size += total;
+  if (!writer->chunked) {
+    if (writer_emit(writer, iov, iov_count) != 0) {
+      writer->failed = 1;
+      return -1;
+    }
+    return 0;
+  }
+  // fill chunks and compress every full one
+  int variable = (writer->chunk_hdr.flags & RTAD_CHUNKS_VARIABLE) != 0;
+  for (size_t i = 0; i < iov_count; i++) {
+    const char *p = (const char *)iov[i].data;
+    size_t size = iov[i].size;
+    while (size > 0) {
+      size_t n = writer->chunk_limit - writer->chunk_used;
+      if (n > size) {
+        n = size;
+      }
+      int cut = 0;
+      if (variable) {
+        n = writer_cdc_scan(writer, (const uint8_t *)p, n, &cut);
+      }
+      memcpy(writer->chunk_buf + writer->chunk_used, p, n);
+      writer->chunk_used += n;
+      p += n;
+      size -= n;
+      if (writer->chunk_used == writer->chunk_limit) {
+        // no cut found up to the largest chunk
+        writer->cdc_hash = 0;
+        cut = 1;
+      }
+      if (cut && writer_put_chunk(writer) != 0) {
+        writer->failed = 1;
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+int rtad_writer_writev(struct rtad_writer *writer,
+                       const struct rtad_iovec *iov, size_t iov_count) {
+  uint64_t start = PHASE_BEGIN(RTAD_PHASE_APPEND);
+  int result = writer_writev(writer, iov, iov_count);
+  PHASE_END(RTAD_PHASE_APPEND, start);
+  return result;
+}
+
+// a slice of an input file of rtad_writer_add_files, read ahead of the writer
+struct ingest_slice {
+  struct rtad_io io;
+  size_t input;
+  int first; // the entry begins with it
+  int last;  // the file is closed after it
+};
+
+static int writer_add_files(struct rtad_writer *writer,
+                            const struct rtad_file_input *inputs,
+                            size_t count) {
+  if (!writer || (!inputs && count > 0) || writer->failed ||
+      writer->mode == RTAD_WRITER_DATA) {
+    return -1;
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (!inputs[i].name || inputs[i].name[0] == '\0' || !inputs[i].path ||
+        rtad_codec_supported(inputs[i].codec) != 0) {
+      return -1;
+    }
+  }
+  char *arena = (char *)malloc((size_t)IO_DEPTH * IO_SLICE_SIZE);
+  if (!arena) {
+    return -1;
+  }
+  // the slices are read into the registered arena, up to IO_DEPTH at once
+  struct rtad_ring *ring =
+      ring_open(IO_DEPTH, arena, (size_t)IO_DEPTH * IO_SLICE_SIZE);
+  struct ingest_slice slices[IO_DEPTH];
+  size_t head = 0, tail = 0, next = 0;
+  int fd = -1; // the file being sliced
+  off_t file_size = 0, offset = 0;
+  int result = -1;
+  for (;;) {
+    while (tail - head < IO_DEPTH && next < count) {
+      if (fd < 0) {
+        fd = file_open(inputs[next].path);
+        file_size = fd >= 0 ? fd_length(fd) : -1;
+        offset = 0;
+        if (file_size < 0) {
+          goto DONE;
+        }
+      }
+      struct ingest_slice *slice = &slices[tail % IO_DEPTH];
+      size_t size = file_size - offset > IO_SLICE_SIZE
+                        ? IO_SLICE_SIZE
+                        : (size_t)(file_size - offset);
+      slice->io.fd = fd;
+      slice->io.write = 0;
+      slice->io.buf = arena + (tail % IO_DEPTH) * IO_SLICE_SIZE;
+      slice->io.size = size;
+      slice->io.offset = offset;
+      slice->input = next;
+      slice->first = offset == 0;
+      slice->last = offset + (off_t)size == file_size;
+      if (io_submit(ring, &slice->io) != 0) {
+        break;
+      }
+      tail++;
+      offset += (off_t)size;
+      if (slice->last) {
+        // closed by the slice
+        fd = -1;
+        next++;
+      }
+    }
+    if (head == tail) {
+      break;
+    }
+    // the entries are written in order, whatever order the reads complete in
+    struct ingest_slice *slice = &slices[head % IO_DEPTH];
+    while (slice->io.state == IO_QUEUED) {
+      if (ring_reap(ring) != 0) {
+        goto DONE;
+      }
+    }
+    if (slice->io.state != IO_DONE) {
+      goto DONE;
+    }
+    const struct rtad_file_input *input = &inputs[slice->input];
+    if (slice->first &&
+        (rtad_writer_set_codec(writer, input->codec, 0) != 0 ||
+         rtad_writer_begin_entry(writer, input->name) != 0)) {
+      goto DONE;
+    }
+    if (rtad_writer_write(writer, slice->io.buf, slice->io.size) != 0) {
+      goto DONE;
+    }
+    if (slice->last) {
+      file_close(slice->io.fd);
+    }
+    head++;
+  }
+  result = 0;
+DONE:
+  while (ring_in_flight(ring) > 0 && ring_reap(ring) == 0) {
+  }
+  for (; head < tail; head++) {
+    if (slices[head % IO_DEPTH].last) {
+      file_close(slices[head % IO_DEPTH].io.fd);
+    }
+  }
+  if (fd >= 0) {
+    file_close(fd);
+  }
+  ring_close(ring);
+  free(arena);
+  if (result != 0) {
+    // an entry may be cut short
+    writer->failed = 1;
+  }
+  return result;
+}
+
+int rtad_writer_add_files(struct rtad_writer *writer,
+                          const struct rtad_file_input *inputs, size_t count) {
+  uint64_t start = PHASE_BEGIN(RTAD_PHASE_APPEND);
+  int result = writer_add_files(writer, inputs, count);
+  PHASE_END(RTAD_PHASE_APPEND, start);
+  return result;
+}
+
+RTAD_PRIVATE int writer_put_tail(struct rtad_writer *writer) {
+  struct rtad_trailer trailer;
+  trailer_init(&trailer, writer->data_size);
+  if (writer->mode == RTAD_WRITER_ENTRIES) {
+    // drop the tombstones
+    size_t count = 0;
+    for (size_t i = 0; i < writer->item_count; i++) {
+      if (writer->items[i].removed) {
+        free((char *)writer->items[i].name);
+      } else {
+        writer->items[count++] = writer->items[i];
+      }
+    }
+    writer->item_count = count;
+    size_t toc_size = 0;
+    char *toc = toc_build(writer->items, writer->item_count, &toc_size);
+    if (!toc) {
+      return -1;
+    }
+    trailer.toc_offset = writer->data_size;
+    trailer.toc_size = toc_size;
+    trailer.flags |= RTAD_TRAILER_TOC;
+    struct rtad_iovec iov = {.data = toc, .size = toc_size};
+    int written = writer_emit(writer, &iov, 1);
+    free(toc);
+    if (written != 0) {
+      return -1;
+    }
+  } else if (writer->chunked) {
+    trailer.flags |= RTAD_TRAILER_CHUNKED;
+  }
+  if (writer_put_hash(writer) != 0) {
+    return -1;
+  }
+  trailer.flags |= RTAD_TRAILER_HASH;
+  trailer.data_size = writer->data_size;
+  // the TOC, the hash and the trailer usually go out with the last buffered
+  // data
+  struct rtad_iovec iov = {.data = &trailer, .size = sizeof(trailer)};
+  if (writer_emit(writer, &iov, 1) != 0 || writer_flush(writer) != 0) {
+    return -1;
+  }
+  return 0;
+}
+
+RTAD_PRIVATE int writer_release(struct rtad_writer *writer, int result) {
+  // the threads may still be writing after a failure
+  pool_destroy(writer->pool);
+  writer->pool = NULL;
+  if (result != 0) {
+    // don't leave a payload without trailer behind
+    fd_truncate(writer->file->fd, writer->base_size);
+  }
+  if (elf_update(writer->file, writer->load) != 0) {
+    result = -1;
+  }
+  // a borrowed file stays usable, read back what was written
+  if (!writer->owns_file && file_load(writer->file) != 0) {
+    result = -1;
+  }
+  writer_free(writer);
+  return result;
+}
+
+int rtad_writer_close(struct rtad_writer *writer) {
+  if (!writer) {
+    return -1;
+  }
+  uint64_t start = PHASE_BEGIN(RTAD_PHASE_APPEND);
+  int result = 0;
+  if (writer->failed) {
+    result = -1;
+  } else if (writer->mode != RTAD_WRITER_EMPTY) {
+    // with nothing appended, the file is left without payload
+    result = writer_end(writer) == 0 && writer_put_tail(writer) == 0 ? 0 : -1;
+  }
+  result = writer_release(writer, result);
+  PHASE_END(RTAD_PHASE_APPEND, start);
+  return result;
+}
+
+int rtad_writer_abort(struct rtad_writer *writer) {
+  if (!writer) {
+    return -1;
+  }
+  pool_destroy(writer->pool);
+  writer->pool = NULL;
+  int result = fd_truncate(writer->file->fd, writer->base_size);
+  if (elf_update(writer->file, 0) != 0) {
+    result = -1;
+  }
+  if (!writer->owns_file && file_load(writer->file) != 0) {
+    result = -1;
+  }
+  writer_free(writer);
+  return result;
+}
+
+static int inputs_check(const struct rtad_input *inputs, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    if (!inputs[i].name || inputs[i].name[0] == '\0' ||
+        (!inputs[i].data && inputs[i].size > 0) ||
+        rtad_codec_supported(inputs[i].codec) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int writer_put_inputs(struct rtad_writer *writer,
+                             const struct rtad_input *inputs, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    if (rtad_writer_set_codec(writer, inputs[i].codec, 0) != 0 ||
+        rtad_writer_begin_entry(writer, inputs[i].name) != 0 ||
+        rtad_writer_write(writer, inputs[i].data, inputs[i].size) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int rtad_file_append_entries(struct rtad_file *file,
+                             const struct rtad_input *inputs, size_t count) {
+  if (!file || !inputs || count == 0 || inputs_check(inputs, count) != 0) {
+    return -1;
+  }
+  struct rtad_writer *writer = writer_open(file, 0);
+  if (!writer) {
+    return -1;
+  }
+  if (writer_put_inputs(writer, inputs, count) != 0) {
+    rtad_writer_abort(writer);
+    return -1;
+  }
+  return rtad_writer_close(writer);
+}
+
+int rtad_file_repack(struct rtad_file *src, const char *dest_path,
+                     const char *const *keep, size_t keep_count,
+                     const struct rtad_input *inputs, size_t count) {
+  if (!src || !dest_path || (!keep && keep_count > 0) ||
+      (!inputs && count > 0) || keep_count + count == 0 ||
+      inputs_check(inputs, count) != 0) {
+    return -1;
+  }
+  struct rtad_file *dest = file_copy_exe(src, dest_path);
+  struct rtad_writer *writer = writer_open(dest, 0);
+  if (!writer) {
+    rtad_close(dest);
+    return -1;
+  }
+  int result = -1;
+  if (rtad_writer_copy_entries(writer, src, keep, keep_count) != 0 ||
+      writer_put_inputs(writer, inputs, count) != 0) {
+    rtad_writer_abort(writer);
+  } else {
+    result = rtad_writer_close(writer);
+  }
+  if (rtad_close(dest) != 0) {
+    result = -1;
+  }
+  return result;
+}
+
+int rtad_repack(const char *src_path, const char *dest_path,
+                const char *const *keep, size_t keep_count,
+                const struct rtad_input *inputs, size_t count) {
+  if (!src_path) {
+    return -1;
+  }
+  struct rtad_file *src = rtad_open(src_path);
+  if (!src) {
+    return -1;
+  }
+  int result =
+      rtad_file_repack(src, dest_path, keep, keep_count, inputs, count);
+  rtad_close(src);
+  return result;
+}
+
+int rtad_append_packed_entries(const char *dest_path,
+                               const struct rtad_input *inputs, size_t count) {
+  if (!dest_path || !inputs || count == 0) {
+    return -1;
+  }
+  struct rtad_file *file = rtad_open_rw(dest_path);
+  if (!file) {
+    return -1;
+  }
+  int result = rtad_file_append_entries(file, inputs, count);
+  if (rtad_close(file) != 0) {
+    result = -1;
+  }
+  return result;
+}
+
+int rtad_copy_self_with_entries(const char *dest_path,
+                                const struct rtad_input *inputs, size_t count) {
+  if (!dest_path || !inputs || count == 0) {
+    return -1;
+  }
+  struct rtad_file *dest = file_copy_exe(rtad_self(), dest_path);
+  if (!dest) {
+    return -1;
+  }
+  int result = rtad_file_append_entries(dest, inputs, count);
+  if (rtad_close(dest) != 0) {
+    result = -1;
+  }
+  return result;
+}
+
+RTAD_PRIVATE int toc_record_get(const struct rtad_file *file, uint32_t index,
+                                struct rtad_toc_entry *record,
+                                const char **out_name) {
+  const struct rtad_toc_hdr *toc = &file->toc;
+  // the TOC is in memory, records are copied out as they are unaligned
+  const char *entries = file->toc_data + sizeof(struct rtad_toc_hdr) +
+                        ((size_t)toc->bucket_count + 1) * sizeof(uint32_t);
+  const char *names = entries + (size_t)toc->entry_count * toc->entry_size;
+  if (toc->entry_size < sizeof(*record)) {
+    // an older, shorter record
+    memset(record, 0, sizeof(*record));
+    memcpy(record, entries + (size_t)index * toc->entry_size, toc->entry_size);
+    record->raw_size = record->size;
+  } else {
+    memcpy(record, entries + (size_t)index * toc->entry_size, sizeof(*record));
+  }
+  if ((uint64_t)record->name_offset + record->name_size > toc->names_size) {
+    return -1;
+  }
+  *out_name = names + record->name_offset;
+  return 0;
+}
+
+static int entry_from_record(const struct rtad_file *file,
+                             const struct rtad_toc_entry *record,
+                             struct rtad_entry *out_entry) {
+  if (record->offset > file->trailer.toc_offset ||
+      record->size > file->trailer.toc_offset - record->offset) {
+    // corrupted TOC, the entry is outside of the data area
+    return -1;
+  }
+  out_entry->offset = record->offset;
+  out_entry->size = record->size;
+  out_entry->flags = record->flags;
+  out_entry->align = record->align;
+  out_entry->raw_size = record->raw_size;
+  return 0;
+}
+
+int rtad_find(struct rtad_file *file, const char *name,
+              struct rtad_entry *out_entry) {
+  if (!file || !name || !out_entry || !file->toc_data) {
+    return -1;
+  }
+  const struct rtad_toc_hdr *toc = &file->toc;
+  size_t name_size = strlen(name);
+  uint64_t hash = name_hash(name, name_size);
+  const char *buckets = file->toc_data + sizeof(struct rtad_toc_hdr);
+
+  uint32_t range[2];
+  uint32_t bucket = (uint32_t)(hash & (toc->bucket_count - 1));
+  memcpy(range, buckets + (size_t)bucket * sizeof(uint32_t), sizeof(range));
+  if (range[0] > range[1] || range[1] > toc->entry_count) {
+    return -1;
+  }
+  for (uint32_t i = range[0]; i < range[1]; i++) {
+    struct rtad_toc_entry record;
+    const char *record_name = NULL;
+    if (toc_record_get(file, i, &record, &record_name) != 0 ||
+        record.name_hash != hash || record.name_size != name_size ||
+        memcmp(record_name, name, name_size) != 0) {
+      continue;
+    }
+    return entry_from_record(file, &record, out_entry);
+  }
+  return -1;
+}
+
+size_t rtad_entry_count(rtad_file *file) {
+  return file && file->toc_data ? file->toc.entry_count : 0;
+}
+
+int rtad_entry_at(rtad_file *file, size_t index, const char **out_name,
+                  size_t *out_name_size, struct rtad_entry *out_entry) {
+  if (!file || !out_name || !out_name_size || !out_entry ||
+      index >= rtad_entry_count(file)) {
+    return -1;
+  }
+  struct rtad_toc_entry record;
+  if (toc_record_get(file, (uint32_t)index, &record, out_name) != 0 ||
+      entry_from_record(file, &record, out_entry) != 0) {
+    return -1;
+  }
+  *out_name_size = record.name_size;
+  return 0;
+}
+
+int rtad_entry_read(struct rtad_file *file, const struct rtad_entry *entry,
+                    char **out_data, size_t *out_data_size) {
+  if (!file || !entry || !out_data || !out_data_size) {
+    return -1;
+  }
+  return reader_read_all(file, entry, out_data, out_data_size);
+}
+
+int rtad_entry_map(struct rtad_file *file, const struct rtad_entry *entry,
+                   const char **out_data, size_t *out_data_size) {
+  // a chunked entry is decoded, it can't be mapped as is
+  if (rtad_file_validate(file) != 0 || !entry || !out_data ||
+      !out_data_size || (entry->flags & RTAD_ENTRY_CHUNKED) ||
+      entry->size == 0 || entry->offset > file->trailer.data_size ||
+      entry->size > file->trailer.data_size - entry->offset ||
+      entry->size > SIZE_MAX) {
+    return -1;
+  }
+  size_t size = (size_t)entry->size;
+  off_t offset = file->data_offset + (off_t)entry->offset;
+  const char *data = fd_map(file_fd(file), offset, size);
+  if (!data) {
+    return -1;
+  }
+#if defined(MADV_HUGEPAGE)
+  // file pages only get huge pages with transparent huge pages, and when the
+  // view and the file agree on the 2MiB boundaries; it's a hint, a refusal is
+  // not an error
+  if (offset % RTAD_ALIGN_HUGE == 0 && size >= RTAD_ALIGN_HUGE) {
+    madvise((void *)data, size - size % RTAD_ALIGN_HUGE, MADV_HUGEPAGE);
+  }
+#endif
+  *out_data = data;
+  *out_data_size = size;
+  return 0;
+}
+
+static int piece_compare(const void *a, const void *b) {
+  uint64_t x = ((const struct rtad_get_piece *)a)->offset;
+  uint64_t y = ((const struct rtad_get_piece *)b)->offset;
+  return (x > y) - (x < y);
+}
+
+RTAD_PRIVATE size_t get_ranges(struct rtad_get_piece *pieces, size_t count,
+                               struct rtad_get_range *ranges) {
+  if (count > 1) {
+    qsort(pieces, count, sizeof(struct rtad_get_piece), piece_compare);
+  }
+  size_t range_count = 0;
+  for (size_t i = 0; i < count; i++) {
+    uint64_t end = pieces[i].offset + pieces[i].size;
+    if (range_count > 0) {
+      struct rtad_get_range *range = &ranges[range_count - 1];
+      uint64_t range_end = range->offset + range->size;
+      uint64_t new_end = end > range_end ? end : range_end;
+      // shared chunks overlap, a piece inside the range is always taken
+      if (pieces[i].offset <= range_end + GET_GAP_SIZE &&
+          (new_end == range_end ||
+           new_end - range->offset <= GET_RANGE_SIZE)) {
+        range->size = new_end - range->offset;
+        range->count++;
+        continue;
+      }
+    }
+    ranges[range_count].offset = pieces[i].offset;
+    ranges[range_count].size = pieces[i].size;
+    ranges[range_count].first = i;
+    ranges[range_count].count = 1;
+    range_count++;
+  }
+  return range_count;
+}
+
+// the pieces of an entry, its chunks if it's chunked
+static int get_add_pieces(struct rtad_file *file,
+                          const struct rtad_entry *entry, char *dest,
+                          struct rtad_get_piece **pieces, size_t *count,
+                          size_t *capacity) {
+  struct rtad_chunk_hdr hdr = {0};
+  struct rtad_chunk *chunks = NULL;
+  uint64_t *raw_offsets = NULL;
+  size_t needed = 1;
+  if (entry->flags & RTAD_ENTRY_CHUNKED) {
+    chunks = chunks_load(file, entry->offset, entry->size, &hdr, &raw_offsets);
+    if (!chunks || hdr.raw_size != entry->raw_size) {
+      mem_free(chunks);
+      mem_free(raw_offsets);
+      return -1;
+    }
+    needed = hdr.chunk_count;
+  } else if (entry->size != entry->raw_size) {
+    return -1;
+  }
+  if (*count + needed > *capacity) {
+    size_t new_capacity = *capacity ? *capacity * 2 : 64;
+    while (new_capacity < *count + needed) {
+      new_capacity *= 2;
+    }
+    struct rtad_get_piece *grown = (struct rtad_get_piece *)mem_grow(
+        *pieces, *capacity * sizeof(struct rtad_get_piece),
+        new_capacity * sizeof(struct rtad_get_piece));
+    if (!grown) {
+      mem_free(chunks);
+      mem_free(raw_offsets);
+      return -1;
+    }
+    *pieces = grown;
+    *capacity = new_capacity;
+  }
+  if (!chunks) {
+    if (entry->size > 0) {
+      (*pieces)[(*count)++] = (struct rtad_get_piece){
+          .offset = entry->offset,
+          .size = entry->size,
+          .dest = dest,
+          .raw_size = (size_t)entry->size,
+          .codec = RTAD_CODEC_NONE};
+    }
+    return 0;
+  }
+  for (uint32_t i = 0; i < hdr.chunk_count; i++) {
+    uint64_t start =
+        raw_offsets ? raw_offsets[i] : (uint64_t)i * hdr.chunk_size;
+    uint64_t end = raw_offsets ? raw_offsets[i + 1]
+                   : i + 1 < hdr.chunk_count
+                       ? start + hdr.chunk_size
+                       : hdr.raw_size;
+    (*pieces)[(*count)++] = (struct rtad_get_piece){
+        .offset = chunks[i].offset,
+        .size = chunks[i].size,
+        .dest = dest + start,
+        .raw_size = (size_t)(end - start),
+        .codec = (chunks[i].flags & RTAD_CHUNK_STORED) ? RTAD_CODEC_NONE
+                                                       : hdr.codec};
+  }
+  mem_free(chunks);
+  mem_free(raw_offsets);
+  return 0;
+}
+
+// a range of a single stored piece is read in place, the others are staged
+static int get_range_direct(const struct rtad_get_range *range,
+                            const struct rtad_get_piece *pieces) {
+  return range->count == 1 && pieces[range->first].codec == RTAD_CODEC_NONE;
+}
+
+static int get_many(struct rtad_file *file, const char *const *names,
+                    size_t count, struct rtad_data *out) {
+  if (!file || (!names && count > 0) || (!out && count > 0)) {
     return -1;
   }
-  HANDLE hFile = CreateFileA(path, GENERIC_WRITE, 0, NULL, OPEN_EXISTING,
-                             FILE_ATTRIBUTE_NORMAL, NULL);
-  if (hFile == INVALID_HANDLE_VALUE) {
-    goto FAIL;
+  if (count > 0) {
+    memset(out, 0, count * sizeof(struct rtad_data));
   }
-  LARGE_INTEGER li = {.QuadPart = (LONGLONG)size};
-  if (SetFilePointerEx(hFile, li, NULL, FILE_BEGIN) == 0) {
-    goto FAIL;
+  if (rtad_file_validate(file) != 0) {
+    return -1;
+  }
+  struct rtad_get_piece *pieces = NULL;
+  size_t piece_count = 0, piece_capacity = 0;
+  struct rtad_get_range *ranges = NULL;
+  size_t range_count = 0;
+  struct rtad_io *ios = NULL;
+  struct rtad_ring *ring = NULL;
+  int result = -1;
+  for (size_t i = 0; i < count; i++) {
+    struct rtad_entry entry;
+    if (!names[i] || rtad_find(file, names[i], &entry) != 0 ||
+        entry.raw_size > SIZE_MAX) {
+      goto DONE;
+    }
+    // an empty entry gets a buffer to free too
+    out[i].data = (char *)mem_alloc((size_t)entry.raw_size);
+    out[i].size = (size_t)entry.raw_size;
+    if (!out[i].data || get_add_pieces(file, &entry, out[i].data, &pieces,
+                                       &piece_count, &piece_capacity) != 0) {
+      goto DONE;
+    }
+  }
+  ranges = (struct rtad_get_range *)mem_calloc(
+      piece_count, sizeof(struct rtad_get_range));
+  if (!ranges) {
+    goto DONE;
+  }
+  range_count = get_ranges(pieces, piece_count, ranges);
+  ios = (struct rtad_io *)mem_calloc(range_count, sizeof(struct rtad_io));
+  if (!ios) {
+    goto DONE;
+  }
+  for (size_t r = 0; r < range_count; r++) {
+    const struct rtad_get_range *range = &ranges[r];
+    if (range->size > SIZE_MAX) {
+      goto DONE;
+    }
+    ios[r].fd = file_fd(file);
+    ios[r].size = (size_t)range->size;
+    ios[r].offset = file->data_offset + (off_t)range->offset;
+    ios[r].buf = get_range_direct(range, pieces)
+                     ? pieces[range->first].dest
+                     : (char *)mem_alloc((size_t)range->size);
+    if (!ios[r].buf) {
+      goto DONE;
+    }
+  }
+  if (range_count >= GET_RING_MIN) {
+    ring = ring_open(IO_DEPTH, NULL, 0);
+  }
+  if (io_batch(ring, ios, range_count) != 0) {
+    goto DONE;
+  }
+  // scatter the staged ranges, decoding compressed chunks
+  for (size_t r = 0; r < range_count; r++) {
+    const struct rtad_get_range *range = &ranges[r];
+    if (get_range_direct(range, pieces)) {
+      continue;
+    }
+    for (size_t i = range->first; i < range->first + range->count; i++) {
+      const struct rtad_get_piece *piece = &pieces[i];
+      const char *stored = ios[r].buf + (piece->offset - range->offset);
+      if (piece->codec == RTAD_CODEC_NONE) {
+        if (piece->size != piece->raw_size) {
+          goto DONE;
+        }
+        memcpy(piece->dest, stored, piece->raw_size);
+      } else if (codec_decompress(piece->codec, stored, (size_t)piece->size,
+                                  piece->dest, piece->raw_size) != 0) {
+        goto DONE;
+      }
+    }
+  }
+  result = 0;
+DONE:
+  ring_close(ring);
+  for (size_t r = 0; ios && r < range_count; r++) {
+    if (!get_range_direct(&ranges[r], pieces)) {
+      mem_free(ios[r].buf);
+    }
+  }
+  mem_free(ios);
+  mem_free(ranges);
+  mem_free(pieces);
+  if (result != 0) {
+    for (size_t i = 0; i < count; i++) {
+      mem_free(out[i].data);
+      out[i].data = NULL;
+      out[i].size = 0;
+    }
+  }
+  return result;
+}
+
+int rtad_get_many(struct rtad_file *file, const char *const *names,
+                  size_t count, struct rtad_data *out) {
+  uint64_t start = PHASE_BEGIN(RTAD_PHASE_EXTRACT);
+  int result = get_many(file, names, count, out);
+  PHASE_END(RTAD_PHASE_EXTRACT, start);
+  return result;
+}
+
+RTAD_PRIVATE struct rtad_chunk *chunks_load(struct rtad_file *file,
+                                            uint64_t offset, uint64_t size,
+                                            struct rtad_chunk_hdr *hdr,
+                                            uint64_t **out_raw_offsets) {
+  *out_raw_offsets = NULL;
+  if (size < sizeof(*hdr)) {
+    return NULL;
   }
-  if (SetEndOfFile(hFile) == 0) {
+  off_t end = file->data_offset + (off_t)offset + (off_t)size;
+  if (file_read(file, hdr, sizeof(*hdr), end - (off_t)sizeof(*hdr)) != 0) {
+    return NULL;
+  }
+  int variable = (hdr->flags & RTAD_CHUNKS_VARIABLE) != 0;
+  uint64_t chunk_limit = (uint64_t)hdr->chunk_size *
+                         (variable ? RTAD_CDC_MAX_FACTOR : 1);
+  uint64_t table_size = (uint64_t)hdr->chunk_count * sizeof(struct rtad_chunk);
+  uint64_t sizes_size =
+      variable ? (uint64_t)hdr->chunk_count * sizeof(uint32_t) : 0;
+  if (rtad_codec_supported(hdr->codec) != 0 || hdr->chunk_size == 0 ||
+      (hdr->flags & ~(uint32_t)RTAD_CHUNKS_VARIABLE) != 0 ||
+      chunk_limit > UINT32_MAX ||
+      (variable ? hdr->chunk_count > hdr->raw_size
+                : hdr->chunk_count != hdr->raw_size / hdr->chunk_size +
+                                          (hdr->raw_size % hdr->chunk_size !=
+                                           0)) ||
+      table_size + sizes_size > size - sizeof(*hdr)) {
+    return NULL;
+  }
+  struct rtad_chunk *chunks =
+      (struct rtad_chunk *)mem_alloc((size_t)table_size);
+  uint32_t *raw_sizes = NULL;
+  uint64_t *raw_offsets = NULL;
+  if (!chunks) {
+    return NULL;
+  }
+  off_t table_offset =
+      end - (off_t)sizeof(*hdr) - (off_t)sizes_size - (off_t)table_size;
+  if (table_size > 0 &&
+      file_read(file, chunks, (size_t)table_size, table_offset) != 0) {
     goto FAIL;
   }
-  CloseHandle(hFile);
-  return 0;
-FAIL:
-  if (hFile != INVALID_HANDLE_VALUE) {
-    CloseHandle(hFile);
+  if (variable) {
+    raw_sizes = (uint32_t *)mem_alloc((size_t)sizes_size);
+    raw_offsets =
+        (uint64_t *)mem_alloc(((size_t)hdr->chunk_count + 1) *
+                                       sizeof(uint64_t));
+    if (!raw_sizes || !raw_offsets ||
+        (sizes_size > 0 &&
+         file_read(file, raw_sizes, (size_t)sizes_size,
+                   table_offset + (off_t)table_size) != 0)) {
+      goto FAIL;
+    }
+    raw_offsets[0] = 0;
+    for (uint32_t i = 0; i < hdr->chunk_count; i++) {
+      if (raw_sizes[i] == 0 || raw_sizes[i] > chunk_limit ||
+          raw_sizes[i] > hdr->raw_size - raw_offsets[i]) {
+        goto FAIL;
+      }
+      raw_offsets[i + 1] = raw_offsets[i] + raw_sizes[i];
+    }
+    if (raw_offsets[hdr->chunk_count] != hdr->raw_size) {
+      goto FAIL;
+    }
   }
-  return -1;
+  // chunks may be anywhere in the data area, not only in this window
+  uint64_t limit = (file->trailer.flags & RTAD_TRAILER_TOC)
+                       ? file->trailer.toc_offset
+                       : file->trailer.data_size;
+  size_t bound = codec_bound(hdr->codec, (size_t)chunk_limit);
+  for (uint32_t i = 0; i < hdr->chunk_count; i++) {
+    uint64_t raw_size =
+        variable ? raw_sizes[i]
+        : i + 1 < hdr->chunk_count
+            ? hdr->chunk_size
+            : hdr->raw_size - (uint64_t)i * hdr->chunk_size;
+    // without codec every chunk is stored
+    if (chunks[i].offset > limit || chunks[i].size > limit - chunks[i].offset ||
+        ((chunks[i].flags & RTAD_CHUNK_STORED) ? chunks[i].size != raw_size
+         : hdr->codec == RTAD_CODEC_NONE       ? 1
+                                               : chunks[i].size > bound)) {
+      goto FAIL;
+    }
+  }
+  mem_free(raw_sizes);
+  *out_raw_offsets = raw_offsets;
+  return chunks;
+FAIL:
+  mem_free(chunks);
+  mem_free(raw_sizes);
+  mem_free(raw_offsets);
+  return NULL;
 }
 
-// GCC or Clang on Windows
-#elif defined(__GNUC__) || defined(__clang__)
-RTAD_PRIVATE int file_truncate(const char *path, size_t size) {
-  if (!path || size == 0) {
-    return -1;
+static uint64_t reader_chunk_size(const struct rtad_reader *reader,
+                                  uint64_t index) {
+  const struct rtad_chunk_hdr *hdr = &reader->chunk_hdr;
+  if (reader->raw_offsets) {
+    return reader->raw_offsets[index + 1] - reader->raw_offsets[index];
+  }
+  if (index + 1 < hdr->chunk_count) {
+    return hdr->chunk_size;
   }
-  return truncate(path, (off_t)size);
+  return hdr->raw_size - index * hdr->chunk_size;
 }
 
-#else
-#error "Define failed: Unsupported Windows compiler"
+static uint64_t reader_chunk_start(const struct rtad_reader *reader,
+                                   uint64_t index) {
+  if (reader->raw_offsets) {
+    return reader->raw_offsets[index];
+  }
+  return index * reader->chunk_hdr.chunk_size;
+}
 
-#endif
+// the chunk with the raw offset, by binary search with variable chunks
+static uint64_t reader_chunk_index(const struct rtad_reader *reader,
+                                   uint64_t offset) {
+  if (!reader->raw_offsets) {
+    return offset / reader->chunk_hdr.chunk_size;
+  }
+  uint64_t low = 0;
+  uint64_t high = reader->chunk_hdr.chunk_count;
+  while (high - low > 1) {
+    uint64_t mid = low + (high - low) / 2;
+    if (reader->raw_offsets[mid] <= offset) {
+      low = mid;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
 
-#elif defined(__APPLE__)
-RTAD_PRIVATE int exe_path(char *buffer, size_t buf_size) {
-  if (!buffer || buf_size == 0)
-    return -1;
-  uint32_t size = (uint32_t)buf_size;
-  if (_NSGetExecutablePath(buffer, &size) != 0) {
-    // Buffer too small
-    if (buf_size > 0)
-      buffer[buf_size - 1] = '\0';
+// read stored bytes at offset of the payload, with rtad_reader_enable_verify
+// the blocks they touch are checked the first time
+static int reader_pread_stored(struct rtad_reader *reader, void *buf,
+                               size_t size, uint64_t offset) {
+  struct rtad_file *file = reader->file;
+  if (file_read(file, buf, size, file->data_offset + (off_t)offset) != 0) {
     return -1;
   }
+  if (!reader->leaves || size == 0) {
+    return 0;
+  }
+  uint64_t block_size = file->hash.block_size;
+  uint64_t last = (offset + size - 1) / block_size;
+  for (uint64_t i = offset / block_size; i <= last; i++) {
+    if (reader->verified[i / 8] & (1u << (i % 8))) {
+      continue;
+    }
+    uint64_t start = i * block_size;
+    uint64_t end = start + block_size < file->hash.covered_size
+                       ? start + block_size
+                       : file->hash.covered_size;
+    const char *block = reader->verify_buf;
+    if (start >= offset && end <= offset + size) {
+      // the whole block was just read
+      block = (const char *)buf + (start - offset);
+    } else if (file_read(file, reader->verify_buf, (size_t)(end - start),
+                         file->data_offset + (off_t)start) != 0) {
+      return -1;
+    }
+    if (hash_block_check(file, reader->leaves, i, block) != 0) {
+      return -1;
+    }
+    reader->verified[i / 8] |= (uint8_t)(1u << (i % 8));
+  }
   return 0;
 }
 
-RTAD_PRIVATE int file_truncate(const char *path, size_t size) {
-  if (!path || size == 0) {
+// decode a chunk into dest, room for its raw size; compressed chunks go
+// through the stored buffer, allocated on first use
+static int reader_decode_chunk(struct rtad_reader *reader, uint64_t index,
+                               char *dest) {
+  STAT_ADD(STAT_CHUNKS_DECODED, 1);
+  const struct rtad_chunk *chunk = &reader->chunks[index];
+  size_t raw_size = (size_t)reader_chunk_size(reader, index);
+  if (chunk->flags & RTAD_CHUNK_STORED) {
+    return reader_pread_stored(reader, dest, raw_size, chunk->offset);
+  }
+  if (!reader->stored_buf) {
+    const struct rtad_chunk_hdr *hdr = &reader->chunk_hdr;
+    size_t chunk_limit =
+        (size_t)hdr->chunk_size *
+        ((hdr->flags & RTAD_CHUNKS_VARIABLE) ? RTAD_CDC_MAX_FACTOR : 1);
+    reader->stored_buf =
+        (char *)mem_alloc(codec_bound(hdr->codec, chunk_limit));
+    if (!reader->stored_buf) {
+      return -1;
+    }
+  }
+  if (reader_pread_stored(reader, reader->stored_buf, chunk->size,
+                          chunk->offset) != 0 ||
+      codec_decompress(reader->chunk_hdr.codec, reader->stored_buf,
+                       chunk->size, dest, raw_size) != 0) {
     return -1;
   }
-  return truncate(path, (off_t)size);
+  return 0;
 }
 
-#elif defined(__linux__)
-RTAD_PRIVATE int exe_path(char *buffer, size_t buf_size) {
-  if (!buffer || buf_size == 0)
-    return -1;
-  ssize_t len = readlink("/proc/self/exe", buffer, buf_size);
-  if (len == -1) {
-    return -1;
-  } else if (len == buf_size) {
-    // Buffer too small
+// decode a chunk into the cache, unless it's already there
+static int reader_load_chunk(struct rtad_reader *reader, uint64_t index) {
+  if (reader->cached_chunk == index) {
+    STAT_ADD(STAT_CACHE_HITS, 1);
+    return 0;
+  }
+  STAT_ADD(STAT_CACHE_MISSES, 1);
+  reader->cached_chunk = UINT64_MAX;
+  if (!reader->chunk_cache) {
+    const struct rtad_chunk_hdr *hdr = &reader->chunk_hdr;
+    reader->chunk_cache = (char *)mem_alloc(
+        (size_t)hdr->chunk_size *
+        ((hdr->flags & RTAD_CHUNKS_VARIABLE) ? RTAD_CDC_MAX_FACTOR : 1));
+    if (!reader->chunk_cache) {
+      return -1;
+    }
+  }
+  if (reader_decode_chunk(reader, index, reader->chunk_cache) != 0) {
     return -1;
   }
-  buffer[len] = '\0';
+  reader->cached_chunk = index;
   return 0;
 }
 
-RTAD_PRIVATE int file_truncate(const char *path, size_t size) {
-  if (!path || size == 0) {
+// set up a reader in place, the buffers of chunked data are allocated on
+// first use
+static int reader_init(struct rtad_reader *reader, struct rtad_file *file,
+                       const struct rtad_entry *entry) {
+  memset(reader, 0, sizeof(*reader));
+  reader->cached_chunk = UINT64_MAX;
+  if (rtad_file_validate(file) != 0) {
     return -1;
   }
-  return truncate(path, (off_t)size);
+  uint64_t offset = 0;
+  uint64_t size = file->trailer.data_size;
+  int chunked = (file->trailer.flags & RTAD_TRAILER_CHUNKED) != 0;
+  if (entry) {
+    if (entry->offset > file->trailer.data_size ||
+        entry->size > file->trailer.data_size - entry->offset) {
+      return -1;
+    }
+    offset = entry->offset;
+    size = entry->size;
+    chunked = (entry->flags & RTAD_ENTRY_CHUNKED) != 0;
+  }
+  reader->file = file;
+  reader->offset = file->data_offset + (off_t)offset;
+  reader->size = size;
+  if (chunked) {
+    struct rtad_chunk_hdr *hdr = &reader->chunk_hdr;
+    reader->chunks = chunks_load(file, offset, size, hdr, &reader->raw_offsets);
+    if (!reader->chunks || (entry && entry->raw_size != hdr->raw_size)) {
+      return -1;
+    }
+    reader->size = hdr->raw_size;
+  }
+  return 0;
 }
 
-#else
-#error "Define failed: Unsupported platform"
+// free the buffers of a reader set up by reader_init
+static void reader_release(struct rtad_reader *reader) {
+  mem_free(reader->chunks);
+  mem_free(reader->raw_offsets);
+  mem_free(reader->chunk_cache);
+  mem_free(reader->stored_buf);
+  mem_free(reader->leaves);
+  mem_free(reader->verified);
+  mem_free(reader->verify_buf);
+}
 
-#endif
+// read size bytes from the start of the reader into the buffers, in order
+static int reader_scatter(struct rtad_reader *reader,
+                          const struct rtad_data *bufs, size_t buf_count,
+                          size_t size) {
+  uint64_t pos = 0;
+  for (size_t i = 0; i < buf_count && pos < size; i++) {
+    size_t n = bufs[i].size < size - pos ? bufs[i].size : size - pos;
+    size_t read_size = 0;
+    if ((!bufs[i].data && n > 0) ||
+        rtad_reader_pread(reader, bufs[i].data, n, pos, &read_size) != 0 ||
+        read_size != n) {
+      return -1;
+    }
+    pos += n;
+  }
+  return pos == size ? 0 : -1;
+}
 
-RTAD_PRIVATE ssize_t file_length(const char *path) {
-  if (!path) {
-    return -1;
+RTAD_PRIVATE int reader_read_all(struct rtad_file *file,
+                                 const struct rtad_entry *entry,
+                                 char **out_data, size_t *out_data_size) {
+  uint64_t start = PHASE_BEGIN(RTAD_PHASE_EXTRACT);
+  struct rtad_reader reader;
+  int result = -1;
+  // the data may not fit in memory on 32-bit platforms
+  if (reader_init(&reader, file, entry) != 0 || reader.size > SIZE_MAX) {
+    goto DONE;
   }
-  FILE *fp = fopen(path, "rb");
-  if (!fp) {
-    return -1;
+  // empty data gets a buffer to free too
+  struct rtad_data buf = {.data = (char *)mem_alloc((size_t)reader.size),
+                          .size = (size_t)reader.size};
+  if (!buf.data || reader_scatter(&reader, &buf, 1, buf.size) != 0) {
+    mem_free(buf.data);
+    goto DONE;
   }
-  if (fseeko(fp, 0, SEEK_END) != 0) {
-    fclose(fp);
+  *out_data = buf.data;
+  *out_data_size = buf.size;
+  result = 0;
+DONE:
+  reader_release(&reader);
+  PHASE_END(RTAD_PHASE_EXTRACT, start);
+  return result;
+}
+
+int rtad_extract_iov(struct rtad_file *file, const struct rtad_entry *entry,
+                     const struct rtad_data *bufs, size_t buf_count,
+                     size_t *out_data_size) {
+  if (!file || (!bufs && buf_count > 0) || !out_data_size) {
     return -1;
   }
-  off_t size = ftello(fp);
-  fclose(fp);
-  return size;
+  uint64_t start = PHASE_BEGIN(RTAD_PHASE_EXTRACT);
+  struct rtad_reader reader;
+  int result = -1;
+  if (reader_init(&reader, file, entry) != 0 || reader.size > SIZE_MAX) {
+    goto DONE;
+  }
+  *out_data_size = (size_t)reader.size;
+  size_t capacity = 0;
+  for (size_t i = 0; i < buf_count; i++) {
+    capacity += bufs[i].size < SIZE_MAX - capacity ? bufs[i].size
+                                                   : SIZE_MAX - capacity;
+  }
+  // too small, the caller learns the size it needs
+  if (capacity < reader.size) {
+    goto DONE;
+  }
+  result = reader_scatter(&reader, bufs, buf_count, (size_t)reader.size);
+DONE:
+  reader_release(&reader);
+  PHASE_END(RTAD_PHASE_EXTRACT, start);
+  return result;
 }
 
-RTAD_PRIVATE int file_copy(const char *src_path, const char *dest_path) {
-  if (!src_path || !dest_path) {
-    return -1;
+int rtad_extract_into(struct rtad_file *file, const struct rtad_entry *entry,
+                      char *buf, size_t capacity, size_t *out_data_size) {
+  struct rtad_data data = {.data = buf, .size = capacity};
+  return rtad_extract_iov(file, entry, &data, 1, out_data_size);
+}
+
+struct rtad_reader *rtad_reader_open(struct rtad_file *file,
+                                     const struct rtad_entry *entry) {
+  struct rtad_reader *reader =
+      (struct rtad_reader *)mem_alloc(sizeof(struct rtad_reader));
+  if (!reader) {
+    return NULL;
+  }
+  if (reader_init(reader, file, entry) != 0) {
+    rtad_reader_close(reader);
+    return NULL;
   }
-  FILE *src_fp = fopen(src_path, "rb");
-  if (!src_fp) {
+  return reader;
+}
+
+int rtad_reader_close(struct rtad_reader *reader) {
+  if (!reader) {
     return -1;
   }
-  FILE *dest_fp = fopen(dest_path, "wb");
-  if (!dest_fp) {
-    fclose(src_fp);
+  reader_release(reader);
+  mem_free(reader);
+  return 0;
+}
+
+static int reader_pread(struct rtad_reader *reader, void *buf, size_t size,
+                        uint64_t offset, size_t *out_read) {
+  if (!reader || (!buf && size > 0) || !out_read) {
     return -1;
   }
-  char copy_buf[BUFFER_SIZE];
-  size_t bytes;
-  while ((bytes = fread(copy_buf, 1, sizeof(copy_buf), src_fp)) > 0) {
-    fwrite(copy_buf, 1, bytes, dest_fp);
+  *out_read = 0;
+  if (offset >= reader->size || size == 0) {
+    return 0;
+  }
+  if (size > reader->size - offset) {
+    size = (size_t)(reader->size - offset);
+  }
+  if (!reader->chunks) {
+    uint64_t start = (uint64_t)(reader->offset - reader->file->data_offset);
+    if (reader_pread_stored(reader, buf, size, start + offset) != 0) {
+      return -1;
+    }
+    *out_read = size;
+    return 0;
+  }
+  // decode only the chunks covering the range, whole ones straight into buf
+  size_t done = 0;
+  while (done < size) {
+    uint64_t index = reader_chunk_index(reader, offset + done);
+    size_t within = (size_t)(offset + done - reader_chunk_start(reader, index));
+    size_t chunk_size = (size_t)reader_chunk_size(reader, index);
+    size_t n = chunk_size - within;
+    if (n > size - done) {
+      n = size - done;
+    }
+    if (n == chunk_size && reader->cached_chunk != index) {
+      if (reader_decode_chunk(reader, index, (char *)buf + done) != 0) {
+        return -1;
+      }
+    } else if (reader_load_chunk(reader, index) != 0) {
+      return -1;
+    } else {
+      memcpy((char *)buf + done, reader->chunk_cache + within, n);
+    }
+    done += n;
   }
-  fclose(src_fp);
-  fclose(dest_fp);
+  *out_read = size;
   return 0;
 }
 
-RTAD_PRIVATE int file_copy_self(const char *dest_path) {
-  if (!dest_path) {
+int rtad_reader_pread(struct rtad_reader *reader, void *buf, size_t size,
+                      uint64_t offset, size_t *out_read) {
+  uint64_t start = PHASE_BEGIN(RTAD_PHASE_EXTRACT);
+  int result = reader_pread(reader, buf, size, offset, out_read);
+  PHASE_END(RTAD_PHASE_EXTRACT, start);
+  return result;
+}
+
+int rtad_entry_fd(struct rtad_file *file, const struct rtad_entry *entry) {
+  if (!file) {
     return -1;
   }
-  char pathBuf[PATH_MAX];
-  if (exe_path(pathBuf, sizeof(pathBuf)) != 0) {
-    return -1;
+  uint64_t start = PHASE_BEGIN(RTAD_PHASE_EXTRACT);
+  struct rtad_reader reader;
+  char *buf = NULL;
+  int fd = -1;
+  if (reader_init(&reader, file, entry) != 0 ||
+      (fd = memfd_open("rtad")) < 0 ||
+      fd_truncate(fd, (off_t)reader.size) != 0) {
+    goto FAIL;
+  }
+  if (!reader.chunks) {
+    // stored as is, from file to file without going through user space
+    if (fd_copy_range(file_fd(file), reader.offset, fd, 0, (off_t)reader.size,
+                      COPY_RANGE | COPY_SENDFILE) != 0) {
+      goto FAIL;
+    }
+  } else if (reader.size > 0) {
+    // whole chunks are decoded straight into the buffer
+    buf = (char *)mem_alloc(COPY_BUFFER_SIZE);
+    if (!buf) {
+      goto FAIL;
+    }
+    for (uint64_t done = 0; done < reader.size;) {
+      size_t n = 0;
+      if (reader_pread(&reader, buf, COPY_BUFFER_SIZE, done, &n) != 0 ||
+          n == 0 || file_pwrite(fd, buf, n, (off_t)done) != 0) {
+        goto FAIL;
+      }
+      done += n;
+    }
+  }
+  // a copy with sendfile moves the position
+  if (memfd_seal(fd) != 0 || fd_seek(fd, 0) != 0) {
+    goto FAIL;
+  }
+  mem_free(buf);
+  reader_release(&reader);
+  PHASE_END(RTAD_PHASE_EXTRACT, start);
+  return fd;
+FAIL:
+  if (fd >= 0) {
+    file_close(fd);
   }
-  return file_copy(pathBuf, dest_path);
+  mem_free(buf);
+  reader_release(&reader);
+  PHASE_END(RTAD_PHASE_EXTRACT, start);
+  return -1;
 }
 
-RTAD_PRIVATE int file_append_data(const char *path, const char *data,
-                                  size_t data_size) {
-  if (!path || !data || data_size == 0) {
+int rtad_entry_sendfile(struct rtad_file *file, const struct rtad_entry *entry,
+                        int out_fd, uint64_t offset, uint64_t size,
+                        uint64_t *out_sent) {
+  if (!file || out_fd < 0 || !out_sent) {
     return -1;
   }
-  FILE *fp = fopen(path, "ab");
-  if (!fp) {
+  *out_sent = 0;
+  uint64_t start = PHASE_BEGIN(RTAD_PHASE_EXTRACT);
+  struct rtad_reader reader;
+  char *buf = NULL;
+  int result = -1;
+  int saved_errno;
+  if (reader_init(&reader, file, entry) != 0 || offset > reader.size) {
+    goto DONE;
+  }
+  if (size > reader.size - offset) {
+    size = reader.size - offset;
+  }
+  if (!reader.chunks) {
+    result = fd_send(file_fd(file), reader.offset + (off_t)offset, out_fd, size,
+                     out_sent);
+    goto DONE;
+  }
+  // decoded into a buffer, whole chunks in place
+  size_t buf_size = size > COPY_BUFFER_SIZE ? COPY_BUFFER_SIZE : (size_t)size;
+  buf = (char *)mem_alloc(buf_size);
+  if (!buf) {
+    goto DONE;
+  }
+  result = 0;
+  while (result == 0 && *out_sent < size) {
+    uint64_t left = size - *out_sent;
+    size_t n = 0;
+    if (reader_pread(&reader, buf, left < buf_size ? (size_t)left : buf_size,
+                     offset + *out_sent, &n) != 0 ||
+        n == 0 || fd_send_buf(out_fd, buf, n, out_sent) != 0) {
+      result = -1;
+    }
+  }
+DONE:
+  // the caller checks errno for EAGAIN
+  saved_errno = errno;
+  mem_free(buf);
+  reader_release(&reader);
+  PHASE_END(RTAD_PHASE_EXTRACT, start);
+  errno = saved_errno;
+  return result;
+}
+
+int rtad_reader_read(struct rtad_reader *reader, void *buf, size_t size,
+                     size_t *out_read) {
+  if (!reader) {
     return -1;
   }
-  size_t written = fwrite(data, 1, data_size, fp);
-  if (written != data_size) {
-    fclose(fp);
+  if (rtad_reader_pread(reader, buf, size, reader->pos, out_read) != 0) {
     return -1;
   }
-  fclose(fp);
+  reader->pos += *out_read;
   return 0;
 }
 
-int rtad_extract_hdr(const char *exe_path, struct rtad_hdr *header) {
-  if (!header || !exe_path) {
+int rtad_reader_seek(struct rtad_reader *reader, int64_t offset, int whence) {
+  if (!reader) {
     return -1;
   }
-  FILE *fp = fopen(exe_path, "rb");
-  if (!fp) {
+  int64_t base;
+  switch (whence) {
+  case SEEK_SET:
+    base = 0;
+    break;
+  case SEEK_CUR:
+    base = (int64_t)reader->pos;
+    break;
+  case SEEK_END:
+    base = (int64_t)reader->size;
+    break;
+  default:
     return -1;
   }
-  if (fseeko(fp, -((off_t)RTAD_HDR_SIZE), SEEK_END) != 0) {
-    fclose(fp);
+  // base is never negative, so -base can't overflow where -offset could
+  if ((offset < 0 && offset < -base) ||
+      (offset > 0 && offset > INT64_MAX - base)) {
     return -1;
   }
-  struct rtad_hdr temp_header;
-  // too small file to contain header
-  if (fread(&temp_header, 1, sizeof(temp_header), fp) != sizeof(temp_header)) {
-    fclose(fp);
+  // like lseek, seeking past the end is allowed and reads nothing
+  reader->pos = (uint64_t)(base + offset);
+  return 0;
+}
+
+uint64_t rtad_reader_tell(const struct rtad_reader *reader) {
+  return reader ? reader->pos : 0;
+}
+
+uint64_t rtad_reader_size(const struct rtad_reader *reader) {
+  return reader ? reader->size : 0;
+}
+
+#if defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__)
+// the functions of a stream of rtad_fopen, over a reader the stream owns
+static long stream_read(void *cookie, char *buf, size_t size) {
+  size_t read_size = 0;
+  if (rtad_reader_read((struct rtad_reader *)cookie, buf, size, &read_size) !=
+      0) {
+    errno = EIO;
     return -1;
   }
-  fclose(fp);
-  fp = NULL;
-  if (memcmp(temp_header.magic, RTAD_MAGIC, sizeof(temp_header.magic)) != 0) {
+  return (long)read_size;
+}
+
+static int stream_seek(void *cookie, int64_t *offset, int whence) {
+  struct rtad_reader *reader = (struct rtad_reader *)cookie;
+  if (rtad_reader_seek(reader, *offset, whence) != 0) {
+    errno = EINVAL;
     return -1;
   }
-  *header = temp_header;
+  *offset = (int64_t)reader->pos;
   return 0;
 }
 
-int rtad_validate_hdr(const char *exe_path) {
-  struct rtad_hdr header;
-  if (!exe_path) {
+static int stream_close(void *cookie) {
+  return rtad_reader_close((struct rtad_reader *)cookie);
+}
+
+#if defined(__linux__)
+static ssize_t cookie_read(void *cookie, char *buf, size_t size) {
+  return (ssize_t)stream_read(cookie, buf, size);
+}
+
+static int cookie_seek(void *cookie, off64_t *offset, int whence) {
+  int64_t pos = (int64_t)*offset;
+  if (stream_seek(cookie, &pos, whence) != 0) {
     return -1;
   }
-  return rtad_extract_hdr(exe_path, &header);
+  *offset = (off64_t)pos;
+  return 0;
+}
+#else
+static int funopen_read(void *cookie, char *buf, int size) {
+  return (int)stream_read(cookie, buf, size > 0 ? (size_t)size : 0);
 }
 
-int rtad_truncate_data(const char *exe_path) {
-  struct rtad_hdr header;
-  if (!exe_path) {
-    return -1;
+static fpos_t funopen_seek(void *cookie, fpos_t offset, int whence) {
+  int64_t pos = (int64_t)offset;
+  return stream_seek(cookie, &pos, whence) == 0 ? (fpos_t)pos : -1;
+}
+#endif
+
+FILE *rtad_fopen(struct rtad_file *file, const struct rtad_entry *entry,
+                 const char *mode) {
+  if (!mode || (strcmp(mode, "r") != 0 && strcmp(mode, "rb") != 0)) {
+    return NULL;
+  }
+  struct rtad_reader *reader = rtad_reader_open(file, entry);
+  if (!reader) {
+    return NULL;
+  }
+#if defined(__linux__)
+  cookie_io_functions_t io = {
+      .read = cookie_read, .write = NULL, .seek = cookie_seek,
+      .close = stream_close};
+  FILE *fp = fopencookie(reader, "r", io);
+#else
+  FILE *fp = funopen(reader, funopen_read, NULL, funopen_seek, stream_close);
+#endif
+  if (!fp) {
+    rtad_reader_close(reader);
   }
+  return fp;
+}
 
-  ssize_t file_size = file_length(exe_path);
-  if (file_size < 0) {
-    // could not get file size
-    // or file does not exist
+#else
+FILE *rtad_fopen(struct rtad_file *file, const struct rtad_entry *entry,
+                 const char *mode) {
+  // no custom streams in the Windows CRT
+  (void)file;
+  (void)entry;
+  (void)mode;
+  return NULL;
+}
+#endif
+
+int rtad_reader_enable_verify(struct rtad_reader *reader) {
+  if (!reader) {
     return -1;
   }
-  if (rtad_extract_hdr(exe_path, &header) != 0) {
-    // no valid header, nothing to truncate
+  if (reader->leaves) {
     return 0;
   }
-
-  size_t new_size =
-      (size_t)file_size - (header.data_size + sizeof(struct rtad_hdr));
-  if (file_truncate(exe_path, new_size) != 0) {
+  const struct rtad_hash_hdr *hash = &reader->file->hash;
+  uint8_t *leaves = hash_leaves_load(reader->file);
+  if (!leaves) {
     return -1;
   }
+  reader->verified = (uint8_t *)mem_calloc(hash->block_count / 8 + 1, 1);
+  reader->verify_buf = (char *)mem_alloc(hash->block_size);
+  if (!reader->verified || !reader->verify_buf) {
+    mem_free(leaves);
+    mem_free(reader->verified);
+    mem_free(reader->verify_buf);
+    reader->verified = NULL;
+    reader->verify_buf = NULL;
+    return -1;
+  }
+  // a chunk decoded before is not checked again
+  reader->cached_chunk = UINT64_MAX;
+  reader->leaves = leaves;
   return 0;
 }
 
-int rtad_append_packed_data(const char *dest_path, const char *append_data,
-                            size_t append_data_size) {
-  if (append_data_size > UINT32_MAX || !dest_path || !append_data ||
-      append_data_size == 0) {
-    return -1;
+RTAD_PRIVATE uint8_t *hash_leaves_load(struct rtad_file *file) {
+  const struct rtad_hash_hdr *hash = &file->hash;
+  if (hash->block_count == 0 ||
+      (uint64_t)hash->block_count * RTAD_HASH_SIZE > SIZE_MAX) {
+    return NULL;
+  }
+  size_t size = (size_t)hash->block_count * RTAD_HASH_SIZE;
+  uint8_t *leaves = (uint8_t *)mem_alloc(size);
+  if (!leaves) {
+    return NULL;
+  }
+  if (file_read(file, leaves, size,
+                file->data_offset + (off_t)hash->covered_size) != 0) {
+    goto FAIL;
   }
-  if (file_append_data(dest_path, append_data, append_data_size) != 0) {
+  // a single leaf is checked with its block, hashed as the root
+  if (hash->block_count > 1) {
+    uint8_t root[RTAD_HASH_SIZE];
+    hash_leaves(leaves, hash->block_count, root);
+    if (memcmp(root, hash->root, RTAD_HASH_SIZE) != 0) {
+      goto FAIL;
+    }
+  }
+  return leaves;
+FAIL:
+  mem_free(leaves);
+  return NULL;
+}
+
+RTAD_PRIVATE int hash_block_check(const struct rtad_file *file,
+                                  const uint8_t *leaves, uint64_t index,
+                                  const char *data) {
+  const struct rtad_hash_hdr *hash = &file->hash;
+  uint64_t start = index * hash->block_size;
+  size_t size = (size_t)(hash->covered_size - start < hash->block_size
+                             ? hash->covered_size - start
+                             : hash->block_size);
+  uint8_t out[RTAD_HASH_SIZE];
+  if (hash->block_count == 1) {
+    hash_tree(data, size, 0, 1, out);
+    return memcmp(out, hash->root, RTAD_HASH_SIZE) == 0 ? 0 : -1;
+  }
+  hash_tree(data, size, start / BLAKE3_CHUNK_LEN, 0, out);
+  return memcmp(out, leaves + index * RTAD_HASH_SIZE, RTAD_HASH_SIZE) == 0
+             ? 0
+             : -1;
+}
+
+// every step-th block from first, on one thread of rtad_verify_full
+struct verify_job {
+  struct rtad_file *file;
+  const uint8_t *leaves;
+  uint64_t first;
+  uint64_t step;
+  int failed;
+};
+
+static void verify_work(void *arg) {
+  struct verify_job *job = (struct verify_job *)arg;
+  const struct rtad_hash_hdr *hash = &job->file->hash;
+  char *buf = (char *)mem_alloc(hash->block_size);
+  if (!buf) {
+    job->failed = 1;
+    return;
+  }
+  for (uint64_t i = job->first; i < hash->block_count && !job->failed;
+       i += job->step) {
+    uint64_t start = i * hash->block_size;
+    size_t size = (size_t)(hash->covered_size - start < hash->block_size
+                               ? hash->covered_size - start
+                               : hash->block_size);
+    if (file_read(job->file, buf, size,
+                  job->file->data_offset + (off_t)start) != 0 ||
+        hash_block_check(job->file, job->leaves, i, buf) != 0) {
+      job->failed = 1;
+    }
+  }
+  mem_free(buf);
+}
+
+static int verify_full(struct rtad_file *file, unsigned threads) {
+  if (rtad_file_validate(file) != 0) {
     return -1;
   }
-  struct rtad_hdr header = {.data_size = (uint32_t)append_data_size};
-  memcpy(header.magic, RTAD_MAGIC, sizeof(header.magic));
-  if (file_append_data(dest_path, (const char *)&header, sizeof(header)) != 0) {
+  uint8_t *leaves = hash_leaves_load(file);
+  if (!leaves) {
     return -1;
   }
+  if (threads == 0) {
+    threads = cpu_count();
+  }
+  if (threads > file->hash.block_count) {
+    threads = file->hash.block_count;
+  }
+  struct verify_job *jobs =
+      (struct verify_job *)mem_calloc(threads, sizeof(struct verify_job));
+  rtad_thread_t *handles =
+      (rtad_thread_t *)mem_calloc(threads, sizeof(rtad_thread_t));
+  int *started = (int *)mem_calloc(threads, sizeof(int));
+  int result = -1;
+  if (!jobs || !handles || !started) {
+    goto DONE;
+  }
+  for (unsigned i = 0; i < threads; i++) {
+    jobs[i].file = file;
+    jobs[i].leaves = leaves;
+    jobs[i].first = i;
+    jobs[i].step = threads;
+  }
+  // the first job runs here, a job without thread too
+  for (unsigned i = 1; i < threads; i++) {
+    started[i] = thread_create(&handles[i], verify_work, &jobs[i]) == 0;
+  }
+  for (unsigned i = 0; i < threads; i++) {
+    if (!started[i]) {
+      verify_work(&jobs[i]);
+    }
+  }
+  result = 0;
+  for (unsigned i = 0; i < threads; i++) {
+    if (started[i]) {
+      thread_join(handles[i]);
+    }
+    if (jobs[i].failed) {
+      result = -1;
+    }
+  }
+DONE:
+  mem_free(started);
+  mem_free(handles);
+  mem_free(jobs);
+  mem_free(leaves);
+  return result;
+}
+
+int rtad_verify_full(struct rtad_file *file, unsigned threads) {
+  uint64_t start = PHASE_BEGIN(RTAD_PHASE_VERIFY);
+  int result = verify_full(file, threads);
+  PHASE_END(RTAD_PHASE_VERIFY, start);
+  return result;
+}
+
+static int extent_compare(const void *a, const void *b) {
+  const struct rtad_extent *x = (const struct rtad_extent *)a;
+  const struct rtad_extent *y = (const struct rtad_extent *)b;
+  if (x->offset != y->offset) {
+    return x->offset < y->offset ? -1 : 1;
+  }
+  return (x->size > y->size) - (x->size < y->size);
+}
 
+static int live_add_extent(struct rtad_live *live, uint64_t offset,
+                           uint64_t size, int index, uint32_t align) {
+  if (live->extent_count == live->extent_capacity) {
+    size_t capacity = live->extent_capacity ? live->extent_capacity * 2 : 64;
+    struct rtad_extent *extents = (struct rtad_extent *)realloc(
+        live->extents, capacity * sizeof(struct rtad_extent));
+    if (!extents) {
+      return -1;
+    }
+    live->extents = extents;
+    live->extent_capacity = capacity;
+  }
+  struct rtad_extent *extent = &live->extents[live->extent_count++];
+  extent->offset = offset;
+  extent->size = size;
+  extent->new_offset = 0;
+  extent->index = index;
+  extent->align = align;
   return 0;
 }
 
-int rtad_copy_self_with_data(const char *dest_path, const char *append_data,
-                             size_t append_data_size) {
-  if (!dest_path || !append_data || append_data_size == 0) {
+static int live_alloc(struct rtad_live *live, size_t count) {
+  memset(live, 0, sizeof(*live));
+  size_t alloc_count = count > 0 ? count : 1;
+  live->items = (struct rtad_toc_item *)calloc(alloc_count,
+                                               sizeof(struct rtad_toc_item));
+  live->chunk_hdrs = (struct rtad_chunk_hdr *)calloc(
+      alloc_count, sizeof(struct rtad_chunk_hdr));
+  live->chunks =
+      (struct rtad_chunk **)calloc(alloc_count, sizeof(struct rtad_chunk *));
+  live->raw_offsets = (uint64_t **)calloc(alloc_count, sizeof(uint64_t *));
+  return live->items && live->chunk_hdrs && live->chunks && live->raw_offsets
+             ? 0
+             : -1;
+}
+
+// add an entry of the TOC of file, with the extents it points at
+static int live_add(struct rtad_file *file, struct rtad_live *live,
+                    const struct rtad_toc_entry *record, const char *name,
+                    size_t name_size, int with_extents) {
+  if (record->offset > file->trailer.toc_offset ||
+      record->size > file->trailer.toc_offset - record->offset) {
     return -1;
   }
-  if (file_copy_self(dest_path) != 0) {
+  size_t i = live->item_count;
+  struct rtad_toc_item *item = &live->items[i];
+  char *name_copy = (char *)malloc(name_size + 1);
+  if (!name_copy) {
     return -1;
   }
-  // try to validate and truncate
-  if (rtad_truncate_data(dest_path) != 0) {
+  memcpy(name_copy, name, name_size);
+  name_copy[name_size] = '\0';
+  item->name = name_copy;
+  item->record = *record;
+  live->item_count++;
+  if (!with_extents) {
+    return 0;
+  }
+  if (!(record->flags & RTAD_ENTRY_CHUNKED)) {
+    return record->size > 0
+               ? live_add_extent(live, record->offset, record->size, 0,
+                                 record->align)
+               : 0;
+  }
+  struct rtad_chunk_hdr *hdr = &live->chunk_hdrs[i];
+  live->chunks[i] = chunks_load(file, record->offset, record->size, hdr,
+                                &live->raw_offsets[i]);
+  if (!live->chunks[i] || hdr->raw_size != record->raw_size) {
     return -1;
   }
-  if (rtad_append_packed_data(dest_path, append_data, append_data_size) != 0) {
+  for (uint32_t j = 0; j < hdr->chunk_count; j++) {
+    const struct rtad_chunk *chunk = &live->chunks[i][j];
+    if (live_add_extent(live, chunk->offset, chunk->size, 0, 0) != 0) {
+      return -1;
+    }
+  }
+  // the index ends the entry, chunks_load checked it fits
+  uint64_t index_size =
+      (uint64_t)hdr->chunk_count *
+          (sizeof(struct rtad_chunk) +
+           ((hdr->flags & RTAD_CHUNKS_VARIABLE) ? sizeof(uint32_t) : 0)) +
+      sizeof(*hdr);
+  return live_add_extent(live, record->offset + record->size - index_size,
+                         index_size, 1, 0);
+}
+
+static void live_sort(struct rtad_live *live) {
+  if (live->extent_count > 0) {
+    qsort(live->extents, live->extent_count, sizeof(struct rtad_extent),
+          extent_compare);
+  }
+}
+
+RTAD_PRIVATE int live_load(struct rtad_file *file, struct rtad_live *live,
+                           int with_extents) {
+  if (live_alloc(live, file->toc.entry_count) != 0 || !file->toc_data) {
     return -1;
   }
+  for (uint32_t i = 0; i < file->toc.entry_count; i++) {
+    struct rtad_toc_entry record;
+    const char *name = NULL;
+    if (toc_record_get(file, i, &record, &name) != 0 ||
+        live_add(file, live, &record, name, record.name_size, with_extents) !=
+            0) {
+      return -1;
+    }
+  }
+  live_sort(live);
   return 0;
 }
 
-int rtad_extract_data(const char *exe_path, char **out_data,
-                      size_t *out_data_size) {
-  if (!exe_path || !out_data || !out_data_size) {
+RTAD_PRIVATE int live_select(struct rtad_file *file, struct rtad_live *live,
+                             const char *const *names, size_t count) {
+  if (live_alloc(live, count) != 0) {
     return -1;
   }
-  struct rtad_hdr header;
-  if (rtad_extract_hdr(exe_path, &header) != 0) {
-    return -1;
+  for (size_t i = 0; i < count; i++) {
+    struct rtad_entry entry;
+    if (!names[i] || rtad_find(file, names[i], &entry) != 0) {
+      return -1;
+    }
+    struct rtad_toc_entry record;
+    memset(&record, 0, sizeof(record));
+    record.offset = entry.offset;
+    record.size = entry.size;
+    record.flags = entry.flags;
+    record.align = entry.align;
+    record.raw_size = entry.raw_size;
+    if (live_add(file, live, &record, names[i], strlen(names[i]), 1) != 0) {
+      return -1;
+    }
   }
-  FILE *fp = fopen(exe_path, "rb");
-  if (!fp) {
-    return -1;
+  live_sort(live);
+  return 0;
+}
+
+RTAD_PRIVATE void live_free(struct rtad_live *live) {
+  // the items may have been handed over to a writer
+  for (size_t i = 0; i < live->item_count; i++) {
+    if (live->items) {
+      free((char *)live->items[i].name);
+    }
+    mem_free(live->chunks[i]);
+    mem_free(live->raw_offsets[i]);
   }
-  if (fseeko(fp, -((off_t)(header.data_size + sizeof(struct rtad_hdr))),
-             SEEK_END) != 0) {
-    fclose(fp);
+  free(live->items);
+  free(live->chunk_hdrs);
+  free(live->chunks);
+  free(live->raw_offsets);
+  free(live->extents);
+  memset(live, 0, sizeof(*live));
+}
+
+int rtad_file_dead_size(struct rtad_file *file, uint64_t *out_size) {
+  if (!file || !out_size || rtad_file_validate(file) != 0) {
     return -1;
   }
-  char *data_buf = (char *)malloc(header.data_size);
-  if (!data_buf) {
-    fclose(fp);
-    return -1;
+  *out_size = 0;
+  if (!(file->trailer.flags & RTAD_TRAILER_TOC)) {
+    return 0;
   }
-  if (fread(data_buf, 1, header.data_size, fp) != header.data_size) {
-    free(data_buf);
-    fclose(fp);
+  struct rtad_live live;
+  if (live_load(file, &live, 1) != 0) {
+    live_free(&live);
     return -1;
   }
-  fclose(fp);
-  *out_data = data_buf;
-  if (out_data_size) {
-    *out_data_size = header.data_size;
+  // the bytes rtad_file_compact keeps: the chunk indexes, shared ones once,
+  // and the spans packed as it does, with the padding of the aligned ones
+  uint64_t used = file->trailer.toc_size;
+  uint64_t end = 0;
+  for (size_t i = 0; i < live.extent_count; i++) {
+    const struct rtad_extent *extent = &live.extents[i];
+    uint64_t start = extent->offset > end ? extent->offset : end;
+    if (extent->index && extent->offset + extent->size > start) {
+      used += extent->offset + extent->size - start;
+      end = extent->offset + extent->size;
+    }
   }
+  size_t span_count = live_spans(&live, 0, file->data_offset);
+  if (span_count > 0) {
+    used += live.extents[span_count - 1].new_offset +
+            live.extents[span_count - 1].size;
+  }
+  live_free(&live);
+  *out_size = file->trailer.data_size > used ? file->trailer.data_size - used
+                                             : 0;
   return 0;
 }
 
-int rtad_free_extracted_data(char *data) {
-  if (!data) {
-    return -1;
+RTAD_PRIVATE size_t live_spans(struct rtad_live *live, uint64_t start,
+                               off_t base) {
+  // in place, a span is never ahead of the extents left to merge
+  struct rtad_extent *spans = live->extents;
+  size_t span_count = 0;
+  for (size_t i = 0; i < live->extent_count; i++) {
+    struct rtad_extent extent = live->extents[i];
+    if (extent.index) {
+      continue;
+    }
+    struct rtad_extent *last = span_count > 0 ? &spans[span_count - 1] : NULL;
+    // an aligned extent right after the last span is moved on its own
+    if (last && (extent.offset < last->offset + last->size ||
+                 (extent.offset == last->offset + last->size &&
+                  !extent.align))) {
+      if (extent.offset + extent.size > last->offset + last->size) {
+        last->size = extent.offset + extent.size - last->offset;
+      }
+    } else {
+      spans[span_count++] = extent;
+    }
   }
-  free(data);
-  return 0;
+  live->extent_count = span_count;
+  for (size_t i = 0; i < span_count; i++) {
+    start += align_gap(base, start, spans[i].align);
+    spans[i].new_offset = start;
+    start += spans[i].size;
+  }
+  return span_count;
 }
 
-int rtad_extract_self_data(char **out_data, size_t *out_data_size) {
-  if (!out_data || !out_data_size) {
-    return -1;
+// the offset of stored bytes once their span is moved
+static uint64_t spans_remap(const struct rtad_extent *spans, size_t count,
+                            uint64_t offset) {
+  if (count == 0 || offset < spans[0].offset) {
+    return 0;
   }
-  char pathBuf[PATH_MAX];
-  if (exe_path(pathBuf, sizeof(pathBuf)) != 0) {
+  size_t low = 0;
+  size_t high = count;
+  while (high - low > 1) {
+    size_t mid = low + (high - low) / 2;
+    if (spans[mid].offset <= offset) {
+      low = mid;
+    } else {
+      high = mid;
+    }
+  }
+  return spans[low].new_offset + (offset - spans[low].offset);
+}
+
+// write the chunk index of a live item with the offsets of the moved chunks
+static int live_put_index(struct rtad_writer *writer, struct rtad_live *live,
+                          size_t index) {
+  struct rtad_chunk_hdr *hdr = &live->chunk_hdrs[index];
+  struct rtad_chunk *chunks = live->chunks[index];
+  uint32_t *raw_sizes = NULL;
+  if (hdr->flags & RTAD_CHUNKS_VARIABLE) {
+    raw_sizes = (uint32_t *)malloc(
+        hdr->chunk_count > 0 ? hdr->chunk_count * sizeof(uint32_t) : 1);
+    if (!raw_sizes) {
+      return -1;
+    }
+    for (uint32_t j = 0; j < hdr->chunk_count; j++) {
+      raw_sizes[j] = (uint32_t)(live->raw_offsets[index][j + 1] -
+                                live->raw_offsets[index][j]);
+    }
+  }
+  for (uint32_t j = 0; j < hdr->chunk_count; j++) {
+    chunks[j].offset =
+        spans_remap(live->extents, live->extent_count, chunks[j].offset);
+  }
+  struct rtad_iovec iov[3] = {
+      {.data = chunks, .size = hdr->chunk_count * sizeof(struct rtad_chunk)},
+      {.data = raw_sizes,
+       .size = raw_sizes ? hdr->chunk_count * sizeof(uint32_t) : 0},
+      {.data = hdr, .size = sizeof(*hdr)},
+  };
+  struct rtad_toc_entry *record = &live->items[index].record;
+  record->offset = writer->data_size;
+  int result = writer_emit(writer, iov, 3);
+  record->size = writer->data_size - record->offset;
+  free(raw_sizes);
+  return result;
+}
+
+RTAD_PRIVATE int live_put_records(struct rtad_writer *writer,
+                                  struct rtad_live *live) {
+  struct rtad_extent *order = (struct rtad_extent *)malloc(
+      (live->item_count > 0 ? live->item_count : 1) *
+      sizeof(struct rtad_extent));
+  if (!order) {
     return -1;
   }
-  return rtad_extract_data(pathBuf, out_data, out_data_size);
+  // chunked items sharing an index keep sharing the new one
+  size_t order_count = 0;
+  for (size_t i = 0; i < live->item_count; i++) {
+    struct rtad_toc_entry *record = &live->items[i].record;
+    if (record->flags & RTAD_ENTRY_CHUNKED) {
+      order[order_count].offset = record->offset;
+      order[order_count].size = record->size;
+      order[order_count].new_offset = i;
+      order_count++;
+    } else {
+      record->offset =
+          record->size > 0
+              ? spans_remap(live->extents, live->extent_count, record->offset)
+              : 0;
+      // merged into the middle of a span, it's no longer aligned
+      if (align_gap(writer->file->data_offset, record->offset,
+                    record->align) != 0) {
+        record->align = 0;
+      }
+    }
+  }
+  if (order_count > 0) {
+    qsort(order, order_count, sizeof(struct rtad_extent), extent_compare);
+  }
+  int result = 0;
+  for (size_t i = 0; i < order_count && result == 0; i++) {
+    size_t index = (size_t)order[i].new_offset;
+    if (i > 0 && extent_compare(&order[i - 1], &order[i]) == 0) {
+      const struct rtad_toc_entry *shared =
+          &live->items[(size_t)order[i - 1].new_offset].record;
+      live->items[index].record.offset = shared->offset;
+      live->items[index].record.size = shared->size;
+    } else {
+      result = live_put_index(writer, live, index);
+    }
+  }
+  free(order);
+  return result;
 }
 
-int rtad_validate_self_hdr() {
-  char pathBuf[PATH_MAX];
-  if (exe_path(pathBuf, sizeof(pathBuf)) != 0) {
+static int file_compact(struct rtad_file *file) {
+  if (!file || !file->writable || rtad_file_validate(file) != 0) {
+    return -1;
+  }
+  if (!(file->trailer.flags & RTAD_TRAILER_TOC)) {
+    // a single payload has no dead bytes
+    return 0;
+  }
+  struct rtad_live live;
+  if (live_load(file, &live, 1) != 0) {
+    live_free(&live);
+    return -1;
+  }
+  // spans packed from the payload start, in order, so a span is never
+  // written over bytes not read yet; the payload doesn't move, so an aligned
+  // span never moves past where it was
+  live_spans(&live, 0, file->data_offset);
+  struct rtad_writer *writer = writer_alloc(file, 0);
+  if (!writer) {
+    live_free(&live);
     return -1;
   }
-  return rtad_validate_hdr(pathBuf);
+  // the payload is rewritten in place, it's dropped if that fails
+  writer->base_size = file->data_offset;
+  int result = -1;
+  char *buf = (char *)malloc(COPY_BUFFER_SIZE);
+  if (!buf || fd_seek(file->fd, file->data_offset) != 0) {
+    goto DONE;
+  }
+  for (size_t i = 0; i < live.extent_count; i++) {
+    const struct rtad_extent *span = &live.extents[i];
+    if (span->new_offset > span->offset ||
+        writer_pad(writer, span->new_offset - writer->data_size) != 0) {
+      goto DONE;
+    }
+    for (uint64_t done = 0; done < span->size;) {
+      struct rtad_iovec iov = {.data = buf,
+                               .size = span->size - done < COPY_BUFFER_SIZE
+                                           ? (size_t)(span->size - done)
+                                           : COPY_BUFFER_SIZE};
+      if (file_pread(file->fd, buf, iov.size,
+                     file->data_offset + (off_t)(span->offset + done)) != 0 ||
+          writer_emit(writer, &iov, 1) != 0) {
+        goto DONE;
+      }
+      done += iov.size;
+    }
+  }
+  if (live_put_records(writer, &live) != 0) {
+    goto DONE;
+  }
+  writer->items = live.items;
+  writer->item_count = live.item_count;
+  writer->item_capacity = live.item_count;
+  writer->mode = RTAD_WRITER_ENTRIES;
+  live.items = NULL;
+  if (writer_put_tail(writer) == 0 &&
+      fd_truncate(file->fd, writer->base_size + (off_t)writer->data_size) ==
+          0) {
+    result = 0;
+  }
+DONE:
+  free(buf);
+  live_free(&live);
+  return writer_release(writer, result);
 }
 
-int rtad_truncate_self_data(const char *new_path) {
-  char pathBuf[PATH_MAX];
-  if (exe_path(pathBuf, sizeof(pathBuf)) != 0) {
+int rtad_file_compact(struct rtad_file *file) {
+  uint64_t start = PHASE_BEGIN(RTAD_PHASE_COMPACT);
+  int result = file_compact(file);
+  PHASE_END(RTAD_PHASE_COMPACT, start);
+  return result;
+}
+
+int rtad_compact(const char *exe_path) {
+  if (!exe_path) {
     return -1;
   }
-  if (file_copy_self(new_path) != 0) {
+  struct rtad_file *file = rtad_open_rw(exe_path);
+  if (!file) {
     return -1;
   }
-  return rtad_truncate_data(new_path);
-}
\ No newline at end of file
+  int result = rtad_file_compact(file);
+  if (rtad_close(file) != 0) {
+    result = -1;
+  }
+  return result;
+}
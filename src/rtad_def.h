@@ -1,26 +1,89 @@
 #ifndef __RTAD_PRIVATE_H__
 #define __RTAD_PRIVATE_H__
 
-#define BUFFER_SIZE 4096
+// 64-bit off_t on 32-bit POSIX platforms, payloads may exceed 4GiB
+#if !defined(_WIN32) && !defined(_FILE_OFFSET_BITS)
+#define _FILE_OFFSET_BITS 64
+#endif
+// fopencookie and the memfd seals are GNU extensions
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#define COPY_BUFFER_SIZE (1024 * 1024)
+#define WRITE_BUFFER_SIZE (64 * 1024)
+// bytes read from the end of the file at open, the trailer and a TOC of a
+// few hundred entries are found with a single read
+#define TAIL_READ_SIZE (64 * 1024)
+
+// copy_file_range and sendfile are called for at most this many bytes
+#define COPY_CHUNK_SIZE (1 << 30)
 
 // platform-specific includes
 #if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
 #include <windows.h>
 
 #elif defined(__APPLE__)
+#include <fcntl.h>
 #include <mach-o/dyld.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #elif defined(__linux__)
+#include <elf.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <linux/memfd.h>
+#if defined(RTAD_HAVE_IO_URING)
+#include <linux/io_uring.h>
+#endif
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #endif
 
+// memfd seals, older C libraries don't define them
+#if defined(__linux__) && !defined(F_ADD_SEALS)
+#define F_ADD_SEALS 1033
+#define F_GET_SEALS 1034
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#define F_SEAL_WRITE 0x0008
+#endif
+
+// io_uring is called through raw system calls, liburing is not needed
+#if defined(RTAD_HAVE_IO_URING) &&                                             \
+    (!defined(__linux__) || !defined(__NR_io_uring_setup))
+#undef RTAD_HAVE_IO_URING
+#endif
+
+#include "rtad.h"
+
+#if defined(RTAD_HAVE_ZLIB)
+#include <zlib.h>
+#endif
+
+#include <errno.h>
 #include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 // Cross-platform compatibility macros
 #if defined(_MSC_VER)
@@ -54,33 +117,428 @@
 #define RTAD_PRIVATE static
 #endif
 
+#if defined(_WIN32)
+typedef INIT_ONCE rtad_once_t;
+#define RTAD_ONCE_INIT INIT_ONCE_STATIC_INIT
+typedef HANDLE rtad_thread_t;
+typedef SRWLOCK rtad_mutex_t;
+typedef CONDITION_VARIABLE rtad_cond_t;
+typedef DWORD rtad_key_t;
+#else
+typedef pthread_once_t rtad_once_t;
+#define RTAD_ONCE_INIT PTHREAD_ONCE_INIT
+typedef pthread_t rtad_thread_t;
+typedef pthread_mutex_t rtad_mutex_t;
+typedef pthread_cond_t rtad_cond_t;
+typedef pthread_key_t rtad_key_t;
+#endif
+
+#if defined(_MSC_VER)
+#define RTAD_THREAD_LOCAL __declspec(thread)
+#else
+#define RTAD_THREAD_LOCAL __thread
+#endif
+
 // platform-specific implementations
+#if !defined(__linux__)
 /**
  * @brief Get the executable path, if the the return value is not 0,
  * the buffer maybe not ended with '\0', so don't use the buffer if error
- * happens.
+ * happens. Linux opens /proc/self/exe instead.
  *
  * @param buffer
  * @param buf_size
  * @return 0 if success, -1 on error
  */
 RTAD_PRIVATE int exe_path(char *buffer, size_t buf_size);
+#endif
+/**
+ * @brief Open the running executable for reading. On Linux it's opened through
+ * /proc/self/exe, so it's still the running binary if the path was replaced.
+ *
+ * @return file descriptor, -1 on error
+ */
+RTAD_PRIVATE int exe_open(void);
+/**
+ * @brief Get the alignment required for the file offset of a mapping,
+ * page size on POSIX, allocation granularity on Windows.
+ *
+ * @return size_t
+ */
+RTAD_PRIVATE size_t map_granularity(void);
+/**
+ * @brief Map [offset, offset + size) of an opened file as read-only,
+ * demand-paged memory. The offset doesn't need to be aligned, the mapping
+ * starts at the granularity boundary below it, and it stays valid after the
+ * descriptor is closed.
+ *
+ * @param fd
+ * @param offset
+ * @param size
+ * @return pointer to the byte at offset, NULL on error
+ */
+RTAD_PRIVATE const char *fd_map(int fd, off_t offset, size_t size);
+/**
+ * @brief Unmap memory returned by fd_map.
+ *
+ * @param addr the pointer returned by fd_map
+ * @param size the size passed to fd_map
+ * @return 0 if success, -1 on error
+ */
+RTAD_PRIVATE int file_unmap(const char *addr, size_t size);
+/**
+ * @brief Open a regular file for reading.
+ *
+ * @param path
+ * @return file descriptor, -1 on error
+ */
+RTAD_PRIVATE int file_open(const char *path);
+/**
+ * @brief Close a file descriptor returned by file_open.
+ *
+ * @param fd
+ * @return 0 if success, -1 on error
+ */
+RTAD_PRIVATE int file_close(int fd);
+/**
+ * @brief Read exactly size bytes at offset without moving the file position,
+ * a short read is an error.
+ *
+ * @param fd
+ * @param buf
+ * @param size
+ * @param offset
+ * @return 0 if success, -1 on error
+ */
+RTAD_PRIVATE int file_pread(int fd, void *buf, size_t size, off_t offset);
+/**
+ * @brief Get the size of an opened regular file.
+ *
+ * @param fd
+ * @return file size, -1 on error
+ */
+RTAD_PRIVATE off_t fd_length(int fd);
+/**
+ * @brief Open an existing regular file for reading and writing.
+ *
+ * @param path
+ * @return file descriptor, -1 on error
+ */
+RTAD_PRIVATE int file_open_rw(const char *path);
+/**
+ * @brief Move the file position to offset from the start.
+ *
+ * @param fd
+ * @param offset
+ * @return 0 if success, -1 on error
+ */
+RTAD_PRIVATE int fd_seek(int fd, off_t offset);
+/**
+ * @brief Write exactly size bytes at the file position.
+ *
+ * @param fd
+ * @param buf
+ * @param size
+ * @return 0 if success, -1 on error
+ */
+RTAD_PRIVATE int file_write(int fd, const void *buf, size_t size);
+/**
+ * @brief Write exactly size bytes to a file, a pipe or a socket, and count
+ * what was written even when it fails, like a non-blocking socket that is
+ * full.
+ *
+ * @param fd
+ * @param buf
+ * @param size
+ * @param out_sent added the bytes written
+ * @return 0 if success, -1 on error with errno set
+ */
+RTAD_PRIVATE int fd_send_buf(int fd, const void *buf, size_t size,
+                             uint64_t *out_sent);
+/**
+ * @brief Send size bytes of a file at offset to a file, a pipe or a socket,
+ * in the kernel when possible, with sendfile.
+ *
+ * @param in_fd
+ * @param offset
+ * @param out_fd
+ * @param size
+ * @param out_sent added the bytes sent, also on error
+ * @return 0 if success, -1 on error with errno set
+ */
+RTAD_PRIVATE int fd_send(int in_fd, off_t offset, int out_fd, uint64_t size,
+                         uint64_t *out_sent);
 /**
- * @brief A wrapper of platform-specific file truncate function,
- * the behavior **SHOULD** be same as POSIX truncate.
- * This function is designed for shrinking file size.
+ * @brief Write all buffers in order at the file position, with a single
+ * gather write where the platform supports it.
+ *
+ * @param fd
+ * @param iov
+ * @param iov_count
+ * @return 0 if success, -1 on error
+ */
+RTAD_PRIVATE int file_writev(int fd, const struct rtad_iovec *iov,
+                             size_t iov_count);
+/**
+ * @brief Create or truncate a file for reading and writing.
  *
  * @param path
+ * @return file descriptor, -1 on error
+ */
+RTAD_PRIVATE int file_create(const char *path);
+/**
+ * @brief Write exactly size bytes at offset without moving the file position.
+ *
+ * @param fd
+ * @param buf
+ * @param size
+ * @param offset
+ * @return 0 if success, -1 on error
+ */
+RTAD_PRIVATE int file_pwrite(int fd, const void *buf, size_t size,
+                             off_t offset);
+/**
+ * @brief Set the size of an opened file, growing it leaves a hole.
+ *
+ * @param fd
+ * @param size
+ * @return 0 if success, -1 on error
+ */
+RTAD_PRIVATE int fd_truncate(int fd, off_t size);
+/**
+ * @brief Create an anonymous file in memory that can be sealed, closed on
+ * exec.
+ *
+ * @param name shown in /proc/self/fd, for debugging only
+ * @return the file descriptor, -1 on error or if not supported
+ */
+RTAD_PRIVATE int memfd_open(const char *name);
+/**
+ * @brief Seal a file from memfd_open against any change of its content or
+ * size, and against more seals.
+ *
+ * @param fd
+ * @return 0 if success, -1 on error
+ */
+RTAD_PRIVATE int memfd_seal(int fd);
+/**
+ * @brief Call init exactly once for a once object, concurrent callers wait
+ * until it has returned.
+ *
+ * @param once
+ * @param init
+ */
+RTAD_PRIVATE void run_once(rtad_once_t *once, void (*init)(void));
+/**
+ * @brief Start a thread running fn(arg).
+ *
+ * @param thread
+ * @param fn
+ * @param arg
+ * @return 0 if success, -1 on error
+ */
+RTAD_PRIVATE int thread_create(rtad_thread_t *thread, void (*fn)(void *),
+                               void *arg);
+RTAD_PRIVATE void thread_join(rtad_thread_t thread);
+RTAD_PRIVATE int mutex_init(rtad_mutex_t *mutex);
+RTAD_PRIVATE void mutex_destroy(rtad_mutex_t *mutex);
+RTAD_PRIVATE void mutex_lock(rtad_mutex_t *mutex);
+RTAD_PRIVATE void mutex_unlock(rtad_mutex_t *mutex);
+RTAD_PRIVATE int cond_init(rtad_cond_t *cond);
+RTAD_PRIVATE void cond_destroy(rtad_cond_t *cond);
+RTAD_PRIVATE void cond_wait(rtad_cond_t *cond, rtad_mutex_t *mutex);
+RTAD_PRIVATE void cond_broadcast(rtad_cond_t *cond);
+#if defined(RTAD_HAVE_STATS)
+/**
+ * @brief Create a thread-specific key, destructor is called with the value of
+ * a thread when it exits. Only one key is created on Windows.
+ *
+ * @param key
+ * @param destructor
+ * @return 0 if success, -1 on error
+ */
+RTAD_PRIVATE int key_create(rtad_key_t *key, void (*destructor)(void *));
+RTAD_PRIVATE int key_set(rtad_key_t key, void *value);
+/**
+ * @brief Get the time of a monotonic clock.
+ *
+ * @return nanoseconds, from an unspecified start
+ */
+RTAD_PRIVATE uint64_t clock_ns(void);
+#endif
+/**
+ * @brief Get the number of online processors.
+ *
+ * @return at least 1
+ */
+RTAD_PRIVATE unsigned cpu_count(void);
+/**
+ * @brief Allocate memory of the read path with the allocator set by
+ * rtad_set_allocator, or malloc.
+ *
+ * @param size
+ * @return NULL on failure
+ */
+RTAD_PRIVATE void *mem_alloc(size_t size);
+RTAD_PRIVATE void *mem_calloc(size_t count, size_t size);
+/**
+ * @brief Move memory from mem_alloc to a bigger block, the allocator can't
+ * resize in place.
+ *
+ * @param ptr may be NULL
+ * @param old_size
+ * @param new_size
+ * @return NULL on failure, ptr is then left as is
+ */
+RTAD_PRIVATE void *mem_grow(void *ptr, size_t old_size, size_t new_size);
+RTAD_PRIVATE void mem_free(void *ptr);
+
+// counters of a thread, the ones of struct rtad_stats
+enum rtad_stat {
+  STAT_BYTES_READ,
+  STAT_BYTES_WRITTEN,
+  STAT_BYTES_COPIED,
+  STAT_SYSCALLS,
+  STAT_OPENS,
+  STAT_MAPS,
+  STAT_CACHE_HITS,
+  STAT_CACHE_MISSES,
+  STAT_CHUNKS_DECODED,
+  STAT_PHASE_CALLS,
+  STAT_PHASE_NS = STAT_PHASE_CALLS + RTAD_PHASE_COUNT,
+  STAT_COUNT = STAT_PHASE_NS + RTAD_PHASE_COUNT
+};
+
+#if defined(RTAD_HAVE_STATS)
+/**
+ * @brief Add to a counter of the calling thread.
+ *
+ * @param stat
+ * @param n
+ */
+RTAD_PRIVATE void stat_add(enum rtad_stat stat, uint64_t n);
+/**
+ * @brief Begin a phase on the calling thread and call the trace hook.
+ *
+ * @param phase RTAD_PHASE_*
+ * @return the start time to pass to phase_end, 0 if the phase is already
+ * running on the thread
+ */
+RTAD_PRIVATE uint64_t phase_begin(int phase);
+RTAD_PRIVATE void phase_end(int phase, uint64_t start);
+#define STAT_ADD(stat, n) stat_add(stat, (uint64_t)(n))
+#define PHASE_BEGIN(phase) phase_begin(phase)
+#define PHASE_END(phase, start) phase_end(phase, start)
+#else
+// compiled out, nothing is counted and the clock is not read
+#define STAT_ADD(stat, n) ((void)0)
+#define PHASE_BEGIN(phase) ((uint64_t)0)
+#define PHASE_END(phase, start) ((void)(start))
+#endif
+
+// methods the copy engine may use, tried in this order
+#define COPY_REFLINK 0x1  // share the extents, ioctl FICLONE
+#define COPY_RANGE 0x2    // in-kernel copy, copy_file_range
+#define COPY_SENDFILE 0x4 // in-kernel copy, sendfile
+#define COPY_SPARSE 0x8   // skip holes with SEEK_DATA and SEEK_HOLE
+#define COPY_ALL 0xF
+// without any method, data is copied with read and write
+
+/**
+ * @brief Copy size bytes at src_offset to dest_offset, with the fastest
+ * method allowed and supported by the file systems.
+ *
+ * @param src_fd
+ * @param src_offset
+ * @param dest_fd
+ * @param dest_offset
+ * @param size
+ * @param methods COPY_* flags
+ * @return 0 if success, -1 on error
+ */
+RTAD_PRIVATE int fd_copy_range(int src_fd, off_t src_offset, int dest_fd,
+                               off_t dest_offset, off_t size,
+                               unsigned methods);
+/**
+ * @brief Make dest_fd a copy of the first size bytes of src_fd.
+ * dest_fd must be empty, holes of src_fd are kept with COPY_SPARSE.
+ *
+ * @param src_fd
+ * @param dest_fd
  * @param size
+ * @param methods COPY_* flags
  * @return 0 if success, -1 on error
  */
-RTAD_PRIVATE int file_truncate(const char *path, size_t size);
+RTAD_PRIVATE int fd_copy(int src_fd, int dest_fd, off_t size,
+                         unsigned methods);
+
+// requests kept in flight by a batch, and the slices pack ingest reads in
+#define IO_DEPTH 32
+#define IO_SLICE_SIZE (256 * 1024)
+
+enum { IO_QUEUED, IO_DONE, IO_FAILED };
+
+// a positional read or write of a batch, done in full or failed
+struct rtad_io {
+  int fd;
+  int write;
+  char *buf;
+  size_t size;
+  off_t offset;
+  size_t transferred;
+  int state; // IO_*
+};
+
+// an io_uring instance, opened when the kernel and the build support it
+struct rtad_ring;
+
+/**
+ * @brief Open a ring keeping up to depth requests in flight, and register
+ * buf for requests inside it to skip the page pinning per request.
+ *
+ * @param depth
+ * @param buf may be NULL
+ * @param buf_size
+ * @return NULL without io_uring, callers fall back to positional I/O
+ */
+RTAD_PRIVATE struct rtad_ring *ring_open(unsigned depth, char *buf,
+                                         size_t buf_size);
+RTAD_PRIVATE void ring_close(struct rtad_ring *ring);
+/**
+ * @brief Queue a request on the ring, or do it now without ring.
+ *
+ * @param ring may be NULL
+ * @param io left IO_QUEUED until completed by ring_reap
+ * @return 0 if queued or done, -1 if the ring is full
+ */
+RTAD_PRIVATE int io_submit(struct rtad_ring *ring, struct rtad_io *io);
+/**
+ * @brief Submit the queued requests and wait for at least one completion.
+ * Short transfers are queued again for the rest.
+ *
+ * @param ring
+ * @return 0 if success, -1 if the ring failed
+ */
+RTAD_PRIVATE int ring_reap(struct rtad_ring *ring);
+RTAD_PRIVATE unsigned ring_in_flight(const struct rtad_ring *ring);
+/**
+ * @brief Run requests with up to the ring depth in flight, one after the
+ * other without ring.
+ *
+ * @param ring may be NULL
+ * @param ios
+ * @param count
+ * @return 0 if all are done, -1 otherwise
+ */
+RTAD_PRIVATE int io_batch(struct rtad_ring *ring, struct rtad_io *ios,
+                          size_t count);
 
 // platform-independent implementations
 
 #define RTAD_MAGIC "\x01*RTAD"
 #define RTAD_MAGIC_SIZE (sizeof(RTAD_MAGIC) - 1)
 
+// legacy header, only read for backward compatibility
 RTAD_PACKED_STRUCT(struct rtad_hdr {
   uint32_t data_size; // max size: 4GiB
   char magic[RTAD_MAGIC_SIZE];
@@ -88,12 +546,639 @@ RTAD_PACKED_STRUCT(struct rtad_hdr {
 
 #define RTAD_HDR_SIZE (sizeof(struct rtad_hdr))
 
-RTAD_PRIVATE ssize_t file_length(const char *path);
-RTAD_PRIVATE int file_copy(const char *src_path, const char *dest_path);
-RTAD_PRIVATE int file_copy_self(const char *dest_path);
-RTAD_PRIVATE int file_append_data(const char *path, const char *data,
-                                  size_t data_size);
-int rtad_extract_hdr(const char *exe_path, struct rtad_hdr *header);
+// The versioned trailer with 64-bit sizes, the magic is kept at the very end
+// of the file like the legacy header, so both can be told apart by the last
+// bytes.
+#define RTAD_MAGIC_V2 "\x02*RTAD"
+#define RTAD_VERSION 2
+
+// the payload ends with a table of contents
+#define RTAD_TRAILER_TOC 0x1
+// the payload without TOC is chunked, see struct rtad_chunk_hdr
+#define RTAD_TRAILER_CHUNKED 0x2
+// the payload ends with its tree hash, see struct rtad_hash_hdr
+#define RTAD_TRAILER_HASH 0x4
+
+RTAD_PACKED_STRUCT(struct rtad_trailer {
+  uint64_t data_size;  // payload size, trailer excluded
+  uint64_t toc_offset; // relative to the payload start
+  uint64_t toc_size;
+  uint32_t flags;
+  uint16_t version;
+  uint16_t trailer_size; // on-disk size, readers must check it
+  char magic[RTAD_MAGIC_SIZE];
+});
+
+#define RTAD_TRAILER_SIZE (sizeof(struct rtad_trailer))
+
+// TOC layout:
+// struct rtad_toc_hdr
+// uint32_t buckets[bucket_count + 1], index of the first entry of a bucket
+// struct rtad_toc_entry entries[entry_count], sorted by bucket
+// char names[names_size], not '\0' terminated
+RTAD_PACKED_STRUCT(struct rtad_toc_hdr {
+  uint32_t entry_count;
+  uint32_t bucket_count; // power of 2
+  uint32_t entry_size;   // size of one entry record
+  uint32_t names_size;
+});
+
+RTAD_PACKED_STRUCT(struct rtad_toc_entry {
+  uint64_t offset; // relative to the payload start
+  uint64_t size;
+  uint64_t name_hash;
+  uint32_t name_offset; // relative to the name table
+  uint32_t name_size;
+  uint32_t flags; // RTAD_ENTRY_*
+  uint32_t align; // file offset alignment of an entry stored as is, 0 if none
+  uint64_t raw_size; // size once decoded, missing in RTAD_TOC_ENTRY_MIN_SIZE
+});
+
+// records written before raw_size was added, raw_size is the stored size
+#define RTAD_TOC_ENTRY_MIN_SIZE 40
+
+// Chunked data, an entry with RTAD_ENTRY_CHUNKED or a payload with
+// RTAD_TRAILER_CHUNKED:
+// the stored chunks, each one can be decoded on its own
+// struct rtad_chunk chunks[chunk_count]
+// uint32_t raw_sizes[chunk_count], with RTAD_CHUNKS_VARIABLE only
+// struct rtad_chunk_hdr, at the end like the trailer, so it's written last
+RTAD_PACKED_STRUCT(struct rtad_chunk_hdr {
+  uint64_t raw_size;
+  uint32_t chunk_size; // raw size of every chunk but the last one, or the
+                       // average one with RTAD_CHUNKS_VARIABLE
+  uint32_t chunk_count;
+  uint32_t codec; // RTAD_CODEC_*, every chunk is stored with RTAD_CODEC_NONE
+  uint32_t flags; // RTAD_CHUNKS_*
+});
+
+// chunks are cut where the content says, up to RTAD_CDC_MAX_FACTOR times
+// chunk_size, and their raw sizes follow the table
+#define RTAD_CHUNKS_VARIABLE 0x1
+
+// content-defined chunks are at least chunk_size / RTAD_CDC_MIN_DIVISOR and
+// at most chunk_size * RTAD_CDC_MAX_FACTOR bytes
+#define RTAD_CDC_MIN_DIVISOR 4
+#define RTAD_CDC_MAX_FACTOR 4
+
+// an entry index in the dedup table, instead of a chunk codec and flags
+#define RTAD_DEDUP_TAG_ENTRY UINT32_MAX
+
+// stored bytes already written, keyed by their BLAKE3 hash
+struct rtad_dedup_item {
+  uint8_t digest[RTAD_HASH_SIZE];
+  uint64_t offset; // relative to the payload start
+  uint64_t size;
+  uint32_t tag; // codec << 8 | RTAD_CHUNK_* of a chunk, RTAD_DEDUP_TAG_ENTRY
+  uint32_t used;
+};
+
+// the chunk is stored as is, it didn't get smaller with the codec
+#define RTAD_CHUNK_STORED 0x1
+
+RTAD_PACKED_STRUCT(struct rtad_chunk {
+  uint64_t offset; // relative to the payload start, so chunks can be shared
+  uint32_t size;   // stored size
+  uint32_t flags;
+});
+
+// Tree hash, at the end of the payload with RTAD_TRAILER_HASH:
+// uint8_t leaves[block_count][RTAD_HASH_SIZE], chaining value of every block
+// struct rtad_hash_hdr
+// The root is the BLAKE3 hash of the covered bytes. A block is a whole subtree
+// of the BLAKE3 tree, so it's checked on its own against its leaf, and the
+// leaves against the root. Once loaded, the rest of the payload ends at
+// covered_size, the leaves are not part of it.
+RTAD_PACKED_STRUCT(struct rtad_hash_hdr {
+  uint8_t root[RTAD_HASH_SIZE];
+  uint64_t covered_size; // payload bytes before the leaves
+  uint32_t block_size;   // a power of 2 number of BLAKE3 chunks
+  uint32_t block_count;  // at least 1, an empty payload has an empty block
+  uint32_t algorithm;    // RTAD_HASH_BLAKE3
+  uint32_t reserved;
+});
+
+#define RTAD_HASH_BLAKE3 1
+#define RTAD_HASH_BLOCK_SIZE (64 * 1024)
+
+// A variable of the library, found in an ELF executable by its magic and
+// patched by elf_update when the payload is loaded with the executable. The
+// payload is at the address of the locator plus delta wherever it's loaded.
+#define RTAD_LOCATOR_MAGIC "\x03*RTAD-LOCATOR"
+#define RTAD_LOCATOR_MAGIC_SIZE 16
+
+RTAD_PACKED_STRUCT(struct rtad_locator {
+  char magic[RTAD_LOCATOR_MAGIC_SIZE];
+  int64_t delta;   // from the locator to the payload in memory
+  uint64_t offset; // file offset of the payload
+  uint64_t size;   // bytes to the end of the file, 0 if not loaded
+});
+
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_CHUNK_START 0x1
+#define BLAKE3_CHUNK_END 0x2
+#define BLAKE3_PARENT 0x4
+#define BLAKE3_ROOT 0x8
+
+// a chunk of the built-in codec, independent of RTAD_CHUNK_SIZE
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+// an entry to be written into a TOC, name_hash and name_offset of the record
+// are filled by toc_build
+struct rtad_toc_item {
+  const char *name;
+  struct rtad_toc_entry record;
+  int removed; // replaced or removed, a tombstone left out of the TOC
+};
+
+// stored bytes an entry points at, moved by rtad_file_compact
+struct rtad_extent {
+  uint64_t offset; // relative to the payload start
+  uint64_t size;
+  uint64_t new_offset; // once compacted
+  int index;           // a chunk index, rewritten instead of moved
+  uint32_t align;      // file offset alignment kept when moved, 0 if none
+};
+
+// the entries of a TOC and the bytes they point at
+struct rtad_live {
+  struct rtad_toc_item *items;
+  size_t item_count;
+  struct rtad_chunk_hdr *chunk_hdrs; // of every chunked item
+  struct rtad_chunk **chunks;        // NULL for other items
+  uint64_t **raw_offsets;            // with RTAD_CHUNKS_VARIABLE only
+  struct rtad_extent *extents;       // sorted by offset, may overlap
+  size_t extent_count;
+  size_t extent_capacity;
+};
+
+enum rtad_writer_mode {
+  RTAD_WRITER_EMPTY,   // nothing written yet
+  RTAD_WRITER_DATA,    // a single anonymous payload
+  RTAD_WRITER_ENTRIES, // named entries and a TOC
+};
+
+enum rtad_slot_state {
+  RTAD_SLOT_FREE,   // the writer thread is done with it
+  RTAD_SLOT_FILLED, // holds a full chunk, waiting for a worker
+  RTAD_SLOT_BUSY,   // a worker compresses it
+  RTAD_SLOT_DONE,   // compressed, waiting for the writer thread
+};
+
+struct rtad_slot {
+  enum rtad_slot_state state;
+  char *raw; // swapped with the chunk buffer of the writer when filled
+  size_t raw_size;
+  char *out;
+  struct rtad_iovec stored; // out, or raw if it didn't get smaller
+  uint32_t flags;           // RTAD_CHUNK_*
+  uint8_t digest[RTAD_HASH_SIZE]; // of the stored bytes, with dedup only
+};
+
+// workers compress the chunks of a ring of slots, the writer thread writes
+// them in the order they were filled, so the output doesn't depend on the
+// number of threads. Slots change state under the lock only.
+struct rtad_pool {
+  struct rtad_writer *writer;
+  uint32_t codec;
+  size_t chunk_limit; // size of every raw buffer
+  size_t bound;       // size of every out buffer
+  unsigned thread_count;
+  int dedup; // hash the stored chunks
+  rtad_mutex_t lock;
+  rtad_cond_t changed; // a slot changed state, or stop was set
+  int sync_ready;      // lock and changed are initialized
+  struct rtad_slot *slots;
+  size_t slot_count;
+  size_t next_fill;  // filled next by the caller
+  size_t next_work;  // taken next by a worker
+  size_t next_write; // written next by the writer thread
+  size_t pending;    // filled and not written yet
+  int stop;
+  int failed; // the writer thread failed, the following chunks are dropped
+  rtad_thread_t *threads; // the writer thread first, then the workers
+  size_t started;
+};
+
+struct rtad_writer {
+  struct rtad_file *file;
+  int owns_file; // the file is closed with the writer
+  int failed;    // any write failed, the payload is dropped at close
+  enum rtad_writer_mode mode;
+  int update; // new entries replace earlier ones, see rtad_writer_open_update
+  off_t base_size;    // file size without payload, or before the update
+  uint64_t data_size; // payload bytes written so far, buffered ones included
+  struct rtad_toc_item *items;
+  size_t item_count;
+  size_t item_capacity;
+  uint32_t codec; // for the following entries, see rtad_writer_set_codec
+  uint32_t chunk_size;
+  uint32_t dedup;          // RTAD_DEDUP_*, see rtad_writer_set_dedup
+  unsigned threads;        // see rtad_writer_set_threads
+  uint32_t align;          // see rtad_writer_set_align
+  uint32_t load;           // see rtad_writer_set_load
+  struct rtad_pool *pool;  // NULL while compressing on the calling thread
+  // the entry, or the payload, being written
+  int entry_open; // the last item is being written
+  uint64_t entry_offset;
+  uint64_t entry_raw_size;
+  int chunked;
+  struct rtad_chunk_hdr chunk_hdr;
+  size_t chunk_limit; // largest raw chunk
+  uint64_t cdc_hash;  // gear hash since the last content-defined cut
+  struct rtad_chunk *chunks;
+  uint32_t *raw_sizes; // of the chunks, as many as chunk_capacity
+  size_t chunk_capacity;
+  // every stored chunk and chunked entry index written, with dedup only
+  struct rtad_dedup_item *dedup_items;
+  size_t dedup_count;
+  size_t dedup_capacity; // power of 2
+  char *chunk_buf; // raw data of the chunk being filled
+  size_t chunk_buf_capacity;
+  size_t chunk_used;
+  char *compress_buf;
+  size_t compress_capacity;
+  // tree hash of the payload, updated as it's written
+  int hashing;      // off for the leaves and the trailer
+  char *hash_block; // bytes of the last block, hashed once another follows
+  size_t hash_used;
+  uint8_t *leaves;
+  size_t leaf_count;
+  size_t leaf_capacity;
+  size_t buffer_used;
+  char buffer[WRITE_BUFFER_SIZE];
+};
+
+// an opened file, the trailer and the TOC are read once at open and kept
+// until the payload is changed through the handle
+struct rtad_file {
+  int fd;
+  int writable;
+  int shared; // the rtad_self handle, never closed
+  off_t file_size;
+  off_t data_offset;           // absolute offset of the payload, or file_size
+  struct rtad_trailer trailer; // zeroed without payload
+  struct rtad_toc_hdr toc;     // zeroed without RTAD_TRAILER_TOC
+  char *toc_data;              // the whole TOC, NULL without RTAD_TRAILER_TOC
+  struct rtad_hash_hdr hash;   // zeroed without RTAD_TRAILER_HASH
+  // rtad_self of a payload loaded with the executable, see elf_update: the
+  // bytes from image_offset to the end of the file are in memory, and fd is
+  // opened on first use by file_fd
+  const char *image;
+  off_t image_offset;
+  size_t image_size;
+};
+
+// a window over the payload or an entry, reading with file_pread on the fd
+// borrowed from the file, so the position is private to the reader
+struct rtad_reader {
+  struct rtad_file *file;
+  off_t offset;  // absolute offset of the window
+  uint64_t size; // decoded size
+  uint64_t pos;
+  // chunked data only, the last decoded chunk is kept; whole chunks read at
+  // once are decoded in place, so the buffers are allocated on first use
+  struct rtad_chunk_hdr chunk_hdr;
+  struct rtad_chunk *chunks;
+  uint64_t *raw_offsets; // chunk_count + 1, RTAD_CHUNKS_VARIABLE only
+  char *chunk_cache;
+  uint64_t cached_chunk; // UINT64_MAX if none
+  char *stored_buf;      // a compressed chunk
+  // with rtad_reader_enable_verify only, blocks are checked on first read
+  uint8_t *leaves;
+  uint8_t *verified; // a bit per block
+  char *verify_buf;
+};
+
+RTAD_PRIVATE uint64_t name_hash(const char *name, size_t name_size);
+RTAD_PRIVATE void trailer_init(struct rtad_trailer *trailer,
+                               uint64_t data_size);
+RTAD_PRIVATE char *toc_build(struct rtad_toc_item *items, size_t count,
+                            size_t *out_toc_size);
+/**
+ * @brief Compress with the built-in codec, LZ77 sequences of a literal run and
+ * a match with 16-bit offset.
+ *
+ * @param src
+ * @param src_size
+ * @param dst
+ * @param dst_capacity
+ * @return compressed size, 0 if it doesn't fit in dst_capacity
+ */
+RTAD_PRIVATE size_t lz_compress(const char *src, size_t src_size, char *dst,
+                                size_t dst_capacity);
+/**
+ * @brief Decompress data of lz_compress, the input is not trusted.
+ *
+ * @param src
+ * @param src_size
+ * @param dst
+ * @param dst_size the exact decompressed size
+ * @return 0 if success, -1 on corrupted data
+ */
+RTAD_PRIVATE int lz_decompress(const char *src, size_t src_size, char *dst,
+                               size_t dst_size);
+/**
+ * @brief Get the largest compressed size of size bytes.
+ *
+ * @param codec
+ * @param size
+ * @return 0 if the codec is not supported
+ */
+RTAD_PRIVATE size_t codec_bound(uint32_t codec, size_t size);
+RTAD_PRIVATE size_t codec_compress(uint32_t codec, const char *src,
+                                   size_t src_size, char *dst,
+                                   size_t dst_capacity);
+RTAD_PRIVATE int codec_decompress(uint32_t codec, const char *src,
+                                  size_t src_size, char *dst, size_t dst_size);
+/**
+ * @brief Hash size bytes of data with BLAKE3 as the subtree starting at chunk
+ * chunk_counter, or as the whole input if root is set.
+ *
+ * @param data
+ * @param size a power of 2 number of chunks, unless it's the last subtree
+ * @param chunk_counter
+ * @param root
+ * @param out chaining value, or the hash with root
+ */
+RTAD_PRIVATE void hash_tree(const char *data, size_t size,
+                            uint64_t chunk_counter, int root,
+                            uint8_t out[RTAD_HASH_SIZE]);
+/**
+ * @brief Get the root hash of the subtrees of consecutive blocks.
+ *
+ * @param leaves chaining values of the blocks
+ * @param count at least 2
+ * @param out
+ */
+RTAD_PRIVATE void hash_leaves(const uint8_t *leaves, size_t count,
+                              uint8_t out[RTAD_HASH_SIZE]);
+/**
+ * @brief Read the leaves of the tree hash and check them against the root.
+ *
+ * @param file
+ * @return malloc'd leaves, NULL without hash, on error or mismatch
+ */
+RTAD_PRIVATE uint8_t *hash_leaves_load(struct rtad_file *file);
+/**
+ * @brief Hash a block of the payload and check it against the tree hash.
+ *
+ * @param file
+ * @param leaves from hash_leaves_load
+ * @param index
+ * @param data the bytes of the block
+ * @return 0 if it matches, -1 otherwise
+ */
+RTAD_PRIVATE int hash_block_check(const struct rtad_file *file,
+                                  const uint8_t *leaves, uint64_t index,
+                                  const char *data);
+/**
+ * @brief Read and check the chunk index of chunked data at
+ * [offset, offset + size) of the payload.
+ *
+ * @param file
+ * @param offset
+ * @param size
+ * @param hdr
+ * @param out_raw_offsets malloc'd raw offsets of the chunks and of their end
+ * with RTAD_CHUNKS_VARIABLE, NULL otherwise
+ * @return malloc'd chunk table, NULL on error or corrupted index
+ */
+RTAD_PRIVATE struct rtad_chunk *chunks_load(struct rtad_file *file,
+                                            uint64_t offset, uint64_t size,
+                                            struct rtad_chunk_hdr *hdr,
+                                            uint64_t **out_raw_offsets);
+
+// rtad_get_many merges reads closer than this, reading the gap costs less
+// than another request
+#define GET_GAP_SIZE (16 * 1024)
+// and makes them at most this long, unless a single piece is longer
+#define GET_RANGE_SIZE (4 * 1024 * 1024)
+// from this many reads on, they go through a ring when there is one
+#define GET_RING_MIN 4
+
+// the stored bytes of a whole entry or of one chunk, for rtad_get_many
+struct rtad_get_piece {
+  uint64_t offset; // relative to the payload start
+  uint64_t size;   // stored size
+  char *dest;
+  size_t raw_size;
+  uint32_t codec; // RTAD_CODEC_NONE if stored as is
+};
+
+// a read covering pieces [first, first + count)
+struct rtad_get_range {
+  uint64_t offset;
+  uint64_t size;
+  size_t first;
+  size_t count;
+};
+
+/**
+ * @brief Sort pieces by offset and merge them into as few reads as the gap
+ * and range limits allow.
+ *
+ * @param pieces sorted in place
+ * @param count
+ * @param ranges count at most
+ * @return the number of ranges
+ */
+RTAD_PRIVATE size_t get_ranges(struct rtad_get_piece *pieces, size_t count,
+                               struct rtad_get_range *ranges);
+/**
+ * @brief Read an entry, or the whole payload if entry is NULL, decoded.
+ *
+ * @param file
+ * @param entry
+ * @param out_data
+ * @param out_data_size
+ * @return 0 if success, -1 on error
+ */
+RTAD_PRIVATE int reader_read_all(struct rtad_file *file,
+                                 const struct rtad_entry *entry,
+                                 char **out_data, size_t *out_data_size);
+/**
+ * @brief Parse the trailer from the last tail_size bytes of a file, the legacy
+ * header is presented as a version 1 trailer with trailer_size of
+ * RTAD_HDR_SIZE.
+ *
+ * @param tail
+ * @param tail_size
+ * @param file_size
+ * @param trailer
+ * @return 0 if success, -1 if there is no valid trailer
+ */
+RTAD_PRIVATE int trailer_parse(const char *tail, size_t tail_size,
+                               off_t file_size, struct rtad_trailer *trailer);
+/**
+ * @brief (Re)load the trailer and the TOC of file with one read of the
+ * file tail, a file without valid trailer has no payload.
+ *
+ * @param file
+ * @return 0 if success, -1 on error or corrupted TOC
+ */
+RTAD_PRIVATE int file_load(struct rtad_file *file);
+/**
+ * @brief Read from file, in memory for the part of rtad_self loaded with the
+ * executable.
+ *
+ * @param file
+ * @param buf
+ * @param size
+ * @param offset absolute
+ * @return 0 if all bytes are read, -1 otherwise
+ */
+RTAD_PRIVATE int file_read(struct rtad_file *file, void *buf, size_t size,
+                           off_t offset);
+/**
+ * @brief Get the descriptor of file, opening the executable the first time
+ * for rtad_self loaded with it.
+ *
+ * @param file
+ * @return file descriptor, -1 on error
+ */
+RTAD_PRIVATE int file_fd(struct rtad_file *file);
+/**
+ * @brief Keep the PT_LOAD segment of an ELF executable over its payload in
+ * step with it, and the locator with the address. The segment is added with
+ * load, moved if the payload changed, and removed without payload. Nothing is
+ * changed in other files, nor in executables without locator or spare
+ * program header.
+ *
+ * @param file writable, data_offset is where the payload starts
+ * @param load RTAD_LOAD_* flags to add the segment if there is none, 0 to keep
+ * it as is
+ * @return 0 if success, -1 on error
+ */
+RTAD_PRIVATE int elf_update(struct rtad_file *file, uint32_t load);
+#if defined(__linux__)
+/**
+ * @brief Check if a PT_NOTE segment has the GNU build id, so its header is
+ * never taken by elf_update.
+ *
+ * @param fd
+ * @param end the notes must be in [0, end) of fd
+ * @param phdr
+ * @return 1 if it has, or can't be read, 0 otherwise
+ */
+RTAD_PRIVATE int elf_note_build_id(int fd, off_t end, const Elf64_Phdr *phdr);
+#endif
+/**
+ * @brief Make a handle of an opened file, fd is closed on error.
+ *
+ * @param fd
+ * @param writable
+ * @return NULL on error
+ */
+RTAD_PRIVATE struct rtad_file *file_attach(int fd, int writable);
+/**
+ * @brief Copy src without its payload to dest_path.
+ *
+ * @param src
+ * @param dest_path
+ * @return writable handle of dest_path, NULL on error
+ */
+RTAD_PRIVATE struct rtad_file *file_copy_exe(struct rtad_file *src,
+                                             const char *dest_path);
+/**
+ * @brief Start writing a new payload to file, the existing one is dropped.
+ *
+ * @param file
+ * @param owns_file close file with the writer, also on error here
+ * @return NULL on error
+ */
+RTAD_PRIVATE struct rtad_writer *writer_open(struct rtad_file *file,
+                                             int owns_file);
+/**
+ * @brief Start an update of the entries of file, the existing payload is
+ * kept and the writer appends after it. A file without payload gets a new
+ * one.
+ *
+ * @param file
+ * @param owns_file close file with the writer, also on error here
+ * @return NULL on error or if the payload has no TOC
+ */
+RTAD_PRIVATE struct rtad_writer *writer_open_update(struct rtad_file *file,
+                                                    int owns_file);
+/**
+ * @brief Write the TOC without the removed items, the tree hash and the
+ * trailer after the payload written so far.
+ *
+ * @param writer
+ * @return 0 if success, -1 on error
+ */
+RTAD_PRIVATE int writer_put_tail(struct rtad_writer *writer);
+/**
+ * @brief Free the writer, on failure the file is truncated to the size it had
+ * before the writer and a borrowed file is reloaded either way.
+ *
+ * @param writer
+ * @param result 0 if the payload is complete, -1 to drop it
+ * @return result, or -1 if reloading the file failed
+ */
+RTAD_PRIVATE int writer_release(struct rtad_writer *writer, int result);
+/**
+ * @brief Read a record of the TOC of file.
+ *
+ * @param file
+ * @param index less than the number of entries
+ * @param record raw_size is the stored size for older, shorter records
+ * @param out_name not '\0' terminated, record->name_size bytes
+ * @return 0 if success, -1 if the name is outside of the name table
+ */
+RTAD_PRIVATE int toc_record_get(const struct rtad_file *file, uint32_t index,
+                                struct rtad_toc_entry *record,
+                                const char **out_name);
+/**
+ * @brief Load the entries of the TOC of file, and with with_extents their
+ * chunk indexes and the extents of the payload they point at.
+ *
+ * @param file
+ * @param live freed with live_free, also on error
+ * @param with_extents
+ * @return 0 if success, -1 on error or corrupted TOC
+ */
+RTAD_PRIVATE int live_load(struct rtad_file *file, struct rtad_live *live,
+                           int with_extents);
+/**
+ * @brief Load the named entries of the TOC of file, with their chunk indexes
+ * and the extents of the payload they point at.
+ *
+ * @param file
+ * @param live freed with live_free, also on error
+ * @param names
+ * @param count
+ * @return 0 if success, -1 on error or if an entry is missing
+ */
+RTAD_PRIVATE int live_select(struct rtad_file *file, struct rtad_live *live,
+                             const char *const *names, size_t count);
+/**
+ * @brief Merge the extents of live, chunk indexes left out, into spans placed
+ * one after the other from start. An aligned extent starts its own span,
+ * moved up to the next multiple of its alignment.
+ *
+ * @param live the extents become the spans
+ * @param start new offset of the first span
+ * @param base absolute offset of the payload the spans are placed in
+ * @return the number of spans
+ */
+RTAD_PRIVATE size_t live_spans(struct rtad_live *live, uint64_t start,
+                               off_t base);
+/**
+ * @brief Point the records of live at the moved spans, and write new chunk
+ * indexes for the chunked entries, shared ones once.
+ *
+ * @param writer
+ * @param live after live_spans
+ * @return 0 if success, -1 on error
+ */
+RTAD_PRIVATE int live_put_records(struct rtad_writer *writer,
+                                  struct rtad_live *live);
+RTAD_PRIVATE void live_free(struct rtad_live *live);
+int rtad_extract_hdr(const char *exe_path, struct rtad_trailer *trailer);
 int rtad_validate_hdr(const char *exe_path);
 int rtad_truncate_data(const char *exe_path);
 int rtad_truncate_self_data(const char *new_path);
@@ -106,4 +1191,54 @@ int rtad_extract_data(const char *exe_path, char **out_data,
 int rtad_free_extracted_data(char *data);
 int rtad_extract_self_data(char **out_data, size_t *out_data_size);
 int rtad_validate_self_hdr();
+int rtad_map_data(const char *exe_path, const char **out_data,
+                  size_t *out_data_size);
+int rtad_map_self_data(const char **out_data, size_t *out_data_size);
+int rtad_unmap_data(const char *data, size_t data_size);
+int rtad_append_packed_entries(const char *dest_path,
+                               const struct rtad_input *inputs, size_t count);
+int rtad_copy_self_with_entries(const char *dest_path,
+                                const struct rtad_input *inputs, size_t count);
+struct rtad_writer *rtad_writer_open(const char *dest_path);
+int rtad_writer_begin_entry(struct rtad_writer *writer, const char *name);
+int rtad_writer_set_codec(struct rtad_writer *writer, uint32_t codec,
+                          uint32_t chunk_size);
+int rtad_codec_supported(uint32_t codec);
+int rtad_writer_write(struct rtad_writer *writer, const void *data,
+                      size_t size);
+int rtad_writer_writev(struct rtad_writer *writer,
+                       const struct rtad_iovec *iov, size_t iov_count);
+int rtad_writer_close(struct rtad_writer *writer);
+int rtad_writer_abort(struct rtad_writer *writer);
+struct rtad_file *rtad_open(const char *exe_path);
+struct rtad_file *rtad_open_rw(const char *exe_path);
+struct rtad_file *rtad_open_self(void);
+struct rtad_file *rtad_self(void);
+int rtad_self_data(const char **out_data, size_t *out_data_size);
+int rtad_self_entry(const char *name, const char **out_data,
+                    size_t *out_data_size);
+int rtad_close(struct rtad_file *file);
+int rtad_file_validate(struct rtad_file *file);
+int rtad_file_extract(struct rtad_file *file, char **out_data,
+                      size_t *out_data_size);
+int rtad_file_map(struct rtad_file *file, const char **out_data,
+                  size_t *out_data_size);
+int rtad_file_truncate(struct rtad_file *file);
+int rtad_file_append(struct rtad_file *file, const char *data, size_t size);
+int rtad_file_append_entries(struct rtad_file *file,
+                             const struct rtad_input *inputs, size_t count);
+int rtad_find(struct rtad_file *file, const char *name,
+              struct rtad_entry *out_entry);
+int rtad_entry_read(struct rtad_file *file, const struct rtad_entry *entry,
+                    char **out_data, size_t *out_data_size);
+struct rtad_reader *rtad_reader_open(struct rtad_file *file,
+                                     const struct rtad_entry *entry);
+int rtad_reader_close(struct rtad_reader *reader);
+int rtad_reader_read(struct rtad_reader *reader, void *buf, size_t size,
+                     size_t *out_read);
+int rtad_reader_pread(struct rtad_reader *reader, void *buf, size_t size,
+                      uint64_t offset, size_t *out_read);
+int rtad_reader_seek(struct rtad_reader *reader, int64_t offset, int whence);
+uint64_t rtad_reader_tell(const struct rtad_reader *reader);
+uint64_t rtad_reader_size(const struct rtad_reader *reader);
 #endif
\ No newline at end of file
@@ -42,6 +42,37 @@ static void test_truncate_data(void **state) {
   assert_int_equal(out_data_size, 0);
 }
 
+static void test_copy_self_with_entries(void **state) {
+  (void)state; /* unused */
+  const struct rtad_input inputs[2] = {
+      {.name = "first", .data = "abc", .size = 3},
+      {.name = "second", .data = "defgh", .size = 5}};
+  int result = rtad_copy_self_with_entries(__FUNCTION__, inputs, 2);
+  assert_int_equal(result, 0);
+  rtad_file *file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  struct rtad_entry entry;
+  assert_int_equal(rtad_find(file, "second", &entry), 0);
+  char *out_data = NULL;
+  size_t out_data_size = 0;
+  assert_int_equal(rtad_entry_read(file, &entry, &out_data, &out_data_size), 0);
+  assert_int_equal(out_data_size, 5);
+  assert_memory_equal(out_data, "defgh", 5);
+  rtad_free_extracted_data(out_data);
+  rtad_close(file);
+
+  // packing again starts over from the executable itself
+  result = rtad_copy_self_with_data(__FUNCTION__, "xyz", 3);
+  assert_int_equal(result, 0);
+  result = rtad_copy_self_with_entries(__FUNCTION__, inputs, 1);
+  assert_int_equal(result, 0);
+  file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  assert_int_equal(rtad_find(file, "second", &entry), -1);
+  assert_int_equal(rtad_find(file, "first", &entry), 0);
+  rtad_close(file);
+}
+
 static char the_data[] = "Hello World from RTAD!";
 static size_t the_data_size = sizeof(the_data);
 static void test_copy_self_with_data(void **state) {
@@ -104,10 +135,142 @@ static int test_copy_self_with_data_body() {
   if (result != 0) {
     return 1;
   }
+
+  const char *mapped_data = NULL;
+  size_t mapped_data_size = 0;
+  if (rtad_map_self_data(&mapped_data, &mapped_data_size) != 0) {
+    return 1;
+  }
+  if (mapped_data_size != the_data_size ||
+      memcmp(mapped_data, the_data, the_data_size) != 0) {
+    rtad_unmap_data(mapped_data, mapped_data_size);
+    return 1;
+  }
+  if (rtad_unmap_data(mapped_data, mapped_data_size) != 0) {
+    return 1;
+  }
+
+  // borrowed views of the cached self handle
+  const char *view = NULL;
+  size_t view_size = 0;
+  if (rtad_self_data(&view, &view_size) != 0 || view_size != the_data_size ||
+      memcmp(view, the_data, the_data_size) != 0) {
+    return 1;
+  }
+  if (rtad_self_entry("name", &view, &view_size) == 0) {
+    return 1;
+  }
   return 0;
 }
 
+static void run_self_with_entries(const char *path, const char *mode) {
+  char exe_path[1024] = {0};
+  // the path, the mode and the separators
+  char subprocess_cmd[sizeof(exe_path) + 32];
+  int length;
+#ifdef _WIN32
+  snprintf(exe_path, sizeof(exe_path), "%s.exe", path);
+  length = snprintf(subprocess_cmd, sizeof(subprocess_cmd), ".\\%s %s",
+                    exe_path, mode);
+#else
+  snprintf(exe_path, sizeof(exe_path), "%s", path);
+  length = snprintf(subprocess_cmd, sizeof(subprocess_cmd), "./%s %s",
+                    exe_path, mode);
+#endif
+  assert_true(length > 0 && (size_t)length < sizeof(subprocess_cmd));
+#ifndef _MSC_VER
+  chmod(exe_path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+#endif
+  assert_int_equal(system(subprocess_cmd), 0);
+}
+
+static void pack_self_with_entries(const char *path, uint32_t load) {
+  char exe_path[1024] = {0};
+#ifdef _WIN32
+  snprintf(exe_path, sizeof(exe_path), "%s.exe", path);
+#else
+  snprintf(exe_path, sizeof(exe_path), "%s", path);
+#endif
+  assert_int_equal(rtad_truncate_self_data(exe_path), 0);
+  rtad_writer *writer = rtad_writer_open(exe_path);
+  assert_non_null(writer);
+  assert_int_equal(rtad_writer_set_load(writer, load), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "first"), 0);
+  assert_int_equal(rtad_writer_write(writer, "abc", 3), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "second"), 0);
+  assert_int_equal(rtad_writer_write(writer, "defgh", 5), 0);
+  assert_int_equal(rtad_writer_close(writer), 0);
+}
+
+static void test_copy_self_with_load(void **state) {
+  (void)state; /* unused */
+  // the test binary has no PT_NULL header, the segment takes a PT_NOTE one
+  pack_self_with_entries(__FUNCTION__, RTAD_LOAD_NOTE);
+  run_self_with_entries(__FUNCTION__, "load");
+
+  // an update keeps the payload loaded with the executable
+  char exe_path[1024] = {0};
+#ifdef _WIN32
+  snprintf(exe_path, sizeof(exe_path), "%s.exe", __FUNCTION__);
+#else
+  snprintf(exe_path, sizeof(exe_path), "%s", __FUNCTION__);
+#endif
+  rtad_writer *writer = rtad_writer_open_update(exe_path);
+  assert_non_null(writer);
+  assert_int_equal(rtad_writer_begin_entry(writer, "third"), 0);
+  assert_int_equal(rtad_writer_write(writer, "ijk", 3), 0);
+  assert_int_equal(rtad_writer_close(writer), 0);
+  run_self_with_entries(__FUNCTION__, "load");
+
+  // without payload the segment goes too, the tail format is left
+  assert_int_equal(rtad_truncate_data(exe_path), 0);
+  assert_int_not_equal(rtad_validate_hdr(exe_path), 0);
+  pack_self_with_entries(__FUNCTION__, 0);
+  run_self_with_entries(__FUNCTION__, "tail");
+}
+
+static int test_copy_self_with_load_body(int loaded) {
+  // not run by cmocka either
+#if defined(__linux__)
+  struct rtad_stats before;
+  int stats = rtad_stats_thread(&before) == 0;
+#endif
+  const char *view = NULL;
+  size_t view_size = 0;
+  if (rtad_self_entry("first", &view, &view_size) != 0 || view_size != 3 ||
+      memcmp(view, "abc", 3) != 0) {
+    return 1;
+  }
+#if defined(__linux__)
+  // in the memory mapped by the loader, nothing was opened nor read
+  struct rtad_stats after;
+  if (stats && (rtad_stats_thread(&after) != 0 ||
+                (after.opens == before.opens &&
+                 after.syscalls == before.syscalls) != loaded)) {
+    return 1;
+  }
+#else
+  (void)loaded;
+#endif
+  // the executable is opened for what needs a descriptor
+  struct rtad_entry entry;
+  const char *mapped = NULL;
+  size_t mapped_size = 0;
+  if (rtad_find(rtad_self(), "second", &entry) != 0 ||
+      rtad_entry_map(rtad_self(), &entry, &mapped, &mapped_size) != 0) {
+    return 1;
+  }
+  int result = mapped_size == 5 && memcmp(mapped, "defgh", 5) == 0 ? 0 : 1;
+  rtad_unmap_data(mapped, mapped_size);
+  return result;
+}
+
 int main(int argc, char **argv) {
+  if (argc > 1 && (strcmp(argv[1], "load") == 0 ||
+                   strcmp(argv[1], "tail") == 0)) {
+    // test the payload loaded with the executable as a subprocess
+    return test_copy_self_with_load_body(strcmp(argv[1], "load") == 0);
+  }
   if (argc > 1) {
     // test extract_self_data as a subprocess
     return test_copy_self_with_data_body();
@@ -117,6 +280,8 @@ int main(int argc, char **argv) {
       cmocka_unit_test(test_extract_from_specific_file),
       cmocka_unit_test(test_truncate_data),
       cmocka_unit_test(test_copy_self_with_data),
+      cmocka_unit_test(test_copy_self_with_entries),
+      cmocka_unit_test(test_copy_self_with_load),
   };
   return cmocka_run_group_tests(tests, NULL, NULL);
 }
\ No newline at end of file
@@ -14,12 +14,23 @@
 #define ssize_t SSIZE_T
 
 #elif defined(__GNUC__) || defined(__clang__)
+#include <sys/socket.h>
 #include <unistd.h>
 
 #endif
 
 #include <limits.h>
 
+static void test_exe_open_ok(void **state) {
+  (void)state; /* unused */
+  int fd = exe_open();
+  assert_true(fd >= 0);
+  assert_true(fd_length(fd) > 0);
+  file_close(fd);
+}
+
+#if !defined(__linux__)
+// Linux opens /proc/self/exe, other platforms get the path first
 static void test_exe_path_ok(void **state) {
   (void)state; /* unused */
   char buffer[PATH_MAX];
@@ -53,8 +64,11 @@ static void test_exe_path_null_buffer_with_wrong_length(void **state) {
   int result = exe_path(NULL, 42);
   assert_int_not_equal(result, 0);
 }
+#endif
 
 const size_t TMP_FILE_SIZE = 1024 * 16;
+// the tree hash after a payload of a single block
+const size_t HASH_SECTION_SIZE = RTAD_HASH_SIZE + sizeof(struct rtad_hash_hdr);
 // Just create, not delete.
 // There is not file delete function in standard C library.
 static void __create_tmp_file(const char *filename) {
@@ -91,6 +105,17 @@ static int __file_content_cmp(const char *path1, const char *path2) {
   return 0;
 }
 
+// -1 when the file can't be opened
+static off_t __file_length(const char *path) {
+  int fd = file_open(path);
+  if (fd < 0) {
+    return -1;
+  }
+  off_t length = fd_length(fd);
+  file_close(fd);
+  return length;
+}
+
 static void __create_tmp_file_append_data_hdr(const char *filename,
                                               size_t data_length) {
   __create_tmp_file(filename);
@@ -105,139 +130,312 @@ static void __create_tmp_file_append_data_hdr(const char *filename,
   fclose(fp);
 }
 
-static void test_file_truncate_ok(void **state) {
+// Create a TMP_FILE_SIZE file followed by a sparse payload of data_size bytes
+// and a trailer, so large payloads don't fill the disk. The payload starts
+// with "HEAD" and ends with "TAIL". Returns 0 where sparse files are not
+// available.
+static int __create_sparse_file_append_trailer(const char *filename,
+                                               uint64_t data_size) {
+#if defined(_WIN32)
+  // NTFS only creates sparse files on request
+  (void)filename;
+  (void)data_size;
+  return 0;
+#else
+  __create_tmp_file(filename);
+  FILE *fp = fopen(filename, "ab");
+  assert_non_null(fp);
+  fwrite("HEAD", 1, 4, fp);
+  fflush(fp);
+  if (ftruncate(fileno(fp), (off_t)(TMP_FILE_SIZE + data_size - 4)) != 0) {
+    fclose(fp);
+    return 0;
+  }
+  fseeko(fp, 0, SEEK_END);
+  fwrite("TAIL", 1, 4, fp);
+  struct rtad_trailer trailer = {
+      .data_size = data_size,
+      .version = RTAD_VERSION,
+      .trailer_size = RTAD_TRAILER_SIZE,
+  };
+  memcpy(trailer.magic, RTAD_MAGIC_V2, sizeof(trailer.magic));
+  fwrite(&trailer, sizeof(trailer), 1, fp);
+  fclose(fp);
+  return 1;
+#endif
+}
+
+static void test_fd_truncate_ok(void **state) {
   (void)state; /* unused */
   __create_tmp_file(__FUNCTION__);
-  int result = file_truncate(__FUNCTION__, TMP_FILE_SIZE / 2);
-  assert_int_equal(result, 0);
-  ssize_t length = file_length(__FUNCTION__);
-  assert_int_equal(length, TMP_FILE_SIZE / 2);
+  int fd = file_open_rw(__FUNCTION__);
+  assert_true(fd >= 0);
+  assert_int_equal(fd_truncate(fd, TMP_FILE_SIZE / 2), 0);
+  assert_int_equal(fd_length(fd), TMP_FILE_SIZE / 2);
+  file_close(fd);
+  assert_int_equal(__file_length(__FUNCTION__), TMP_FILE_SIZE / 2);
 }
 
-static void test_file_truncate_wrong_path(void **state) {
+static void test_fd_truncate_invalid_fd(void **state) {
   (void)state; /* unused */
-  int result = file_truncate("non_existing_file", 1024);
-  assert_int_equal(result, -1);
+  assert_int_equal(fd_truncate(-1, 1024), -1);
 }
 
-static void test_file_truncate_null_path(void **state) {
+static void test_fd_length_ok(void **state) {
   (void)state; /* unused */
-  int result = file_truncate(NULL, 1024);
-  assert_int_equal(result, -1);
+  __create_tmp_file(__FUNCTION__);
+  int fd = file_open(__FUNCTION__);
+  assert_true(fd >= 0);
+  assert_int_equal(fd_length(fd), TMP_FILE_SIZE);
+  file_close(fd);
 }
 
-static void test_file_length_ok(void **state) {
+static void test_fd_length_invalid_fd(void **state) {
   (void)state; /* unused */
-  __create_tmp_file(__FUNCTION__);
-  ssize_t length = file_length(__FUNCTION__);
-  assert_int_equal(length, TMP_FILE_SIZE);
+  assert_int_equal(fd_length(-1), -1);
 }
 
-static void test_file_length_wrong_path(void **state) {
+static void test_file_copy_exe_no_data(void **state) {
   (void)state; /* unused */
-  ssize_t length = file_length("non_existing_file");
-  assert_int_equal(length, -1);
+  __create_tmp_file(__FUNCTION__);
+  const char *dest_path = "test_file_copy_exe_no_data_dest";
+
+  // without payload, the whole file is the executable
+  rtad_file *src = rtad_open(__FUNCTION__);
+  assert_non_null(src);
+  struct rtad_file *dest = file_copy_exe(src, dest_path);
+  assert_non_null(dest);
+  assert_int_equal(rtad_close(dest), 0);
+  rtad_close(src);
+  assert_int_equal(__file_length(dest_path), __file_length(__FUNCTION__));
+  assert_int_equal(__file_content_cmp(__FUNCTION__, dest_path), 0);
 }
 
-static void test_file_length_null_path(void **state) {
+static void test_fd_copy_invalid_fd(void **state) {
   (void)state; /* unused */
-  ssize_t length = file_length(NULL);
-  assert_int_equal(length, -1);
+  int dest_fd = file_create("test_fd_copy_invalid_fd_dest");
+  assert_true(dest_fd >= 0);
+  assert_int_equal(fd_copy(-1, dest_fd, 10, COPY_ALL), -1);
+  assert_int_equal(fd_copy(dest_fd, -1, 10, COPY_ALL), -1);
+  file_close(dest_fd);
 }
 
-static void test_file_copy_ok(void **state) {
+static void __fd_copy_with_methods(const char *src_path, const char *dest_path,
+                                   unsigned methods) {
+  int src_fd = file_open(src_path);
+  assert_true(src_fd >= 0);
+  int dest_fd = file_create(dest_path);
+  assert_true(dest_fd >= 0);
+  assert_int_equal(fd_copy(src_fd, dest_fd, fd_length(src_fd), methods), 0);
+  file_close(src_fd);
+  file_close(dest_fd);
+  assert_int_equal(__file_content_cmp(src_path, dest_path), 0);
+  assert_int_equal(__file_length(src_path), __file_length(dest_path));
+}
+
+static void test_fd_copy_every_method(void **state) {
   (void)state; /* unused */
   __create_tmp_file(__FUNCTION__);
-  const char *dest_path = "test_file_copy_ok_dest";
-
-  int result = file_copy(__FUNCTION__, dest_path);
-  assert_int_equal(result, 0);
-  ssize_t length_src = file_length(__FUNCTION__);
-  ssize_t length_dest = file_length(dest_path);
-  assert_int_equal(length_src, length_dest);
+  const unsigned methods[] = {0,           COPY_REFLINK, COPY_RANGE,
+                              COPY_SENDFILE, COPY_SPARSE, COPY_ALL};
+  for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+    __fd_copy_with_methods(__FUNCTION__, "test_fd_copy_every_method_dest",
+                           methods[i]);
+  }
 }
 
-static void test_file_copy_wrong_src_path(void **state) {
-  int result =
-      file_copy("non_existing_file", "test_file_copy_wrong_src_path_dest");
-  assert_int_equal(result, -1);
+#if defined(__linux__) && defined(FICLONE)
+// a reflink that fails, across filesystems or on one without shared extents,
+// falls back to the other methods
+static void __fd_copy_reflink_fallback(const char *src_path,
+                                       const char *dest_path) {
+  int src_fd = file_open(src_path);
+  assert_true(src_fd >= 0);
+  int dest_fd = file_create(dest_path);
+  assert_true(dest_fd >= 0);
+  if (ioctl(dest_fd, FICLONE, src_fd) != 0) {
+    assert_true(errno == EOPNOTSUPP || errno == EXDEV || errno == EINVAL ||
+                errno == ENOTTY);
+  }
+  assert_int_equal(fd_copy(src_fd, dest_fd, 1000, COPY_REFLINK), 0);
+  assert_int_equal(fd_length(dest_fd), 1000);
+  assert_int_equal(fd_copy(src_fd, dest_fd, fd_length(src_fd), COPY_REFLINK),
+                   0);
+  file_close(src_fd);
+  file_close(dest_fd);
+  assert_int_equal(__file_content_cmp(src_path, dest_path), 0);
 }
 
-static void test_file_copy_cannot_create_dest(void **state) {
+static void test_fd_copy_reflink_fallback(void **state) {
   (void)state; /* unused */
   __create_tmp_file(__FUNCTION__);
-  // Try to copy to a directory
-  int result = file_copy(__FUNCTION__, ".");
-  assert_int_equal(result, -1);
+  __fd_copy_reflink_fallback(__FUNCTION__,
+                             "test_fd_copy_reflink_fallback_dest");
+  // EXDEV, if the shared memory is another filesystem
+  struct stat src_stat, shm_stat;
+  const char *shm_path = "/dev/shm/test_fd_copy_reflink_fallback_dest";
+  if (stat(__FUNCTION__, &src_stat) == 0 && stat("/dev/shm", &shm_stat) == 0 &&
+      src_stat.st_dev != shm_stat.st_dev) {
+    __fd_copy_reflink_fallback(__FUNCTION__, shm_path);
+    unlink(shm_path);
+  }
 }
+#endif
 
-static void test_file_copy_self_ok(void **state) {
+static void test_fd_copy_sparse_file(void **state) {
   (void)state; /* unused */
-  const char *dest_path = "test_file_copy_self_ok_dest";
-
-  int result = file_copy_self(dest_path);
-  assert_int_equal(result, 0);
-  char exe_path_buffer[PATH_MAX];
-  exe_path(exe_path_buffer, sizeof(exe_path_buffer));
-  assert_int_equal(__file_content_cmp(exe_path_buffer, dest_path), 0);
+  // data, a hole, data and a trailing hole
+  FILE *fp = fopen(__FUNCTION__, "wb");
+  assert_non_null(fp);
+  fwrite("head", 1, 4, fp);
+  fseeko(fp, 1024 * 1024, SEEK_SET);
+  fwrite("middle", 1, 6, fp);
+  fclose(fp);
+  int fd = file_open_rw(__FUNCTION__);
+  assert_true(fd >= 0);
+  assert_int_equal(fd_truncate(fd, 3 * 1024 * 1024), 0);
+  file_close(fd);
+  const unsigned methods[] = {COPY_SPARSE, COPY_SPARSE | COPY_RANGE, COPY_ALL};
+  for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+    __fd_copy_with_methods(__FUNCTION__, "test_fd_copy_sparse_file_dest",
+                           methods[i]);
+  }
 }
 
-static void test_file_copy_self_null_dest(void **state) {
+static void test_fd_copy_prefix(void **state) {
   (void)state; /* unused */
-  int result = file_copy_self(NULL);
-  assert_int_equal(result, -1);
+  __create_tmp_file(__FUNCTION__);
+  int src_fd = file_open(__FUNCTION__);
+  int dest_fd = file_create("test_fd_copy_prefix_dest");
+  assert_true(src_fd >= 0 && dest_fd >= 0);
+  assert_int_equal(fd_copy(src_fd, dest_fd, 1000, COPY_ALL), 0);
+  file_close(src_fd);
+  file_close(dest_fd);
+  assert_int_equal(__file_length("test_fd_copy_prefix_dest"), 1000);
 }
 
-static void test_file_copy_self_invalid_dest(void **state) {
+static void test_fd_copy_range_offsets(void **state) {
   (void)state; /* unused */
-  // Try to copy to a directory
-  int result = file_copy_self(".");
-  assert_int_equal(result, -1);
+  __create_tmp_file(__FUNCTION__);
+  const unsigned methods[] = {0, COPY_RANGE, COPY_SENDFILE};
+  for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+    int src_fd = file_open(__FUNCTION__);
+    int dest_fd = file_create("test_fd_copy_range_offsets_dest");
+    assert_true(src_fd >= 0 && dest_fd >= 0);
+    assert_int_equal(
+        fd_copy_range(src_fd, 100, dest_fd, 10, 300, methods[i]), 0);
+    // past the end of the source
+    assert_int_equal(fd_copy_range(src_fd, TMP_FILE_SIZE - 1, dest_fd, 0, 2,
+                                   methods[i]),
+                     -1);
+    char buf[300];
+    assert_int_equal(file_pread(src_fd, buf, 300, 100), 0);
+    file_close(dest_fd);
+    int check_fd = file_open("test_fd_copy_range_offsets_dest");
+    char copied[300];
+    assert_int_equal(file_pread(check_fd, copied, 300, 10), 0);
+    assert_memory_equal(buf, copied, 300);
+    file_close(check_fd);
+    file_close(src_fd);
+  }
 }
 
-static void test_file_append_data_20_bytes(void **state) {
+static void test_io_batch(void **state) {
   (void)state; /* unused */
   __create_tmp_file(__FUNCTION__);
-  const char *data = "12345678901234567890";
-  size_t data_size = strlen(data);
-  int result = file_append_data(__FUNCTION__, data, data_size);
-  assert_int_equal(result, 0);
-  assert_int_equal(file_length(__FUNCTION__), TMP_FILE_SIZE + data_size);
+  enum { COUNT = 100 };
+  static char bufs[COUNT][64];
+  struct rtad_io ios[COUNT];
+  char *arena = (char *)bufs;
+  // with the ring when the kernel has it, half in the registered buffer
+  struct rtad_ring *rings[2] = {ring_open(8, arena, sizeof(bufs) / 2), NULL};
+  for (size_t r = 0; r < 2; r++) {
+    int fd = file_open(__FUNCTION__);
+    assert_true(fd >= 0);
+    memset(bufs, 0, sizeof(bufs));
+    for (size_t i = 0; i < COUNT; i++) {
+      ios[i] = (struct rtad_io){.fd = fd,
+                                .buf = bufs[i],
+                                .size = 1 + i % 64,
+                                .offset = (off_t)(i * 37 % (TMP_FILE_SIZE - 64))};
+    }
+    assert_int_equal(io_batch(rings[r], ios, COUNT), 0);
+    for (size_t i = 0; i < COUNT; i++) {
+      assert_int_equal(ios[i].transferred, ios[i].size);
+      for (size_t j = 0; j < ios[i].size; j++) {
+        assert_int_equal((unsigned char)bufs[i][j],
+                         (unsigned char)(ios[i].offset + j));
+      }
+    }
+    // past the end of the file
+    ios[0].offset = TMP_FILE_SIZE - 1;
+    ios[0].size = 2;
+    assert_int_equal(io_batch(rings[r], ios, 1), -1);
+    assert_int_equal(ios[0].state, IO_FAILED);
+    file_close(fd);
+  }
+  ring_close(rings[0]);
 }
 
-static void test_file_append_data_1_byte(void **state) {
+static void test_file_copy_exe_ok(void **state) {
   (void)state; /* unused */
-  __create_tmp_file(__FUNCTION__);
-  const char data = 'A';
-  size_t data_size = 1;
-  int result = file_append_data(__FUNCTION__, &data, data_size);
-  assert_int_equal(result, 0);
-  assert_int_equal(file_length(__FUNCTION__), TMP_FILE_SIZE + data_size);
+  const char *dest_path = "test_file_copy_exe_ok_dest";
+
+  // the test executable has no payload, it's copied whole
+  struct rtad_file *dest = file_copy_exe(rtad_self(), dest_path);
+  assert_non_null(dest);
+  assert_int_equal(rtad_close(dest), 0);
+#if defined(__linux__)
+  const char *self_path = "/proc/self/exe";
+#else
+  char self_path[PATH_MAX];
+  assert_int_equal(exe_path(self_path, sizeof(self_path)), 0);
+#endif
+  assert_int_equal(__file_content_cmp(self_path, dest_path), 0);
 }
 
-static void test_file_append_data_null_path(void **state) {
+static void test_file_copy_exe_null_args(void **state) {
   (void)state; /* unused */
-  const char data = 'A';
-  size_t data_size = 1;
-  int result = file_append_data(NULL, &data, data_size);
-  assert_int_equal(result, -1);
+  assert_null(file_copy_exe(NULL, "test_file_copy_exe_null_args_dest"));
+  assert_null(file_copy_exe(rtad_self(), NULL));
 }
 
-static void test_file_append_data_null_data(void **state) {
+static void test_file_copy_exe_invalid_dest(void **state) {
+  (void)state; /* unused */
+  // Try to copy to a directory
+  assert_null(file_copy_exe(rtad_self(), "."));
+}
+
+static void test_fd_map_unaligned_offset(void **state) {
   (void)state; /* unused */
   __create_tmp_file(__FUNCTION__);
-  size_t data_size = 1;
-  int result = file_append_data(__FUNCTION__, NULL, data_size);
-  assert_int_equal(result, -1);
+  // an offset that is not a multiple of any page size
+  const off_t offset = 4097;
+  const size_t size = 100;
+  int fd = file_open(__FUNCTION__);
+  assert_true(fd >= 0);
+  const char *data = fd_map(fd, offset, size);
+  // the mapping outlives the descriptor
+  file_close(fd);
+  assert_non_null(data);
+  for (size_t i = 0; i < size; i++) {
+    assert_int_equal((unsigned char)data[i], (unsigned char)(offset + i));
+  }
+  assert_int_equal(file_unmap(data, size), 0);
 }
 
-static void test_file_append_data_zero_size(void **state) {
+static void test_fd_map_invalid_fd(void **state) {
+  (void)state; /* unused */
+  assert_null(fd_map(-1, 0, 1));
+}
+
+static void test_fd_map_zero_size(void **state) {
   (void)state; /* unused */
   __create_tmp_file(__FUNCTION__);
-  const char data = 'A';
-  size_t data_size = 0;
-  int result = file_append_data(__FUNCTION__, &data, data_size);
-  assert_int_equal(result, -1);
+  int fd = file_open(__FUNCTION__);
+  assert_true(fd >= 0);
+  assert_null(fd_map(fd, 0, 0));
+  file_close(fd);
 }
 
 static void test_rtad_extract_hdr_no_buffer(void **state) {
@@ -249,14 +447,14 @@ static void test_rtad_extract_hdr_no_buffer(void **state) {
 
 static void test_rtad_extract_hdr_non_existing_file(void **state) {
   (void)state; /* unused */
-  struct rtad_hdr hdr;
+  struct rtad_trailer hdr;
   int result = rtad_extract_hdr("non_existing_file", &hdr);
   assert_int_equal(result, -1);
 }
 
 static void test_rtad_extract_hdr_invalid_file(void **state) {
   (void)state; /* unused */
-  struct rtad_hdr hdr;
+  struct rtad_trailer hdr;
   int result = rtad_extract_hdr(".", &hdr);
   assert_int_equal(result, -1);
 }
@@ -264,14 +462,14 @@ static void test_rtad_extract_hdr_invalid_file(void **state) {
 static void test_rtad_extract_hdr_invalid_hdr(void **state) {
   (void)state; /* unused */
   __create_tmp_file(__FUNCTION__);
-  struct rtad_hdr hdr;
+  struct rtad_trailer hdr;
   int result = rtad_extract_hdr(__FUNCTION__, &hdr);
   assert_int_equal(result, -1);
 }
 
 static void test_rtad_extract_hdr_null_path(void **state) {
   (void)state; /* unused */
-  struct rtad_hdr hdr;
+  struct rtad_trailer hdr;
   int result = rtad_extract_hdr(NULL, &hdr);
   assert_int_equal(result, -1);
 }
@@ -286,7 +484,7 @@ static void test_rtad_extract_hdr_too_small_file(void **state) {
     fputc(0, fp);
   }
   fclose(fp);
-  struct rtad_hdr hdr;
+  struct rtad_trailer hdr;
   int result = rtad_extract_hdr(filename, &hdr);
   assert_int_equal(result, -1);
 }
@@ -294,10 +492,12 @@ static void test_rtad_extract_hdr_too_small_file(void **state) {
 static void test_rtad_extract_hdr_ok(void **state) {
   (void)state; /* unused */
   __create_tmp_file_append_data_hdr(__FUNCTION__, 10);
-  struct rtad_hdr hdr_out;
+  struct rtad_trailer hdr_out;
   int result = rtad_extract_hdr(__FUNCTION__, &hdr_out);
   assert_int_equal(result, 0);
   assert_int_equal(hdr_out.data_size, 10);
+  assert_int_equal(hdr_out.version, 1);
+  assert_int_equal(hdr_out.trailer_size, RTAD_HDR_SIZE);
   assert_memory_equal(hdr_out.magic, RTAD_MAGIC, RTAD_MAGIC_SIZE);
 }
 
@@ -360,10 +560,10 @@ static void test_rtad_truncate_data_file_smaller_than_hdr(void **state) {
 static void test_rtad_truncate_data_ok(void **state) {
   (void)state; /* unused */
   __create_tmp_file_append_data_hdr(__FUNCTION__, 20);
-  ssize_t length_before = file_length(__FUNCTION__);
+  ssize_t length_before = __file_length(__FUNCTION__);
   int result = rtad_truncate_data(__FUNCTION__);
   assert_int_equal(result, 0);
-  ssize_t length_after = file_length(__FUNCTION__);
+  ssize_t length_after = __file_length(__FUNCTION__);
   assert_int_equal(length_before - length_after, 20 + sizeof(struct rtad_hdr));
 }
 
@@ -391,11 +591,43 @@ static void test_rtad_append_packed_data_zero_size(void **state) {
 
 static void test_rtad_append_packed_data_larger_than_uint32_max(void **state) {
   (void)state; /* unused */
-  __create_tmp_file(__FUNCTION__);
-  const char data[] = "data";
-  int result =
-      rtad_append_packed_data(__FUNCTION__, data, (size_t)UINT32_MAX + 1);
-  assert_int_equal(result, -1);
+  if (!__create_sparse_file_append_trailer(__FUNCTION__,
+                                           (uint64_t)UINT32_MAX + 4097)) {
+    skip();
+  }
+  struct rtad_trailer hdr_out;
+  int result = rtad_extract_hdr(__FUNCTION__, &hdr_out);
+  assert_int_equal(result, 0);
+  assert_true(hdr_out.data_size == (uint64_t)UINT32_MAX + 4097);
+  assert_int_equal(rtad_validate_hdr(__FUNCTION__), 0);
+}
+
+static void test_rtad_map_data_larger_than_uint32_max(void **state) {
+  (void)state; /* unused */
+  const uint64_t data_size = (uint64_t)UINT32_MAX + 4097;
+  if (sizeof(size_t) < sizeof(uint64_t) ||
+      !__create_sparse_file_append_trailer(__FUNCTION__, data_size)) {
+    skip();
+  }
+  const char *out_data = NULL;
+  size_t out_data_size = 0;
+  int result = rtad_map_data(__FUNCTION__, &out_data, &out_data_size);
+  assert_int_equal(result, 0);
+  assert_true(out_data_size == data_size);
+  // only the first and the last pages are touched
+  assert_memory_equal(out_data, "HEAD", 4);
+  assert_memory_equal(out_data + out_data_size - 4, "TAIL", 4);
+  assert_int_equal(rtad_unmap_data(out_data, out_data_size), 0);
+}
+
+static void test_rtad_truncate_data_larger_than_uint32_max(void **state) {
+  (void)state; /* unused */
+  if (!__create_sparse_file_append_trailer(__FUNCTION__,
+                                           (uint64_t)UINT32_MAX + 4097)) {
+    skip();
+  }
+  assert_int_equal(rtad_truncate_data(__FUNCTION__), 0);
+  assert_int_equal(__file_length(__FUNCTION__), TMP_FILE_SIZE);
 }
 
 static void test_rtad_append_packed_data_ok(void **state) {
@@ -406,16 +638,18 @@ static void test_rtad_append_packed_data_ok(void **state) {
   int result = rtad_append_packed_data(__FUNCTION__, data, data_size);
   assert_int_equal(result, 0);
   // Validate by extracting header
-  struct rtad_hdr hdr_out;
+  struct rtad_trailer hdr_out;
   result = rtad_extract_hdr(__FUNCTION__, &hdr_out);
   assert_int_equal(result, 0);
   assert_int_equal(hdr_out.data_size, data_size);
-  assert_memory_equal(hdr_out.magic, RTAD_MAGIC, RTAD_MAGIC_SIZE);
+  assert_int_equal(hdr_out.version, RTAD_VERSION);
+  assert_memory_equal(hdr_out.magic, RTAD_MAGIC_V2, RTAD_MAGIC_SIZE);
   // check the appended data
   FILE *fp = fopen(__FUNCTION__, "rb");
   assert_non_null(fp);
   // Seek to the start of appended data
-  fseeko(fp, -(ssize_t)(data_size + sizeof(struct rtad_hdr)), SEEK_END);
+  fseeko(fp, -(ssize_t)(data_size + HASH_SECTION_SIZE + RTAD_TRAILER_SIZE),
+         SEEK_END);
   char *data_buf = (char *)malloc(data_size);
   long bytes = fread(data_buf, 1, data_size, fp);
   assert_int_equal(bytes, data_size);
@@ -455,16 +689,18 @@ static void test_rtad_copy_self_with_data_ok(void **state) {
   int result = rtad_copy_self_with_data(dest_path, data, data_size);
   assert_int_equal(result, 0);
   // Validate by extracting header
-  struct rtad_hdr hdr_out;
+  struct rtad_trailer hdr_out;
   result = rtad_extract_hdr(dest_path, &hdr_out);
   assert_int_equal(result, 0);
   assert_int_equal(hdr_out.data_size, data_size);
-  assert_memory_equal(hdr_out.magic, RTAD_MAGIC, RTAD_MAGIC_SIZE);
+  assert_int_equal(hdr_out.version, RTAD_VERSION);
+  assert_memory_equal(hdr_out.magic, RTAD_MAGIC_V2, RTAD_MAGIC_SIZE);
   // check the appended data
   FILE *fp = fopen(dest_path, "rb");
   assert_non_null(fp);
   // Seek to the start of appended data
-  fseeko(fp, -(ssize_t)(data_size + sizeof(struct rtad_hdr)), SEEK_END);
+  fseeko(fp, -(ssize_t)(data_size + HASH_SECTION_SIZE + RTAD_TRAILER_SIZE),
+         SEEK_END);
   char *data_buf = (char *)malloc(data_size);
   long bytes = fread(data_buf, 1, data_size, fp);
   assert_int_equal(bytes, data_size);
@@ -511,6 +747,20 @@ static void test_rtad_extract_data_ok(void **state) {
   rtad_free_extracted_data(out_data);
 }
 
+static void test_rtad_extract_data_legacy_hdr(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file_append_data_hdr(__FUNCTION__, 20);
+  char *out_data = NULL;
+  size_t out_data_size = 0;
+  int result = rtad_extract_data(__FUNCTION__, &out_data, &out_data_size);
+  assert_int_equal(result, 0);
+  assert_int_equal(out_data_size, 20);
+  for (size_t i = 0; i < out_data_size; i++) {
+    assert_int_equal((unsigned char)out_data[i], i);
+  }
+  rtad_free_extracted_data(out_data);
+}
+
 // just ignore rtad_free_extracted_data error case, as it only frees memory
 
 static void test_rtad_extract_self_data_null_out_data(void **state) {
@@ -551,26 +801,2132 @@ static void test_rtad_extract_self_data_ok(void **state) {
   rtad_free_extracted_data(out_data);
 }
 
+static void test_rtad_map_data_null_exe_path(void **state) {
+  (void)state; /* unused */
+  const char *out_data = NULL;
+  size_t out_data_size = 0;
+  int result = rtad_map_data(NULL, &out_data, &out_data_size);
+  assert_int_equal(result, -1);
+}
+
+static void test_rtad_map_data_null_out_data(void **state) {
+  (void)state; /* unused */
+  size_t out_data_size = 0;
+  int result = rtad_map_data(__FUNCTION__, NULL, &out_data_size);
+  assert_int_equal(result, -1);
+}
+
+static void test_rtad_map_data_invalid_hdr(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file(__FUNCTION__);
+  const char *out_data = NULL;
+  size_t out_data_size = 0;
+  int result = rtad_map_data(__FUNCTION__, &out_data, &out_data_size);
+  assert_int_equal(result, -1);
+  assert_null(out_data);
+}
+
+static void test_rtad_map_data_ok(void **state) {
+  (void)state; /* unused */
+  static const char data[] = "Hello, RTAD!";
+  size_t data_size = sizeof(data) - 1;
+  // odd sized prefix, so the payload doesn't start on a page boundary
+  FILE *fp = fopen(__FUNCTION__, "wb");
+  assert_non_null(fp);
+  for (size_t i = 0; i < 1001; i++) {
+    fputc(i, fp);
+  }
+  fclose(fp);
+  rtad_append_packed_data(__FUNCTION__, data, data_size);
+  const char *out_data = NULL;
+  size_t out_data_size = 0;
+  int result = rtad_map_data(__FUNCTION__, &out_data, &out_data_size);
+  assert_int_equal(result, 0);
+  assert_int_equal(out_data_size, data_size);
+  assert_memory_equal(out_data, data, data_size);
+  assert_int_equal(rtad_unmap_data(out_data, out_data_size), 0);
+}
+
+static void test_rtad_unmap_data_null_data(void **state) {
+  (void)state; /* unused */
+  assert_int_equal(rtad_unmap_data(NULL, 1), -1);
+}
+
+static void test_rtad_map_self_data_no_valid_rtad_data(void **state) {
+  (void)state; /* unused */
+  const char *out_data = NULL;
+  size_t out_data_size = 0;
+  int result = rtad_map_self_data(&out_data, &out_data_size);
+  assert_int_equal(result, -1);
+}
+
+static void test_toc_build_duplicated_names(void **state) {
+  (void)state; /* unused */
+  struct rtad_toc_item items[3] = {
+      {.name = "a"}, {.name = "b"}, {.name = "a"}};
+  size_t toc_size = 0;
+  assert_null(toc_build(items, 3, &toc_size));
+}
+
+static void test_toc_build_ok(void **state) {
+  (void)state; /* unused */
+  struct rtad_toc_item items[3] = {
+      {.name = "a"}, {.name = "bb"}, {.name = "ccc"}};
+  size_t toc_size = 0;
+  char *toc = toc_build(items, 3, &toc_size);
+  assert_non_null(toc);
+  struct rtad_toc_hdr hdr;
+  memcpy(&hdr, toc, sizeof(hdr));
+  assert_int_equal(hdr.entry_count, 3);
+  assert_int_equal(hdr.bucket_count, 4);
+  assert_int_equal(hdr.names_size, 6);
+  assert_int_equal(toc_size, sizeof(hdr) + 5 * sizeof(uint32_t) +
+                                 3 * sizeof(struct rtad_toc_entry) + 6);
+  free(toc);
+}
+
+static void test_lz_roundtrip(void **state) {
+  (void)state; /* unused */
+  enum { SIZE = 200000 };
+  static char src[SIZE];
+  static char compressed[SIZE + SIZE / 255 + 16];
+  static char out[SIZE];
+  // text-like data, a long run of one byte and noise
+  for (size_t i = 0; i < SIZE; i++) {
+    src[i] = i < SIZE / 2 ? "lorem ipsum dolor sit amet "[i % 27]
+                          : (i < SIZE * 3 / 4 ? 'x' : (char)(i * 7919 >> 3));
+  }
+  size_t sizes[] = {0, 1, 3, 4, 15, 16, 300, SIZE};
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    size_t size = lz_compress(src, sizes[i], compressed, sizeof(compressed));
+    assert_true(size > 0);
+    assert_int_equal(lz_decompress(compressed, size, out, sizes[i]), 0);
+    assert_memory_equal(out, src, sizes[i]);
+  }
+  size_t size = lz_compress(src, SIZE, compressed, sizeof(compressed));
+  assert_true(size < SIZE / 4);
+  // the output doesn't fit
+  assert_int_equal(lz_compress(src, SIZE, compressed, 100), 0);
+}
+
+static void test_lz_decompress_corrupted(void **state) {
+  (void)state; /* unused */
+  const char src[] = "abcabcabcabcabcabcabcabcabcabc";
+  char compressed[64];
+  char out[sizeof(src)];
+  size_t size = lz_compress(src, sizeof(src), compressed, sizeof(compressed));
+  assert_true(size > 0);
+  // wrong size, truncated input, offset before the start
+  assert_int_equal(lz_decompress(compressed, size, out, sizeof(src) - 1), -1);
+  assert_int_equal(lz_decompress(compressed, size - 1, out, sizeof(src)), -1);
+  const char bad[] = {0x10, 'a', 0x05, 0x00};
+  assert_int_equal(lz_decompress(bad, sizeof(bad), out, 5), -1);
+}
+
+static void __check_entry_read(rtad_file *file, const char *name,
+                               const char *data, size_t size) {
+  struct rtad_entry entry;
+  assert_int_equal(rtad_find(file, name, &entry), 0);
+  assert_int_equal(entry.raw_size, size);
+  char *out_data = NULL;
+  size_t out_data_size = 0;
+  assert_int_equal(rtad_entry_read(file, &entry, &out_data, &out_data_size),
+                   0);
+  assert_int_equal(out_data_size, size);
+  assert_memory_equal(out_data, data, size);
+  rtad_free_extracted_data(out_data);
+}
+
+static void test_rtad_writer_compressed_entries(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file(__FUNCTION__);
+  enum { SIZE = 10000 };
+  static char data[SIZE];
+  for (size_t i = 0; i < SIZE; i++) {
+    data[i] = "0123456789abcdef"[(i / 3) % 16];
+  }
+  rtad_writer *writer = rtad_writer_open(__FUNCTION__);
+  assert_non_null(writer);
+  assert_int_equal(rtad_writer_set_codec(writer, 99, 0), -1);
+  assert_int_equal(rtad_writer_set_codec(writer, RTAD_CODEC_LZ, 1024), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "packed"), 0);
+  // written in pieces that don't match the chunks
+  for (size_t i = 0; i < SIZE; i += 777) {
+    size_t n = SIZE - i < 777 ? SIZE - i : 777;
+    assert_int_equal(rtad_writer_write(writer, data + i, n), 0);
+  }
+  assert_int_equal(rtad_writer_begin_entry(writer, "empty"), 0);
+  assert_int_equal(rtad_writer_set_codec(writer, RTAD_CODEC_NONE, 0), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "plain"), 0);
+  assert_int_equal(rtad_writer_write(writer, data, 100), 0);
+  assert_int_equal(rtad_writer_close(writer), 0);
+
+  rtad_file *file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  struct rtad_entry entry;
+  assert_int_equal(rtad_find(file, "packed", &entry), 0);
+  assert_true(entry.flags & RTAD_ENTRY_CHUNKED);
+  assert_true(entry.size < SIZE / 4);
+  __check_entry_read(file, "packed", data, SIZE);
+  __check_entry_read(file, "empty", data, 0);
+  __check_entry_read(file, "plain", data, 100);
+  assert_int_equal(rtad_find(file, "plain", &entry), 0);
+  assert_false(entry.flags & RTAD_ENTRY_CHUNKED);
+
+  // a range over three chunks, only those are decoded
+  assert_int_equal(rtad_find(file, "packed", &entry), 0);
+  rtad_reader *reader = rtad_reader_open(file, &entry);
+  assert_non_null(reader);
+  assert_int_equal(rtad_reader_size(reader), SIZE);
+  char buf[2500];
+  size_t read_size = 0;
+  assert_int_equal(rtad_reader_pread(reader, buf, sizeof(buf), 1000, &read_size),
+                   0);
+  assert_int_equal(read_size, sizeof(buf));
+  assert_memory_equal(buf, data + 1000, sizeof(buf));
+  assert_int_equal(rtad_reader_pread(reader, buf, sizeof(buf), SIZE - 10,
+                                     &read_size),
+                   0);
+  assert_int_equal(read_size, 10);
+  assert_memory_equal(buf, data + SIZE - 10, 10);
+  rtad_reader_close(reader);
+  rtad_close(file);
+}
+
+static void test_rtad_writer_compressed_data(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file(__FUNCTION__);
+  static char data[100000];
+  memset(data, 'z', sizeof(data));
+  rtad_writer *writer = rtad_writer_open(__FUNCTION__);
+  assert_non_null(writer);
+  assert_int_equal(rtad_writer_set_codec(writer, RTAD_CODEC_LZ, 0), 0);
+  assert_int_equal(rtad_writer_write(writer, data, sizeof(data)), 0);
+  assert_int_equal(rtad_writer_close(writer), 0);
+  assert_true(__file_length(__FUNCTION__) < (off_t)TMP_FILE_SIZE + 2000);
+
+  char *out_data = NULL;
+  size_t out_data_size = 0;
+  assert_int_equal(rtad_extract_data(__FUNCTION__, &out_data, &out_data_size),
+                   0);
+  assert_int_equal(out_data_size, sizeof(data));
+  assert_memory_equal(out_data, data, sizeof(data));
+  rtad_free_extracted_data(out_data);
+  // the stored bytes are not the data
+  const char *mapped = NULL;
+  size_t mapped_size = 0;
+  assert_int_equal(rtad_map_data(__FUNCTION__, &mapped, &mapped_size), -1);
+}
+
+static char __threaded_data[300000];
+
+static void __write_threaded(const char *path, unsigned threads) {
+  __create_tmp_file(path);
+  rtad_writer *writer = rtad_writer_open(path);
+  assert_non_null(writer);
+  assert_int_equal(rtad_writer_set_threads(writer, threads), 0);
+  assert_int_equal(rtad_writer_set_codec(writer, RTAD_CODEC_LZ, 4096), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "small_chunks"), 0);
+  assert_int_equal(rtad_writer_write(writer, __threaded_data,
+                                     sizeof(__threaded_data)),
+                   0);
+  assert_int_equal(rtad_writer_set_codec(writer, RTAD_CODEC_NONE, 0), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "raw"), 0);
+  assert_int_equal(rtad_writer_write(writer, "raw", 3), 0);
+  assert_int_equal(rtad_writer_set_codec(writer, RTAD_CODEC_LZ, 0), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "default_chunks"), 0);
+  assert_int_equal(rtad_writer_write(writer, __threaded_data,
+                                     sizeof(__threaded_data)),
+                   0);
+  assert_int_equal(rtad_writer_close(writer), 0);
+}
+
+static void test_rtad_writer_threads_same_output(void **state) {
+  (void)state; /* unused */
+  // compressible runs and random bytes, so some chunks are stored as is
+  uint32_t x = 12345;
+  for (size_t i = 0; i < sizeof(__threaded_data); i++) {
+    x = x * 1103515245 + 12345;
+    __threaded_data[i] = (i / 20000) % 2 ? (char)(x >> 24) : (char)(i % 13);
+  }
+  char path_1[64], path_4[64], path_0[64];
+  snprintf(path_1, sizeof(path_1), "%s_1", __FUNCTION__);
+  snprintf(path_4, sizeof(path_4), "%s_4", __FUNCTION__);
+  snprintf(path_0, sizeof(path_0), "%s_0", __FUNCTION__);
+  __write_threaded(path_1, 1);
+  __write_threaded(path_4, 4);
+  __write_threaded(path_0, 0);
+  assert_int_equal(__file_content_cmp(path_1, path_4), 0);
+  assert_int_equal(__file_content_cmp(path_1, path_0), 0);
+
+  rtad_file *file = rtad_open(path_4);
+  assert_non_null(file);
+  __check_entry_read(file, "small_chunks", __threaded_data,
+                     sizeof(__threaded_data));
+  __check_entry_read(file, "raw", "raw", 3);
+  __check_entry_read(file, "default_chunks", __threaded_data,
+                     sizeof(__threaded_data));
+  rtad_close(file);
+  assert_int_equal(rtad_writer_set_threads(NULL, 4), -1);
+}
+
+static void test_rtad_writer_threads_abort(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file(__FUNCTION__);
+  rtad_writer *writer = rtad_writer_open(__FUNCTION__);
+  assert_non_null(writer);
+  assert_int_equal(rtad_writer_set_threads(writer, 3), 0);
+  assert_int_equal(rtad_writer_set_codec(writer, RTAD_CODEC_LZ, 1024), 0);
+  assert_int_equal(rtad_writer_write(writer, __threaded_data,
+                                     sizeof(__threaded_data)),
+                   0);
+  // chunks still in flight are dropped with the payload
+  assert_int_equal(rtad_writer_abort(writer), 0);
+  assert_int_equal(__file_length(__FUNCTION__), TMP_FILE_SIZE);
+}
+
+static void test_rtad_writer_dedup_entries(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file(__FUNCTION__);
+  static char data[100000];
+  uint32_t x = 777;
+  for (size_t i = 0; i < sizeof(data); i++) {
+    x = x * 1103515245 + 12345;
+    data[i] = (char)(x >> 24);
+  }
+  rtad_writer *writer = rtad_writer_open(__FUNCTION__);
+  assert_non_null(writer);
+  assert_int_equal(rtad_writer_set_dedup(writer, 0x80), -1);
+  assert_int_equal(rtad_writer_set_dedup(writer, RTAD_DEDUP_ENTRIES), 0);
+  assert_int_equal(rtad_writer_set_threads(writer, 2), 0);
+  const char *names[] = {"a", "b", "c"};
+  char last = (char)(data[sizeof(data) - 1] ^ 1);
+  for (size_t i = 0; i < 3; i++) {
+    assert_int_equal(rtad_writer_begin_entry(writer, names[i]), 0);
+    // "c" differs in its last byte only
+    assert_int_equal(rtad_writer_write(writer, data, sizeof(data) - 1), 0);
+    assert_int_equal(
+        rtad_writer_write(writer, i == 2 ? &last : data + sizeof(data) - 1, 1),
+        0);
+  }
+  assert_int_equal(rtad_writer_set_codec(writer, RTAD_CODEC_LZ, 4096), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "lz_1"), 0);
+  assert_int_equal(rtad_writer_write(writer, data, 5000), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "lz_2"), 0);
+  assert_int_equal(rtad_writer_write(writer, data, 5000), 0);
+  assert_int_equal(rtad_writer_close(writer), 0);
+  // "a" once, the last chunk of "c", "lz_1" and the indexes
+  assert_true(__file_length(__FUNCTION__) <
+              (off_t)TMP_FILE_SIZE + (off_t)sizeof(data) * 3 / 2);
+
+  rtad_file *file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  struct rtad_entry a, b, c;
+  assert_int_equal(rtad_find(file, "a", &a), 0);
+  assert_int_equal(rtad_find(file, "b", &b), 0);
+  assert_int_equal(rtad_find(file, "c", &c), 0);
+  assert_true(a.flags & RTAD_ENTRY_CHUNKED);
+  assert_int_equal(a.offset, b.offset);
+  assert_int_equal(a.size, b.size);
+  assert_int_not_equal(a.offset, c.offset);
+  __check_entry_read(file, "a", data, sizeof(data));
+  __check_entry_read(file, "b", data, sizeof(data));
+  char *out_data = NULL;
+  size_t out_data_size = 0;
+  assert_int_equal(rtad_entry_read(file, &c, &out_data, &out_data_size), 0);
+  assert_int_equal(out_data_size, sizeof(data));
+  assert_memory_equal(out_data, data, sizeof(data) - 1);
+  assert_int_equal(out_data[sizeof(data) - 1], last);
+  rtad_free_extracted_data(out_data);
+  assert_int_equal(rtad_find(file, "lz_1", &a), 0);
+  assert_int_equal(rtad_find(file, "lz_2", &b), 0);
+  assert_int_equal(a.offset, b.offset);
+  __check_entry_read(file, "lz_2", data, 5000);
+  assert_int_equal(rtad_verify_full(file, 1), 0);
+  rtad_close(file);
+}
+
+static void test_rtad_writer_dedup_cdc(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file(__FUNCTION__);
+  static char data[200000];
+  uint32_t x = 4242;
+  for (size_t i = 0; i < sizeof(data); i++) {
+    x = x * 1103515245 + 12345;
+    data[i] = (char)(x >> 24);
+  }
+  rtad_writer *writer = rtad_writer_open(__FUNCTION__);
+  assert_non_null(writer);
+  assert_int_equal(rtad_writer_set_dedup(writer, RTAD_DEDUP_CDC), 0);
+  assert_int_equal(rtad_writer_set_codec(writer, RTAD_CODEC_NONE, 4096), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "base"), 0);
+  assert_int_equal(rtad_writer_write(writer, data, sizeof(data)), 0);
+  // the same bytes after a prefix, fixed chunks would share nothing
+  assert_int_equal(rtad_writer_begin_entry(writer, "shifted"), 0);
+  assert_int_equal(rtad_writer_write(writer, "prefix", 6), 0);
+  assert_int_equal(rtad_writer_write(writer, data, sizeof(data)), 0);
+  assert_int_equal(rtad_writer_close(writer), 0);
+  assert_true(__file_length(__FUNCTION__) <
+              (off_t)TMP_FILE_SIZE + (off_t)sizeof(data) + 40000);
+
+  rtad_file *file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  __check_entry_read(file, "base", data, sizeof(data));
+  struct rtad_entry entry;
+  assert_int_equal(rtad_find(file, "shifted", &entry), 0);
+  assert_int_equal(entry.raw_size, sizeof(data) + 6);
+  // ranges across chunks of different sizes
+  rtad_reader *reader = rtad_reader_open(file, &entry);
+  assert_non_null(reader);
+  static char buf[20000];
+  size_t read_size = 0;
+  for (uint64_t offset = 0; offset < sizeof(data); offset += 17011) {
+    assert_int_equal(rtad_reader_pread(reader, buf, sizeof(buf), offset + 6,
+                                       &read_size),
+                     0);
+    size_t n = sizeof(data) - offset < sizeof(buf) ? sizeof(data) - offset
+                                                   : sizeof(buf);
+    assert_int_equal(read_size, n);
+    assert_memory_equal(buf, data + offset, n);
+  }
+  assert_int_equal(rtad_reader_pread(reader, buf, 6, 0, &read_size), 0);
+  assert_memory_equal(buf, "prefix", 6);
+  rtad_reader_close(reader);
+  rtad_close(file);
+}
+
+static void test_rtad_writer_update_entries(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file(__FUNCTION__);
+  static char data[200000];
+  uint32_t x = 99;
+  for (size_t i = 0; i < sizeof(data); i++) {
+    x = x * 1103515245 + 12345;
+    data[i] = (char)(x >> 24);
+  }
+  rtad_writer *writer = rtad_writer_open(__FUNCTION__);
+  assert_non_null(writer);
+  assert_int_equal(rtad_writer_begin_entry(writer, "big"), 0);
+  assert_int_equal(rtad_writer_write(writer, data, sizeof(data)), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "config"), 0);
+  assert_int_equal(rtad_writer_write(writer, "old", 3), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "gone"), 0);
+  assert_int_equal(rtad_writer_write(writer, "bye", 3), 0);
+  assert_int_equal(rtad_writer_set_align(writer, RTAD_ALIGN_PAGE), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "aligned"), 0);
+  assert_int_equal(rtad_writer_write(writer, data, 5000), 0);
+  assert_int_equal(rtad_writer_close(writer), 0);
+  off_t packed_size = __file_length(__FUNCTION__);
+
+  // the padding in front of the aligned entry is not dead
+  rtad_file *file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  uint64_t dead_size = 0;
+  assert_int_equal(rtad_file_dead_size(file, &dead_size), 0);
+  assert_int_equal(dead_size, 0);
+  rtad_close(file);
+
+  // an aborted update leaves the file as it was
+  writer = rtad_writer_open_update(__FUNCTION__);
+  assert_non_null(writer);
+  assert_int_equal(rtad_writer_write(writer, "x", 1), -1);
+  assert_int_equal(rtad_writer_begin_entry(writer, "config"), 0);
+  assert_int_equal(rtad_writer_write(writer, "aborted", 7), 0);
+  assert_int_equal(rtad_writer_abort(writer), 0);
+  assert_int_equal(__file_length(__FUNCTION__), packed_size);
+
+  writer = rtad_writer_open_update(__FUNCTION__);
+  assert_non_null(writer);
+  assert_int_equal(rtad_writer_begin_entry(writer, "config"), 0);
+  assert_int_equal(rtad_writer_write(writer, "new!", 4), 0);
+  assert_int_equal(rtad_writer_remove(writer, "gone"), 0);
+  assert_int_equal(rtad_writer_remove(writer, "gone"), -1);
+  assert_int_equal(rtad_writer_begin_entry(writer, "added"), 0);
+  assert_int_equal(rtad_writer_write(writer, "+", 1), 0);
+  assert_int_equal(rtad_writer_close(writer), 0);
+  // the new bytes, a TOC and the tree hash only
+  off_t updated_size = __file_length(__FUNCTION__);
+  assert_true(updated_size < packed_size + 1000);
+
+  file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  __check_entry_read(file, "big", data, sizeof(data));
+  __check_entry_read(file, "config", "new!", 4);
+  __check_entry_read(file, "added", "+", 1);
+  __check_entry_read(file, "aligned", data, 5000);
+  struct rtad_entry entry;
+  assert_int_equal(rtad_find(file, "gone", &entry), -1);
+  assert_int_equal(rtad_verify_full(file, 2), 0);
+  assert_int_equal(rtad_file_dead_size(file, &dead_size), 0);
+  assert_true(dead_size >= 6);
+  rtad_close(file);
+
+  assert_int_equal(rtad_compact(__FUNCTION__), 0);
+  assert_int_equal(__file_length(__FUNCTION__), updated_size - (off_t)dead_size);
+  file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  __check_entry_read(file, "big", data, sizeof(data));
+  __check_entry_read(file, "config", "new!", 4);
+  __check_entry_read(file, "added", "+", 1);
+  __check_entry_read(file, "aligned", data, 5000);
+  assert_int_equal(rtad_find(file, "aligned", &entry), 0);
+  assert_int_equal((entry.offset + (uint64_t)file->data_offset) %
+                       RTAD_ALIGN_PAGE,
+                   0);
+  assert_int_equal(rtad_verify_full(file, 2), 0);
+  assert_int_equal(rtad_file_dead_size(file, &dead_size), 0);
+  assert_int_equal(dead_size, 0);
+  rtad_close(file);
+
+  // a payload without entries can't be updated
+  __create_tmp_file(__FUNCTION__);
+  assert_int_equal(rtad_append_packed_data(__FUNCTION__, "data", 4), 0);
+  assert_null(rtad_writer_open_update(__FUNCTION__));
+}
+
+static void test_rtad_compact_shared_chunks(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file(__FUNCTION__);
+  static char data[150000];
+  uint32_t x = 2024;
+  for (size_t i = 0; i < sizeof(data); i++) {
+    x = x * 1103515245 + 12345;
+    data[i] = (i / 5000) % 2 ? (char)(x >> 24) : (char)(i % 7);
+  }
+  rtad_writer *writer = rtad_writer_open(__FUNCTION__);
+  assert_non_null(writer);
+  assert_int_equal(rtad_writer_set_dedup(writer, RTAD_DEDUP_CDC), 0);
+  assert_int_equal(rtad_writer_set_codec(writer, RTAD_CODEC_LZ, 4096), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "base"), 0);
+  assert_int_equal(rtad_writer_write(writer, data, sizeof(data)), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "copy"), 0);
+  assert_int_equal(rtad_writer_write(writer, data, sizeof(data)), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "tail"), 0);
+  assert_int_equal(rtad_writer_write(writer, data + 50000, 100000), 0);
+  assert_int_equal(rtad_writer_set_dedup(writer, 0), 0);
+  assert_int_equal(rtad_writer_set_codec(writer, RTAD_CODEC_NONE, 0), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "plain"), 0);
+  assert_int_equal(rtad_writer_write(writer, data, 1000), 0);
+  assert_int_equal(rtad_writer_close(writer), 0);
+
+  // replacing "base" frees nothing, its chunks are still used
+  writer = rtad_writer_open_update(__FUNCTION__);
+  assert_non_null(writer);
+  assert_int_equal(rtad_writer_begin_entry(writer, "base"), 0);
+  assert_int_equal(rtad_writer_write(writer, "replaced", 8), 0);
+  assert_int_equal(rtad_writer_remove(writer, "plain"), 0);
+  assert_int_equal(rtad_writer_close(writer), 0);
+  off_t updated_size = __file_length(__FUNCTION__);
+
+  assert_int_equal(rtad_compact(__FUNCTION__), 0);
+  assert_true(__file_length(__FUNCTION__) < updated_size - 1000);
+  rtad_file *file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  __check_entry_read(file, "base", "replaced", 8);
+  __check_entry_read(file, "copy", data, sizeof(data));
+  __check_entry_read(file, "tail", data + 50000, 100000);
+  struct rtad_entry entry;
+  assert_int_equal(rtad_find(file, "plain", &entry), -1);
+  assert_int_equal(rtad_verify_full(file, 1), 0);
+  rtad_close(file);
+  // nothing left to reclaim, the second pass keeps the same layout
+  updated_size = __file_length(__FUNCTION__);
+  assert_int_equal(rtad_compact(__FUNCTION__), 0);
+  assert_int_equal(__file_length(__FUNCTION__), updated_size);
+}
+
+static void test_rtad_repack_keep_entries(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file(__FUNCTION__);
+  off_t exe_size = __file_length(__FUNCTION__);
+  static char data[120000];
+  uint32_t x = 14;
+  for (size_t i = 0; i < sizeof(data); i++) {
+    x = x * 1103515245 + 12345;
+    data[i] = (i / 4000) % 2 ? (char)(x >> 24) : (char)(i % 11);
+  }
+  rtad_writer *writer = rtad_writer_open(__FUNCTION__);
+  assert_non_null(writer);
+  assert_int_equal(rtad_writer_set_dedup(writer, RTAD_DEDUP_ENTRIES), 0);
+  assert_int_equal(rtad_writer_set_codec(writer, RTAD_CODEC_LZ, 8192), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "a"), 0);
+  assert_int_equal(rtad_writer_write(writer, data, sizeof(data)), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "a2"), 0);
+  assert_int_equal(rtad_writer_write(writer, data, sizeof(data)), 0);
+  assert_int_equal(rtad_writer_set_dedup(writer, 0), 0);
+  assert_int_equal(rtad_writer_set_codec(writer, RTAD_CODEC_NONE, 0), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "dropped"), 0);
+  assert_int_equal(rtad_writer_write(writer, data, 50000), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "b"), 0);
+  assert_int_equal(rtad_writer_write(writer, "kept", 4), 0);
+  assert_int_equal(rtad_writer_close(writer), 0);
+
+  char dest_path[256];
+  snprintf(dest_path, sizeof(dest_path), "%s_dest", __FUNCTION__);
+  const char *keep[] = {"b", "a", "a2"};
+  struct rtad_input inputs[1] = {
+      {.name = "c", .data = data, .size = 3000, .codec = RTAD_CODEC_LZ}};
+  assert_int_equal(rtad_repack(__FUNCTION__, dest_path, keep, 3, inputs, 1),
+                   0);
+  rtad_file *file = rtad_open(dest_path);
+  assert_non_null(file);
+  // the old payload is not copied, the shared chunks are copied once
+  assert_int_equal(file->data_offset, exe_size);
+  assert_true(__file_length(dest_path) < __file_length(__FUNCTION__) - 40000);
+  __check_entry_read(file, "a", data, sizeof(data));
+  __check_entry_read(file, "a2", data, sizeof(data));
+  __check_entry_read(file, "b", "kept", 4);
+  __check_entry_read(file, "c", data, 3000);
+  struct rtad_entry entry;
+  assert_int_equal(rtad_find(file, "dropped", &entry), -1);
+  assert_int_equal(rtad_verify_full(file, 1), 0);
+  rtad_close(file);
+
+  const char *missing[] = {"b", "nope"};
+  assert_int_equal(rtad_repack(__FUNCTION__, dest_path, missing, 2, NULL, 0),
+                   -1);
+}
+
+// an aligned entry starts at a file offset multiple of its alignment
+static void __check_entry_aligned(rtad_file *file, const char *name,
+                                  uint32_t align, const char *data,
+                                  size_t size) {
+  struct rtad_entry entry;
+  assert_int_equal(rtad_find(file, name, &entry), 0);
+  assert_int_equal(entry.align, align);
+  assert_int_equal((file->data_offset + entry.offset) % align, 0);
+  const char *view = NULL;
+  size_t view_size = 0;
+  assert_int_equal(rtad_entry_map(file, &entry, &view, &view_size), 0);
+  assert_int_equal((uintptr_t)view % RTAD_ALIGN_PAGE, 0);
+  assert_int_equal(view_size, size);
+  assert_memory_equal(view, data, size);
+  assert_int_equal(rtad_unmap_data(view, view_size), 0);
+}
+
+static void test_rtad_entry_map_aligned(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file(__FUNCTION__);
+  static char data[300000];
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (char)(i * 13 + i / 777);
+  }
+  rtad_writer *writer = rtad_writer_open(__FUNCTION__);
+  assert_non_null(writer);
+  assert_int_equal(rtad_writer_set_align(writer, 3), -1);
+  assert_int_equal(rtad_writer_set_align(writer, RTAD_ALIGN_MAX * 2u), -1);
+  assert_int_equal(rtad_writer_begin_entry(writer, "plain"), 0);
+  assert_int_equal(rtad_writer_write(writer, data, 10), 0);
+  assert_int_equal(rtad_writer_set_align(writer, RTAD_ALIGN_PAGE), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "a"), 0);
+  assert_int_equal(rtad_writer_write(writer, data, 5000), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "dropped"), 0);
+  assert_int_equal(rtad_writer_write(writer, data, 3), 0);
+  assert_int_equal(rtad_writer_set_codec(writer, RTAD_CODEC_LZ, 0), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "packed"), 0);
+  assert_int_equal(rtad_writer_write(writer, data, 7000), 0);
+  assert_int_equal(rtad_writer_set_codec(writer, RTAD_CODEC_NONE, 0), 0);
+  assert_int_equal(rtad_writer_set_align(writer, RTAD_ALIGN_HUGE), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "huge"), 0);
+  assert_int_equal(rtad_writer_write(writer, data, sizeof(data)), 0);
+  assert_int_equal(rtad_writer_close(writer), 0);
+
+  rtad_file *file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  __check_entry_aligned(file, "a", RTAD_ALIGN_PAGE, data, 5000);
+  __check_entry_aligned(file, "dropped", RTAD_ALIGN_PAGE, data, 3);
+  __check_entry_aligned(file, "huge", RTAD_ALIGN_HUGE, data, sizeof(data));
+  struct rtad_entry entry;
+  const char *view = NULL;
+  size_t view_size = 0;
+  // chunked entries are not aligned and can't be mapped
+  assert_int_equal(rtad_find(file, "packed", &entry), 0);
+  assert_int_equal(entry.align, 0);
+  assert_int_equal(rtad_entry_map(file, &entry, &view, &view_size), -1);
+  assert_int_equal(rtad_find(file, "plain", &entry), 0);
+  assert_int_equal(entry.align, 0);
+  assert_int_equal(rtad_entry_map(file, &entry, &view, &view_size), 0);
+  assert_memory_equal(view, data, 10);
+  assert_int_equal(rtad_unmap_data(view, view_size), 0);
+  assert_int_equal(rtad_verify_full(file, 1), 0);
+  rtad_close(file);
+
+  // the entries stay aligned once moved by compaction and by a repack
+  writer = rtad_writer_open_update(__FUNCTION__);
+  assert_non_null(writer);
+  assert_int_equal(rtad_writer_remove(writer, "dropped"), 0);
+  assert_int_equal(rtad_writer_close(writer), 0);
+  assert_int_equal(rtad_compact(__FUNCTION__), 0);
+  file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  __check_entry_aligned(file, "a", RTAD_ALIGN_PAGE, data, 5000);
+  __check_entry_aligned(file, "huge", RTAD_ALIGN_HUGE, data, sizeof(data));
+  __check_entry_read(file, "plain", data, 10);
+  __check_entry_read(file, "packed", data, 7000);
+  assert_int_equal(rtad_verify_full(file, 1), 0);
+  rtad_close(file);
+
+  char dest_path[256];
+  snprintf(dest_path, sizeof(dest_path), "%s_dest", __FUNCTION__);
+  const char *keep[] = {"huge", "plain", "a"};
+  assert_int_equal(rtad_repack(__FUNCTION__, dest_path, keep, 3, NULL, 0), 0);
+  file = rtad_open(dest_path);
+  assert_non_null(file);
+  __check_entry_aligned(file, "a", RTAD_ALIGN_PAGE, data, 5000);
+  __check_entry_aligned(file, "huge", RTAD_ALIGN_HUGE, data, sizeof(data));
+  __check_entry_read(file, "plain", data, 10);
+  assert_int_equal(rtad_verify_full(file, 1), 0);
+  rtad_close(file);
+}
+
+// a bump allocator counting calls, free leaves the memory in the arena
+struct test_arena {
+  char buf[1024 * 1024];
+  size_t used;
+  int allocs;
+  int frees;
+};
+
+static void *__arena_alloc(void *ctx, size_t size) {
+  struct test_arena *arena = (struct test_arena *)ctx;
+  size = (size + 15) & ~(size_t)15;
+  if (size > sizeof(arena->buf) - arena->used) {
+    return NULL;
+  }
+  arena->allocs++;
+  arena->used += size;
+  return arena->buf + arena->used - size;
+}
+
+static void __arena_free(void *ctx, void *ptr) {
+  struct test_arena *arena = (struct test_arena *)ctx;
+  assert_true((char *)ptr >= arena->buf &&
+              (char *)ptr < arena->buf + sizeof(arena->buf));
+  arena->frees++;
+}
+
+static void test_rtad_extract_into(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file(__FUNCTION__);
+  static char data[200000];
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (char)((i / 300) % 2 ? i * 7 : i % 5);
+  }
+  rtad_writer *writer = rtad_writer_open(__FUNCTION__);
+  assert_non_null(writer);
+  assert_int_equal(rtad_writer_begin_entry(writer, "raw"), 0);
+  assert_int_equal(rtad_writer_write(writer, data, 100000), 0);
+  assert_int_equal(rtad_writer_set_codec(writer, RTAD_CODEC_LZ, 8192), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "lz"), 0);
+  assert_int_equal(rtad_writer_write(writer, data, sizeof(data)), 0);
+  assert_int_equal(rtad_writer_close(writer), 0);
+
+  static struct test_arena arena;
+  struct rtad_allocator allocator = {
+      .alloc = __arena_alloc, .free = NULL, .ctx = &arena};
+  assert_int_equal(rtad_set_allocator(&allocator), -1);
+  allocator.free = __arena_free;
+  assert_int_equal(rtad_set_allocator(&allocator), 0);
+  rtad_file *file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  assert_true(arena.allocs > 0);
+
+  // stored as is, straight into the buffers without any allocation
+  static char out[sizeof(data)];
+  int allocs = arena.allocs;
+  struct rtad_entry entry;
+  size_t size = 0;
+  assert_int_equal(rtad_find(file, "raw", &entry), 0);
+  assert_int_equal(rtad_extract_into(file, &entry, out, 99999, &size), -1);
+  assert_int_equal(size, 100000);
+  assert_int_equal(rtad_extract_into(file, &entry, out, sizeof(out), &size),
+                   0);
+  assert_int_equal(size, 100000);
+  assert_memory_equal(out, data, 100000);
+  memset(out, 0, sizeof(out));
+  struct rtad_data bufs[3] = {
+      {.data = out, .size = 10}, {.data = out + 10, .size = 0},
+      {.data = out + 10, .size = sizeof(out) - 10}};
+  assert_int_equal(rtad_extract_iov(file, &entry, bufs, 3, &size), 0);
+  assert_memory_equal(out, data, 100000);
+  assert_int_equal(arena.allocs, allocs);
+
+  // chunked, the chunk table and the stored buffer come from the arena
+  int frees = arena.frees;
+  memset(out, 0, sizeof(out));
+  assert_int_equal(rtad_find(file, "lz", &entry), 0);
+  bufs[0].size = 5000;
+  bufs[2].data = out + 5000;
+  bufs[2].size = sizeof(out) - 5000;
+  assert_int_equal(rtad_extract_iov(file, &entry, bufs, 3, &size), 0);
+  assert_int_equal(size, sizeof(data));
+  assert_memory_equal(out, data, sizeof(data));
+  assert_true(arena.allocs > allocs);
+  assert_int_equal(arena.allocs - allocs, arena.frees - frees);
+
+  char *extracted = NULL;
+  assert_int_equal(rtad_entry_read(file, &entry, &extracted, &size), 0);
+  assert_true(extracted >= arena.buf &&
+              extracted < arena.buf + sizeof(arena.buf));
+  assert_memory_equal(extracted, data, sizeof(data));
+  assert_int_equal(rtad_free_extracted_data(extracted), 0);
+  rtad_close(file);
+  assert_int_equal(arena.allocs, arena.frees);
+  assert_int_equal(rtad_set_allocator(NULL), 0);
+}
+
+#if defined(__linux__)
+static void __check_fd(int fd, const char *data, size_t size) {
+  assert_true(fd >= 0);
+  assert_int_equal(fd_length(fd), (off_t)size);
+  static char buf[200000];
+  assert_true(size <= sizeof(buf));
+  // read from the start, through the descriptor and through a path
+  assert_int_equal(file_write(fd, "x", 1), -1);
+  assert_int_equal((ssize_t)read(fd, buf, sizeof(buf)), (ssize_t)size);
+  assert_memory_equal(buf, data, size);
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+  FILE *fp = fopen(path, "rb");
+  assert_non_null(fp);
+  assert_int_equal(fread(buf, 1, sizeof(buf), fp), size);
+  assert_memory_equal(buf, data, size);
+  fclose(fp);
+}
+#endif
+
+static void test_rtad_entry_fd(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file(__FUNCTION__);
+  static char data[150000];
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (char)((i / 100) % 3 ? i * 13 : i % 11);
+  }
+  rtad_writer *writer = rtad_writer_open(__FUNCTION__);
+  assert_non_null(writer);
+  assert_int_equal(rtad_writer_set_align(writer, RTAD_ALIGN_PAGE), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "raw"), 0);
+  assert_int_equal(rtad_writer_write(writer, data, 100000), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "empty"), 0);
+  assert_int_equal(rtad_writer_set_codec(writer, RTAD_CODEC_LZ, 8192), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "lz"), 0);
+  assert_int_equal(rtad_writer_write(writer, data, sizeof(data)), 0);
+  assert_int_equal(rtad_writer_close(writer), 0);
+
+  rtad_file *file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  struct rtad_entry entry;
+  assert_int_equal(rtad_entry_fd(NULL, NULL), -1);
+#if defined(__linux__)
+  assert_int_equal(rtad_find(file, "raw", &entry), 0);
+  int fd = rtad_entry_fd(file, &entry);
+  __check_fd(fd, data, 100000);
+  int seals = fcntl(fd, F_GET_SEALS);
+  assert_true(seals & F_SEAL_WRITE);
+  assert_true(seals & F_SEAL_SEAL);
+  assert_int_equal(fd_truncate(fd, 0), -1);
+  file_close(fd);
+
+  assert_int_equal(rtad_find(file, "lz", &entry), 0);
+  fd = rtad_entry_fd(file, &entry);
+  __check_fd(fd, data, sizeof(data));
+  file_close(fd);
+
+  assert_int_equal(rtad_find(file, "empty", &entry), 0);
+  fd = rtad_entry_fd(file, &entry);
+  __check_fd(fd, data, 0);
+  file_close(fd);
+#else
+  assert_int_equal(rtad_find(file, "raw", &entry), 0);
+  assert_int_equal(rtad_entry_fd(file, &entry), -1);
+#endif
+  rtad_close(file);
+}
+
+static void test_rtad_fopen(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file(__FUNCTION__);
+  static char data[100000];
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (char)((i / 50) % 2 ? '\n' + i % 60 : i % 9);
+  }
+  rtad_writer *writer = rtad_writer_open(__FUNCTION__);
+  assert_non_null(writer);
+  assert_int_equal(rtad_writer_begin_entry(writer, "raw"), 0);
+  assert_int_equal(rtad_writer_write(writer, data, 30000), 0);
+  assert_int_equal(rtad_writer_set_codec(writer, RTAD_CODEC_LZ, 4096), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "lz"), 0);
+  assert_int_equal(rtad_writer_write(writer, data, sizeof(data)), 0);
+  assert_int_equal(rtad_writer_close(writer), 0);
+
+  rtad_file *file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  struct rtad_entry entry;
+  assert_int_equal(rtad_find(file, "lz", &entry), 0);
+  assert_null(rtad_fopen(file, &entry, "w"));
+  assert_null(rtad_fopen(file, &entry, NULL));
+  FILE *fp = rtad_fopen(file, &entry, "rb");
+#if defined(_WIN32)
+  assert_null(fp);
+#else
+  assert_non_null(fp);
+  // in odd pieces across the chunks, then back and forth
+  static char buf[sizeof(data)];
+  size_t done = 0;
+  size_t n;
+  while ((n = fread(buf + done, 1, 777, fp)) > 0) {
+    done += n;
+  }
+  assert_int_equal(done, sizeof(data));
+  assert_memory_equal(buf, data, sizeof(data));
+  assert_true(feof(fp));
+  assert_int_equal(fseek(fp, 50001, SEEK_SET), 0);
+  assert_int_equal(ftell(fp), 50001);
+  assert_int_equal(fgetc(fp), (unsigned char)data[50001]);
+  assert_int_equal(fseek(fp, -10, SEEK_END), 0);
+  assert_int_equal(fread(buf, 1, sizeof(buf), fp), 10);
+  assert_memory_equal(buf, data + sizeof(data) - 10, 10);
+  assert_int_equal(fseek(fp, -1, SEEK_SET), -1);
+  assert_int_equal(fclose(fp), 0);
+
+  // stored as is, and the whole appended data
+  assert_int_equal(rtad_find(file, "raw", &entry), 0);
+  fp = rtad_fopen(file, &entry, "r");
+  assert_non_null(fp);
+  assert_int_equal(fread(buf, 1, sizeof(buf), fp), 30000);
+  assert_memory_equal(buf, data, 30000);
+  assert_int_equal(fclose(fp), 0);
+  fp = rtad_fopen(file, NULL, "r");
+  assert_non_null(fp);
+  assert_int_equal(fseek(fp, 0, SEEK_END), 0);
+  struct rtad_trailer trailer;
+  assert_int_equal(rtad_extract_hdr(__FUNCTION__, &trailer), 0);
+  assert_int_equal((uint64_t)ftell(fp), trailer.data_size);
+  assert_int_equal(fclose(fp), 0);
+#endif
+  rtad_close(file);
+}
+
+#if !defined(_WIN32)
+// send a whole entry through a small non-blocking socket, resuming where a
+// full socket stopped, and check what comes out the other end
+static void __check_sendfile_socket(rtad_file *file,
+                                    const struct rtad_entry *entry,
+                                    const char *data, size_t size) {
+  int fds[2];
+  assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  int buf_size = 8192;
+  setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &buf_size, sizeof(buf_size));
+  assert_int_equal(fcntl(fds[0], F_SETFL, O_NONBLOCK), 0);
+  static char received[300000];
+  assert_true(size <= sizeof(received));
+  uint64_t offset = 0;
+  size_t got = 0;
+  int blocked = 0;
+  while (offset < size) {
+    uint64_t sent = 0;
+    int result =
+        rtad_entry_sendfile(file, entry, fds[0], offset, UINT64_MAX, &sent);
+    offset += sent;
+    if (result != 0) {
+      assert_int_equal(errno, EAGAIN);
+      blocked = 1;
+    }
+    ssize_t n;
+    while (got < offset &&
+           (n = read(fds[1], received + got, sizeof(received) - got)) > 0) {
+      got += (size_t)n;
+    }
+  }
+  assert_true(blocked);
+  assert_int_equal(offset, size);
+  assert_int_equal(got, size);
+  assert_memory_equal(received, data, size);
+  close(fds[0]);
+  close(fds[1]);
+}
+#endif
+
+static void test_rtad_entry_sendfile(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file(__FUNCTION__);
+  static char data[300000];
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (char)((i / 200) % 2 ? i * 31 : i % 13);
+  }
+  rtad_writer *writer = rtad_writer_open(__FUNCTION__);
+  assert_non_null(writer);
+  assert_int_equal(rtad_writer_begin_entry(writer, "raw"), 0);
+  assert_int_equal(rtad_writer_write(writer, data, sizeof(data)), 0);
+  assert_int_equal(rtad_writer_set_codec(writer, RTAD_CODEC_LZ, 16384), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "lz"), 0);
+  assert_int_equal(rtad_writer_write(writer, data, sizeof(data)), 0);
+  assert_int_equal(rtad_writer_close(writer), 0);
+
+  rtad_file *file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  struct rtad_entry raw, lz;
+  assert_int_equal(rtad_find(file, "raw", &raw), 0);
+  assert_int_equal(rtad_find(file, "lz", &lz), 0);
+  uint64_t sent = 1;
+  assert_int_equal(rtad_entry_sendfile(file, &raw, -1, 0, 10, &sent), -1);
+  assert_int_equal(rtad_entry_sendfile(file, &raw, 1, sizeof(data) + 1, 10,
+                                       &sent),
+                   -1);
+  assert_int_equal(sent, 0);
+
+  // a range of each into a file, one after the other
+  const char *dest_path = "test_rtad_entry_sendfile_dest";
+  int fd = file_create(dest_path);
+  assert_true(fd >= 0);
+  assert_int_equal(rtad_entry_sendfile(file, &raw, fd, 1000, 5000, &sent), 0);
+  assert_int_equal(sent, 5000);
+  assert_int_equal(
+      rtad_entry_sendfile(file, &lz, fd, 12345, UINT64_MAX, &sent), 0);
+  assert_int_equal(sent, sizeof(data) - 12345);
+  assert_int_equal(rtad_entry_sendfile(file, &lz, fd, sizeof(data), 10, &sent),
+                   0);
+  assert_int_equal(sent, 0);
+  static char buf[sizeof(data)];
+  assert_int_equal(fd_length(fd), 5000 + sizeof(data) - 12345);
+  assert_int_equal(file_pread(fd, buf, 5000, 0), 0);
+  assert_memory_equal(buf, data + 1000, 5000);
+  assert_int_equal(file_pread(fd, buf, sizeof(data) - 12345, 5000), 0);
+  assert_memory_equal(buf, data + 12345, sizeof(data) - 12345);
+  file_close(fd);
+  remove(dest_path);
+
+#if !defined(_WIN32)
+  __check_sendfile_socket(file, &raw, data, sizeof(data));
+  __check_sendfile_socket(file, &lz, data, sizeof(data));
+#endif
+  rtad_close(file);
+}
+
+struct test_trace {
+  int begins[RTAD_PHASE_COUNT];
+  int ends[RTAD_PHASE_COUNT];
+  uint64_t last_ns;
+};
+
+static void __trace(void *ctx, int phase, int end, uint64_t time_ns) {
+  struct test_trace *trace = (struct test_trace *)ctx;
+  assert_true(phase >= 0 && phase < RTAD_PHASE_COUNT);
+  assert_true(time_ns >= trace->last_ns);
+  trace->last_ns = time_ns;
+  if (end) {
+    trace->ends[phase]++;
+    assert_int_equal(trace->ends[phase], trace->begins[phase]);
+  } else {
+    trace->begins[phase]++;
+  }
+}
+
+static void __stats_thread(void *arg) {
+  char *data = NULL;
+  size_t size = 0;
+  if (rtad_extract_data((const char *)arg, &data, &size) == 0) {
+    rtad_free_extracted_data(data);
+  }
+}
+
+static void test_rtad_stats(void **state) {
+  (void)state; /* unused */
+  struct rtad_stats stats;
+  if (rtad_stats_get(&stats) != 0) {
+    // built without RTAD_WITH_STATS
+    assert_int_equal(rtad_stats_thread(&stats), -1);
+    skip();
+  }
+  __create_tmp_file(__FUNCTION__);
+  rtad_stats_reset();
+  assert_int_equal(rtad_stats_thread(&stats), 0);
+  assert_int_equal(stats.syscalls, 0);
+  assert_int_equal(stats.bytes_written, 0);
+
+  static char data[100000];
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (char)(i % 7);
+  }
+  struct test_trace trace;
+  memset(&trace, 0, sizeof(trace));
+  assert_int_equal(rtad_set_trace(__trace, &trace), 0);
+  rtad_writer *writer = rtad_writer_open(__FUNCTION__);
+  assert_non_null(writer);
+  assert_int_equal(rtad_writer_set_codec(writer, RTAD_CODEC_LZ, 8192), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "lz"), 0);
+  assert_int_equal(rtad_writer_write(writer, data, sizeof(data)), 0);
+  assert_int_equal(rtad_writer_close(writer), 0);
+  assert_int_equal(rtad_stats_thread(&stats), 0);
+  assert_true(stats.opens >= 1);
+  assert_true(stats.syscalls > stats.opens);
+  assert_true(stats.bytes_written > 0);
+  assert_int_equal(stats.phase_calls[RTAD_PHASE_APPEND], 2);
+  assert_int_equal(trace.begins[RTAD_PHASE_APPEND], 2);
+
+  // small reads in one chunk decode it once
+  rtad_file *file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  struct rtad_entry entry;
+  assert_int_equal(rtad_find(file, "lz", &entry), 0);
+  rtad_reader *reader = rtad_reader_open(file, &entry);
+  assert_non_null(reader);
+  char buf[100];
+  size_t size = 0;
+  for (int i = 0; i < 3; i++) {
+    assert_int_equal(rtad_reader_read(reader, buf, sizeof(buf), &size), 0);
+    assert_memory_equal(buf, data + i * sizeof(buf), sizeof(buf));
+  }
+  rtad_reader_close(reader);
+  assert_int_equal(rtad_stats_thread(&stats), 0);
+  assert_int_equal(stats.cache_misses, 1);
+  assert_int_equal(stats.cache_hits, 2);
+  assert_int_equal(stats.phase_calls[RTAD_PHASE_EXTRACT], 3);
+
+  // a whole read counts once, not once per chunk
+  char *extracted = NULL;
+  uint64_t decoded = stats.chunks_decoded;
+  assert_int_equal(rtad_entry_read(file, &entry, &extracted, &size), 0);
+  assert_int_equal(rtad_free_extracted_data(extracted), 0);
+  rtad_close(file);
+  assert_int_equal(rtad_stats_thread(&stats), 0);
+  assert_int_equal(stats.chunks_decoded, decoded + 13);
+  assert_int_equal(stats.phase_calls[RTAD_PHASE_EXTRACT], 4);
+  assert_true(stats.phase_calls[RTAD_PHASE_HEADER] >= 2);
+  assert_true(stats.phase_ns[RTAD_PHASE_EXTRACT] > 0);
+  assert_int_equal(rtad_set_trace(NULL, NULL), 0);
+  for (int i = 0; i < RTAD_PHASE_COUNT; i++) {
+    assert_int_equal(trace.begins[i], trace.ends[i]);
+    assert_int_equal(trace.begins[i], (int)stats.phase_calls[i]);
+  }
+
+  // the counts of another thread are in the totals, not in this thread's
+  struct rtad_stats mine, all;
+  assert_int_equal(rtad_stats_thread(&mine), 0);
+  rtad_thread_t thread;
+  assert_int_equal(thread_create(&thread, __stats_thread, (void *)__FUNCTION__), 0);
+  thread_join(thread);
+  assert_int_equal(rtad_stats_thread(&stats), 0);
+  assert_int_equal(stats.bytes_read, mine.bytes_read);
+  assert_int_equal(rtad_stats_get(&all), 0);
+  assert_true(all.bytes_read > mine.bytes_read);
+  assert_true(all.phase_calls[RTAD_PHASE_EXTRACT] >
+              mine.phase_calls[RTAD_PHASE_EXTRACT]);
+
+  rtad_stats_reset();
+  assert_int_equal(rtad_stats_get(&all), 0);
+  assert_int_equal(all.bytes_read, 0);
+  assert_int_equal(all.phase_calls[RTAD_PHASE_EXTRACT], 0);
+  assert_string_equal(rtad_phase_name(RTAD_PHASE_HEADER), "header");
+  assert_null(rtad_phase_name(RTAD_PHASE_COUNT));
+}
+
+static void test_rtad_writer_add_files(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file(__FUNCTION__);
+  // empty, one byte, several slices, and more slices than the ring depth
+  static const size_t sizes[] = {0, 1, 3 * IO_SLICE_SIZE + 5,
+                                 (IO_DEPTH + 3) * IO_SLICE_SIZE};
+  enum { COUNT = sizeof(sizes) / sizeof(sizes[0]) };
+  static char data[(IO_DEPTH + 3) * IO_SLICE_SIZE];
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (char)(i * 7 + i / 1000);
+  }
+  char paths[COUNT][64];
+  char names[COUNT][16];
+  struct rtad_file_input inputs[COUNT];
+  for (size_t i = 0; i < COUNT; i++) {
+    snprintf(paths[i], sizeof(paths[i]), "%s_%zu", __FUNCTION__, i);
+    snprintf(names[i], sizeof(names[i]), "in/%zu", i);
+    FILE *fp = fopen(paths[i], "wb");
+    assert_non_null(fp);
+    assert_int_equal(fwrite(data + i, 1, sizes[i], fp), sizes[i]);
+    fclose(fp);
+    inputs[i] = (struct rtad_file_input){
+        .name = names[i], .path = paths[i],
+        .codec = i % 2 ? RTAD_CODEC_LZ : RTAD_CODEC_NONE};
+  }
+  rtad_writer *writer = rtad_writer_open(__FUNCTION__);
+  assert_non_null(writer);
+  assert_int_equal(rtad_writer_add_files(writer, inputs, COUNT), 0);
+  assert_int_equal(rtad_writer_close(writer), 0);
+  rtad_file *file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  for (size_t i = 0; i < COUNT; i++) {
+    __check_entry_read(file, names[i], data + i, sizes[i]);
+  }
+  assert_int_equal(rtad_verify_full(file, 1), 0);
+  rtad_close(file);
+
+  // a missing file fails the writer, nothing is left behind
+  writer = rtad_writer_open(__FUNCTION__);
+  assert_non_null(writer);
+  inputs[1].path = "test_rtad_writer_add_files_missing";
+  assert_int_equal(rtad_writer_add_files(writer, inputs, COUNT), -1);
+  assert_int_equal(rtad_writer_close(writer), -1);
+  assert_int_equal(rtad_validate_hdr(__FUNCTION__), -1);
+}
+
+static void test_rtad_append_packed_entries_zlib(void **state) {
+  (void)state; /* unused */
+  if (rtad_codec_supported(RTAD_CODEC_ZLIB) != 0) {
+    skip();
+  }
+  __create_tmp_file(__FUNCTION__);
+  static char data[50000];
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (char)(i % 61);
+  }
+  struct rtad_input inputs[2] = {
+      {.name = "z", .data = data, .size = sizeof(data),
+       .codec = RTAD_CODEC_ZLIB},
+      {.name = "lz", .data = data, .size = sizeof(data),
+       .codec = RTAD_CODEC_LZ}};
+  assert_int_equal(rtad_append_packed_entries(__FUNCTION__, inputs, 2), 0);
+  rtad_file *file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  __check_entry_read(file, "z", data, sizeof(data));
+  __check_entry_read(file, "lz", data, sizeof(data));
+  rtad_close(file);
+}
+
+static void test_hash_tree_vectors(void **state) {
+  (void)state; /* unused */
+  // from the BLAKE3 reference, input bytes are i % 251
+  static const struct {
+    size_t size;
+    const char *hex;
+  } vectors[] = {
+      {0, "af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262"},
+      {1, "2d3adedff11b61f14c886e35afa036736dcd87a74d27b5c1510225d0f592e213"},
+      {1024,
+       "42214739f095a406f3fc83deb889744ac00df831c10daa55189b5d121c855af7"},
+      {1025,
+       "d00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444"},
+      {65536,
+       "68d647e619a930e7b1082f74f334b0c65a315725569bdc123f0ee11881717bfe"},
+      {65537,
+       "7c99f9840a73dfcb6e5bfe4ff6d1558acab7e015640790c26411818bdbe17eca"},
+      {200000,
+       "55409142cced2ec79897459f170b6d22565daf883710b4ad7aeeddaef54244b4"},
+  };
+  static char data[200000];
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (char)(i % 251);
+  }
+  for (size_t v = 0; v < sizeof(vectors) / sizeof(vectors[0]); v++) {
+    uint8_t out[RTAD_HASH_SIZE];
+    char hex[2 * RTAD_HASH_SIZE + 1];
+    hash_tree(data, vectors[v].size, 0, 1, out);
+    for (size_t i = 0; i < RTAD_HASH_SIZE; i++) {
+      snprintf(hex + 2 * i, 3, "%02x", out[i]);
+    }
+    assert_string_equal(hex, vectors[v].hex);
+  }
+  // the same root from the subtrees of 64KiB blocks
+  uint8_t leaves[4 * RTAD_HASH_SIZE];
+  for (size_t i = 0; i < 4; i++) {
+    size_t start = i * RTAD_HASH_BLOCK_SIZE;
+    size_t size = sizeof(data) - start < RTAD_HASH_BLOCK_SIZE
+                      ? sizeof(data) - start
+                      : RTAD_HASH_BLOCK_SIZE;
+    hash_tree(data + start, size, start / 1024, 0,
+              leaves + i * RTAD_HASH_SIZE);
+  }
+  uint8_t root[RTAD_HASH_SIZE], expected[RTAD_HASH_SIZE];
+  hash_leaves(leaves, 4, root);
+  hash_tree(data, sizeof(data), 0, 1, expected);
+  assert_memory_equal(root, expected, RTAD_HASH_SIZE);
+}
+
+static char __hashed_data[300000];
+
+// entries over several hash blocks
+static void __create_hashed_file(const char *path) {
+  for (size_t i = 0; i < sizeof(__hashed_data); i++) {
+    __hashed_data[i] = (char)(i * 7 + i / 1000);
+  }
+  __create_tmp_file(path);
+  struct rtad_input inputs[2] = {
+      {.name = "plain", .data = __hashed_data,
+       .size = sizeof(__hashed_data)},
+      {.name = "lz", .data = __hashed_data, .size = sizeof(__hashed_data),
+       .codec = RTAD_CODEC_LZ}};
+  assert_int_equal(rtad_append_packed_entries(path, inputs, 2), 0);
+}
+
+static void __flip_byte(const char *path, off_t offset) {
+  FILE *fp = fopen(path, "r+b");
+  assert_non_null(fp);
+  assert_int_equal(fseeko(fp, offset, SEEK_SET), 0);
+  int c = fgetc(fp);
+  assert_int_equal(fseeko(fp, offset, SEEK_SET), 0);
+  fputc(c ^ 0x20, fp);
+  fclose(fp);
+}
+
+static void test_rtad_verify_full(void **state) {
+  (void)state; /* unused */
+  __create_hashed_file(__FUNCTION__);
+  rtad_file *file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  assert_int_equal(rtad_verify_full(file, 1), 0);
+  assert_int_equal(rtad_verify_full(file, 3), 0);
+  assert_int_equal(rtad_verify_full(file, 0), 0);
+  // the root is BLAKE3 of the payload bytes before the leaves
+  uint8_t root[RTAD_HASH_SIZE], expected[RTAD_HASH_SIZE];
+  assert_int_equal(rtad_file_hash(file, root), 0);
+  char *payload = (char *)malloc(file->hash.covered_size);
+  assert_non_null(payload);
+  assert_int_equal(file_pread(file->fd, payload,
+                              (size_t)file->hash.covered_size,
+                              file->data_offset),
+                   0);
+  hash_tree(payload, (size_t)file->hash.covered_size, 0, 1, expected);
+  assert_memory_equal(root, expected, RTAD_HASH_SIZE);
+  free(payload);
+  rtad_close(file);
+
+  __flip_byte(__FUNCTION__, TMP_FILE_SIZE + 200000);
+  file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  assert_int_equal(rtad_verify_full(file, 1), -1);
+  assert_int_equal(rtad_verify_full(file, 4), -1);
+  rtad_close(file);
+
+  // a payload without tree hash can't be verified
+  __create_tmp_file_append_data_hdr(__FUNCTION__, 20);
+  file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  assert_int_equal(rtad_file_validate(file), 0);
+  assert_int_equal(rtad_verify_full(file, 1), -1);
+  assert_int_equal(rtad_file_hash(file, root), -1);
+  rtad_close(file);
+}
+
+static void test_rtad_reader_verify_lazy(void **state) {
+  (void)state; /* unused */
+  __create_hashed_file(__FUNCTION__);
+  // in the fourth block of the plain entry
+  __flip_byte(__FUNCTION__, TMP_FILE_SIZE + 3 * RTAD_HASH_BLOCK_SIZE + 10);
+  rtad_file *file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  struct rtad_entry entry;
+  assert_int_equal(rtad_find(file, "plain", &entry), 0);
+  rtad_reader *reader = rtad_reader_open(file, &entry);
+  assert_non_null(reader);
+  assert_int_equal(rtad_reader_enable_verify(reader), 0);
+  char buf[100];
+  size_t read_size = 0;
+  // blocks that are not touched are not checked
+  assert_int_equal(rtad_reader_pread(reader, buf, sizeof(buf), 0, &read_size),
+                   0);
+  assert_memory_equal(buf, __hashed_data, sizeof(buf));
+  assert_int_equal(rtad_reader_pread(reader, buf, sizeof(buf),
+                                     3 * RTAD_HASH_BLOCK_SIZE, &read_size),
+                   -1);
+  rtad_reader_close(reader);
+  // without verification the bytes are returned as stored
+  reader = rtad_reader_open(file, &entry);
+  assert_non_null(reader);
+  assert_int_equal(rtad_reader_pread(reader, buf, sizeof(buf),
+                                     3 * RTAD_HASH_BLOCK_SIZE, &read_size),
+                   0);
+  rtad_reader_close(reader);
+  // the compressed entry is in other blocks
+  assert_int_equal(rtad_find(file, "lz", &entry), 0);
+  reader = rtad_reader_open(file, &entry);
+  assert_non_null(reader);
+  assert_int_equal(rtad_reader_enable_verify(reader), 0);
+  char *out_data = (char *)malloc(sizeof(__hashed_data));
+  assert_non_null(out_data);
+  assert_int_equal(rtad_reader_pread(reader, out_data, sizeof(__hashed_data),
+                                     0, &read_size),
+                   0);
+  assert_int_equal(read_size, sizeof(__hashed_data));
+  assert_memory_equal(out_data, __hashed_data, sizeof(__hashed_data));
+  free(out_data);
+  rtad_reader_close(reader);
+  rtad_close(file);
+
+  // leaves that don't match the root are refused
+  __create_hashed_file(__FUNCTION__);
+  file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  off_t leaf_offset = file->data_offset + (off_t)file->hash.covered_size;
+  rtad_close(file);
+  __flip_byte(__FUNCTION__, leaf_offset);
+  file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  reader = rtad_reader_open(file, NULL);
+  assert_non_null(reader);
+  assert_int_equal(rtad_reader_enable_verify(reader), -1);
+  rtad_reader_close(reader);
+  rtad_close(file);
+}
+
+static void test_rtad_find_short_toc_records(void **state) {
+  (void)state; /* unused */
+  // a TOC written before raw_size was added to the records
+  struct rtad_toc_item items[2] = {{.name = "a"}, {.name = "b"}};
+  items[0].record.size = 3;
+  items[1].record.offset = 3;
+  items[1].record.size = 2;
+  size_t toc_size = 0;
+  char *toc = toc_build(items, 2, &toc_size);
+  assert_non_null(toc);
+  struct rtad_toc_hdr hdr;
+  memcpy(&hdr, toc, sizeof(hdr));
+  size_t head_size = sizeof(hdr) + (hdr.bucket_count + 1) * sizeof(uint32_t);
+  char old_toc[256];
+  size_t old_size = head_size;
+  hdr.entry_size = RTAD_TOC_ENTRY_MIN_SIZE;
+  memcpy(old_toc, toc, head_size);
+  memcpy(old_toc, &hdr, sizeof(hdr));
+  for (size_t i = 0; i < 2; i++) {
+    memcpy(old_toc + old_size,
+           toc + head_size + i * sizeof(struct rtad_toc_entry),
+           RTAD_TOC_ENTRY_MIN_SIZE);
+    old_size += RTAD_TOC_ENTRY_MIN_SIZE;
+  }
+  memcpy(old_toc + old_size, toc + toc_size - hdr.names_size, hdr.names_size);
+  old_size += hdr.names_size;
+  free(toc);
+
+  __create_tmp_file(__FUNCTION__);
+  FILE *fp = fopen(__FUNCTION__, "ab");
+  assert_non_null(fp);
+  struct rtad_trailer trailer;
+  trailer_init(&trailer, 5 + old_size);
+  trailer.flags = RTAD_TRAILER_TOC;
+  trailer.toc_offset = 5;
+  trailer.toc_size = old_size;
+  fwrite("xxxyy", 1, 5, fp);
+  fwrite(old_toc, 1, old_size, fp);
+  fwrite(&trailer, 1, sizeof(trailer), fp);
+  fclose(fp);
+
+  rtad_file *file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  __check_entry_read(file, "a", "xxx", 3);
+  __check_entry_read(file, "b", "yy", 2);
+  rtad_close(file);
+}
+
+static void test_rtad_append_packed_entries_null_name(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file(__FUNCTION__);
+  struct rtad_input inputs[1] = {{.name = NULL, .data = "x", .size = 1}};
+  int result = rtad_append_packed_entries(__FUNCTION__, inputs, 1);
+  assert_int_equal(result, -1);
+}
+
+static void test_rtad_append_packed_entries_empty_name(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file(__FUNCTION__);
+  struct rtad_input inputs[1] = {{.name = "", .data = "x", .size = 1}};
+  int result = rtad_append_packed_entries(__FUNCTION__, inputs, 1);
+  assert_int_equal(result, -1);
+}
+
+static void test_rtad_append_packed_entries_duplicated_name(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file(__FUNCTION__);
+  struct rtad_input inputs[2] = {{.name = "x", .data = "1", .size = 1},
+                                 {.name = "x", .data = "2", .size = 1}};
+  int result = rtad_append_packed_entries(__FUNCTION__, inputs, 2);
+  assert_int_equal(result, -1);
+  // nothing is written
+  assert_int_equal(__file_length(__FUNCTION__), TMP_FILE_SIZE);
+}
+
+static void test_rtad_append_packed_entries_ok(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file(__FUNCTION__);
+  struct rtad_input inputs[3] = {
+      {.name = "config.ini", .data = "a=1\n", .size = 4},
+      {.name = "empty", .data = NULL, .size = 0},
+      {.name = "dir/readme.txt", .data = "Hello, RTAD!", .size = 12}};
+  int result = rtad_append_packed_entries(__FUNCTION__, inputs, 3);
+  assert_int_equal(result, 0);
+  assert_int_equal(rtad_validate_hdr(__FUNCTION__), 0);
+
+  rtad_file *file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  for (size_t i = 0; i < 3; i++) {
+    struct rtad_entry entry;
+    assert_int_equal(rtad_find(file, inputs[i].name, &entry), 0);
+    assert_int_equal(entry.size, inputs[i].size);
+    char *out_data = NULL;
+    size_t out_data_size = 0;
+    assert_int_equal(rtad_entry_read(file, &entry, &out_data, &out_data_size),
+                     0);
+    assert_int_equal(out_data_size, inputs[i].size);
+    if (inputs[i].size > 0) {
+      assert_memory_equal(out_data, inputs[i].data, inputs[i].size);
+    }
+    rtad_free_extracted_data(out_data);
+  }
+  struct rtad_entry entry;
+  assert_int_equal(rtad_find(file, "missing", &entry), -1);
+  assert_int_equal(rtad_find(file, "config.in", &entry), -1);
+  assert_int_equal(rtad_close(file), 0);
+
+  // the whole archive is truncated
+  assert_int_equal(rtad_truncate_data(__FUNCTION__), 0);
+  assert_int_equal(__file_length(__FUNCTION__), TMP_FILE_SIZE);
+}
+
+static void test_rtad_append_packed_entries_many(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file(__FUNCTION__);
+  enum { COUNT = 1000 };
+  static char names[COUNT][16];
+  static struct rtad_input inputs[COUNT];
+  for (size_t i = 0; i < COUNT; i++) {
+    snprintf(names[i], sizeof(names[i]), "entry%zu", i);
+    inputs[i].name = names[i];
+    inputs[i].data = names[i];
+    inputs[i].size = strlen(names[i]);
+  }
+  assert_int_equal(rtad_append_packed_entries(__FUNCTION__, inputs, COUNT), 0);
+  rtad_file *file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  for (size_t i = 0; i < COUNT; i++) {
+    struct rtad_entry entry;
+    assert_int_equal(rtad_find(file, names[i], &entry), 0);
+    char *out_data = NULL;
+    size_t out_data_size = 0;
+    assert_int_equal(rtad_entry_read(file, &entry, &out_data, &out_data_size),
+                     0);
+    assert_int_equal(out_data_size, strlen(names[i]));
+    assert_memory_equal(out_data, names[i], out_data_size);
+    rtad_free_extracted_data(out_data);
+  }
+  rtad_close(file);
+}
+
+static void test_rtad_entry_at(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file(__FUNCTION__);
+  enum { COUNT = 100 };
+  static char names[COUNT][16];
+  static struct rtad_input inputs[COUNT];
+  for (size_t i = 0; i < COUNT; i++) {
+    snprintf(names[i], sizeof(names[i]), "dir/%zu", i);
+    inputs[i].name = names[i];
+    inputs[i].data = names[i];
+    inputs[i].size = strlen(names[i]);
+  }
+  assert_int_equal(rtad_append_packed_entries(__FUNCTION__, inputs, COUNT), 0);
+  rtad_file *file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  assert_int_equal(rtad_entry_count(file), COUNT);
+  // every entry is listed once, with the entry rtad_find returns
+  int seen[COUNT] = {0};
+  for (size_t i = 0; i < COUNT; i++) {
+    const char *name = NULL;
+    size_t name_size = 0;
+    struct rtad_entry entry, found;
+    assert_int_equal(rtad_entry_at(file, i, &name, &name_size, &entry), 0);
+    char buf[16] = {0};
+    assert_true(name_size < sizeof(buf));
+    memcpy(buf, name, name_size);
+    size_t index = (size_t)atoi(buf + 4);
+    assert_true(index < COUNT);
+    assert_int_equal(seen[index]++, 0);
+    assert_int_equal(rtad_find(file, buf, &found), 0);
+    assert_int_equal(entry.offset, found.offset);
+    assert_int_equal(entry.size, found.size);
+    assert_int_equal(entry.raw_size, found.raw_size);
+  }
+  const char *name = NULL;
+  size_t name_size = 0;
+  struct rtad_entry entry;
+  assert_int_equal(rtad_entry_at(file, COUNT, &name, &name_size, &entry), -1);
+  rtad_close(file);
+}
+
+static void test_get_ranges(void **state) {
+  (void)state; /* unused */
+  struct rtad_get_piece pieces[] = {
+      {.offset = 100, .size = 50},
+      {.offset = 0, .size = 100},
+      // inside the first range, a shared chunk
+      {.offset = 10, .size = 20},
+      {.offset = 150 + GET_GAP_SIZE + 1, .size = 10},
+      {.offset = 1 << 30, .size = GET_RANGE_SIZE + 1},
+      {.offset = (1 << 30) + 5, .size = 10},
+      {.offset = (1 << 30) + GET_RANGE_SIZE + 1, .size = 1}};
+  enum { COUNT = sizeof(pieces) / sizeof(pieces[0]) };
+  struct rtad_get_range ranges[COUNT];
+  assert_int_equal(get_ranges(pieces, COUNT, ranges), 4);
+  assert_int_equal(ranges[0].offset, 0);
+  assert_int_equal(ranges[0].size, 150);
+  assert_int_equal(ranges[0].count, 3);
+  assert_int_equal(ranges[1].count, 1);
+  // a long piece takes what it covers, not what follows
+  assert_int_equal(ranges[2].size, GET_RANGE_SIZE + 1);
+  assert_int_equal(ranges[2].count, 2);
+  assert_int_equal(ranges[3].first, 6);
+}
+
+static void test_rtad_get_many(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file(__FUNCTION__);
+  enum { COUNT = 300 };
+  static char names[COUNT][16];
+  static char data[COUNT * 500];
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (char)((i / 7) % 13);
+  }
+  rtad_writer *writer = rtad_writer_open(__FUNCTION__);
+  assert_non_null(writer);
+  for (size_t i = 0; i < COUNT; i++) {
+    snprintf(names[i], sizeof(names[i]), "asset%zu", i);
+    // every third one compressed in small chunks
+    assert_int_equal(
+        rtad_writer_set_codec(writer, i % 3 ? RTAD_CODEC_NONE : RTAD_CODEC_LZ,
+                              128),
+        0);
+    assert_int_equal(rtad_writer_begin_entry(writer, names[i]), 0);
+    assert_int_equal(rtad_writer_write(writer, data + i * 500, i % 500), 0);
+  }
+  assert_int_equal(rtad_writer_close(writer), 0);
+
+  rtad_file *file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  // in another order, one of them twice
+  const char *wanted[COUNT + 1];
+  for (size_t i = 0; i < COUNT; i++) {
+    wanted[i] = names[(i * 7) % COUNT];
+  }
+  wanted[COUNT] = names[5];
+  static struct rtad_data out[COUNT + 1];
+  assert_int_equal(rtad_get_many(file, wanted, COUNT + 1, out), 0);
+  for (size_t i = 0; i <= COUNT; i++) {
+    size_t index = i < COUNT ? (i * 7) % COUNT : 5;
+    assert_int_equal(out[i].size, index % 500);
+    assert_memory_equal(out[i].data, data + index * 500, out[i].size);
+    rtad_free_extracted_data(out[i].data);
+  }
+
+  // a missing entry fails the whole call
+  wanted[3] = "missing";
+  assert_int_equal(rtad_get_many(file, wanted, COUNT, out), -1);
+  for (size_t i = 0; i < COUNT; i++) {
+    assert_null(out[i].data);
+  }
+  assert_int_equal(rtad_get_many(file, wanted, 0, out), 0);
+  rtad_close(file);
+}
+
+static void test_rtad_open_no_toc(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file_append_data_hdr(__FUNCTION__, 10);
+  rtad_file *file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  struct rtad_entry entry;
+  assert_int_equal(rtad_find(file, "name", &entry), -1);
+  rtad_close(file);
+}
+
+static void test_rtad_open_no_data(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file(__FUNCTION__);
+  rtad_file *file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  assert_int_equal(rtad_file_validate(file), -1);
+  char *out_data = NULL;
+  size_t out_data_size = 0;
+  assert_int_equal(rtad_file_extract(file, &out_data, &out_data_size), -1);
+  assert_null(rtad_reader_open(file, NULL));
+  // read-only handle
+  assert_int_equal(rtad_file_truncate(file), -1);
+  assert_int_equal(rtad_file_append(file, "data", 4), -1);
+  rtad_close(file);
+}
+
+static void test_rtad_open_toc_larger_than_tail(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file(__FUNCTION__);
+  // the TOC doesn't fit in the first read of the file tail
+  enum { COUNT = 4000 };
+  static char names[COUNT][16];
+  static struct rtad_input inputs[COUNT];
+  for (size_t i = 0; i < COUNT; i++) {
+    snprintf(names[i], sizeof(names[i]), "entry%zu", i);
+    inputs[i].name = names[i];
+    inputs[i].data = names[i];
+    inputs[i].size = 1;
+  }
+  assert_int_equal(rtad_append_packed_entries(__FUNCTION__, inputs, COUNT), 0);
+  rtad_file *file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  assert_true(file->trailer.toc_size > TAIL_READ_SIZE);
+  struct rtad_entry entry;
+  assert_int_equal(rtad_find(file, "entry0", &entry), 0);
+  assert_int_equal(rtad_find(file, "entry3999", &entry), 0);
+  assert_int_equal(entry.offset, COUNT - 1);
+  rtad_close(file);
+}
+
+static void test_rtad_file_append_and_truncate(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file(__FUNCTION__);
+  rtad_file *file = rtad_open_rw(__FUNCTION__);
+  assert_non_null(file);
+  assert_int_equal(rtad_file_truncate(file), 0);
+  assert_int_equal(rtad_file_append(file, "first", 5), 0);
+  assert_int_equal(rtad_file_validate(file), 0);
+  // the payload is replaced, not stacked
+  assert_int_equal(rtad_file_append(file, "second", 6), 0);
+  char *out_data = NULL;
+  size_t out_data_size = 0;
+  assert_int_equal(rtad_file_extract(file, &out_data, &out_data_size), 0);
+  assert_int_equal(out_data_size, 6);
+  assert_memory_equal(out_data, "second", 6);
+  rtad_free_extracted_data(out_data);
+  assert_int_equal(rtad_close(file), 0);
+  assert_int_equal(__file_length(__FUNCTION__),
+                   TMP_FILE_SIZE + 6 + HASH_SECTION_SIZE + RTAD_TRAILER_SIZE);
+
+  file = rtad_open_rw(__FUNCTION__);
+  assert_non_null(file);
+  assert_int_equal(rtad_file_truncate(file), 0);
+  assert_int_equal(rtad_file_validate(file), -1);
+  assert_int_equal(rtad_close(file), 0);
+  assert_int_equal(__file_length(__FUNCTION__), TMP_FILE_SIZE);
+}
+
+static void test_rtad_file_append_entries_keeps_handle(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file(__FUNCTION__);
+  rtad_file *file = rtad_open_rw(__FUNCTION__);
+  assert_non_null(file);
+  struct rtad_input inputs[2] = {{.name = "a", .data = "1", .size = 1},
+                                 {.name = "b", .data = "22", .size = 2}};
+  assert_int_equal(rtad_file_append_entries(file, inputs, 2), 0);
+  // the handle sees the new TOC without reopening
+  struct rtad_entry entry;
+  assert_int_equal(rtad_find(file, "b", &entry), 0);
+  assert_int_equal(entry.size, 2);
+  assert_int_equal(rtad_file_append(file, "blob", 4), 0);
+  assert_int_equal(rtad_find(file, "b", &entry), -1);
+  rtad_close(file);
+  assert_int_equal(rtad_validate_hdr(__FUNCTION__), 0);
+}
+
+static void test_rtad_open_non_existing_file(void **state) {
+  (void)state; /* unused */
+  assert_null(rtad_open("non_existing_file"));
+}
+
+static void test_rtad_self_same_handle(void **state) {
+  (void)state; /* unused */
+  rtad_file *self = rtad_self();
+  assert_non_null(self);
+  assert_ptr_equal(rtad_self(), self);
+  // the test binary has no payload
+  assert_int_equal(rtad_file_validate(self), -1);
+  const char *data = NULL;
+  size_t data_size = 0;
+  assert_int_equal(rtad_self_data(&data, &data_size), -1);
+  assert_int_equal(rtad_self_entry("name", &data, &data_size), -1);
+  // the shared handle can't be closed or modified
+  assert_int_equal(rtad_close(self), -1);
+  assert_int_equal(rtad_file_truncate(self), -1);
+  assert_ptr_equal(rtad_self(), self);
+}
+
+#if !defined(_WIN32)
+static void *__rtad_self_thread(void *arg) {
+  *(rtad_file **)arg = rtad_self();
+  return NULL;
+}
+
+static void test_rtad_self_threads(void **state) {
+  (void)state; /* unused */
+  enum { THREADS = 8 };
+  pthread_t threads[THREADS];
+  rtad_file *handles[THREADS];
+  for (size_t i = 0; i < THREADS; i++) {
+    assert_int_equal(
+        pthread_create(&threads[i], NULL, __rtad_self_thread, &handles[i]), 0);
+  }
+  for (size_t i = 0; i < THREADS; i++) {
+    pthread_join(threads[i], NULL);
+    assert_non_null(handles[i]);
+    assert_ptr_equal(handles[i], handles[0]);
+  }
+}
+#endif
+
+static void test_rtad_find_null_args(void **state) {
+  (void)state; /* unused */
+  struct rtad_entry entry;
+  assert_int_equal(rtad_find(NULL, "name", &entry), -1);
+}
+
+static void test_rtad_writer_open_null_path(void **state) {
+  (void)state; /* unused */
+  assert_null(rtad_writer_open(NULL));
+}
+
+static void test_rtad_writer_open_non_existing_file(void **state) {
+  (void)state; /* unused */
+  assert_null(rtad_writer_open("non_existing_file"));
+}
+
+static void test_rtad_writer_write_data_ok(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file(__FUNCTION__);
+  // larger than the write buffer, mixed with small writes
+  const size_t big_size = WRITE_BUFFER_SIZE * 3 + 7;
+  char *big = (char *)malloc(big_size);
+  assert_non_null(big);
+  for (size_t i = 0; i < big_size; i++) {
+    big[i] = (char)(i * 7);
+  }
+  rtad_writer *writer = rtad_writer_open(__FUNCTION__);
+  assert_non_null(writer);
+  assert_int_equal(rtad_writer_write(writer, "abc", 3), 0);
+  assert_int_equal(rtad_writer_write(writer, big, big_size), 0);
+  assert_int_equal(rtad_writer_write(writer, "def", 3), 0);
+  // an anonymous payload can't have entries
+  assert_int_equal(rtad_writer_begin_entry(writer, "name"), -1);
+  assert_int_equal(rtad_writer_close(writer), 0);
+
+  char *out_data = NULL;
+  size_t out_data_size = 0;
+  assert_int_equal(rtad_extract_data(__FUNCTION__, &out_data, &out_data_size),
+                   0);
+  assert_int_equal(out_data_size, big_size + 6);
+  assert_memory_equal(out_data, "abc", 3);
+  assert_memory_equal(out_data + 3, big, big_size);
+  assert_memory_equal(out_data + 3 + big_size, "def", 3);
+  rtad_free_extracted_data(out_data);
+  free(big);
+}
+
+static void test_rtad_writer_writev_entries_ok(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file(__FUNCTION__);
+  const size_t big_size = WRITE_BUFFER_SIZE + 1;
+  char *big = (char *)calloc(1, big_size);
+  assert_non_null(big);
+  big[big_size - 1] = 'z';
+  rtad_writer *writer = rtad_writer_open(__FUNCTION__);
+  assert_non_null(writer);
+  struct rtad_iovec small_iov[3] = {
+      {.data = "Hello", .size = 5}, {.data = ", ", .size = 2},
+      {.data = "RTAD!", .size = 5}};
+  assert_int_equal(rtad_writer_begin_entry(writer, "small"), 0);
+  assert_int_equal(rtad_writer_writev(writer, small_iov, 3), 0);
+  struct rtad_iovec big_iov[2] = {{.data = "a", .size = 1},
+                                  {.data = big, .size = big_size}};
+  assert_int_equal(rtad_writer_begin_entry(writer, "big"), 0);
+  assert_int_equal(rtad_writer_writev(writer, big_iov, 2), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "empty"), 0);
+  assert_int_equal(rtad_writer_close(writer), 0);
+
+  rtad_file *file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  struct rtad_entry entry;
+  char *out_data = NULL;
+  size_t out_data_size = 0;
+  assert_int_equal(rtad_find(file, "small", &entry), 0);
+  assert_int_equal(rtad_entry_read(file, &entry, &out_data, &out_data_size),
+                   0);
+  assert_int_equal(out_data_size, 12);
+  assert_memory_equal(out_data, "Hello, RTAD!", 12);
+  rtad_free_extracted_data(out_data);
+  assert_int_equal(rtad_find(file, "big", &entry), 0);
+  assert_int_equal(rtad_entry_read(file, &entry, &out_data, &out_data_size),
+                   0);
+  assert_int_equal(out_data_size, big_size + 1);
+  assert_int_equal(out_data[0], 'a');
+  assert_memory_equal(out_data + 1, big, big_size);
+  rtad_free_extracted_data(out_data);
+  assert_int_equal(rtad_find(file, "empty", &entry), 0);
+  assert_int_equal(entry.size, 0);
+  rtad_close(file);
+  free(big);
+}
+
+static void test_rtad_writer_replaces_existing_data(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file_append_data_hdr(__FUNCTION__, 20);
+  rtad_writer *writer = rtad_writer_open(__FUNCTION__);
+  assert_non_null(writer);
+  assert_int_equal(rtad_writer_write(writer, "new", 3), 0);
+  assert_int_equal(rtad_writer_close(writer), 0);
+  assert_int_equal(__file_length(__FUNCTION__),
+                   TMP_FILE_SIZE + 3 + HASH_SECTION_SIZE + RTAD_TRAILER_SIZE);
+}
+
+static void test_rtad_writer_close_empty(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file(__FUNCTION__);
+  rtad_writer *writer = rtad_writer_open(__FUNCTION__);
+  assert_non_null(writer);
+  assert_int_equal(rtad_writer_close(writer), 0);
+  assert_int_equal(__file_length(__FUNCTION__), TMP_FILE_SIZE);
+  assert_int_equal(rtad_validate_hdr(__FUNCTION__), -1);
+}
+
+static void test_rtad_writer_abort(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file(__FUNCTION__);
+  rtad_writer *writer = rtad_writer_open(__FUNCTION__);
+  assert_non_null(writer);
+  assert_int_equal(rtad_writer_begin_entry(writer, "a"), 0);
+  assert_int_equal(rtad_writer_write(writer, "data", 4), 0);
+  assert_int_equal(rtad_writer_abort(writer), 0);
+  assert_int_equal(__file_length(__FUNCTION__), TMP_FILE_SIZE);
+}
+
+static void test_rtad_writer_close_duplicated_name(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file(__FUNCTION__);
+  rtad_writer *writer = rtad_writer_open(__FUNCTION__);
+  assert_non_null(writer);
+  assert_int_equal(rtad_writer_begin_entry(writer, "a"), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "a"), 0);
+  assert_int_equal(rtad_writer_close(writer), -1);
+  assert_int_equal(__file_length(__FUNCTION__), TMP_FILE_SIZE);
+}
+
+static void test_rtad_writer_null_args(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file(__FUNCTION__);
+  rtad_writer *writer = rtad_writer_open(__FUNCTION__);
+  assert_non_null(writer);
+  assert_int_equal(rtad_writer_begin_entry(writer, NULL), -1);
+  assert_int_equal(rtad_writer_begin_entry(writer, ""), -1);
+  assert_int_equal(rtad_writer_write(writer, NULL, 1), -1);
+  assert_int_equal(rtad_writer_writev(writer, NULL, 1), -1);
+  assert_int_equal(rtad_writer_write(NULL, "a", 1), -1);
+  assert_int_equal(rtad_writer_close(writer), 0);
+  assert_int_equal(rtad_writer_close(NULL), -1);
+}
+
+#if defined(__linux__)
+// the program headers of an ELF executable, at most 64
+static size_t __elf_phdrs(const char *path, Elf64_Phdr *phdrs) {
+  int fd = file_open(path);
+  assert_true(fd >= 0);
+  Elf64_Ehdr ehdr;
+  assert_int_equal(file_pread(fd, &ehdr, sizeof(ehdr), 0), 0);
+  assert_true(ehdr.e_phnum <= 64);
+  assert_int_equal(file_pread(fd, phdrs, ehdr.e_phnum * sizeof(Elf64_Phdr),
+                              (off_t)ehdr.e_phoff),
+                   0);
+  file_close(fd);
+  return ehdr.e_phnum;
+}
+
+static size_t __elf_count(const Elf64_Phdr *phdrs, size_t count,
+                          uint32_t type) {
+  size_t found = 0;
+  for (size_t i = 0; i < count; i++) {
+    found += phdrs[i].p_type == type;
+  }
+  return found;
+}
+
+static void __pack_load(const char *path, uint32_t load) {
+  rtad_writer *writer = rtad_writer_open(path);
+  assert_non_null(writer);
+  assert_int_equal(rtad_writer_set_load(writer, load), 0);
+  assert_int_equal(rtad_writer_begin_entry(writer, "a"), 0);
+  assert_int_equal(rtad_writer_write(writer, "data", 4), 0);
+  assert_int_equal(rtad_writer_close(writer), 0);
+}
+
+static void test_rtad_writer_load_keeps_notes(void **state) {
+  (void)state; /* unused */
+  const char *dest_path = "test_rtad_writer_load_keeps_notes_dest";
+  struct rtad_file *dest = file_copy_exe(rtad_self(), dest_path);
+  assert_non_null(dest);
+  assert_int_equal(rtad_close(dest), 0);
+  Elf64_Phdr before[64];
+  size_t count = __elf_phdrs(dest_path, before);
+  size_t notes = __elf_count(before, count, PT_NOTE);
+  size_t loads = __elf_count(before, count, PT_LOAD);
+  size_t nulls = __elf_count(before, count, PT_NULL);
+
+  rtad_writer *writer = rtad_writer_open(dest_path);
+  assert_non_null(writer);
+  assert_int_equal(rtad_writer_set_load(writer, 0x4), -1);
+  assert_int_equal(rtad_writer_abort(writer), 0);
+
+  // by default only a PT_NULL header is taken, the notes are left
+  __pack_load(dest_path, RTAD_LOAD_SEGMENT);
+  Elf64_Phdr after[64];
+  assert_int_equal(__elf_phdrs(dest_path, after), count);
+  assert_int_equal(__elf_count(after, count, PT_NOTE), notes);
+  assert_int_equal(__elf_count(after, count, PT_LOAD), loads + (nulls > 0));
+
+  // a PT_NOTE may be taken when asked, never the one of the build id
+  assert_int_equal(rtad_truncate_data(dest_path), 0);
+  assert_int_equal(__elf_count(after, __elf_phdrs(dest_path, after), PT_LOAD),
+                   loads);
+  __pack_load(dest_path, RTAD_LOAD_NOTE);
+  assert_int_equal(__elf_phdrs(dest_path, after), count);
+  int fd = file_open(dest_path);
+  assert_true(fd >= 0);
+  off_t end = fd_length(fd);
+  size_t spare = nulls;
+  for (size_t i = 0; i < count; i++) {
+    if (before[i].p_type != PT_NOTE) {
+      continue;
+    }
+    int build_id = elf_note_build_id(fd, end, &before[i]);
+    spare += !build_id;
+    int kept = 0;
+    for (size_t j = 0; j < count; j++) {
+      kept |= memcmp(&before[i], &after[j], sizeof(Elf64_Phdr)) == 0;
+    }
+    assert_true(kept || !build_id);
+  }
+  file_close(fd);
+  assert_int_equal(__elf_count(after, count, PT_LOAD), loads + (spare > 0));
+}
+#endif
+
+static void test_rtad_reader_read_data(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file_append_data_hdr(__FUNCTION__, 1000);
+  rtad_file *file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  rtad_reader *reader = rtad_reader_open(file, NULL);
+  assert_non_null(reader);
+  assert_int_equal(rtad_reader_size(reader), 1000);
+  // a small fixed buffer streams the whole payload
+  char buf[64];
+  size_t bytes = 0;
+  size_t total = 0;
+  do {
+    assert_int_equal(rtad_reader_read(reader, buf, sizeof(buf), &bytes), 0);
+    for (size_t i = 0; i < bytes; i++) {
+      assert_int_equal((unsigned char)buf[i], (unsigned char)(total + i));
+    }
+    total += bytes;
+  } while (bytes > 0);
+  assert_int_equal(total, 1000);
+  assert_int_equal(rtad_reader_tell(reader), 1000);
+  assert_int_equal(rtad_reader_close(reader), 0);
+  rtad_close(file);
+}
+
+static void test_rtad_reader_pread_and_seek(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file_append_data_hdr(__FUNCTION__, 200);
+  rtad_file *file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  rtad_reader *reader = rtad_reader_open(file, NULL);
+  assert_non_null(reader);
+  char buf[16];
+  size_t bytes = 0;
+  assert_int_equal(rtad_reader_pread(reader, buf, 4, 100, &bytes), 0);
+  assert_int_equal(bytes, 4);
+  assert_int_equal((unsigned char)buf[0], 100);
+  // pread doesn't move the position
+  assert_int_equal(rtad_reader_tell(reader), 0);
+  // short read at the end
+  assert_int_equal(rtad_reader_pread(reader, buf, sizeof(buf), 195, &bytes),
+                   0);
+  assert_int_equal(bytes, 5);
+  assert_int_equal(rtad_reader_pread(reader, buf, sizeof(buf), 200, &bytes),
+                   0);
+  assert_int_equal(bytes, 0);
+
+  assert_int_equal(rtad_reader_seek(reader, -10, SEEK_END), 0);
+  assert_int_equal(rtad_reader_tell(reader), 190);
+  assert_int_equal(rtad_reader_seek(reader, 5, SEEK_CUR), 0);
+  assert_int_equal(rtad_reader_read(reader, buf, 1, &bytes), 0);
+  assert_int_equal((unsigned char)buf[0], 195);
+  assert_int_equal(rtad_reader_seek(reader, -1, SEEK_SET), -1);
+  assert_int_equal(rtad_reader_seek(reader, INT64_MIN, SEEK_SET), -1);
+  assert_int_equal(rtad_reader_seek(reader, INT64_MIN, SEEK_END), -1);
+  assert_int_equal(rtad_reader_seek(reader, INT64_MAX, SEEK_END), -1);
+  assert_int_equal(rtad_reader_seek(reader, 0, 42), -1);
+  // a failed seek leaves the position as it was
+  assert_int_equal(rtad_reader_tell(reader), 196);
+  rtad_reader_close(reader);
+  rtad_close(file);
+}
+
+static void test_rtad_reader_entry(void **state) {
+  (void)state; /* unused */
+  __create_tmp_file(__FUNCTION__);
+  struct rtad_input inputs[2] = {{.name = "a", .data = "0123", .size = 4},
+                                 {.name = "b", .data = "456789", .size = 6}};
+  assert_int_equal(rtad_append_packed_entries(__FUNCTION__, inputs, 2), 0);
+  rtad_file *file = rtad_open(__FUNCTION__);
+  assert_non_null(file);
+  struct rtad_entry entry;
+  assert_int_equal(rtad_find(file, "b", &entry), 0);
+  rtad_reader *first = rtad_reader_open(file, &entry);
+  rtad_reader *second = rtad_reader_open(file, &entry);
+  assert_non_null(first);
+  assert_non_null(second);
+  assert_int_equal(rtad_reader_size(first), 6);
+  // readers over the same file keep their own positions
+  char buf[16];
+  size_t bytes = 0;
+  assert_int_equal(rtad_reader_read(first, buf, 2, &bytes), 0);
+  assert_memory_equal(buf, "45", 2);
+  assert_int_equal(rtad_reader_read(second, buf, 3, &bytes), 0);
+  assert_memory_equal(buf, "456", 3);
+  // reads stop at the end of the entry
+  assert_int_equal(rtad_reader_read(first, buf, sizeof(buf), &bytes), 0);
+  assert_int_equal(bytes, 4);
+  assert_memory_equal(buf, "6789", 4);
+  rtad_reader_close(first);
+  rtad_reader_close(second);
+
+  struct rtad_entry bad_entry = {.offset = 0, .size = UINT64_MAX};
+  assert_null(rtad_reader_open(file, &bad_entry));
+  rtad_close(file);
+}
+
+static void test_rtad_reader_null_args(void **state) {
+  (void)state; /* unused */
+  size_t bytes = 0;
+  char buf[1];
+  assert_null(rtad_reader_open(NULL, NULL));
+  assert_int_equal(rtad_reader_read(NULL, buf, 1, &bytes), -1);
+  assert_int_equal(rtad_reader_seek(NULL, 0, SEEK_SET), -1);
+  assert_int_equal(rtad_reader_close(NULL), -1);
+}
+
 int main(void) {
   const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_exe_open_ok),
+#if !defined(__linux__)
       cmocka_unit_test(test_exe_path_ok),
       cmocka_unit_test(test_exe_path_little_buffer),
       cmocka_unit_test(test_exe_path_null_buffer),
       cmocka_unit_test(test_exe_path_buffer_with_0_length),
       cmocka_unit_test(test_exe_path_null_buffer_with_wrong_length),
-      cmocka_unit_test(test_file_truncate_ok),
-      cmocka_unit_test(test_file_truncate_wrong_path),
-      cmocka_unit_test(test_file_length_ok),
-      cmocka_unit_test(test_file_length_wrong_path),
-      cmocka_unit_test(test_file_copy_ok),
-      cmocka_unit_test(test_file_copy_wrong_src_path),
-      cmocka_unit_test(test_file_copy_cannot_create_dest),
-      cmocka_unit_test(test_file_copy_self_ok),
-      cmocka_unit_test(test_file_append_data_20_bytes),
-      cmocka_unit_test(test_file_append_data_1_byte),
-      cmocka_unit_test(test_file_append_data_null_path),
-      cmocka_unit_test(test_file_append_data_null_data),
-      cmocka_unit_test(test_file_append_data_zero_size),
+#endif
+      cmocka_unit_test(test_fd_truncate_ok),
+      cmocka_unit_test(test_fd_truncate_invalid_fd),
+      cmocka_unit_test(test_fd_length_ok),
+      cmocka_unit_test(test_fd_length_invalid_fd),
+      cmocka_unit_test(test_file_copy_exe_no_data),
+      cmocka_unit_test(test_fd_copy_invalid_fd),
+      cmocka_unit_test(test_file_copy_exe_ok),
+      cmocka_unit_test(test_fd_copy_every_method),
+#if defined(__linux__) && defined(FICLONE)
+      cmocka_unit_test(test_fd_copy_reflink_fallback),
+#endif
+      cmocka_unit_test(test_fd_copy_sparse_file),
+      cmocka_unit_test(test_fd_copy_prefix),
+      cmocka_unit_test(test_fd_copy_range_offsets),
+      cmocka_unit_test(test_io_batch),
       cmocka_unit_test(test_rtad_extract_hdr_no_buffer),
       cmocka_unit_test(test_rtad_extract_hdr_non_existing_file),
       cmocka_unit_test(test_rtad_extract_hdr_too_small_file),
@@ -580,11 +2936,9 @@ int main(void) {
       cmocka_unit_test(test_rtad_validate_hdr_ok),
       cmocka_unit_test(test_rtad_validate_hdr_invalid),
       cmocka_unit_test(test_rtad_validate_hdr_non_existing_file),
-      cmocka_unit_test(test_file_copy_self_null_dest),
-      cmocka_unit_test(test_file_copy_self_invalid_dest),
+      cmocka_unit_test(test_file_copy_exe_null_args),
+      cmocka_unit_test(test_file_copy_exe_invalid_dest),
       cmocka_unit_test(test_rtad_extract_hdr_null_path),
-      cmocka_unit_test(test_file_truncate_null_path),
-      cmocka_unit_test(test_file_length_null_path),
       cmocka_unit_test(test_rtad_truncate_data_null_path),
       cmocka_unit_test(test_rtad_truncate_data_non_existing_file),
       cmocka_unit_test(test_rtad_truncate_data_invalid_hdr),
@@ -594,6 +2948,8 @@ int main(void) {
       cmocka_unit_test(test_rtad_append_packed_data_null_data),
       cmocka_unit_test(test_rtad_append_packed_data_zero_size),
       cmocka_unit_test(test_rtad_append_packed_data_larger_than_uint32_max),
+      cmocka_unit_test(test_rtad_map_data_larger_than_uint32_max),
+      cmocka_unit_test(test_rtad_truncate_data_larger_than_uint32_max),
       cmocka_unit_test(test_rtad_append_packed_data_ok),
       cmocka_unit_test(test_rtad_copy_self_with_data_null_dest_path),
       cmocka_unit_test(test_rtad_copy_self_with_data_null_append_data),
@@ -603,10 +2959,80 @@ int main(void) {
       cmocka_unit_test(test_rtad_extract_data_null_out_data),
       cmocka_unit_test(test_rtad_extract_data_null_out_data_size),
       cmocka_unit_test(test_rtad_extract_data_ok),
+      cmocka_unit_test(test_rtad_extract_data_legacy_hdr),
       cmocka_unit_test(test_rtad_extract_self_data_null_out_data),
       cmocka_unit_test(test_rtad_extract_self_data_null_out_data_size),
       cmocka_unit_test(test_rtad_extract_self_data_no_valid_rtad_data),
       cmocka_unit_test(test_rtad_extract_self_data_ok),
+      cmocka_unit_test(test_fd_map_unaligned_offset),
+      cmocka_unit_test(test_fd_map_invalid_fd),
+      cmocka_unit_test(test_fd_map_zero_size),
+      cmocka_unit_test(test_rtad_map_data_null_exe_path),
+      cmocka_unit_test(test_rtad_map_data_null_out_data),
+      cmocka_unit_test(test_rtad_map_data_invalid_hdr),
+      cmocka_unit_test(test_rtad_map_data_ok),
+      cmocka_unit_test(test_rtad_unmap_data_null_data),
+      cmocka_unit_test(test_rtad_map_self_data_no_valid_rtad_data),
+      cmocka_unit_test(test_toc_build_duplicated_names),
+      cmocka_unit_test(test_toc_build_ok),
+      cmocka_unit_test(test_rtad_append_packed_entries_null_name),
+      cmocka_unit_test(test_rtad_append_packed_entries_empty_name),
+      cmocka_unit_test(test_rtad_append_packed_entries_duplicated_name),
+      cmocka_unit_test(test_rtad_append_packed_entries_ok),
+      cmocka_unit_test(test_rtad_append_packed_entries_many),
+      cmocka_unit_test(test_rtad_entry_at),
+      cmocka_unit_test(test_get_ranges),
+      cmocka_unit_test(test_rtad_get_many),
+      cmocka_unit_test(test_rtad_open_no_toc),
+      cmocka_unit_test(test_rtad_open_non_existing_file),
+      cmocka_unit_test(test_rtad_find_null_args),
+      cmocka_unit_test(test_rtad_writer_open_null_path),
+      cmocka_unit_test(test_rtad_writer_open_non_existing_file),
+      cmocka_unit_test(test_rtad_writer_write_data_ok),
+      cmocka_unit_test(test_rtad_writer_writev_entries_ok),
+      cmocka_unit_test(test_rtad_writer_replaces_existing_data),
+      cmocka_unit_test(test_rtad_writer_close_empty),
+      cmocka_unit_test(test_rtad_writer_abort),
+#if defined(__linux__)
+      cmocka_unit_test(test_rtad_writer_load_keeps_notes),
+#endif
+      cmocka_unit_test(test_rtad_writer_close_duplicated_name),
+      cmocka_unit_test(test_rtad_writer_null_args),
+      cmocka_unit_test(test_rtad_open_no_data),
+      cmocka_unit_test(test_lz_roundtrip),
+      cmocka_unit_test(test_lz_decompress_corrupted),
+      cmocka_unit_test(test_rtad_writer_compressed_entries),
+      cmocka_unit_test(test_rtad_writer_compressed_data),
+      cmocka_unit_test(test_rtad_writer_threads_same_output),
+      cmocka_unit_test(test_rtad_writer_threads_abort),
+      cmocka_unit_test(test_rtad_writer_dedup_entries),
+      cmocka_unit_test(test_rtad_writer_dedup_cdc),
+      cmocka_unit_test(test_rtad_writer_update_entries),
+      cmocka_unit_test(test_rtad_compact_shared_chunks),
+      cmocka_unit_test(test_rtad_repack_keep_entries),
+      cmocka_unit_test(test_rtad_entry_map_aligned),
+      cmocka_unit_test(test_rtad_extract_into),
+      cmocka_unit_test(test_rtad_entry_fd),
+      cmocka_unit_test(test_rtad_fopen),
+      cmocka_unit_test(test_rtad_entry_sendfile),
+      cmocka_unit_test(test_rtad_stats),
+      cmocka_unit_test(test_rtad_writer_add_files),
+      cmocka_unit_test(test_rtad_append_packed_entries_zlib),
+      cmocka_unit_test(test_hash_tree_vectors),
+      cmocka_unit_test(test_rtad_verify_full),
+      cmocka_unit_test(test_rtad_reader_verify_lazy),
+      cmocka_unit_test(test_rtad_find_short_toc_records),
+      cmocka_unit_test(test_rtad_self_same_handle),
+#if !defined(_WIN32)
+      cmocka_unit_test(test_rtad_self_threads),
+#endif
+      cmocka_unit_test(test_rtad_open_toc_larger_than_tail),
+      cmocka_unit_test(test_rtad_file_append_and_truncate),
+      cmocka_unit_test(test_rtad_file_append_entries_keeps_handle),
+      cmocka_unit_test(test_rtad_reader_read_data),
+      cmocka_unit_test(test_rtad_reader_pread_and_seek),
+      cmocka_unit_test(test_rtad_reader_entry),
+      cmocka_unit_test(test_rtad_reader_null_args),
   };
   return cmocka_run_group_tests(tests, NULL, NULL);
 }
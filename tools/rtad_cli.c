@@ -0,0 +1,964 @@
+// Command-line front end, built on the public API only so it runs the same
+// code paths as the applications linking the library:
+//   rtad pack <exe> <dir> [-o out] [-u] [-c codec] [-s chunk_kib] [-d]
+//            [-a align_kib] [-j n] [-L] [-N]
+//   rtad ls <exe> [-l]
+//   rtad cat <exe> <entry>
+//   rtad extract-all <exe> <dir> [-j n]
+//   rtad verify <exe> [-j n]
+//   rtad strip <exe>
+#include "rtad.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <direct.h>
+#include <fcntl.h>
+#include <io.h>
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#define IO_BUFFER_SIZE (1024 * 1024)
+// files up to this size are loaded by the reader threads, bigger ones are
+// streamed into the writer
+#define LOAD_MAX_SIZE (8 * 1024 * 1024)
+// bytes loaded ahead of the writer, at most
+#define LOAD_AHEAD_SIZE (128 * 1024 * 1024)
+
+#if defined(_WIN32)
+typedef HANDLE cli_thread_t;
+typedef SRWLOCK cli_mutex_t;
+typedef CONDITION_VARIABLE cli_cond_t;
+
+static double now_seconds(void) {
+  LARGE_INTEGER freq, counter;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&counter);
+  return (double)counter.QuadPart / (double)freq.QuadPart;
+}
+
+static unsigned cpu_count(void) {
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors ? (unsigned)info.dwNumberOfProcessors : 1;
+}
+
+static void mutex_init(cli_mutex_t *mutex) { InitializeSRWLock(mutex); }
+static void mutex_destroy(cli_mutex_t *mutex) { (void)mutex; }
+static void mutex_lock(cli_mutex_t *mutex) { AcquireSRWLockExclusive(mutex); }
+static void mutex_unlock(cli_mutex_t *mutex) {
+  ReleaseSRWLockExclusive(mutex);
+}
+static void cond_init(cli_cond_t *cond) { InitializeConditionVariable(cond); }
+static void cond_destroy(cli_cond_t *cond) { (void)cond; }
+static void cond_wait(cli_cond_t *cond, cli_mutex_t *mutex) {
+  SleepConditionVariableSRW(cond, mutex, INFINITE, 0);
+}
+static void cond_broadcast(cli_cond_t *cond) { WakeAllConditionVariable(cond); }
+
+static int make_dir(const char *path) {
+  return _mkdir(path) == 0 || errno == EEXIST ? 0 : -1;
+}
+
+#else
+typedef pthread_t cli_thread_t;
+typedef pthread_mutex_t cli_mutex_t;
+typedef pthread_cond_t cli_cond_t;
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static unsigned cpu_count(void) {
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? (unsigned)count : 1;
+}
+
+static void mutex_init(cli_mutex_t *mutex) { pthread_mutex_init(mutex, NULL); }
+static void mutex_destroy(cli_mutex_t *mutex) { pthread_mutex_destroy(mutex); }
+static void mutex_lock(cli_mutex_t *mutex) { pthread_mutex_lock(mutex); }
+static void mutex_unlock(cli_mutex_t *mutex) { pthread_mutex_unlock(mutex); }
+static void cond_init(cli_cond_t *cond) { pthread_cond_init(cond, NULL); }
+static void cond_destroy(cli_cond_t *cond) { pthread_cond_destroy(cond); }
+static void cond_wait(cli_cond_t *cond, cli_mutex_t *mutex) {
+  pthread_cond_wait(cond, mutex);
+}
+static void cond_broadcast(cli_cond_t *cond) { pthread_cond_broadcast(cond); }
+
+static int make_dir(const char *path) {
+  return mkdir(path, 0755) == 0 || errno == EEXIST ? 0 : -1;
+}
+
+#endif
+
+// all the threads of a command run the same function on the same state
+struct task {
+  void (*fn)(void *);
+  void *arg;
+};
+
+#if defined(_WIN32)
+static DWORD WINAPI thread_main(LPVOID arg) {
+  struct task *task = (struct task *)arg;
+  task->fn(task->arg);
+  return 0;
+}
+
+static int thread_start(cli_thread_t *thread, struct task *task) {
+  *thread = CreateThread(NULL, 0, thread_main, task, 0, NULL);
+  return *thread ? 0 : -1;
+}
+
+static void thread_join(cli_thread_t thread) {
+  WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+}
+
+#else
+static void *thread_main(void *arg) {
+  struct task *task = (struct task *)arg;
+  task->fn(task->arg);
+  return NULL;
+}
+
+static int thread_start(cli_thread_t *thread, struct task *task) {
+  return pthread_create(thread, NULL, thread_main, task) == 0 ? 0 : -1;
+}
+
+static void thread_join(cli_thread_t thread) { pthread_join(thread, NULL); }
+
+#endif
+
+// start up to count threads, returns how many are running
+static unsigned threads_start(cli_thread_t *threads, unsigned count,
+                              struct task *task) {
+  unsigned started = 0;
+  while (started < count && thread_start(&threads[started], task) == 0) {
+    started++;
+  }
+  return started;
+}
+
+static void threads_join(cli_thread_t *threads, unsigned count) {
+  for (unsigned i = 0; i < count; i++) {
+    thread_join(threads[i]);
+  }
+}
+
+static char *str_dup(const char *str) {
+  size_t size = strlen(str) + 1;
+  char *copy = (char *)malloc(size);
+  if (copy) {
+    memcpy(copy, str, size);
+  }
+  return copy;
+}
+
+static char *path_join(const char *dir, const char *name) {
+  size_t dir_size = strlen(dir), name_size = strlen(name);
+  char *path = (char *)malloc(dir_size + name_size + 2);
+  if (path) {
+    memcpy(path, dir, dir_size);
+    path[dir_size] = '/';
+    memcpy(path + dir_size + 1, name, name_size + 1);
+  }
+  return path;
+}
+
+static double mib(uint64_t size) { return (double)size / (1024.0 * 1024.0); }
+
+static void print_throughput(const char *what, size_t count, uint64_t size,
+                             double seconds) {
+  printf("%s %zu entries, %.1f MiB in %.3f s, %.1f MiB/s\n", what, count,
+         mib(size), seconds, seconds > 0 ? mib(size) / seconds : 0.0);
+}
+
+// an input file of pack, loaded by a reader thread if small enough
+struct input {
+  char *path;
+  char *name; // relative to the packed directory, '/' separated
+  uint64_t size;
+  char *data;
+  int state; // INPUT_*
+};
+
+enum { INPUT_PENDING, INPUT_LOADED, INPUT_STREAM, INPUT_FAILED };
+
+struct input_list {
+  struct input *items;
+  size_t count;
+  size_t capacity;
+};
+
+static int input_add(struct input_list *list, char *path, char *name,
+                     uint64_t size) {
+  if (list->count == list->capacity) {
+    size_t capacity = list->capacity ? list->capacity * 2 : 64;
+    struct input *items =
+        (struct input *)realloc(list->items, capacity * sizeof(struct input));
+    if (!items) {
+      return -1;
+    }
+    list->items = items;
+    list->capacity = capacity;
+  }
+  struct input *input = &list->items[list->count++];
+  memset(input, 0, sizeof(*input));
+  input->path = path;
+  input->name = name;
+  input->size = size;
+  return 0;
+}
+
+static void input_list_free(struct input_list *list) {
+  for (size_t i = 0; i < list->count; i++) {
+    free(list->items[i].path);
+    free(list->items[i].name);
+    free(list->items[i].data);
+  }
+  free(list->items);
+}
+
+static int input_compare(const void *a, const void *b) {
+  return strcmp(((const struct input *)a)->name,
+                ((const struct input *)b)->name);
+}
+
+// add the regular files under dir, prefix is the name of dir in the payload;
+// links to directories are not followed
+#if defined(_WIN32)
+static int walk_dir(struct input_list *list, const char *dir,
+                    const char *prefix) {
+  char *pattern = path_join(dir, "*");
+  if (!pattern) {
+    return -1;
+  }
+  WIN32_FIND_DATAA found;
+  HANDLE find = FindFirstFileA(pattern, &found);
+  free(pattern);
+  if (find == INVALID_HANDLE_VALUE) {
+    fprintf(stderr, "rtad: cannot read %s\n", dir);
+    return -1;
+  }
+  int result = 0;
+  do {
+    if (strcmp(found.cFileName, ".") == 0 ||
+        strcmp(found.cFileName, "..") == 0) {
+      continue;
+    }
+    char *path = path_join(dir, found.cFileName);
+    char *name = prefix ? path_join(prefix, found.cFileName)
+                        : str_dup(found.cFileName);
+    if (!path || !name) {
+      result = -1;
+    } else if (found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+      if (!(found.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)) {
+        result = walk_dir(list, path, name);
+      }
+    } else if (input_add(list, path, name,
+                         ((uint64_t)found.nFileSizeHigh << 32) |
+                             found.nFileSizeLow) == 0) {
+      path = name = NULL;
+    } else {
+      result = -1;
+    }
+    free(path);
+    free(name);
+  } while (result == 0 && FindNextFileA(find, &found));
+  FindClose(find);
+  return result;
+}
+
+#else
+static int walk_dir(struct input_list *list, const char *dir,
+                    const char *prefix) {
+  DIR *stream = opendir(dir);
+  if (!stream) {
+    fprintf(stderr, "rtad: cannot read %s: %s\n", dir, strerror(errno));
+    return -1;
+  }
+  int result = 0;
+  struct dirent *dirent;
+  while (result == 0 && (dirent = readdir(stream)) != NULL) {
+    if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) {
+      continue;
+    }
+    char *path = path_join(dir, dirent->d_name);
+    char *name =
+        prefix ? path_join(prefix, dirent->d_name) : str_dup(dirent->d_name);
+    struct stat st;
+    if (!path || !name || lstat(path, &st) != 0) {
+      result = -1;
+    } else if (S_ISDIR(st.st_mode)) {
+      result = walk_dir(list, path, name);
+    } else if (S_ISLNK(st.st_mode) && stat(path, &st) != 0) {
+      // dangling link, skipped
+    } else if (S_ISREG(st.st_mode)) {
+      if (input_add(list, path, name, (uint64_t)st.st_size) == 0) {
+        path = name = NULL;
+      } else {
+        result = -1;
+      }
+    }
+    free(path);
+    free(name);
+  }
+  closedir(stream);
+  return result;
+}
+
+#endif
+
+// read a whole file of the expected size
+static char *load_file(const char *path, uint64_t size) {
+  FILE *fp = fopen(path, "rb");
+  char *data = (char *)malloc(size ? (size_t)size : 1);
+  if (!fp || !data || fread(data, 1, (size_t)size, fp) != size ||
+      fgetc(fp) != EOF) {
+    free(data);
+    data = NULL;
+  }
+  if (fp) {
+    fclose(fp);
+  }
+  return data;
+}
+
+// the reader threads of pack load the inputs in order, a bounded number of
+// bytes ahead of the thread writing them
+struct loader {
+  struct input_list *list;
+  size_t next;    // next input to load
+  uint64_t ahead; // bytes loaded and not written yet
+  int stop;
+  cli_mutex_t mutex;
+  cli_cond_t cond;
+};
+
+static void loader_main(void *arg) {
+  struct loader *loader = (struct loader *)arg;
+  mutex_lock(&loader->mutex);
+  for (;;) {
+    while (!loader->stop && loader->next < loader->list->count &&
+           loader->ahead > 0 &&
+           loader->ahead + loader->list->items[loader->next].size >
+               LOAD_AHEAD_SIZE) {
+      cond_wait(&loader->cond, &loader->mutex);
+    }
+    if (loader->stop || loader->next == loader->list->count) {
+      break;
+    }
+    struct input *input = &loader->list->items[loader->next++];
+    if (input->size > LOAD_MAX_SIZE) {
+      input->state = INPUT_STREAM;
+      cond_broadcast(&loader->cond);
+      continue;
+    }
+    loader->ahead += input->size;
+    mutex_unlock(&loader->mutex);
+    char *data = load_file(input->path, input->size);
+    mutex_lock(&loader->mutex);
+    input->data = data;
+    input->state = data ? INPUT_LOADED : INPUT_FAILED;
+    cond_broadcast(&loader->cond);
+  }
+  mutex_unlock(&loader->mutex);
+}
+
+static int stream_file(rtad_writer *writer, const char *path, char *buf) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    return -1;
+  }
+  int result = 0;
+  size_t bytes;
+  while (result == 0 && (bytes = fread(buf, 1, IO_BUFFER_SIZE, fp)) > 0) {
+    result = rtad_writer_write(writer, buf, bytes);
+  }
+  if (ferror(fp)) {
+    result = -1;
+  }
+  fclose(fp);
+  return result;
+}
+
+static int write_inputs(rtad_writer *writer, struct loader *loader) {
+  struct input_list *list = loader->list;
+  char *buf = (char *)malloc(IO_BUFFER_SIZE);
+  int result = buf ? 0 : -1;
+  for (size_t i = 0; i < list->count && result == 0; i++) {
+    struct input *input = &list->items[i];
+    mutex_lock(&loader->mutex);
+    while (input->state == INPUT_PENDING) {
+      cond_wait(&loader->cond, &loader->mutex);
+    }
+    mutex_unlock(&loader->mutex);
+    if (input->state == INPUT_FAILED ||
+        rtad_writer_begin_entry(writer, input->name) != 0 ||
+        (input->state == INPUT_LOADED
+             ? rtad_writer_write(writer, input->data, (size_t)input->size)
+             : stream_file(writer, input->path, buf)) != 0) {
+      fprintf(stderr, "rtad: cannot pack %s\n", input->path);
+      result = -1;
+    }
+    mutex_lock(&loader->mutex);
+    if (input->state == INPUT_LOADED) {
+      free(input->data);
+      input->data = NULL;
+      loader->ahead -= input->size;
+    }
+    cond_broadcast(&loader->cond);
+    mutex_unlock(&loader->mutex);
+  }
+  free(buf);
+  return result;
+}
+
+// copy the executable to pack into, its payload is replaced by the writer
+static int copy_exe(const char *src_path, const char *dest_path) {
+  FILE *src = fopen(src_path, "rb");
+  FILE *dest = fopen(dest_path, "wb");
+  char *buf = (char *)malloc(IO_BUFFER_SIZE);
+  int result = src && dest && buf ? 0 : -1;
+  size_t bytes;
+  while (result == 0 && (bytes = fread(buf, 1, IO_BUFFER_SIZE, src)) > 0) {
+    if (fwrite(buf, 1, bytes, dest) != bytes) {
+      result = -1;
+    }
+  }
+  if (src && ferror(src)) {
+    result = -1;
+  }
+  if (src) {
+    fclose(src);
+  }
+  if (dest && fclose(dest) != 0) {
+    result = -1;
+  }
+  free(buf);
+#if !defined(_WIN32)
+  struct stat st;
+  if (result == 0 && (stat(src_path, &st) != 0 ||
+                      chmod(dest_path, st.st_mode & 07777) != 0)) {
+    result = -1;
+  }
+#endif
+  return result;
+}
+
+struct options {
+  const char *args[2]; // positional arguments
+  int arg_count;
+  const char *out;
+  uint32_t codec;
+  uint32_t chunk_size;
+  uint32_t dedup;
+  uint32_t align;
+  unsigned threads;
+  int update;
+  int details;
+  uint32_t load;
+};
+
+static int parse_codec(const char *name, uint32_t *out_codec) {
+  if (strcmp(name, "none") == 0) {
+    *out_codec = RTAD_CODEC_NONE;
+  } else if (strcmp(name, "lz") == 0) {
+    *out_codec = RTAD_CODEC_LZ;
+  } else if (strcmp(name, "zlib") == 0) {
+    *out_codec = RTAD_CODEC_ZLIB;
+  } else {
+    return -1;
+  }
+  return rtad_codec_supported(*out_codec);
+}
+
+static int parse_options(int argc, char *argv[], struct options *options) {
+  memset(options, 0, sizeof(*options));
+  for (int i = 0; i < argc; i++) {
+    const char *arg = argv[i];
+    const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+    if (strcmp(arg, "-o") == 0 && value) {
+      options->out = value;
+      i++;
+    } else if (strcmp(arg, "-c") == 0 && value) {
+      if (parse_codec(value, &options->codec) != 0) {
+        fprintf(stderr, "rtad: unsupported codec %s\n", value);
+        return -1;
+      }
+      i++;
+    } else if (strcmp(arg, "-s") == 0 && value) {
+      long kib = atol(value);
+      if (kib <= 0 || kib > 1024 * 1024) {
+        return -1;
+      }
+      options->chunk_size = (uint32_t)kib * 1024;
+      i++;
+    } else if (strcmp(arg, "-a") == 0 && value) {
+      long kib = atol(value);
+      if (kib <= 0 || kib > (long)(RTAD_ALIGN_MAX / 1024) ||
+          (kib & (kib - 1)) != 0) {
+        return -1;
+      }
+      options->align = (uint32_t)kib * 1024;
+      i++;
+    } else if (strcmp(arg, "-j") == 0 && value) {
+      options->threads = (unsigned)atoi(value);
+      i++;
+    } else if (strcmp(arg, "-d") == 0) {
+      options->dedup = RTAD_DEDUP_CDC;
+    } else if (strcmp(arg, "-u") == 0) {
+      options->update = 1;
+    } else if (strcmp(arg, "-l") == 0) {
+      options->details = 1;
+    } else if (strcmp(arg, "-L") == 0) {
+      options->load |= RTAD_LOAD_SEGMENT;
+    } else if (strcmp(arg, "-N") == 0) {
+      options->load |= RTAD_LOAD_NOTE;
+    } else if (arg[0] == '-' || options->arg_count == 2) {
+      return -1;
+    } else {
+      options->args[options->arg_count++] = arg;
+    }
+  }
+  if (options->threads == 0) {
+    options->threads = cpu_count();
+  }
+  return 0;
+}
+
+static int cmd_pack(const struct options *options) {
+  const char *exe_path = options->args[0];
+  const char *dest_path = options->out ? options->out : exe_path;
+  struct input_list list = {0};
+  if (walk_dir(&list, options->args[1], NULL) != 0) {
+    input_list_free(&list);
+    return 1;
+  }
+  // sorted, the same tree gives the same payload
+  if (list.count > 0) {
+    qsort(list.items, list.count, sizeof(struct input), input_compare);
+  }
+  double start = now_seconds();
+  if (options->out && copy_exe(exe_path, dest_path) != 0) {
+    fprintf(stderr, "rtad: cannot copy %s to %s\n", exe_path, dest_path);
+    input_list_free(&list);
+    return 1;
+  }
+  rtad_writer *writer = options->update ? rtad_writer_open_update(dest_path)
+                                        : rtad_writer_open(dest_path);
+  if (!writer ||
+      rtad_writer_set_codec(writer, options->codec, options->chunk_size) !=
+          0 ||
+      rtad_writer_set_threads(writer, options->threads) != 0 ||
+      rtad_writer_set_dedup(writer, options->dedup) != 0 ||
+      rtad_writer_set_align(writer, options->align) != 0 ||
+      rtad_writer_set_load(writer, options->load) != 0) {
+    fprintf(stderr, "rtad: cannot write %s\n", dest_path);
+    if (writer) {
+      rtad_writer_abort(writer);
+    }
+    input_list_free(&list);
+    return 1;
+  }
+
+  struct loader loader = {.list = &list};
+  mutex_init(&loader.mutex);
+  cond_init(&loader.cond);
+  struct task task = {loader_main, &loader};
+  cli_thread_t *threads =
+      (cli_thread_t *)malloc(options->threads * sizeof(cli_thread_t));
+  unsigned started = threads ? threads_start(threads, options->threads, &task)
+                             : 0;
+  int result = -1;
+  if (started > 0) {
+    result = write_inputs(writer, &loader);
+  }
+  mutex_lock(&loader.mutex);
+  loader.stop = 1;
+  cond_broadcast(&loader.cond);
+  mutex_unlock(&loader.mutex);
+  threads_join(threads, started);
+  free(threads);
+  cond_destroy(&loader.cond);
+  mutex_destroy(&loader.mutex);
+
+  if (result == 0) {
+    result = rtad_writer_close(writer);
+  } else {
+    rtad_writer_abort(writer);
+  }
+  if (result != 0) {
+    fprintf(stderr, "rtad: cannot write %s\n", dest_path);
+    input_list_free(&list);
+    return 1;
+  }
+  uint64_t size = 0;
+  for (size_t i = 0; i < list.count; i++) {
+    size += list.items[i].size;
+  }
+  print_throughput("packed", list.count, size, now_seconds() - start);
+  input_list_free(&list);
+  return 0;
+}
+
+// an entry of ls or extract-all, with a NUL-terminated name
+struct listed {
+  char *name;
+  struct rtad_entry entry;
+};
+
+static int listed_compare(const void *a, const void *b) {
+  return strcmp(((const struct listed *)a)->name,
+                ((const struct listed *)b)->name);
+}
+
+static void listed_free(struct listed *entries, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    free(entries[i].name);
+  }
+  free(entries);
+}
+
+// the entries of file sorted by name, NULL on error or without entries
+static struct listed *list_entries(rtad_file *file, size_t *out_count) {
+  size_t count = rtad_entry_count(file);
+  struct listed *entries =
+      count ? (struct listed *)calloc(count, sizeof(struct listed)) : NULL;
+  *out_count = 0;
+  if (!entries) {
+    return NULL;
+  }
+  for (size_t i = 0; i < count; i++) {
+    const char *name = NULL;
+    size_t name_size = 0;
+    if (rtad_entry_at(file, i, &name, &name_size, &entries[i].entry) != 0 ||
+        !(entries[i].name = (char *)malloc(name_size + 1))) {
+      listed_free(entries, count);
+      return NULL;
+    }
+    memcpy(entries[i].name, name, name_size);
+    entries[i].name[name_size] = '\0';
+  }
+  qsort(entries, count, sizeof(struct listed), listed_compare);
+  *out_count = count;
+  return entries;
+}
+
+static rtad_file *open_exe(const char *path) {
+  rtad_file *file = rtad_open(path);
+  if (!file) {
+    fprintf(stderr, "rtad: cannot open %s\n", path);
+  }
+  return file;
+}
+
+static int cmd_ls(const struct options *options) {
+  rtad_file *file = open_exe(options->args[0]);
+  if (!file) {
+    return 1;
+  }
+  size_t count = 0;
+  struct listed *entries = list_entries(file, &count);
+  if (!entries && rtad_entry_count(file) > 0) {
+    fprintf(stderr, "rtad: corrupted table of contents\n");
+    rtad_close(file);
+    return 1;
+  }
+  for (size_t i = 0; i < count; i++) {
+    const struct rtad_entry *entry = &entries[i].entry;
+    if (options->details) {
+      printf("%12llu %12llu %c%c %s\n", (unsigned long long)entry->raw_size,
+             (unsigned long long)entry->size,
+             entry->flags & RTAD_ENTRY_CHUNKED ? 'c' : '-',
+             entry->align ? 'a' : '-', entries[i].name);
+    } else {
+      printf("%s\n", entries[i].name);
+    }
+  }
+  listed_free(entries, count);
+  rtad_close(file);
+  return 0;
+}
+
+static int cmd_cat(const struct options *options) {
+  rtad_file *file = open_exe(options->args[0]);
+  if (!file) {
+    return 1;
+  }
+  struct rtad_entry entry;
+  rtad_reader *reader = rtad_find(file, options->args[1], &entry) == 0
+                            ? rtad_reader_open(file, &entry)
+                            : NULL;
+  char *buf = (char *)malloc(IO_BUFFER_SIZE);
+  int result = reader && buf ? 0 : -1;
+#if defined(_WIN32)
+  _setmode(_fileno(stdout), _O_BINARY);
+#endif
+  size_t bytes = 0;
+  while (result == 0 &&
+         (result = rtad_reader_read(reader, buf, IO_BUFFER_SIZE, &bytes)) ==
+             0 &&
+         bytes > 0) {
+    if (fwrite(buf, 1, bytes, stdout) != bytes) {
+      result = -1;
+    }
+  }
+  if (fflush(stdout) != 0) {
+    result = -1;
+  }
+  if (result != 0) {
+    fprintf(stderr, "rtad: cannot read %s\n", options->args[1]);
+  }
+  free(buf);
+  if (reader) {
+    rtad_reader_close(reader);
+  }
+  rtad_close(file);
+  return result == 0 ? 0 : 1;
+}
+
+// names are written under the output directory only
+static int name_safe(const char *name) {
+  if (name[0] == '\0' || name[0] == '/') {
+    return 0;
+  }
+  for (const char *part = name; part;) {
+    const char *end = strchr(part, '/');
+    size_t size = end ? (size_t)(end - part) : strlen(part);
+    if (size == 0 || (size == 2 && part[0] == '.' && part[1] == '.') ||
+        memchr(part, '\\', size) || memchr(part, ':', size)) {
+      return 0;
+    }
+    part = end ? end + 1 : NULL;
+  }
+  return 1;
+}
+
+// the worker threads of extract-all take the next entry and stream it out
+struct extractor {
+  rtad_file *file;
+  const char *dir;
+  struct listed *entries;
+  size_t count;
+  size_t next;
+  int failed;
+  cli_mutex_t mutex;
+};
+
+static int extract_entry(rtad_file *file, const char *dir,
+                         const struct listed *listed, char *buf) {
+  char *path = path_join(dir, listed->name);
+  rtad_reader *reader = rtad_reader_open(file, &listed->entry);
+  FILE *fp = path && reader ? fopen(path, "wb") : NULL;
+  int result = fp ? 0 : -1;
+  size_t bytes = 0;
+  while (result == 0 &&
+         (result = rtad_reader_read(reader, buf, IO_BUFFER_SIZE, &bytes)) ==
+             0 &&
+         bytes > 0) {
+    if (fwrite(buf, 1, bytes, fp) != bytes) {
+      result = -1;
+    }
+  }
+  if (fp && fclose(fp) != 0) {
+    result = -1;
+  }
+  if (reader) {
+    rtad_reader_close(reader);
+  }
+  if (result != 0) {
+    fprintf(stderr, "rtad: cannot extract %s\n", listed->name);
+  }
+  free(path);
+  return result;
+}
+
+static void extractor_main(void *arg) {
+  struct extractor *extractor = (struct extractor *)arg;
+  char *buf = (char *)malloc(IO_BUFFER_SIZE);
+  for (;;) {
+    mutex_lock(&extractor->mutex);
+    size_t index = extractor->next;
+    if (!buf || extractor->failed) {
+      extractor->failed = 1;
+      index = extractor->count;
+    } else if (index < extractor->count) {
+      extractor->next++;
+    }
+    mutex_unlock(&extractor->mutex);
+    if (index == extractor->count) {
+      break;
+    }
+    if (extract_entry(extractor->file, extractor->dir,
+                      &extractor->entries[index], buf) != 0) {
+      mutex_lock(&extractor->mutex);
+      extractor->failed = 1;
+      mutex_unlock(&extractor->mutex);
+    }
+  }
+  free(buf);
+}
+
+// create the directories of the names, on the calling thread
+static int make_parents(const char *dir, const struct listed *entries,
+                        size_t count) {
+  if (make_dir(dir) != 0) {
+    return -1;
+  }
+  for (size_t i = 0; i < count; i++) {
+    char *path = path_join(dir, entries[i].name);
+    if (!path) {
+      return -1;
+    }
+    int result = 0;
+    for (char *slash = path + strlen(dir) + 1;
+         result == 0 && (slash = strchr(slash, '/')) != NULL; slash++) {
+      *slash = '\0';
+      result = make_dir(path);
+      *slash = '/';
+    }
+    free(path);
+    if (result != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int cmd_extract_all(const struct options *options) {
+  rtad_file *file = open_exe(options->args[0]);
+  if (!file) {
+    return 1;
+  }
+  double start = now_seconds();
+  size_t count = 0;
+  struct listed *entries = list_entries(file, &count);
+  int result = entries || rtad_entry_count(file) == 0 ? 0 : -1;
+  for (size_t i = 0; i < count && result == 0; i++) {
+    if (!name_safe(entries[i].name)) {
+      fprintf(stderr, "rtad: unsafe entry name %s\n", entries[i].name);
+      result = -1;
+    }
+  }
+  if (result == 0 && make_parents(options->args[1], entries, count) != 0) {
+    fprintf(stderr, "rtad: cannot create directories in %s\n",
+            options->args[1]);
+    result = -1;
+  }
+  if (result == 0 && count > 0) {
+    struct extractor extractor = {
+        .file = file, .dir = options->args[1], .entries = entries,
+        .count = count};
+    mutex_init(&extractor.mutex);
+    struct task task = {extractor_main, &extractor};
+    unsigned thread_count =
+        options->threads < count ? options->threads : (unsigned)count;
+    cli_thread_t *threads =
+        (cli_thread_t *)malloc(thread_count * sizeof(cli_thread_t));
+    unsigned started =
+        threads ? threads_start(threads, thread_count, &task) : 0;
+    threads_join(threads, started);
+    free(threads);
+    mutex_destroy(&extractor.mutex);
+    result = started > 0 && !extractor.failed ? 0 : -1;
+  }
+  if (result == 0) {
+    uint64_t size = 0;
+    for (size_t i = 0; i < count; i++) {
+      size += entries[i].entry.raw_size;
+    }
+    print_throughput("extracted", count, size, now_seconds() - start);
+  }
+  listed_free(entries, count);
+  rtad_close(file);
+  return result == 0 ? 0 : 1;
+}
+
+static int cmd_verify(const struct options *options) {
+  rtad_file *file = open_exe(options->args[0]);
+  if (!file) {
+    return 1;
+  }
+  uint8_t hash[RTAD_HASH_SIZE];
+  rtad_reader *reader = rtad_reader_open(file, NULL);
+  uint64_t size = reader ? rtad_reader_size(reader) : 0;
+  if (reader) {
+    rtad_reader_close(reader);
+  }
+  int result = 1;
+  double start = now_seconds();
+  if (rtad_file_hash(file, hash) != 0) {
+    fprintf(stderr, "rtad: %s has no tree hash\n", options->args[0]);
+  } else if (rtad_verify_full(file, options->threads) != 0) {
+    fprintf(stderr, "rtad: %s doesn't match its tree hash\n",
+            options->args[0]);
+  } else {
+    print_throughput("verified", rtad_entry_count(file), size,
+                     now_seconds() - start);
+    result = 0;
+  }
+  rtad_close(file);
+  return result;
+}
+
+static int cmd_strip(const struct options *options) {
+  if (rtad_truncate_data(options->args[0]) != 0) {
+    fprintf(stderr, "rtad: cannot strip %s\n", options->args[0]);
+    return 1;
+  }
+  return 0;
+}
+
+static const struct command {
+  const char *name;
+  int arg_count;
+  int (*run)(const struct options *options);
+  const char *usage;
+} commands[] = {
+    {"pack", 2, cmd_pack,
+     "pack <exe> <dir> [-o out] [-u] [-c none|lz|zlib] [-s chunk_kib] [-d] "
+     "[-a align_kib] [-j n] [-L] [-N]"},
+    {"ls", 1, cmd_ls, "ls <exe> [-l]"},
+    {"cat", 2, cmd_cat, "cat <exe> <entry>"},
+    {"extract-all", 2, cmd_extract_all, "extract-all <exe> <dir> [-j n]"},
+    {"verify", 1, cmd_verify, "verify <exe> [-j n]"},
+    {"strip", 1, cmd_strip, "strip <exe>"},
+};
+
+static int usage(void) {
+  fprintf(stderr, "usage:\n");
+  for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+    fprintf(stderr, "  rtad %s\n", commands[i].usage);
+  }
+  return 2;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    return usage();
+  }
+  for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+    if (strcmp(argv[1], commands[i].name) != 0) {
+      continue;
+    }
+    struct options options;
+    if (parse_options(argc - 2, argv + 2, &options) != 0 ||
+        options.arg_count != commands[i].arg_count) {
+      return usage();
+    }
+    return commands[i].run(&options);
+  }
+  return usage();
+}